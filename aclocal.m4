@@ -138,6 +138,32 @@ AC_DEFUN(AC_ACME_TM_GMTOFF,
 	    AC_DEFINE(HAVE_TM_GMTOFF)
     fi])
 
+dnl
+dnl Checks to see if struct stat has the POSIX.1-2008 st_mtim member
+dnl (modification time in nanoseconds)
+dnl
+dnl usage:
+dnl
+dnl	AC_ACME_ST_MTIM
+dnl
+dnl results:
+dnl
+dnl	HAVE_ST_MTIM (defined)
+dnl
+AC_DEFUN(AC_ACME_ST_MTIM,
+    [AC_MSG_CHECKING(if struct stat has st_mtim member)
+    AC_CACHE_VAL(ac_cv_acme_stat_has_st_mtim,
+	AC_TRY_COMPILE([
+#	include <sys/types.h>
+#	include <sys/stat.h>],
+	[u_int i = sizeof(((struct stat *)0)->st_mtim.tv_nsec)],
+	ac_cv_acme_stat_has_st_mtim=yes,
+	ac_cv_acme_stat_has_st_mtim=no))
+    AC_MSG_RESULT($ac_cv_acme_stat_has_st_mtim)
+    if test $ac_cv_acme_stat_has_st_mtim = yes ; then
+	    AC_DEFINE(HAVE_ST_MTIM)
+    fi])
+
 dnl
 dnl Checks to see if int64_t exists
 dnl
@@ -0,0 +1,123 @@
+#!/bin/bash
+# -*- mode: sh; tabstop: 4; shiftwidth: 4; softtabstop: 4; -*-
+#
+# Measure the latency of the CGI launches of thttpgpd (or ludd) against the
+# resident set size of the server: an instance is run on the loopback, on a
+# throwaway keyring, and at each step its mmap cache (cf. mmc.c) is grown by
+# fetching static files (of 16 MB each), until it maps about the size of the
+# step. Then its VmRSS, RssAnon and RssFile (cf. /proc/PID/status) are read,
+# and sequential requests are timed for:
+#   cgi  a CGI whose output goes through an interposer (cf. cgi_spawn_relay())
+#   nph  a nph- CGI, spawned with the connection as its output
+# The latencies should stay flat as the RSS grows when the CGI aren't run by
+# a fork() of the server: run it with -b against an older build to compare.
+#
+# Note: Linux doesn't copy the page tables of the read-only file mappings at
+# fork() (but does those of the anonymous memory), so RssAnon is the one which
+# weighs most, eg. with a server built without HAVE_MMAP.
+#
+# Needs curl, gpg (>= 2.1), and a server built with the CGI enabled.
+
+steps="0,256,768"
+nreqs=200
+bin="thttpgpd"
+port="11401"
+keep=""
+
+function usage {
+	echo "Usage: $0 [-s STEPS] [-n REQUESTS] [-b SERVER] [-p PORT] [-k]
+	-s STEPS     comma separated list of sizes (MB) of the mapped static files - default: $steps
+	-n REQUESTS  requests per CGI and per step - default: $nreqs
+	-b SERVER    the server binary - default: $bin
+	-p PORT      port of the instance - default: $port
+	-k           keep the working directory (with the log of the instance)" >&2
+	exit 1
+}
+
+while getopts "s:n:b:p:kh" opt ; do
+	case "$opt" in
+		s) steps="$OPTARG" ;;
+		n) nreqs="$OPTARG" ;;
+		b) bin="$OPTARG" ;;
+		p) port="$OPTARG" ;;
+		k) keep="yes" ;;
+		*) usage ;;
+	esac
+done
+
+[[ "$steps" =~ ^[0-9]+(,[0-9]+)*$ && "$nreqs" =~ ^[1-9][0-9]*$ && "$port" =~ ^[0-9]+$ ]] || usage
+for cmd in curl gpg gpgconf "$bin" ; do
+	type "$cmd" > /dev/null || exit 1
+done
+
+work="$(mktemp -d /tmp/cgirss.XXXXXX)"
+pid=""
+function cleanup {
+	[ "$pid" ] && kill "$pid" 2> /dev/null
+	gpgconf --homedir "$work/gpgme" --kill all 2> /dev/null
+	if [ "$keep" ] ; then
+		echo "Working directory kept: $work" >&2
+	else
+		rm -rf "$work"
+	fi
+}
+trap cleanup EXIT
+
+function rss {
+# Print VmRSS, RssAnon and RssFile of the server, in MB.
+	awk '$1=="VmRSS:" { r=$2 } $1=="RssAnon:" { a=$2 } $1=="RssFile:" { f=$2 }
+		END { printf "%8.1f %8.1f %8.1f", r/1024, a/1024, f/1024 }' "/proc/$pid/status"
+}
+
+function latency {
+# Argument 1: URL path
+# Print the p50, p90 and max latencies (ms) of nreqs sequential requests, and
+# the number of them which failed.
+	local i
+	for ((i=0;i<nreqs;i++)) ; do
+		curl -s -f --max-time 30 -o /dev/null -w "%{http_code} %{time_total}\n" "http://127.0.0.1:$port$1"
+	done | sort -k2 -g | awk '
+		{ t[NR]=$2*1000 ; if ($1!=200) ko++ }
+		function pc(p) { return t[int((NR-1)*p)+1] }
+		END { printf "%8.2f %8.2f %8.2f %5d", pc(0.5), pc(0.9), t[NR], ko }'
+}
+
+mkdir -p "$work/gpgme" "$work/pub/cgi-bin" "$work/pub/fill"
+chmod 700 "$work/gpgme"
+echo "Key-Type: eddsa
+Key-Curve: ed25519
+Key-Usage: sign
+Name-Real: cgi rss
+Name-Email: cgirss@localhost
+Expire-Date: 0
+%no-protection
+%commit" > "$work/params"
+fpr=$(gpg --homedir "$work/gpgme" --batch --quiet --status-fd 3 --gen-key "$work/params" 3>&1 > /dev/null 2>&1 | sed -n 's/^\[GNUPG:\] KEY_CREATED [BP] \([[:xdigit:]]*\).*/\1/p')
+[ "$fpr" ] || { echo "$0: could not make a key" >&2 ; exit 1 ; }
+
+echo '#!/bin/sh
+printf "Content-Type: text/plain\r\n\r\nok\n"' > "$work/pub/cgi-bin/hello"
+echo '#!/bin/sh
+printf "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\nok\n"' > "$work/pub/cgi-bin/nph-hello"
+chmod 755 "$work/pub/cgi-bin/hello" "$work/pub/cgi-bin/nph-hello"
+
+"$bin" -d "$work" -p "$port" -nk -D -f "$fpr" -c "/cgi-bin/*" > "$work/log" 2>&1 &
+pid=$!
+for ((i=0;i<30;i++)) ; do
+	curl -s -f --max-time 5 -o /dev/null "http://127.0.0.1:$port/cgi-bin/hello" && break
+	sleep 1
+done
+kill -0 "$pid" 2> /dev/null || { echo "$0: the instance died (cf. its log with -k)" >&2 ; exit 1 ; }
+
+printf "%8s %8s %8s %8s | %8s %8s %8s %5s | %8s %8s %8s %5s\n" "step(MB)" "RSS(MB)" "anon" "file" \
+	"cgi p50" "p90" "max(ms)" "fail" "nph p50" "p90" "max(ms)" "fail"
+nfill=0
+for step in ${steps//,/ } ; do
+	# (the files are mapped by the server as they're sent)
+	for ((; nfill<step/16; nfill++)) ; do
+		head -c $((16*1024*1024)) /dev/urandom > "$work/pub/fill/$nfill.bin"
+		curl -s -f --max-time 60 -o /dev/null "http://127.0.0.1:$port/fill/$nfill.bin" \
+			|| echo "$0: fill/$nfill.bin not fetched" >&2
+	done
+	printf "%8d %s | %s | %s\n" "$step" "$(rss)" "$(latency /cgi-bin/hello)" "$(latency /cgi-bin/nph-hello)"
+done
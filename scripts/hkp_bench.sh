@@ -0,0 +1,143 @@
+#!/bin/bash
+# -*- mode: sh; tabstop: 4; shiftwidth: 4; softtabstop: 4; -*-
+#
+# Benchmark the HKP interface of thttpgpd (or ludd), usually run against a
+# keyring made by hkp_keyring_gen.sh, whose bench/ directory gives the keys
+# to look up and to submit. The workloads are:
+#   index  pks/lookup?op=index of a keyid of the keyring
+#   uid    pks/lookup?op=index of an email address of the keyring
+#   get    pks/lookup?op=get of a fingerprint of the keyring
+#   miss   pks/lookup?op=index of a random keyid (not in the keyring)
+#   new    pks/add of a key not in the keyring (bench/new/)
+#   merge  pks/add of a key of the keyring, with a new user ID (bench/merge/)
+#   reject pks/add of a key without udid2 (bench/reject/)
+# For each of them, it reports the HTTP status codes, the throughput, and the
+# latency percentiles of the requests.
+#
+# Note: pks/add changes the keyring, so new and merge then answer "unchanged"
+# (or from the remembered submissions, cf. KEYIMP_DEDUP) if run again.
+#
+# Needs curl >= 7.67 (--parallel, --no-progress-meter).
+
+nreqs=1000
+conc=8
+datadir="./hkp-keyring/bench"
+workloads="index,uid,get,miss,new,merge,reject"
+heads=()
+
+function usage {
+	echo "Usage: $0 [-n REQUESTS] [-c CONCURRENCY] [-d DIR] [-w WORKLOADS] [-z] [-S] URL
+	-n REQUESTS     requests per workload (at most the number of keys for pks/add) - default: $nreqs
+	-c CONCURRENCY  requests run at once - default: $conc
+	-d DIR          bench/ directory made by hkp_keyring_gen.sh - default: $datadir
+	-w WORKLOADS    comma separated list among index,uid,get,miss,new,merge,reject - default: all
+	-z              accept gzip compressed responses
+	-S              ask for signed responses (multipart/msigned)
+	URL             of the server, eg. http://localhost:11371" >&2
+	exit 1
+}
+
+while getopts "n:c:d:w:zSh" opt ; do
+	case "$opt" in
+		n) nreqs="$OPTARG" ;;
+		c) conc="$OPTARG" ;;
+		d) datadir="$OPTARG" ;;
+		w) workloads="$OPTARG" ;;
+		z) heads+=("Accept-Encoding: gzip") ;;
+		S) heads+=("Accept: multipart/msigned, */*") ;;
+		*) usage ;;
+	esac
+done
+shift $((OPTIND-1))
+url="${1%/}"
+
+[[ "$nreqs" =~ ^[1-9][0-9]*$ && "$conc" =~ ^[1-9][0-9]*$ && "$url" =~ ^https?:// ]] || usage
+[ -f "$datadir/keys.txt" ] || { echo "$0: no $datadir/keys.txt (cf. hkp_keyring_gen.sh)" >&2 ; exit 1 ; }
+type curl > /dev/null || exit 1
+
+work="$(mktemp -d /tmp/hkpbench.XXXXXX)"
+trap 'rm -rf "$work"' EXIT
+
+function urlencode {
+# Argument 1: string to encode as a query parameter
+	local s="$1" c i
+	for ((i=0;i<${#s};i++)) ; do
+		c="${s:i:1}"
+		case "$c" in
+			[a-zA-Z0-9.~_-]) printf "%s" "$c" ;;
+			*) printf "%%%02X" "'$c" ;;
+		esac
+	done
+}
+
+function options {
+# Print the curl config options of a request (or of a group of requests, as
+# they're reset by "next").
+	local h
+	echo "no-progress-meter"
+	echo "write-out = \"%{http_code} %{time_total} %{size_download}\\n\""
+	for h in "${heads[@]}" ; do
+		echo "header = \"$h\""
+	done
+}
+
+function lookups {
+# Argument 1: workload
+# Print the curl config of its requests.
+	local line
+	options
+	case "$1" in
+		index) shuf -r -n "$nreqs" "$datadir/keys.txt" | sed 's/^.*\(.\{16\}\)$/op=index\&options=mr\&search=0x\1/' ;;
+		uid) shuf -r -n "$nreqs" "$datadir/emails.txt" | while read line ; do echo "op=index&options=mr&search=$(urlencode "$line")" ; done ;;
+		get) shuf -r -n "$nreqs" "$datadir/keys.txt" | sed 's/^/op=get\&options=mr\&search=0x/' ;;
+		miss) od -An -vtx1 -N $((nreqs*8)) /dev/urandom | tr -d ' \n' | fold -w 16 | sed -e '$a\' | sed 's/^/op=index\&options=mr\&search=0x/' ;;
+	esac | while read line ; do
+		echo "url = \"$url/pks/lookup?$line\""
+		echo "output = \"/dev/null\""
+	done
+}
+
+function adds {
+# Argument 1: workload (name of the directory of the keys to submit)
+# Print the curl config of its requests.
+	local f sep=""
+	for f in $(ls "$datadir/$1" | head -n "$nreqs") ; do
+		[ "$sep" ] && echo "$sep"
+		sep="next"
+		options
+		echo "url = \"$url/pks/add\""
+		echo "output = \"/dev/null\""
+		echo "data-urlencode = \"keytext@$datadir/$1/$f\""
+	done
+}
+
+function run {
+# Argument 1: workload
+	local start end
+
+	case "$1" in
+		index|uid|get|miss) lookups "$1" > "$work/$1.conf" ;;
+		new|merge|reject) adds "$1" > "$work/$1.conf" ;;
+		*) echo "$0: unknown workload $1" >&2 ; return ;;
+	esac
+	if ! grep -q "^url" "$work/$1.conf" ; then
+		echo "$0: nothing to do for $1" >&2
+		return
+	fi
+	start=$(date +%s.%N)
+	curl --no-progress-meter --parallel --parallel-max "$conc" -K "$work/$1.conf" > "$work/$1.out"
+	end=$(date +%s.%N)
+	sort -k2 -g "$work/$1.out" | awk -v name="$1" -v secs="$start $end" '
+		{ t[NR]=$2*1000 ; st[$1]++ ; bytes+=$3 }
+		function pc(p) { return t[int((NR-1)*p)+1] }
+		END {
+			split(secs,se," ") ; secs=se[2]-se[1]
+			s="" ; for (c in st) s=s c "x" st[c] " "
+			printf "%-7s %6d %9.1f %8.1f %8.1f %8.1f %8.1f %10.1f  %s\n", name, NR, NR/secs, pc(0.5), pc(0.9), pc(0.99), t[NR], bytes/1024, s
+		}'
+}
+
+printf "%-7s %6s %9s %8s %8s %8s %8s %10s  %s\n" workload reqs "req/s" "p50(ms)" "p90(ms)" "p99(ms)" "max(ms)" "recv(KB)" "status x count"
+for w in ${workloads//,/ } ; do
+	run "$w"
+done
@@ -0,0 +1,240 @@
+#!/bin/bash
+# -*- mode: sh; tabstop: 4; shiftwidth: 4; softtabstop: 4; -*-
+#
+# Generate a synthetic keyring, to run thttpgpd (or ludd) against it with
+# hkp_bench.sh.
+#
+# It makes in the output directory:
+#  - gpgme/ : the keyring (a throwaway GNUPGHOME), with the secret key of the
+#             server, whose fingerprint is printed at the end.
+#  - pub/   : an empty WEB_DIR, so that the output directory may be given as
+#             the running directory (-d) of the server.
+#  - bench/ : what hkp_bench.sh needs:
+#       keys.txt   fingerprints of the keys of the keyring
+#       emails.txt some of their email addresses
+#       new/       keys which are not in the keyring (with an udid2)
+#       merge/     keys of the keyring, with a new user ID
+#       reject/    keys which are not in the keyring, without udid2 (rejected
+#                  by a server built with CHECK_UDID2, as all the new keys by a
+#                  server run without -nk)
+#
+# The keys are ed25519 ones. Each has 1 to 6 user IDs (mostly 1), about
+# UDID2_PERCENT% of them with an "udid2;c;..." comment, and 0 to 20
+# certifications (mostly none) made by a pool of signers, as in a real web of
+# trust. Keys are generated by JOBS gpg processes in parallel, but expect about
+# 10ms of CPU time per key: a million keys takes hours.
+
+set -e
+
+nkeys=10000
+jobs=$(nproc 2> /dev/null || echo 2)
+outdir="./hkp-keyring"
+udid2pc=50
+nbench=200
+gpgbin="gpg"
+
+function usage {
+	echo "Usage: $0 [-n NKEYS] [-j JOBS] [-u UDID2_PERCENT] [-b NBENCH] [-o OUTDIR]
+	-n NKEYS          number of keys in the keyring - default: $nkeys
+	-j JOBS           gpg processes run in parallel - default: $jobs
+	-u UDID2_PERCENT  percentage of user IDs with an udid2 - default: $udid2pc
+	-b NBENCH         number of keys in each of bench/{new,merge,reject} - default: $nbench
+	-o OUTDIR         output directory (must not exist) - default: $outdir" >&2
+	exit 1
+}
+
+while getopts "n:j:u:b:o:h" opt ; do
+	case "$opt" in
+		n) nkeys="$OPTARG" ;;
+		j) jobs="$OPTARG" ;;
+		u) udid2pc="$OPTARG" ;;
+		b) nbench="$OPTARG" ;;
+		o) outdir="$OPTARG" ;;
+		*) usage ;;
+	esac
+done
+
+[[ "$nkeys" =~ ^[1-9][0-9]*$ && "$jobs" =~ ^[1-9][0-9]*$ && "$udid2pc" =~ ^[0-9]+$ && "$nbench" =~ ^[0-9]+$ ]] || usage
+[ -e "$outdir" ] && { echo "$0: $outdir already exists" >&2 ; exit 1 ; }
+type "$gpgbin" > /dev/null || exit 1
+
+firsts=(JEAN MARIE PIERRE ANNE LUC SOPHIE PAUL CLAIRE JACQUES JULIE MICHEL NATHALIE ALAIN ISABELLE ERIC CHRISTINE OLIVIER SANDRINE DAVID LAURA JEAN-PAUL ANNE-SOPHIE HANS ANNA JOHN MARY JOSE MARIA ALI FATIMA WEI YUKI)
+lasts=(MARTIN BERNARD DUBOIS THOMAS ROBERT RICHARD PETIT DURAND LEROY MOREAU SIMON LAURENT LEFEBVRE MICHEL GARCIA DAVID BERTRAND ROUX VINCENT FOURNIER MULLER SCHMIDT SMITH JONES ROSSI NOVAK KOWALSKI SILVA LI WANG TANAKA DUPONT-MOREL)
+domains=(example.org example.net example.com mail.example.org openudc.example lists.example.net)
+comments=("" "" "" "" "work" "home" "old key" "signing only")
+now=$(date +%s)
+
+# Note: the random functions below set global variables instead of printing,
+# as $RANDOM doesn't move on in the calling shell when used in a subshell.
+
+function gpgh {
+# Argument 1: GNUPGHOME
+# Arguments 2...: gpg arguments
+# Run gpg without any interaction, nor passphrase.
+	local home="$1"
+	shift
+	"$gpgbin" --homedir "$home" --batch --yes --quiet --no-tty --pinentry-mode loopback --passphrase "" "$@"
+}
+
+function gpgh_kill {
+	gpgconf --homedir "$1" --kill all 2> /dev/null || true
+}
+
+function rand_uid {
+# Argument 1: 1 if the user ID is to have an udid2 comment
+# Set uidname, uidcomment, uidemail and uid to a random user ID.
+	local first="${firsts[RANDOM%${#firsts[@]}]}" last="${lasts[RANDOM%${#lasts[@]}]}"
+	if (($1)) ; then
+		printf -v uidcomment "udid2;c;%s;%s;%04d-%02d-%02d;e%+06.2f%+07.2f;0" "$last" "$first" \
+			$((1930+RANDOM%80)) $((1+RANDOM%12)) $((1+RANDOM%28)) \
+			"$(((RANDOM%18000)-9000))e-2" "$(((RANDOM%36000)-18000))e-2"
+	else
+		uidcomment="${comments[RANDOM%${#comments[@]}]}"
+	fi
+	first="${first,,}"
+	last="${last,,}"
+	uidname="${first^} ${last^}"
+	uidemail="$first.$last$((RANDOM%1000))@${domains[RANDOM%${#domains[@]}]}"
+	uid="$uidname${uidcomment:+ ($uidcomment)} <$uidemail>"
+}
+
+function rand_nuids {
+# Set n to the number of user IDs of a key: 1 (60%), 2 (25%), 3 (10%) or 4 to 6.
+	local r=$((RANDOM%100))
+	if ((r<60)) ; then n=1
+	elif ((r<85)) ; then n=2
+	elif ((r<95)) ; then n=3
+	else n=$((4+RANDOM%3))
+	fi
+}
+
+function rand_nsigs {
+# Set n to the number of certifications of a key: 0 (50%), 1 to 3 (35%) or 4 to 20.
+	local r=$((RANDOM%100))
+	if ((r<50)) ; then n=0
+	elif ((r<85)) ; then n=$((1+RANDOM%3))
+	else n=$((4+RANDOM%17))
+	fi
+}
+
+function genkeys {
+# Argument 1: GNUPGHOME
+# Argument 2: number of keys to generate
+# Argument 3: percentage of them with an udid2
+# Argument 4: 1 if none of them is to expire
+# Print the fingerprints of the generated keys.
+	local i expire
+	for ((i=0;i<$2;i++)) ; do
+		rand_uid $(( RANDOM%100 < $3 ))
+		expire=0
+		(( $4 || RANDOM%5 )) || expire=$(date -u -d "@$((now+86400+RANDOM*RANDOM%(5*365*86400)))" +%Y-%m-%d)
+		echo "Key-Type: eddsa
+Key-Curve: ed25519
+Key-Usage: sign,cert
+Name-Real: $uidname
+${uidcomment:+Name-Comment: $uidcomment
+}Name-Email: $uidemail
+Creation-Date: $(date -u -d "@$((now-RANDOM*RANDOM%(12*365*86400)))" +%Y%m%dT%H%M%S)
+Expire-Date: $expire
+%no-protection
+%commit"
+	done > "$1/params"
+	gpgh "$1" --status-fd 3 --gen-key "$1/params" 3>&1 > /dev/null 2>&1 | sed -n 's/^\[GNUPG:\] KEY_CREATED [BP] \([[:xdigit:]]*\).*/\1/p'
+	rm -f "$1/params"
+}
+
+function shard {
+# Argument 1: shard number
+# Argument 2: number of keys
+# Argument 3: number of keys to put in bench/merge
+# Make $work/$1.asc (a part of the keyring), $work/$1.fpr and $work/$1.emails.
+	local home="$work/h$1" fpr i n signers merged=0
+
+	cp -a "$work/base" "$home"
+	for ((i=0;i<$2;i+=1000)) ; do
+		genkeys "$home" $(( $2-i < 1000 ? $2-i : 1000 )) "$udid2pc" 0
+	done > "$work/$1.fpr"
+	while read fpr ; do
+		rand_nuids
+		for ((;n>1;n--)) ; do
+			rand_uid $((RANDOM%100 < udid2pc))
+			gpgh "$home" --quick-add-uid "$fpr" "$uid" > /dev/null 2>&1 || true
+		done
+		signers=()
+		rand_nsigs
+		for ((;n>0;n--)) ; do
+			signers+=(-u "${signerfprs[RANDOM%${#signerfprs[@]}]}")
+		done
+		if ((${#signers[@]})) ; then
+			gpgh "$home" "${signers[@]}" --quick-sign-key "$fpr" > /dev/null 2>&1 || true
+		fi
+	done < "$work/$1.fpr"
+	gpgh "$home" --armor --export > "$work/$1.asc"
+	gpgh "$home" --with-colons --list-keys $(head -n 50 "$work/$1.fpr") \
+		| awk -F: '$1=="uid" && match($10,/<[^>]*>/) { print substr($10,RSTART+1,RLENGTH-2) }' > "$work/$1.emails"
+	# (after the export of the keyring)
+	while ((merged<$3)) && read fpr ; do
+		rand_uid 1
+		gpgh "$home" --quick-add-uid "$fpr" "$uid" > /dev/null 2>&1
+		gpgh "$home" --armor --export "$fpr" > "$outdir/bench/merge/$1-$merged.asc"
+		merged=$((merged+1))
+	done < "$work/$1.fpr"
+	gpgh_kill "$home"
+	rm -rf "$home"
+}
+
+work="$(mktemp -d /tmp/hkpgen.XXXXXX)"
+trap 'for h in "$work"/h* "$work/base" "$outdir/gpgme" ; do gpgh_kill "$h" ; done ; rm -rf "$work"' EXIT
+
+mkdir -p "$outdir/pub" "$outdir/gpgme" "$outdir/bench/new" "$outdir/bench/merge" "$outdir/bench/reject"
+mkdir "$work/base" "$work/hnew"
+chmod 700 "$outdir/gpgme" "$work/base" "$work/hnew"
+
+# The signers are the first keys of the keyring, their secret keys are copied in each shard
+nsigners=$(( nkeys/100 < 10 ? 10 : ( nkeys/100 > 1000 ? 1000 : nkeys/100 ) ))
+((nsigners > nkeys)) && nsigners=$nkeys
+echo "Generating $nsigners signers..." >&2
+genkeys "$work/base" "$nsigners" "$udid2pc" 1 > "$work/signers.fpr"
+gpgh "$work/base" --armor --export > "$work/signers.asc"
+gpgh_kill "$work/base"
+signerfprs=($(cat "$work/signers.fpr"))
+
+echo "Generating $((nkeys-nsigners)) keys in $jobs jobs..." >&2
+for ((j=0;j<jobs;j++)) ; do
+	RANDOM=$((j+$$))
+	shard $j $(( (nkeys-nsigners)/jobs + (j < (nkeys-nsigners)%jobs) )) $(( nbench/jobs + (j < nbench%jobs) )) &
+done
+wait
+
+echo "Generating the keys to submit..." >&2
+genkeys "$work/hnew" "$nbench" 100 0 > "$work/new.fpr"
+genkeys "$work/hnew" "$nbench" 0 0 > "$work/reject.fpr"
+i=0
+while read fpr ; do
+	gpgh "$work/hnew" --armor --export "$fpr" > "$outdir/bench/new/$((i++)).asc"
+done < "$work/new.fpr"
+i=0
+while read fpr ; do
+	gpgh "$work/hnew" --armor --export "$fpr" > "$outdir/bench/reject/$((i++)).asc"
+done < "$work/reject.fpr"
+
+echo "Importing the keyring..." >&2
+cat "$work/signers.asc" "$work"/[0-9]*.asc | gpgh "$outdir/gpgme" --import 2> /dev/null || true
+cat "$work/signers.fpr" "$work"/[0-9]*.fpr > "$outdir/bench/keys.txt"
+cat "$work"/[0-9]*.emails | sort -u > "$outdir/bench/emails.txt"
+
+# The key of the server itself
+echo "Key-Type: eddsa
+Key-Curve: ed25519
+Key-Usage: sign
+Name-Real: hkp bench server
+Name-Email: hkpbench@localhost
+Expire-Date: 0
+%no-protection
+%commit" > "$work/params"
+fpr=$(gpgh "$outdir/gpgme" --status-fd 3 --gen-key "$work/params" 3>&1 > /dev/null 2>&1 | sed -n 's/^\[GNUPG:\] KEY_CREATED [BP] \([[:xdigit:]]*\).*/\1/p')
+
+echo "$(wc -l < "$outdir/bench/keys.txt") keys in $outdir/gpgme. To run the server against them:
+	thttpgpd -d $outdir -p 11371 -nk -D -f $fpr
+then:
+	$(dirname "$0")/hkp_bench.sh -d $outdir/bench http://localhost:11371" >&2
@@ -0,0 +1,157 @@
+#!/bin/bash
+# -*- mode: sh; tabstop: 4; shiftwidth: 4; softtabstop: 4; -*-
+#
+# Check that the signatures made natively by thttpgpd (or ludd), cf. natsig.c,
+# are verified by gpg: for each key algorithm, a server key is made in a
+# throwaway keyring, and an instance run on it, on the loopback. Once it is
+# up (so that natsig_init() has loaded the key), the secret key is deleted
+# from the keyring, so that gpg can't be the one which signs. Then some
+# multipart/msigned responses (pks/lookup, and static files of various sizes,
+# twice to get their cached signatures too) are split, and their signature
+# checked by "gpg --verify" against their content.
+#
+# A response without signature part (as sent when signing failed) means the
+# native signing was unavailable (cf. the "natsig:" lines of the syslog).
+#
+# Needs curl, gpg (>= 2.1), and a server built with libgcrypt.
+
+algos="ed25519,rsa2048"
+bin="thttpgpd"
+port="11391"
+keep=""
+
+function usage {
+	echo "Usage: $0 [-a ALGOS] [-b SERVER] [-p PORT] [-k]
+	-a ALGOS   comma separated list among ed25519,rsa2048,rsa3072,rsa4096 - default: $algos
+	-b SERVER  the server binary - default: $bin
+	-p PORT    port of the instances - default: $port
+	-k         keep the working directory (with the responses)" >&2
+	exit 1
+}
+
+while getopts "a:b:p:kh" opt ; do
+	case "$opt" in
+		a) algos="$OPTARG" ;;
+		b) bin="$OPTARG" ;;
+		p) port="$OPTARG" ;;
+		k) keep="yes" ;;
+		*) usage ;;
+	esac
+done
+
+[[ "$algos" =~ ^(ed25519|rsa[0-9]+)(,(ed25519|rsa[0-9]+))*$ && "$port" =~ ^[0-9]+$ ]] || usage
+for cmd in curl gpg gpgconf "$bin" ; do
+	type "$cmd" > /dev/null || exit 1
+done
+
+work="$(mktemp -d /tmp/natsig.XXXXXX)"
+pid=""
+function cleanup {
+	[ "$pid" ] && kill "$pid" 2> /dev/null
+	for h in "$work"/*/gpgme ; do
+		gpgconf --homedir "$h" --kill all 2> /dev/null
+	done
+	if [ "$keep" ] ; then
+		echo "Working directory kept: $work" >&2
+	else
+		rm -rf "$work"
+	fi
+}
+trap cleanup EXIT
+
+function gpgh {
+# Argument 1: GNUPGHOME
+# Arguments 2...: gpg arguments
+	local home="$1"
+	shift
+	gpg --homedir "$home" --batch --yes --quiet --no-tty --pinentry-mode loopback --passphrase "" "$@"
+}
+
+function part {
+# Argument 1: file, from the start of a part (its headers)
+# Argument 2: where to write its content
+# Print the bytes of the part (headers and content), or nothing if it has no
+# Content-Length.
+	local hlen clen
+	hlen=$(awk '{ print } /^\r$/ { exit }' "$1" | wc -c)
+	clen=$(awk '/^\r$/ { exit } tolower($1)=="content-length:" { print $2+0 }' "$1")
+	[ "$clen" ] || return
+	tail -c +$((hlen+1)) "$1" | head -c "$clen" > "$2"
+	echo $((hlen+clen))
+}
+
+function check {
+# Argument 1: directory of the instance
+# Argument 2: name of the response
+# Argument 3: URL path
+# Fetch it signed, and verify it. Return 1 if it doesn't.
+	local r="$1/$2" bound n
+	if ! curl -s -f --max-time 30 -D "$r.head" -o "$r" -H "Accept: multipart/msigned" "http://127.0.0.1:$port$3" ; then
+		echo "  $2: request failed" ; return 1
+	fi
+	bound=$(sed -n 's/^Content-Type: multipart\/msigned; boundary=\([^[:space:]]*\).*$/\1/Ip' "$r.head")
+	if [ -z "$bound" ] ; then
+		echo "  $2: not multipart/msigned" ; return 1
+	fi
+	# "--bound\r\n" part "\r\n--bound\r\n" part "\r\n--bound--\r\n"
+	tail -c +$((${#bound}+5)) "$r" > "$r.1"
+	n=$(part "$r.1" "$r.data")
+	[ "$n" ] && tail -c +$((n+${#bound}+7)) "$r.1" > "$r.2" && n=$(part "$r.2" "$r.sig")
+	if [ -z "$n" ] ; then
+		echo "  $2: no signature part" ; return 1
+	fi
+	if gpgh "$1/gpgme" --verify "$r.sig" "$r.data" 2> "$r.verify" ; then
+		echo "  $2: good signature ($(stat -c %s "$r.data") bytes)"
+	else
+		echo "  $2: BAD signature (cf. $r.verify with -k)" ; return 1
+	fi
+}
+
+failed=0
+for algo in ${algos//,/ } ; do
+	dir="$work/$algo"
+	mkdir -p "$dir/gpgme" "$dir/pub"
+	chmod 700 "$dir/gpgme"
+	if [ "$algo" == "ed25519" ] ; then
+		keytype="Key-Type: eddsa
+Key-Curve: ed25519"
+	else
+		keytype="Key-Type: rsa
+Key-Length: ${algo#rsa}"
+	fi
+	echo "$keytype
+Key-Usage: sign
+Name-Real: natsig $algo
+Name-Email: natsig@localhost
+Expire-Date: 0
+%no-protection
+%commit" > "$work/params"
+	fpr=$(gpgh "$dir/gpgme" --status-fd 3 --gen-key "$work/params" 3>&1 > /dev/null 2>&1 | sed -n 's/^\[GNUPG:\] KEY_CREATED [BP] \([[:xdigit:]]*\).*/\1/p')
+	[ "$fpr" ] || { echo "$0: could not make a $algo key" >&2 ; exit 1 ; }
+
+	# Static files: empty, smaller and bigger than the read buffer, binary
+	: > "$dir/pub/empty.txt"
+	echo "natsig interoperability check" > "$dir/pub/small.txt"
+	head -c 100000 /dev/urandom | base64 > "$dir/pub/big.txt"
+	head -c 1000000 /dev/urandom > "$dir/pub/random.bin"
+
+	"$bin" -d "$dir" -p "$port" -nk -D -f "$fpr" > "$dir/log" 2>&1 &
+	pid=$!
+	for ((i=0;i<30;i++)) ; do
+		curl -s -f --max-time 5 -o /dev/null "http://127.0.0.1:$port/small.txt" && break
+		sleep 1
+	done
+	gpgh "$dir/gpgme" --delete-secret-keys "$fpr" 2> /dev/null
+
+	echo "$algo ($fpr):"
+	check "$dir" lookup "/pks/lookup?op=get&options=mr&search=0x$fpr" || failed=1
+	for f in empty.txt small.txt big.txt random.bin ; do
+		check "$dir" "$f" "/$f" || failed=1
+		check "$dir" "$f.cached" "/$f" || failed=1
+	done
+
+	kill "$pid" 2> /dev/null
+	wait "$pid" 2> /dev/null
+	pid=""
+done
+exit $failed
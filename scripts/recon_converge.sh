@@ -0,0 +1,108 @@
+#!/bin/bash
+# -*- mode: sh; tabstop: 4; shiftwidth: 4; softtabstop: 4; -*-
+#
+# Check that two thttpgpd (or ludd) instances reconcile their keyrings (cf.
+# RECON_INTERVAL): two keyrings are made by hkp_keyring_gen.sh, the second one
+# also gets part of the keys of the first, some of them with a new user ID (so
+# that they have to be merged on both sides), and an instance is run on each,
+# on the loopback, with the other one as peer. Then the roots of their prefix
+# trees (pks/recon?prefix=) are compared until they are the same, or until
+# the timeout.
+#
+# The first reconciliation starts at the first "occasional" job of the server
+# (OCCASIONAL_TIME, 2 minutes), the next ones every RECON_INTERVAL seconds.
+#
+# Needs curl, gpg, and a server built with RECON_INTERVAL (and KEYIDX_SLOTS).
+
+nkeys=200
+timeout=1500
+bin="thttpgpd"
+ports="11381,11382"
+keep=""
+
+function usage {
+	echo "Usage: $0 [-n NKEYS] [-t TIMEOUT] [-b SERVER] [-p PORT1,PORT2] [-k]
+	-n NKEYS    number of keys in each keyring - default: $nkeys
+	-t TIMEOUT  seconds to wait for the keyrings to converge - default: $timeout
+	-b SERVER   the server binary - default: $bin
+	-p PORTS    ports of the two instances - default: $ports
+	-k          keep the working directory (with the logs of the instances)" >&2
+	exit 1
+}
+
+while getopts "n:t:b:p:kh" opt ; do
+	case "$opt" in
+		n) nkeys="$OPTARG" ;;
+		t) timeout="$OPTARG" ;;
+		b) bin="$OPTARG" ;;
+		p) ports="$OPTARG" ;;
+		k) keep="yes" ;;
+		*) usage ;;
+	esac
+done
+
+[[ "$nkeys" =~ ^[1-9][0-9]*$ && "$timeout" =~ ^[1-9][0-9]*$ && "$ports" =~ ^[0-9]+,[0-9]+$ ]] || usage
+port=(${ports/,/ })
+for cmd in curl gpg "$bin" ; do
+	type "$cmd" > /dev/null || exit 1
+done
+
+work="$(mktemp -d /tmp/reconconv.XXXXXX)"
+pids=()
+function cleanup {
+	[ "${#pids[@]}" -gt 0 ] && kill "${pids[@]}" 2> /dev/null
+	if [ "$keep" ] ; then
+		echo "Working directory kept: $work" >&2
+	else
+		rm -rf "$work"
+	fi
+}
+trap cleanup EXIT
+
+function root {
+# Argument 1: port of an instance
+# Print the root of its prefix tree (nothing if it doesn't answer yet).
+	curl -s -f --max-time 10 "http://127.0.0.1:$1/pks/recon?prefix="
+}
+
+function count {
+# Read a root of prefix tree, and print the number of keys it covers.
+	awk 'NR==1 { t=$1 ; next } t=="children" { n+=$1 ; next } { n++ } END { print n+0 }'
+}
+
+# The keyrings (all user IDs with an udid2, so that no key is rejected)
+for i in 0 1 ; do
+	"$(dirname "$0")/hkp_keyring_gen.sh" -n "$nkeys" -u 100 -b $((nkeys/10)) -o "$work/$i" > /dev/null 2>&1 \
+		|| { echo "$0: hkp_keyring_gen.sh failed" >&2 ; exit 1 ; }
+done
+# Half of the keys of the first one, and some with a new user ID, in the second
+head -n $((nkeys/2)) "$work/0/bench/keys.txt" | xargs gpg -q --homedir "$work/0/gpgme" --export \
+	| gpg -q --homedir "$work/1/gpgme" --import 2> /dev/null
+cat "$work/0/bench/merge/"*.asc | gpg -q --homedir "$work/1/gpgme" --import 2> /dev/null
+
+for i in 0 1 ; do
+	fpr=$(gpg --homedir "$work/$i/gpgme" --list-secret-keys --with-colons 2> /dev/null | awk -F: '/^fpr/ { print $10 ; exit }')
+	"$bin" -d "$work/$i" -p "${port[i]}" -nk -D -f "$fpr" -P "127.0.0.1:${port[1-i]}" > "$work/$i.log" 2>&1 &
+	pids+=($!)
+done
+
+start=$(date +%s)
+printf "%8s %10s %10s\n" "seconds" "keys ${port[0]}" "keys ${port[1]}"
+while true ; do
+	sleep 10
+	now=$(($(date +%s)-start))
+	r0="$(root "${port[0]}")"
+	r1="$(root "${port[1]}")"
+	printf "%8d %10s %10s\n" "$now" "$(count <<< "$r0")" "$(count <<< "$r1")"
+	if [ "$r0" ] && [ "$r0" == "$r1" ] ; then
+		echo "Converged after $now seconds."
+		exit 0
+	fi
+	for pid in "${pids[@]}" ; do
+		kill -0 "$pid" 2> /dev/null || { echo "$0: an instance died (cf. its log with -k)" >&2 ; exit 1 ; }
+	done
+	if [ "$now" -ge "$timeout" ] ; then
+		echo "$0: not converged after $now seconds" >&2
+		exit 1
+	fi
+done
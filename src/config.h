@@ -127,18 +127,152 @@
 #define SIG_EXCLUDE_PATTERN ""
 
 /* CONFIGURE: sigcache directory (inside the application home directory)
- * which contain all the cached signatures. If a "multipart/msigned" is asked
+ * which contain the signature store. If a "multipart/msigned" is asked
  * through the "Accept:" request header, and requested ressource match SIG_PATTERN ;
- * then it check if the expanded file is older than the cached signature.
+ * then the server look for a signature of the same file (device, inode, size
+ * and modification time) in its in-memory index of the store.
  *
- * If the cached signature does not exist or is older than the file, then the
- * server will generate it into this dir (writing in must be enabled), else it
- * will use the cached signature to sign the requested file.
+ * If there is none, the signature is generated and appended to the store
+ * (writing in must be enabled), else the cached signature is used to sign the
+ * requested file.
  *
  * You may undefine this to disable signatures caching, but that's not recommanded !
  */
 #define SIG_CACHEDIR "sigcache"
 
+/* CONFIGURE: Bytes of signatures the cache keep in memory (the least recently
+ * used are read back from the store when needed), and size above which the
+ * store is compacted (dropping the signatures not used for the longest time).
+ */
+#define SIGC_MAX_BYTES 16000000
+#define SIGC_MAX_STORE 100000000
+
+/* CONFIGURE: Number of threads of the signing service. This service is a
+ * process forked at startup, in which each thread keep a warm gpgme context
+ * with the bot key loaded, so signed responses don't cost a cold gpg round
+ * trip anymore. Interposers reach it through the unix socket SIGSERV_SOCKET
+ * (relative to WEB_DIR), and if more than SIGSERV_QUEUE requests are waiting
+ * for a thread, they sign by themselves as before.
+ *
+ * You may undefine SIGSERV_WORKERS to disable the signing service.
+ */
+#define SIGSERV_WORKERS 4
+#define SIGSERV_QUEUE 64
+#define SIGSERV_SOCKET "../sigserv.sock"
+
+/* CONFIGURE: Number of files the background pre-signer may sign at once.
+ * The pre-signer is a process forked at startup (with its nice value
+ * increased by PRESIGN_NICE) which scan WEB_DIR, then watch it with inotify,
+ * to put the signature of new or modified files in the signature cache
+ * before they are requested. It needs SIG_CACHEDIR.
+ *
+ * You may undefine PRESIGN_JOBS to disable the pre-signer.
+ */
+#define PRESIGN_JOBS 1
+#define PRESIGN_NICE 10
+
+/* CONFIGURE: Number of verified signatures remembered by the native
+ * verification engine (when built with libgcrypt), so that a signed document
+ * received again (eg. from several peers) is not verified again. Each entry
+ * takes about 64 bytes, in a memory area shared by all processes.
+ */
+#define NATSIG_VERIFIED 16384
+
+/* CONFIGURE: Maximum number of gpgme operations run by the server process
+ * itself, driven by the main loop (cf. gpgio.c), instead of forking a process
+ * for each of them. It's used for pks/lookup requests; when this number is
+ * reached, or if undefined, a process is forked as before.
+ * As the responses made this way are held in memory, one which would exceed
+ * HKP_LOOKUP_MAXLEN bytes (eg. a short pattern on a large keyring) is given
+ * up, and made by a forked process which streams it.
+ */
+#define GPGIO_MAX_OPS 32
+#define HKP_LOOKUP_MAXLEN (1024*1024)
+
+/* CONFIGURE: Index the public keyring in memory (cf. keyidx.c), to answer
+ * the pks/lookup requests (op=index) for a keyid, a fingerprint, an email
+ * address between '<' and '>', a user ID or a part of it, without running
+ * gpg. This is the initial size of its hash table (a power of 2, doubled as
+ * needed). Needs GPGIO_MAX_OPS.
+ * The index is saved in KEYIDX_SNAPSHOT (relative to WEB_DIR), and read back
+ * at startup if the keyring didn't change. Undefine it to always list the
+ * keyring at startup.
+ * The armored exports of the keys fetched by op=get are cached with them,
+ * within KEYIDX_EXPORT_BYTES.
+ * The requests for keyids or fingerprints we don't have are answered through
+ * a Bloom filter of KEYIDX_BLOOM_BITS bits (a multiple of 8): about 10 bits
+ * per key (and per subkey) keep its false positives under 1%.
+ */
+#define KEYIDX_SLOTS 65536
+#define KEYIDX_SNAPSHOT "../keyidx.snap"
+#define KEYIDX_EXPORT_BYTES 16000000
+#define KEYIDX_BLOOM_BITS 16777216
+
+/* CONFIGURE: Spool directory (relative to WEB_DIR) of the import pipeline of
+ * pks/add (cf. keyimp.c). The keys submitted are checked in a private keyring
+ * (so those the policy rejects never reach the keyring), then queued there,
+ * and imported by batches of at most KEYIMP_BATCH submissions, in a single gpg
+ * operation each. Clients wait KEYIMP_WAIT seconds for their results, else
+ * get a 202 with the URL where to find them, for KEYIMP_KEEP seconds.
+ *
+ * You may undefine KEYIMP_SPOOL to import each submission by itself as before.
+ */
+#define KEYIMP_SPOOL "../pks-add"
+#define KEYIMP_BATCH 64
+#define KEYIMP_WAIT 10
+#define KEYIMP_KEEP 3600
+
+/* CONFIGURE: Number of pks/add submissions remembered (when built with
+ * libgcrypt), by the SHA256 of their key material, in a memory area shared by
+ * all processes (about 150 bytes each). The same submission made again within
+ * KEYIMP_DEDUP_WINDOW seconds (at most KEYIMP_KEEP) gets the same results
+ * without running gpg, unless one of its keys has changed since (or the
+ * keyrings were changed by some other process than the imports).
+ */
+#define KEYIMP_DEDUP 4096
+#define KEYIMP_DEDUP_WINDOW 1800
+
+/* CONFIGURE: Reconcile the keyring with the peers (cf. -P option and
+ * recon.c) every RECON_INTERVAL seconds: the states of the keys (a hash of
+ * their subkeys, user IDs and signatures) are kept in a prefix tree, whose
+ * nodes peers compare through "pks/recon" to find the differences, walking
+ * down only where they differ. Nodes of at most RECON_LEAF keys are listed.
+ * The keys which differ are then fetched RECON_FETCH at a time (at most
+ * RECON_MAX_KEYS a round from each peer), and imported through the import
+ * pipeline, as per the policy of pks/add. The states of the keys which bring
+ * nothing new are remembered in RECON_SKIPPED, not to fetch them again.
+ * Requests to peers time out after RECON_TIMEOUT seconds. Needs KEYIDX_SLOTS
+ * and KEYIMP_SPOOL.
+ *
+ * You may undefine RECON_INTERVAL to disable the reconciliation.
+ */
+#define RECON_INTERVAL 600
+#define RECON_LEAF 32
+#define RECON_FETCH 16
+#define RECON_MAX_KEYS 4096
+#define RECON_MAX_PEERS 16
+#define RECON_TIMEOUT 30
+#define RECON_SKIPPED "../recon.skip"
+
+/* CONFIGURE: Number of pre-forked processes handling the pks/, udc/ and
+ * directory listing requests (cf. hpool.c): the server pass the connection
+ * to an idle one instead of forking a process for each request, and forks
+ * as before if none is idle. A handler is replaced after HPOOL_REQUESTS
+ * requests, and CGI_TIMELIMIT (if defined) bounds each of them. Undefine
+ * HPOOL_WORKERS to always fork.
+ */
+#define HPOOL_WORKERS 4
+#define HPOOL_REQUESTS 500
+
+/* CONFIGURE: FastCGI client (cf. -F option and fcgi.c): maximum number of
+ * persistent connections to the application, and of requests multiplexed on
+ * each of them once they are all busy. Requests with a body of more than
+ * FCGI_MAXBODY bytes are refused.
+ */
+#define FCGI_MAX_CONNS 8
+#define FCGI_MAX_REQS 8
+#define FCGI_MAXBODY (16*1024*1024)
+
 /* CONFIGURE: Maximum number of simultaneous connexion per client (ip).
  * This use external tool iptables (which have to be in your $PATH and
  * need the root privileges).
@@ -171,6 +305,39 @@
 #define CGI_LIMIT 10000
 #endif
 
+/* CONFIGURE: When CGI_LIMIT processes are running, a request needing one
+** more waits for one to exit in the queue of its class (hkp, udc, signing or
+** CGI), if it holds less than ADMIT_QUEUE_DEPTH requests, instead of getting
+** a 503 (or its file unsigned).  After ADMIT_MAX_WAIT seconds it gets them
+** anyway.  Requests are admitted in arrival order, or class by class (in that
+** order) if ADMIT_PRIORITY is defined.  Undefine ADMIT_QUEUE_DEPTH to disable
+** the queues.
+*/
+#define ADMIT_QUEUE_DEPTH 64
+#define ADMIT_MAX_WAIT 10
+/* #define ADMIT_PRIORITY */
+
+/* CONFIGURE: Adapt the number of processes of each admission class to what
+** the host can take (within the CGI limit, or ADAPT_MAX without one).  It
+** starts at ADAPT_START, and grows by one each time as many processes as the
+** limit ended while it was used.  The run times of the processes (without
+** the time they wait for their client) are taken by windows of ADAPT_SAMPLES
+** per class: once their ADAPT_PERCENTILE percentile is above ADAPT_TOLERANCE
+** times the usual one, the limit is cut in the same ratio.  It's multiplied by
+** ADAPT_BACKOFF when the load average is above ADAPT_LOAD per CPU.  The cuts
+** happen once a second at most, down to ADAPT_MIN.
+** Undefine ADAPT_LIMITS to only use the CGI limit.
+*/
+#define ADAPT_LIMITS
+#define ADAPT_START 16
+#define ADAPT_MIN 2
+#define ADAPT_MAX 256
+#define ADAPT_SAMPLES 32
+#define ADAPT_PERCENTILE 90
+#define ADAPT_TOLERANCE 2.0
+#define ADAPT_BACKOFF 0.8
+#define ADAPT_LOAD 2.0
+
 /* CONFIGURE: How many seconds to allow for reading the initial request
 ** on a new connection.
 */
@@ -226,6 +393,27 @@
  */
 #define PKS_ADD_LOG
 
+/* CONFIGURE: Maximum size of the body of a pks/add request. It's read (and
+ * form-decoded) as gpg consumes it, so the memory used doesn't depend on it,
+ * and it has to be received within PKS_ADD_TIMELIMIT seconds.
+ */
+#define PKS_ADD_MAXBODY (8*1024*1024)
+#define PKS_ADD_TIMELIMIT 120
+
+/* CONFIGURE: Compress the pks/lookup responses (op=index and op=get) with
+ * gzip, when built with zlib and the client accepts it (Accept-Encoding), at
+ * level HKP_GZIP_LEVEL (1 is the fastest, 9 the smallest). Those made by the
+ * server process (cf. GPGIO_MAX_OPS) are compressed from HKP_GZIP_MIN bytes,
+ * the others are compressed as they're written. Signed responses (cf.
+ * multipart/msigned) are never compressed.
+ *
+ * You may undefine HKP_GZIP_LEVEL to never compress them.
+ */
+#ifdef HAVE_LIBZ
+#define HKP_GZIP_LEVEL 6
+#define HKP_GZIP_MIN 1024
+#endif
+
 /* CONFIGURE: The default character set name to use with text MIME types.
 ** This gets substituted into the MIME types where they have a "%s".
 **
@@ -0,0 +1,689 @@
+/* fcgi.c - FastCGI client, run from the event loop
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* When a FastCGI application is given (-F option), the requests matching the
+* CGI pattern are passed to it instead of being run as CGI. Up to
+* FCGI_MAX_CONNS connections to it are kept open (FCGI_KEEP_CONN), and once
+* they are all busy, up to FCGI_MAX_REQS requests are multiplexed on each of
+* them (unless the application tells it can't).
+*
+* All their file descriptors are added to fdwatch with a null client data (as
+* in gpgio.c), and fcgi_dispatch() carry them on once fdwatch() has marked
+* them. A connection is watched for reading, and a dup of it for writing while
+* some records are waiting to be sent.
+*
+* The STDOUT records of a request are written into a pipe whose other end is
+* the hc->cgi_fd of the connection: its response is then relayed like the one
+* of a CGI (cf. httpd_relay_cgi()), and the end of the request closes the
+* pipe. What the pipe can't take yet is kept until it can, but once a request
+* has more than FCGI_MAX_PEND bytes waiting, its connection is no more watched
+* for reading (the application is then blocked by TCP flow control) until they
+* are down to the half: a slow client doesn't make the server hold the whole
+* response in memory.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <netdb.h>
+
+#include "config.h"
+#include "fdwatch.h"
+#include "libhttpd.h"
+#include "fcgi.h"
+
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_CANT_MPX_CONN 1
+
+#define FCGI_MAX_PEND 262144
+
+typedef struct {
+	int fd; /* -1 if the slot is free */
+	int wfd; /* dup of fd, watched for writing */
+	int connected, wwatched, nreqs;
+	int rpaused; /* not watched for reading, cf. FCGI_MAX_PEND */
+	char * out; /* records to send */
+	size_t outlen, maxout;
+	char * in; /* records received, not handled yet */
+	size_t inlen, maxin;
+} FcgiConn;
+
+typedef struct {
+	int used;
+	httpd_conn * hc; /* NULL once aborted */
+	int pfd; /* write end of the pipe to hc->cgi_fd, -1 once closed */
+	int pwatched;
+	int ended; /* FCGI_END_REQUEST received */
+	char * pend; /* output the pipe couldn't take yet */
+	size_t pendlen, maxpend;
+	off_t bodyleft;
+} FcgiJob;
+
+static FcgiConn conns[FCGI_MAX_CONNS];
+static FcgiJob jobs[FCGI_MAX_CONNS][FCGI_MAX_REQS];
+static int num_conns = 0, num_jobs = 0, initialized = 0, nompx = 0;
+static long started_count = 0, ended_count = 0, aborted_count = 0, opened_count = 0, paused_count = 0;
+
+/* Forwards. */
+static void init( void );
+static socklen_t sa_len( const struct sockaddr * sa );
+static FcgiConn * conn_get( const struct sockaddr * sa );
+static void conn_close( FcgiConn * fc, const char * why );
+static void conn_watch( FcgiConn * fc );
+static void conn_rwatch( FcgiConn * fc );
+static void conn_write( FcgiConn * fc );
+static void conn_flush( FcgiConn * fc );
+static void conn_read( FcgiConn * fc );
+static void put_record( FcgiConn * fc, int type, int id, const char * data, size_t len );
+static void put_param( char ** buf, size_t * max, size_t * len, const char * name, size_t nlen, const char * value );
+static void handle_record( FcgiConn * fc, int type, int id, const char * data, size_t len );
+static void job_output( FcgiJob * job, const char * data, size_t len );
+static void job_flush( FcgiJob * job );
+static void job_close_pipe( FcgiJob * job );
+static void job_free( FcgiJob * job );
+
+#define JOB_CONN(job) ( &conns[( (job) - &jobs[0][0] ) / FCGI_MAX_REQS] )
+#define JOB_ID(job) ( (int) ( ( (job) - &jobs[0][0] ) % FCGI_MAX_REQS ) + 1 )
+
+static void init( void ) {
+	int i, j;
+
+	for ( i = 0; i < FCGI_MAX_CONNS; i++ ) {
+		conns[i].fd = conns[i].wfd = -1;
+		for ( j = 0; j < FCGI_MAX_REQS; j++ )
+			jobs[i][j].pfd = -1;
+	}
+	initialized = 1;
+}
+
+struct sockaddr * fcgi_parse_addr( const char * pass ) {
+	struct sockaddr_storage * ss;
+	struct sockaddr_un * su;
+	struct addrinfo hints, * ai;
+	char host[256];
+	const char * port;
+	size_t hlen;
+	int r;
+
+	ss = (struct sockaddr_storage *) calloc( 1, sizeof(*ss) );
+	if ( ! ss ) {
+		syslog( LOG_CRIT, "out of memory copying fastcgi_pass" );
+		return (struct sockaddr *) 0;
+	}
+	if ( ! strncmp( pass, "unix:", 5 ) ) {
+		su = (struct sockaddr_un *) ss;
+		if ( strlen( pass + 5 ) >= sizeof(su->sun_path) ) {
+			syslog( LOG_CRIT, "fastcgi socket path too long: %.80s", pass + 5 );
+			free( ss );
+			return (struct sockaddr *) 0;
+		}
+		su->sun_family = AF_UNIX;
+		strcpy( su->sun_path, pass + 5 );
+		return (struct sockaddr *) ss;
+	}
+
+	port = strrchr( pass, ':' );
+	hlen = port ? port - pass : 0;
+	if ( hlen > 1 && pass[0] == '[' && pass[hlen - 1] == ']' ) {
+		pass++;
+		hlen -= 2;
+	}
+	if ( hlen == 0 || hlen >= sizeof(host) || ! port[1] ) {
+		syslog( LOG_CRIT, "invalid fastcgi address (host:port or unix:/path): %.80s", pass );
+		free( ss );
+		return (struct sockaddr *) 0;
+	}
+	memcpy( host, pass, hlen );
+	host[hlen] = '\0';
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ( ( r = getaddrinfo( host, port + 1, &hints, &ai ) ) != 0 ) {
+		syslog( LOG_CRIT, "getaddrinfo %.80s - %.80s", host, gai_strerror( r ) );
+		free( ss );
+		return (struct sockaddr *) 0;
+	}
+	memcpy( ss, ai->ai_addr, ai->ai_addrlen );
+	freeaddrinfo( ai );
+	return (struct sockaddr *) ss;
+}
+
+static socklen_t sa_len( const struct sockaddr * sa ) {
+	switch ( sa->sa_family ) {
+		case AF_UNIX: return sizeof(struct sockaddr_un);
+		case AF_INET: return sizeof(struct sockaddr_in);
+#ifdef USE_IPV6
+		case AF_INET6: return sizeof(struct sockaddr_in6);
+#endif /* USE_IPV6 */
+		default: return sizeof(struct sockaddr_storage);
+	}
+}
+
+/*! conn_get find a connection to take a new request: an idle one, else a new
+ * one, else the least busy one.
+ * \return the connection, or NULL if none can take it.
+ */
+static FcgiConn * conn_get( const struct sockaddr * sa ) {
+	FcgiConn * fc = (FcgiConn *) 0, * free_fc = (FcgiConn *) 0;
+	int i, on = 1;
+
+	for ( i = 0; i < FCGI_MAX_CONNS; i++ ) {
+		if ( conns[i].fd < 0 ) {
+			if ( ! free_fc )
+				free_fc = &conns[i];
+			continue;
+		}
+		if ( conns[i].nreqs == 0 )
+			return &conns[i];
+		if ( conns[i].nreqs < FCGI_MAX_REQS && ! nompx && ( ! fc || conns[i].nreqs < fc->nreqs ) )
+			fc = &conns[i];
+	}
+	if ( ! free_fc )
+		return fc;
+
+	/* Open a new one */
+	free_fc->fd = socket( sa->sa_family, SOCK_STREAM, 0 );
+	if ( free_fc->fd < 0 ) {
+		syslog( LOG_ERR, "fastcgi socket - %m" );
+		return fc;
+	}
+	(void) fcntl( free_fc->fd, F_SETFD, FD_CLOEXEC );
+	(void) httpd_set_ndelay( free_fc->fd );
+	if ( sa->sa_family != AF_UNIX )
+		(void) setsockopt( free_fc->fd, IPPROTO_TCP, TCP_NODELAY, (void*) &on, sizeof(on) );
+	free_fc->connected = 1;
+	if ( connect( free_fc->fd, sa, sa_len( sa ) ) < 0 ) {
+		if ( errno != EINPROGRESS ) {
+			syslog( LOG_ERR, "fastcgi connect - %m" );
+			close( free_fc->fd );
+			free_fc->fd = -1;
+			return fc;
+		}
+		free_fc->connected = 0;
+	}
+	free_fc->wfd = dup( free_fc->fd );
+	if ( free_fc->wfd < 0 ) {
+		syslog( LOG_ERR, "fastcgi dup - %m" );
+		close( free_fc->fd );
+		free_fc->fd = -1;
+		return fc;
+	}
+	(void) fcntl( free_fc->wfd, F_SETFD, FD_CLOEXEC );
+	free_fc->wwatched = free_fc->rpaused = free_fc->nreqs = 0;
+	free_fc->outlen = free_fc->inlen = 0;
+	fdwatch_add_fd( free_fc->fd, (void*) 0, FDW_READ );
+	conn_watch( free_fc );
+	num_conns++;
+	opened_count++;
+	return free_fc;
+}
+
+/* Close fc (logging why, if not NULL), and end its requests. */
+static void conn_close( FcgiConn * fc, const char * why ) {
+	int j;
+
+	if ( why )
+		syslog( LOG_ERR, "fastcgi %s - %m", why );
+	if ( ! fc->rpaused )
+		fdwatch_del_fd( fc->fd );
+	if ( fc->wwatched )
+		fdwatch_del_fd( fc->wfd );
+	close( fc->fd );
+	close( fc->wfd );
+	fc->fd = fc->wfd = -1;
+	num_conns--;
+	/* (their relay gets EOF) */
+	for ( j = 0; j < FCGI_MAX_REQS; j++ )
+		if ( jobs[fc - conns][j].used )
+			job_free( &jobs[fc - conns][j] );
+}
+
+/* Watch fc for writing while it's connecting or has records to send. */
+static void conn_watch( FcgiConn * fc ) {
+	int want = ( fc->outlen > 0 || ! fc->connected );
+
+	if ( want && ! fc->wwatched )
+		fdwatch_add_fd( fc->wfd, (void*) 0, FDW_WRITE );
+	else if ( ! want && fc->wwatched )
+		fdwatch_del_fd( fc->wfd );
+	fc->wwatched = want;
+}
+
+/* Stop reading fc while one of its requests has more than FCGI_MAX_PEND bytes
+ * waiting for its pipe, and read it again once they are all down to the half. */
+static void conn_rwatch( FcgiConn * fc ) {
+	size_t most = 0;
+	int j, want;
+
+	if ( fc->fd < 0 )
+		return;
+	for ( j = 0; j < FCGI_MAX_REQS; j++ )
+		if ( jobs[fc - conns][j].used && jobs[fc - conns][j].pendlen > most )
+			most = jobs[fc - conns][j].pendlen;
+	want = ( most <= ( fc->rpaused ? FCGI_MAX_PEND / 2 : FCGI_MAX_PEND ) );
+	if ( want && fc->rpaused )
+		fdwatch_add_fd( fc->fd, (void*) 0, FDW_READ );
+	else if ( ! want && ! fc->rpaused ) {
+		fdwatch_del_fd( fc->fd );
+		paused_count++;
+	}
+	fc->rpaused = ! want;
+}
+
+/* fc is writable: check it's connected, and send what it can take. */
+static void conn_write( FcgiConn * fc ) {
+	int err = 0;
+	socklen_t len = sizeof(err);
+	ssize_t r;
+
+	if ( ! fc->connected ) {
+		if ( getsockopt( fc->fd, SOL_SOCKET, SO_ERROR, (void*) &err, &len ) < 0 || err ) {
+			if ( err )
+				errno = err;
+			conn_close( fc, "connect" );
+			return;
+		}
+		fc->connected = 1;
+	}
+	while ( fc->outlen > 0 ) {
+		r = write( fc->fd, fc->out, fc->outlen );
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+			break;
+		if ( r <= 0 ) {
+			conn_close( fc, "write" );
+			return;
+		}
+		(void) memmove( fc->out, &(fc->out[r]), fc->outlen - r );
+		fc->outlen -= r;
+	}
+	conn_watch( fc );
+}
+
+/* Send what was put on fc right now if it's connected (it may get closed). */
+static void conn_flush( FcgiConn * fc ) {
+	if ( fc->connected )
+		conn_write( fc );
+	else
+		conn_watch( fc );
+}
+
+/* fc is readable: handle the complete records received. */
+static void conn_read( FcgiConn * fc ) {
+	unsigned char * h;
+	size_t off, clen, rlen;
+	ssize_t r;
+
+	httpd_realloc_str( &fc->in, &fc->maxin, fc->inlen + FCGI_HEADER_LEN + FCGI_MAX_CONTENT + 255 );
+	r = read( fc->fd, &(fc->in[fc->inlen]), fc->maxin - fc->inlen );
+	if ( r < 0 && ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) )
+		return;
+	if ( r <= 0 ) {
+		/* (without a running request, the application just closed it) */
+		conn_close( fc, r < 0 || fc->nreqs > 0 ? "read" : (char*) 0 );
+		return;
+	}
+	fc->inlen += r;
+
+	for ( off = 0; fc->inlen - off >= FCGI_HEADER_LEN; off += rlen ) {
+		h = (unsigned char *) &(fc->in[off]);
+		clen = ( h[4] << 8 ) | h[5];
+		rlen = FCGI_HEADER_LEN + clen + h[6];
+		if ( fc->inlen - off < rlen )
+			break;
+		if ( h[0] != FCGI_VERSION_1 ) {
+			errno = EPROTO;
+			conn_close( fc, "record" );
+			return;
+		}
+		handle_record( fc, h[1], ( h[2] << 8 ) | h[3], (char*) h + FCGI_HEADER_LEN, clen );
+	}
+	(void) memmove( fc->in, &(fc->in[off]), fc->inlen - off );
+	fc->inlen -= off;
+	conn_rwatch( fc );
+}
+
+/* Put on fc a record (or several if len is too long, or an empty one if len is 0). */
+static void put_record( FcgiConn * fc, int type, int id, const char * data, size_t len ) {
+	unsigned char * h;
+	size_t n;
+
+	do {
+		n = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+		httpd_realloc_str( &fc->out, &fc->maxout, fc->outlen + FCGI_HEADER_LEN + n );
+		h = (unsigned char *) &(fc->out[fc->outlen]);
+		h[0] = FCGI_VERSION_1;
+		h[1] = type;
+		h[2] = ( id >> 8 ) & 0xff;
+		h[3] = id & 0xff;
+		h[4] = ( n >> 8 ) & 0xff;
+		h[5] = n & 0xff;
+		h[6] = h[7] = 0;
+		if ( n > 0 )
+			memcpy( h + FCGI_HEADER_LEN, data, n );
+		fc->outlen += FCGI_HEADER_LEN + n;
+		data += n;
+		len -= n;
+	} while ( len > 0 );
+}
+
+/* Append to *buf the name-value pair name (of nlen bytes) and value. */
+static void put_param( char ** buf, size_t * max, size_t * len, const char * name, size_t nlen, const char * value ) {
+	size_t vlen = strlen( value ), l;
+	unsigned char * p;
+	int i;
+
+	httpd_realloc_str( buf, max, *len + 8 + nlen + vlen );
+	p = (unsigned char *) &((*buf)[*len]);
+	for ( i = 0; i < 2; i++ ) {
+		l = ( i == 0 ? nlen : vlen );
+		if ( l < 128 )
+			*p++ = l;
+		else {
+			*p++ = ( ( l >> 24 ) & 0x7f ) | 0x80;
+			*p++ = ( l >> 16 ) & 0xff;
+			*p++ = ( l >> 8 ) & 0xff;
+			*p++ = l & 0xff;
+		}
+	}
+	memcpy( p, name, nlen );
+	memcpy( p + nlen, value, vlen );
+	*len = (char*) p + nlen + vlen - *buf;
+}
+
+int fcgi_start( httpd_conn * hc, char ** envp ) {
+	static char * params = (char*) 0;
+	static size_t maxparams = 0;
+	size_t plen = 0, c;
+	FcgiConn * fc;
+	FcgiJob * job;
+	char * cp;
+	char begin[8] = { 0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+	int p[2], j, i;
+
+	if ( ! initialized )
+		init();
+	fc = conn_get( hc->hs->fastcgi_saddr );
+	if ( ! fc )
+		return -1;
+	for ( j = 0; j < FCGI_MAX_REQS && jobs[fc - conns][j].used; j++ )
+		;
+	job = &jobs[fc - conns][j];
+	if ( pipe( p ) < 0 ) {
+		syslog( LOG_ERR, "fastcgi pipe - %m" );
+		return -1;
+	}
+	(void) fcntl( p[0], F_SETFD, FD_CLOEXEC );
+	(void) fcntl( p[1], F_SETFD, FD_CLOEXEC );
+	(void) httpd_set_ndelay( p[0] );
+	(void) httpd_set_ndelay( p[1] );
+
+	job->used = 1;
+	job->hc = hc;
+	job->pfd = p[1];
+	job->pwatched = job->ended = 0;
+	job->pendlen = 0;
+	job->bodyleft = 0;
+	fc->nreqs++;
+	num_jobs++;
+	started_count++;
+
+	put_record( fc, FCGI_BEGIN_REQUEST, JOB_ID(job), begin, sizeof(begin) );
+	for ( i = 0; envp[i] != (char*) 0; i++ )
+		if ( ( cp = strchr( envp[i], '=' ) ) != (char*) 0 )
+			put_param( &params, &maxparams, &plen, envp[i], cp - envp[i], cp + 1 );
+	put_param( &params, &maxparams, &plen, "REQUEST_URI", 11, hc->encodedurl );
+	if ( hc->realfilename ) {
+		/* (most applications want it absolute) */
+		httpd_realloc_str( &hc->tmpbuff, &hc->maxtmpbuff, strlen( hc->hs->cwd ) + strlen( hc->realfilename ) );
+		(void) strcpy( hc->tmpbuff, hc->hs->cwd );
+		(void) strcat( hc->tmpbuff, hc->realfilename );
+		put_param( &params, &maxparams, &plen, "SCRIPT_FILENAME", 15, hc->tmpbuff );
+	}
+	put_record( fc, FCGI_PARAMS, JOB_ID(job), params, plen );
+	put_record( fc, FCGI_PARAMS, JOB_ID(job), "", 0 );
+
+	/* The body: what was already read, then what fcgi_body() will read */
+	if ( hc->method == METHOD_POST && hc->contentlength > 0 ) {
+		c = hc->read_idx - hc->checked_idx;
+		if ( c > (size_t) hc->contentlength )
+			c = hc->contentlength;
+		if ( c > 0 )
+			put_record( fc, FCGI_STDIN, JOB_ID(job), &(hc->read_buf[hc->checked_idx]), c );
+		job->bodyleft = hc->contentlength - c;
+	}
+	if ( job->bodyleft > 0 )
+		hc->bfield |= HC_FCGI_BODY;
+	else
+		put_record( fc, FCGI_STDIN, JOB_ID(job), "", 0 );
+
+	hc->cgi_fd = p[0];
+	hc->bfield |= HC_CGI_RELAY;
+	hc->fcgijob = (void*) job;
+	conn_flush( fc );
+	return 0;
+}
+
+int fcgi_body( httpd_conn * hc ) {
+	FcgiJob * job = (FcgiJob *) hc->fcgijob;
+	FcgiConn * fc;
+	char buf[16384];
+	ssize_t r;
+
+	while ( job && job->bodyleft > 0 ) {
+		r = read( hc->conn_fd, buf, job->bodyleft < sizeof(buf) ? job->bodyleft : sizeof(buf) );
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+			return 1;
+		if ( r <= 0 )
+			return -1;
+		job->bodyleft -= r;
+		fc = JOB_CONN(job);
+		put_record( fc, FCGI_STDIN, JOB_ID(job), buf, r );
+		if ( job->bodyleft == 0 )
+			put_record( fc, FCGI_STDIN, JOB_ID(job), "", 0 );
+		conn_flush( fc );
+		/* (it may have been closed, then the relay tells) */
+		job = (FcgiJob *) hc->fcgijob;
+	}
+	hc->bfield &= ~HC_FCGI_BODY;
+	return 0;
+}
+
+void fcgi_abort( httpd_conn * hc ) {
+	FcgiJob * job = (FcgiJob *) hc->fcgijob;
+	FcgiConn * fc;
+
+	if ( ! job )
+		return;
+	hc->fcgijob = (void*) 0;
+	job->hc = (httpd_conn *) 0;
+	if ( job->ended ) {
+		/* (only its output was left) */
+		job_free( job );
+		return;
+	}
+	job_close_pipe( job );
+	/* The slot is freed when the application ends it */
+	fc = JOB_CONN(job);
+	put_record( fc, FCGI_ABORT_REQUEST, JOB_ID(job), "", 0 );
+	conn_flush( fc );
+	aborted_count++;
+}
+
+static void handle_record( FcgiConn * fc, int type, int id, const char * data, size_t len ) {
+	FcgiJob * job = (FcgiJob *) 0;
+
+	if ( id >= 1 && id <= FCGI_MAX_REQS && jobs[fc - conns][id - 1].used )
+		job = &jobs[fc - conns][id - 1];
+	switch ( type ) {
+		case FCGI_STDOUT:
+			if ( job && len > 0 )
+				job_output( job, data, len );
+			break;
+		case FCGI_STDERR:
+			while ( len > 0 && ( data[len - 1] == '\n' || data[len - 1] == '\r' ) )
+				len--;
+			if ( len > 0 )
+				syslog( LOG_NOTICE, "fastcgi stderr: %.*s", (int) ( len > 500 ? 500 : len ), data );
+			break;
+		case FCGI_END_REQUEST:
+			if ( ! job || job->ended )
+				break;
+			if ( len >= 5 && data[4] == FCGI_CANT_MPX_CONN && ! nompx ) {
+				syslog( LOG_NOTICE, "fastcgi application can't multiplex requests" );
+				nompx = 1;
+			}
+			job->ended = 1;
+			ended_count++;
+			/* (freed once its output has gone into the pipe) */
+			job_flush( job );
+			break;
+		default:
+			/* (FCGI_GET_VALUES_RESULT, FCGI_UNKNOWN_TYPE: we send none of them) */
+			break;
+	}
+}
+
+static void job_output( FcgiJob * job, const char * data, size_t len ) {
+	if ( job->pfd < 0 )
+		return;
+	httpd_realloc_str( &job->pend, &job->maxpend, job->pendlen + len );
+	memcpy( &(job->pend[job->pendlen]), data, len );
+	job->pendlen += len;
+	job_flush( job );
+}
+
+/* Write into the pipe what it can take, and free job once it has ended. */
+static void job_flush( FcgiJob * job ) {
+	ssize_t r;
+
+	while ( job->pendlen > 0 && job->pfd >= 0 ) {
+		r = write( job->pfd, job->pend, job->pendlen );
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+			if ( ! job->pwatched )
+				fdwatch_add_fd( job->pfd, (void*) 0, FDW_WRITE );
+			job->pwatched = 1;
+			if ( JOB_CONN(job)->rpaused )
+				conn_rwatch( JOB_CONN(job) );
+			return;
+		}
+		if ( r <= 0 ) {
+			/* (the relay is gone) */
+			job_close_pipe( job );
+			break;
+		}
+		(void) memmove( job->pend, &(job->pend[r]), job->pendlen - r );
+		job->pendlen -= r;
+	}
+	job->pendlen = 0;
+	if ( job->pwatched )
+		fdwatch_del_fd( job->pfd );
+	job->pwatched = 0;
+	if ( job->ended )
+		job_free( job );
+	if ( JOB_CONN(job)->rpaused )
+		conn_rwatch( JOB_CONN(job) );
+}
+
+static void job_close_pipe( FcgiJob * job ) {
+	if ( job->pfd < 0 )
+		return;
+	if ( job->pwatched )
+		fdwatch_del_fd( job->pfd );
+	close( job->pfd );
+	job->pfd = -1;
+	job->pwatched = 0;
+	job->pendlen = 0;
+	if ( JOB_CONN(job)->rpaused )
+		conn_rwatch( JOB_CONN(job) );
+}
+
+static void job_free( FcgiJob * job ) {
+	job_close_pipe( job );
+	if ( job->hc )
+		job->hc->fcgijob = (void*) 0;
+	job->hc = (httpd_conn *) 0;
+	job->used = 0;
+	JOB_CONN(job)->nreqs--;
+	num_jobs--;
+}
+
+void fcgi_dispatch( void ) {
+	FcgiConn * fc;
+	FcgiJob * job;
+	int i, j;
+
+	if ( num_conns == 0 )
+		return;
+
+	for ( i = 0; i < FCGI_MAX_CONNS; i++ ) {
+		fc = &conns[i];
+		if ( fc->fd >= 0 && fc->wwatched && fdwatch_check_fd( fc->wfd ) )
+			conn_write( fc );
+		if ( fc->fd >= 0 && ! fc->rpaused && fdwatch_check_fd( fc->fd ) )
+			conn_read( fc );
+		for ( j = 0; j < FCGI_MAX_REQS; j++ ) {
+			job = &jobs[i][j];
+			if ( job->used && job->pwatched && fdwatch_check_fd( job->pfd ) )
+				job_flush( job );
+		}
+	}
+}
+
+void fcgi_close_fds( void ) {
+	int i, j;
+
+	if ( ! initialized )
+		return;
+	for ( i = 0; i < FCGI_MAX_CONNS; i++ ) {
+		if ( conns[i].fd >= 0 ) {
+			(void) close( conns[i].fd );
+			(void) close( conns[i].wfd );
+		}
+		for ( j = 0; j < FCGI_MAX_REQS; j++ )
+			if ( jobs[i][j].pfd >= 0 )
+				(void) close( jobs[i][j].pfd );
+	}
+}
+
+void fcgi_logstats( long secs ) {
+	if ( ! initialized )
+		return;
+	syslog(
+		LOG_INFO, "  fcgi - %d connections, %d requests running; %ld started, %ld ended, %ld aborted, %ld connections opened, %ld paused",
+		num_conns, num_jobs, started_count, ended_count, aborted_count, opened_count, paused_count );
+	started_count = ended_count = aborted_count = opened_count = paused_count = 0;
+}
@@ -0,0 +1,56 @@
+/* fcgi.h - header file for the FastCGI client run from the event loop
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _FCGI_H_
+#define _FCGI_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "libhttpd.h"
+
+/*! fcgi_parse_addr parse the address given to the -F option: "unix:/path"
+ * for a local socket, or "host:port" ("[addr]:port" for IPv6).
+ * \return a malloc()ed address, or NULL on error (logged).
+ */
+struct sockaddr * fcgi_parse_addr( const char * pass );
+
+/*! fcgi_start send the request of hc, with the parameters envp (as made for
+ * a CGI), to the FastCGI application at the address of the server, through
+ * one of the persistent connections of the pool. The response will come
+ * through hc->cgi_fd (HC_CGI_RELAY), and if the body wasn't read yet,
+ * HC_FCGI_BODY is set (cf. fcgi_body()).
+ * \return 0, or -1 if no connection can take it.
+ */
+int fcgi_start( httpd_conn * hc, char ** envp );
+
+/*! fcgi_body pass to the application what can be read of the body of the
+ * request of hc, without blocking.
+ * \return 1 if the rest has to be waited for, 0 once it's all been passed
+ * (HC_FCGI_BODY is then cleared), or -1 if the client closed or failed.
+ */
+int fcgi_body( httpd_conn * hc );
+
+/*! fcgi_abort detach hc from its request (if any), which the application is
+ * told to abort. To call before closing the connection.
+ */
+void fcgi_abort( httpd_conn * hc );
+
+/*! fcgi_dispatch carry on the FastCGI connections and requests whose file
+ * descriptors are ready (to call after fdwatch()).
+ */
+void fcgi_dispatch( void );
+
+/*! fcgi_close_fds close the connections and pipes of the client: to call in
+ * a forked child process, so that it doesn't keep them open.
+ */
+void fcgi_close_fds( void );
+
+/* Generate debugging statistics syslog message. */
+void fcgi_logstats( long secs );
+
+#endif /* _FCGI_H_ */
@@ -0,0 +1,299 @@
+/* gpgio.c - running gpgme operations from the event loop
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* gpgme may use an external event loop (cf. gpgme_set_io_cbs()): it then
+* registers the file descriptors of its engine (status, data...) and the
+* functions to call when they are ready. Here they are added to fdwatch (with
+* a null client data, so that the main loop doesn't take them for a
+* connection), and gpgio_dispatch() call their functions once fdwatch() has
+* marked them. That way, the server process can run some gpgme operations
+* itself instead of forking for each of them.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <gpgme.h>
+
+#include "config.h"
+#include "fdwatch.h"
+#include "gpgio.h"
+
+#ifdef GPGIO_MAX_OPS
+
+/* gpgme usually registers 3 or 4 fds per operation */
+#define GPGIO_MAX_FDS (GPGIO_MAX_OPS * 8)
+
+typedef struct {
+	gpgme_ctx_t ctx; /* NULL if the slot is free */
+	struct gpgme_io_cbs cbs;
+	gpgio_done_cb_t done;
+	gpgio_key_cb_t key;
+	void * arg;
+	int running;
+	int ended;
+	int cancel; /* to cancel at the next gpgio_dispatch() */
+	gpgme_error_t err;
+} GpgOp;
+
+typedef struct {
+	int fd; /* -1 if the slot is free */
+	gpgme_io_cb_t fnc;
+	void * fnc_data;
+	GpgOp * op;
+} GpgFd;
+
+static GpgOp ops[GPGIO_MAX_OPS];
+static GpgFd fds[GPGIO_MAX_FDS];
+static int num_ops = 0, num_fds = 0, initialized = 0;
+static long started_count = 0, ended_count = 0, canceled_count = 0;
+
+/* Forwards. */
+static void init( void );
+static gpgme_error_t add_io_cb( void * data, int fd, int dir, gpgme_io_cb_t fnc, void * fnc_data, void ** tag );
+static void remove_io_cb( void * tag );
+static void event_io_cb( void * data, gpgme_event_io_t type, void * type_data );
+
+static void init( void ) {
+	int i;
+
+	for ( i = 0; i < GPGIO_MAX_FDS; i++ )
+		fds[i].fd = -1;
+	initialized = 1;
+}
+
+int gpgio_attach( gpgme_ctx_t ctx, gpgio_done_cb_t done, gpgio_key_cb_t key, void * arg ) {
+	GpgOp * op;
+	int i;
+
+	if ( ! initialized )
+		init();
+	for ( i = 0; i < GPGIO_MAX_OPS && ops[i].ctx; i++ )
+		;
+	if ( i >= GPGIO_MAX_OPS )
+		return -1;
+	op = &ops[i];
+	op->ctx = ctx;
+	op->done = done;
+	op->key = key;
+	op->arg = arg;
+	op->running = op->ended = op->cancel = 0;
+	op->err = GPG_ERR_NO_ERROR;
+	op->cbs.add = add_io_cb;
+	op->cbs.add_priv = op;
+	op->cbs.remove = remove_io_cb;
+	op->cbs.event = event_io_cb;
+	op->cbs.event_priv = op;
+	gpgme_set_io_cbs(ctx, &op->cbs);
+	num_ops++;
+	return 0;
+}
+
+void gpgio_detach( gpgme_ctx_t ctx ) {
+	GpgOp * op;
+	int i;
+
+	for ( i = 0; i < GPGIO_MAX_OPS && ops[i].ctx != ctx; i++ )
+		;
+	if ( i >= GPGIO_MAX_OPS )
+		return;
+	op = &ops[i];
+	if ( op->running ) {
+		/* (gpgme removes the fds of the operation, and tells it has ended) */
+		(void) gpgme_cancel(ctx);
+		canceled_count++;
+	}
+	/* In case some fds were left */
+	for ( i = 0; i < GPGIO_MAX_FDS; i++ )
+		if ( fds[i].fd >= 0 && fds[i].op == op ) {
+			fdwatch_del_fd( fds[i].fd );
+			fds[i].fd = -1;
+			num_fds--;
+		}
+	gpgme_set_io_cbs(ctx, (gpgme_io_cbs_t) 0);
+	op->ctx = (gpgme_ctx_t) 0;
+	num_ops--;
+}
+
+void gpgio_cancel( gpgme_ctx_t ctx ) {
+	int i;
+
+	for ( i = 0; i < GPGIO_MAX_OPS && ops[i].ctx != ctx; i++ )
+		;
+	if ( i < GPGIO_MAX_OPS && ops[i].running )
+		ops[i].cancel = 1;
+}
+
+int gpgio_dispatch( void ) {
+	GpgOp * op;
+	int i, n = 0;
+
+	if ( num_ops == 0 )
+		return 0;
+
+	/* (the functions may add or remove fds, but never move them) */
+	for ( i = 0; i < GPGIO_MAX_FDS; i++ )
+		if ( fds[i].fd >= 0 && fdwatch_check_fd( fds[i].fd ) )
+			(void) fds[i].fnc(fds[i].fnc_data, fds[i].fd);
+
+	/* (out of the gpgme callbacks, which may have asked it) */
+	for ( i = 0; i < GPGIO_MAX_OPS; i++ ) {
+		op = &ops[i];
+		if ( op->ctx && op->cancel ) {
+			op->cancel = 0;
+			if ( ! op->running )
+				continue;
+			(void) gpgme_cancel(op->ctx);
+			canceled_count++;
+			if ( op->running ) {
+				op->running = 0;
+				op->ended = 1;
+				ended_count++;
+			}
+			op->err = gpgme_error(GPG_ERR_CANCELED);
+		}
+	}
+
+	for ( i = 0; i < GPGIO_MAX_OPS; i++ ) {
+		op = &ops[i];
+		if ( op->ctx && op->ended ) {
+			op->ended = 0;
+			n++;
+			/* (the done callback may start an other operation, or detach) */
+			op->done(op->arg, op->err);
+		}
+	}
+	return n;
+}
+
+/* gpgme register fd: dir is 1 if gpgme reads from it. */
+static gpgme_error_t add_io_cb( void * data, int fd, int dir, gpgme_io_cb_t fnc, void * fnc_data, void ** tag ) {
+	int i;
+
+	for ( i = 0; i < GPGIO_MAX_FDS && fds[i].fd >= 0; i++ )
+		;
+	if ( i >= GPGIO_MAX_FDS ) {
+		syslog( LOG_ERR, "gpgio: too many gpgme fds" );
+		return gpgme_error(GPG_ERR_GENERAL);
+	}
+	fds[i].fd = fd;
+	fds[i].fnc = fnc;
+	fds[i].fnc_data = fnc_data;
+	fds[i].op = (GpgOp *) data;
+	fdwatch_add_fd( fd, (void*) 0, dir ? FDW_READ : FDW_WRITE );
+	num_fds++;
+	*tag = &fds[i];
+	return GPG_ERR_NO_ERROR;
+}
+
+static void remove_io_cb( void * tag ) {
+	GpgFd * f = (GpgFd *) tag;
+
+	if ( f->fd < 0 )
+		return;
+	fdwatch_del_fd( f->fd );
+	f->fd = -1;
+	num_fds--;
+}
+
+static void event_io_cb( void * data, gpgme_event_io_t type, void * type_data ) {
+	GpgOp * op = (GpgOp *) data;
+
+	switch ( type ) {
+		case GPGME_EVENT_START:
+			op->running = 1;
+			op->ended = 0;
+			started_count++;
+			break;
+		case GPGME_EVENT_DONE:
+			/* (type_data is a gpgme_io_event_done_data_t, or a gpgme_error_t*
+			 * with old gpgme: both begin by the error) */
+			op->err = type_data ? *((gpgme_error_t *) type_data) : GPG_ERR_NO_ERROR;
+			if ( op->running ) {
+				op->running = 0;
+				op->ended = 1;
+				ended_count++;
+			}
+			break;
+		case GPGME_EVENT_NEXT_KEY:
+			/* (with our own event loop, the key isn't queued for
+			 * gpgme_op_keylist_next(): we get its reference) */
+			if ( ! type_data )
+				break;
+			if ( op->key )
+				op->key(op->arg, (gpgme_key_t) type_data);
+			else
+				gpgme_key_unref((gpgme_key_t) type_data);
+			break;
+		default:
+			break;
+	}
+}
+
+void gpgio_close_fds( void ) {
+	int i;
+
+	if ( ! initialized )
+		return;
+	for ( i = 0; i < GPGIO_MAX_FDS; i++ )
+		if ( fds[i].fd >= 0 )
+			(void) close( fds[i].fd );
+}
+
+void gpgio_logstats( long secs ) {
+	syslog(
+		LOG_INFO, "  gpgio - %d contexts attached, %d fds watched; %ld operations started, %ld ended, %ld canceled",
+		num_ops, num_fds, started_count, ended_count, canceled_count );
+	started_count = ended_count = canceled_count = 0;
+}
+
+#endif /* GPGIO_MAX_OPS */
+
+/* nanoseconds since the Epoch */
+#ifdef HAVE_ST_MTIM
+#define NSEC(ts) ( (int64_t) (ts).tv_sec * 1000000000 + (ts).tv_nsec )
+#define MTIME_NS(sb) NSEC((sb).st_mtim)
+#define CTIME_NS(sb) NSEC((sb).st_ctim)
+#else
+#define MTIME_NS(sb) ( (int64_t) (sb).st_mtime * 1000000000 )
+#define CTIME_NS(sb) ( (int64_t) (sb).st_ctime * 1000000000 )
+#endif
+
+int gpgio_ring_stat( int64_t * st ) {
+	static const char * rings[2] = { "pubring.gpg", "pubring.kbx" };
+	static char paths[2][1024];
+	gpgme_engine_info_t enginfo;
+	struct stat sb;
+	int i;
+
+	memset(st, 0, GPGIO_RING_STAT * sizeof(int64_t));
+	if ( ! paths[0][0] ) {
+		/* (the home directory of gpg doesn't change) */
+		if ( gpgme_get_engine_info(&enginfo) != GPG_ERR_NO_ERROR )
+			return -1;
+		for ( ; enginfo && enginfo->protocol != GPGME_PROTOCOL_OpenPGP; enginfo = enginfo->next )
+			;
+		if ( ! enginfo || ! enginfo->home_dir )
+			return -1;
+		for ( i = 0; i < 2; i++ )
+			(void) snprintf(paths[i], sizeof(paths[i]), "%s/%s", enginfo->home_dir, rings[i]);
+	}
+	for ( i = 0; i < 2; i++ )
+		if ( stat(paths[i], &sb) == 0 ) {
+			st[4 * i] = sb.st_ino;
+			st[4 * i + 1] = sb.st_size;
+			st[4 * i + 2] = MTIME_NS(sb);
+			st[4 * i + 3] = CTIME_NS(sb);
+		}
+	return 0;
+}
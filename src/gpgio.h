@@ -0,0 +1,66 @@
+/* gpgio.h - header file for running gpgme operations from the event loop
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _GPGIO_H_
+#define _GPGIO_H_
+
+#include <stdint.h>
+#include <gpgme.h>
+
+#include "config.h"
+
+/* called once the operation of a context has ended */
+typedef void (*gpgio_done_cb_t)( void * arg, gpgme_error_t err );
+/* called for each key listed by a keylist operation (which has to unref it) */
+typedef void (*gpgio_key_cb_t)( void * arg, gpgme_key_t key );
+
+/*! gpgio_attach set the I/O callbacks of ctx, so that the operations started
+ * on it (by the gpgme_op_*_start() functions) are driven by gpgio_dispatch()
+ * from the main loop, without blocking. done (and key, if not NULL) will be
+ * called with arg.
+ * \return 0, or -1 if GPGIO_MAX_OPS contexts are already attached.
+ */
+int gpgio_attach( gpgme_ctx_t ctx, gpgio_done_cb_t done, gpgio_key_cb_t key, void * arg );
+
+/*! gpgio_detach cancel the running operation of ctx (if any, its done callback
+ * won't be called), and detach it. To call before gpgme_release(ctx).
+ */
+void gpgio_detach( gpgme_ctx_t ctx );
+
+/*! gpgio_cancel cancel the running operation of ctx at the next call of
+ * gpgio_dispatch() (so it can be asked from its key callback), whose done
+ * callback is then called with GPG_ERR_CANCELED.
+ */
+void gpgio_cancel( gpgme_ctx_t ctx );
+
+/*! gpgio_dispatch run the gpgme callbacks of the ready file descriptors (to
+ * call after fdwatch()), and then the done callbacks of the operations which
+ * have ended.
+ * \return the number of operations which have ended.
+ */
+int gpgio_dispatch( void );
+
+/*! gpgio_close_fds close the file descriptors of the running operations: to
+ * call in a forked child process, so that it doesn't keep their pipes open.
+ */
+void gpgio_close_fds( void );
+
+/* Generate debugging statistics syslog message. */
+void gpgio_logstats( long secs );
+
+/* number of int64_t filled by gpgio_ring_stat() */
+#define GPGIO_RING_STAT 8
+
+/*! gpgio_ring_stat put in st (GPGIO_RING_STAT int64_t) the inode, size and
+ * modification and change times of the keyrings of gpg (pubring.gpg and
+ * pubring.kbx in its home directory), so that their changes by any process
+ * (eg. an admin's gpg --import) can be told by comparing them. It doesn't
+ * need GPGIO_MAX_OPS.
+ * \return 0, or -1 if the home directory of gpg isn't known.
+ */
+int gpgio_ring_stat( int64_t * st );
+
+#endif /* _GPGIO_H_ */
@@ -9,10 +9,14 @@
 */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <syslog.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>   /* errno             */
+#include <poll.h>
+#include <time.h>
 #include <gpgme.h>
 #include <regex.h>
 #include <pthread.h>
@@ -20,6 +24,16 @@
 #include "config.h"
 #include "hkp.h"
 #include "libhttpd.h"
+#ifdef GPGIO_MAX_OPS
+#include "gpgio.h"
+#include "natsig.h"
+#endif /* GPGIO_MAX_OPS */
+#include "hpool.h"
+#include "keyidx.h"
+#include "keyimp.h"
+#ifdef HKP_GZIP_LEVEL
+#include <zlib.h>
+#endif
 
 #define QSTRING_MAX 1024
 
@@ -37,6 +51,9 @@ struct gpgdata4export_handle {
 };
 
 static int export_start=0; /* set to 1 once by gpgdata4export_cb(...) */
+#ifdef HKP_GZIP_LEVEL
+static gzFile resp_gz=(gzFile) 0; /* compressed body of the response of hkp_lookup(), if any */
+#endif
 
 #ifdef CHECK_UDID2
 extern regex_t udid2c_regex;
@@ -60,10 +77,385 @@ static char * get_matching_comment(const regex_t *preg,const gpgme_key_t gkey) {
 }
 #endif /* CHECK_UDID2 */
 
+/* The body of a pks/add request, read and form-decoded as gpg consumes it */
+struct addbody_handle {
+	httpd_conn* hc;
+	size_t left;       /* bytes of the body not read yet */
+	time_t deadline;
+	int form;          /* "keytext=" (form-encoded) */
+	char pct[2];       /* the "%X" being decoded */
+	int npct;
+	char dec[4096+2];  /* decoded, not consumed yet */
+	size_t dstart, dend;
+	FILE * tee;        /* what was consumed, to read it again (cf. addbody_seek_cb()) */
+	off_t pos, consumed;
+	int status;        /* HTTP status of the error met reading it, if any */
+};
+static struct addbody_handle addbody;
+
+/* read at most len bytes of the body, waiting for them until the deadline */
+static ssize_t addbody_raw( struct addbody_handle * b, char * buf, size_t len ) {
+	httpd_conn* hc = b->hc;
+	struct pollfd pfd;
+	ssize_t r;
+	long timeout;
+
+	len = MIN(len, b->left);
+	if ( len == 0 )
+		return 0;
+	/* (what was read with the headers) */
+	if ( hc->checked_idx < hc->read_idx ) {
+		r = MIN(len, hc->read_idx - hc->checked_idx);
+		memcpy(buf, &(hc->read_buf[hc->checked_idx]), r);
+		hc->checked_idx += r;
+		b->left -= r;
+		return r;
+	}
+	for (;;) {
+		r = read(hc->conn_fd, buf, len);
+		if ( r > 0 ) {
+			b->left -= r;
+			return r;
+		}
+		if ( r == 0 ) {
+			/* (shorter than its Content-Length) */
+			b->status = 400;
+			errno = EPIPE;
+			return -1;
+		}
+		if ( errno == EINTR )
+			continue;
+		if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+			b->status = 500;
+			return -1;
+		}
+		if ( (timeout=( b->deadline - time((time_t *) 0) ) * 1000L) <= 0 ) {
+			b->status = 408;
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		pfd.fd = hc->conn_fd;
+		pfd.events = POLLIN;
+		(void) poll(&pfd, 1, timeout);
+	}
+}
+
+static int addbody_hexit( char c ) {
+	if ( c >= '0' && c <= '9' )
+		return c - '0';
+	if ( c >= 'a' && c <= 'f' )
+		return c - 'a' + 10;
+	if ( c >= 'A' && c <= 'F' )
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* decode (as strdecodequery() does) the n raw bytes of the body in b->dec */
+static void addbody_decode( struct addbody_handle * b, const char * raw, size_t n ) {
+	int a, c;
+	size_t i;
+
+	b->dstart = b->dend = 0;
+	for ( i = 0; i < n; i++ ) {
+		if ( b->npct == 0 ) {
+			if ( raw[i] == '%' )
+				b->pct[b->npct++] = '%';
+			else
+				b->dec[b->dend++] = ( raw[i] == '+' ? ' ' : raw[i] );
+			continue;
+		}
+		if ( addbody_hexit(raw[i]) < 0 ) {
+			/* (not a "%XX": left as is) */
+			memcpy(b->dec + b->dend, b->pct, b->npct);
+			b->dend += b->npct;
+			b->npct = 0;
+			i--;
+			continue;
+		}
+		if ( b->npct == 1 ) {
+			b->pct[b->npct++] = raw[i];
+			continue;
+		}
+		a = addbody_hexit(b->pct[1]);
+		c = addbody_hexit(raw[i]);
+		b->dec[b->dend++] = a * 16 + c;
+		b->npct = 0;
+	}
+}
+
+static ssize_t addbody_read_cb( void * handle, void * buffer, size_t size ) {
+	struct addbody_handle * b = handle;
+	char raw[4096];
+	ssize_t r;
+
+	/* (again, after a seek back) */
+	if ( b->pos < b->consumed ) {
+		if ( fseeko(b->tee, b->pos, SEEK_SET) < 0
+				|| (r=fread(buffer, 1, MIN((off_t) size, b->consumed - b->pos), b->tee)) <= 0 )
+			return -1;
+		b->pos += r;
+		return r;
+	}
+	while ( b->dstart == b->dend ) {
+		if ( (r=addbody_raw(b, raw, sizeof(raw))) < 0 )
+			return -1;
+		if ( r == 0 ) {
+			/* (a '%' at the end) */
+			memcpy(b->dec, b->pct, b->npct);
+			b->dstart = 0;
+			b->dend = b->npct;
+			b->npct = 0;
+			if ( b->dend == 0 )
+				return 0;
+		} else if ( b->form )
+			addbody_decode(b, raw, r);
+		else {
+			memcpy(b->dec, raw, r);
+			b->dstart = 0;
+			b->dend = r;
+		}
+	}
+	r = MIN(size, b->dend - b->dstart);
+	memcpy(buffer, b->dec + b->dstart, r);
+	b->dstart += r;
+	if ( b->tee && fwrite(buffer, 1, r, b->tee) != (size_t) r ) {
+		b->status = 500;
+		return -1;
+	}
+	b->consumed += r;
+	b->pos += r;
+	return r;
+}
+
+/* seeking back is possible only to what was consumed (if it's kept) */
+static off_t addbody_seek_cb( void * handle, off_t offset, int whence ) {
+	struct addbody_handle * b = handle;
+
+	if ( whence == SEEK_CUR )
+		offset += b->pos;
+	else if ( whence != SEEK_SET )
+		offset = -1;
+	if ( offset < 0 || offset > b->consumed || ( offset < b->pos && ! b->tee ) ) {
+		errno = EINVAL;
+		return -1;
+	}
+	b->pos = offset;
+	return offset;
+}
+
+static void addbody_release_cb( void * handle ) {
+	struct addbody_handle * b = handle;
+
+	if ( b->tee )
+		fclose(b->tee);
+	b->tee = (FILE *) 0;
+}
+
+/*! addbody_open make the body of the pks/add request hc a gpgme data, read as
+ * it's consumed (so that the memory used doesn't depend on its size),
+ * form-decoded if it begins with "keytext=". If keep, what's consumed is
+ * kept in a temporary file, so that it can be read again.
+ * \return like gpgme_data_new_from_cbs().
+ */
+static gpgme_error_t addbody_open( httpd_conn* hc, gpgme_data_t * gpgdataP, int keep ) {
+	static struct gpgme_data_cbs gpgcbs = {
+		addbody_read_cb,	/* read method */
+		NULL,			/* write method */
+		addbody_seek_cb,	/* seek method */
+		addbody_release_cb	/* release method */
+	};
+	char head[8];
+	ssize_t r;
+	size_t n;
+
+	memset(&addbody, 0, sizeof(addbody));
+	addbody.hc = hc;
+	addbody.left = hc->contentlength;
+	addbody.deadline = time((time_t *) 0) + PKS_ADD_TIMELIMIT;
+	if ( keep && ! (addbody.tee=tmpfile()) )
+		return gpgme_error_from_errno(errno);
+	/* (whether it's a form, from its first bytes) */
+	for ( n = 0; n < sizeof(head) && (r=addbody_raw(&addbody, head + n, sizeof(head) - n)) > 0; n += r )
+		;
+	if ( n == sizeof(head) && ! strncmp(head, "keytext=", 8) )
+		addbody.form = 1;
+	else {
+		memcpy(addbody.dec, head, n);
+		addbody.dend = n;
+	}
+	return gpgme_data_new_from_cbs(gpgdataP, &gpgcbs, &addbody);
+}
+
+/* send the error met reading the body of the request, if any */
+static void addbody_check( httpd_conn* hc ) {
+	switch ( addbody.status ) {
+	case 0:
+		return;
+	case 408:
+		httpd_send_err(hc, 408, httpd_err408title, "", httpd_err408form, "" );
+		break;
+	case 400:
+		httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "" );
+		break;
+	default:
+		httpd_send_err(hc, 500, err500title, "", err500form, "read error" );
+	}
+	hpool_exit(EXIT_FAILURE);
+}
+
+#ifdef KEYIMP_SPOOL
+#ifdef CHECK_UDID2
+#define ADD_REJECTED_FORM "It may happen if a key is new, or doesn't contain a valid udid2 (\"udid2;c;...\")"
+#else
+#define ADD_REJECTED_FORM "It may happen if the server don't use the newkeys option (-nk) "
+#endif
+
+const char * hkp_add_policy( gpgme_key_t gpgkey, void * arg ) {
+	if ( *(int *) arg ) /* merge only */
+		return((char *) 0);
+#ifdef CHECK_UDID2
+	/* an uid with comment matching "udid2;c;..." or "ubot1;udid2;c..." */
+	return get_matching_comment(&udid2c_regex,gpgkey);
+#else
+	return gpgkey->uids ? gpgkey->uids->uid : "";
+#endif
+}
+
+/* log the results of a submission */
+static void add_log( FILE * fp ) {
+	char line[1024];
+
+	while (fgets(line,sizeof(line),fp)) {
+		line[strcspn(line,"\n")]='\0';
+		PKSADDLOG("pks/add:%s:",line);
+	}
+	rewind(fp);
+}
+
+/* send the results of a submission (one line per key, cf. keyimp_result()) */
+static void add_results( httpd_conn* hc, FILE * fp ) {
+	char line[1024], buff[1024], * pchar;
+	int r, total=0, accepted=0, updated=0, unchanged=0, rejected=0, errors=0;
+
+	while (fgets(line,sizeof(line),fp)) {
+		total++;
+		if (!strncmp(line,"accept:",7))
+			accepted++;
+		else if (!strncmp(line,"update:",7))
+			updated++;
+		else if (!strncmp(line,"unchanged:",10))
+			unchanged++;
+		else if (!strncmp(line,"reject:",7))
+			rejected++;
+		else
+			errors++;
+	}
+	rewind(fp);
+
+	if (rejected)
+		send_mime(hc, 202, ok200title, "", "X-HKP-Status: 418 some key(s) was rejected as per keyserver policy\015\012", "text/html; charset=%s",(off_t) -1, hc->sb.st_mtime );
+	else
+		send_mime(hc, 200, ok200title, "", "", "text/html; charset=%s",(off_t) -1, hc->sb.st_mtime );
+	httpd_write_response(hc);
+	r=snprintf(buff,sizeof(buff),"<html><head><title>pks/add %d keys</title></head><body><h2>Total: %d<br>imported: %d<br>updated: %d<br>unchanged: %d<br>rejected: %d<br>errors: %d</h2>%s%s%s<pre>\n",
+			total, total, accepted, updated, unchanged, rejected, errors, rejected ? "<h3>" : "", rejected ? ADD_REJECTED_FORM : "", rejected ? "</h3>" : "");
+	httpd_write_fully(hc->conn_fd,buff,MIN(r,sizeof(buff)));
+	/* (the user IDs have to be escaped) */
+	while (fgets(line,sizeof(line),fp)) {
+		for (pchar=line, r=0; *pchar && r < sizeof(buff) - 6; pchar++) {
+			if (*pchar == '<')
+				r+=sprintf(buff+r,"&lt;");
+			else if (*pchar == '>')
+				r+=sprintf(buff+r,"&gt;");
+			else if (*pchar == '&')
+				r+=sprintf(buff+r,"&amp;");
+			else
+				buff[r++]=*pchar;
+		}
+		httpd_write_fully(hc->conn_fd,buff,r);
+	}
+	httpd_write_fully(hc->conn_fd,"</pre></body></html>\n",sizeof("</pre></body></html>\n")-1);
+}
+
+/* tell where the results of the submission id will be */
+static void add_pending( httpd_conn* hc, const char * id ) {
+	char buff[512];
+	int r;
+
+	snprintf(buff,sizeof(buff),"X-HKP-Status: 202 queued, results at /pks/add?status=%s\015\012",id);
+	send_mime(hc, 202, ok200title, "", buff, "text/html; charset=%s",(off_t) -1, hc->sb.st_mtime );
+	httpd_write_response(hc);
+	r=snprintf(buff,sizeof(buff),"<html><head><title>pks/add queued</title></head><body><h2>Your keys are queued for import</h2><h3>The results will be at <a href=\"/pks/add?status=%s\">/pks/add?status=%s</a></h3></body></html>",id,id);
+	httpd_write_fully(hc->conn_fd,buff,MIN(r,sizeof(buff)));
+}
+
+/* manage "pks/add?status=ID" */
+static void add_status( httpd_conn* hc ) {
+	const char * id=hc->query+7;
+	FILE * fp;
+
+	if ( strncmp(hc->query,"status=",7) || strlen(id) != KEYIMP_ID_LEN || strspn(id,"0123456789abcdef-") != KEYIMP_ID_LEN ) {
+		httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "" );
+		hpool_exit(EXIT_FAILURE);
+	}
+	if ( (fp=keyimp_result(id)) ) {
+		add_results(hc,fp);
+		fclose(fp);
+	} else if ( errno == EAGAIN )
+		add_pending(hc,id);
+	else {
+		httpd_send_err(hc, 404, err404title, "", "Status: %.80s: unknown or outdated submission", id);
+		hpool_exit(EXIT_FAILURE);
+	}
+	close(hc->conn_fd);
+	hpool_exit(EXIT_SUCCESS);
+}
+
+/* import gpgdata through the pipeline of keyimp.c, and reply */
+static void add_queued( httpd_conn* hc, gpgme_data_t gpgdata, int mergeonly ) {
+	char id[KEYIMP_ID_LEN+1];
+	FILE * fp;
+	int r;
+
+	r=keyimp_submit(gpgdata,hkp_add_policy,&mergeonly,id);
+	gpgme_data_release(gpgdata);
+	if ( r <= 0 )
+		addbody_check(hc);
+	if ( r < 0 ) {
+		httpd_send_err(hc, 500, err500title, "", err500form, "q" );
+		hpool_exit(EXIT_FAILURE);
+	}
+	if ( r == 0 ) {
+		httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "" );
+		hpool_exit(EXIT_FAILURE);
+	}
+
+	r=keyimp_run(id,KEYIMP_WAIT);
+	if ( r == 0 ) {
+		/* Too long: the client will come back for the results */
+		add_pending(hc,id);
+		close(hc->conn_fd);
+		r=keyimp_run(id,-1);
+		if ( r > 0 && (fp=keyimp_result(id)) ) {
+			add_log(fp);
+			fclose(fp);
+		}
+		hpool_exit(r > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if ( r < 0 || ! (fp=keyimp_result(id)) ) {
+		httpd_send_err(hc, 500, err500title, "", err500form, "i" );
+		hpool_exit(EXIT_FAILURE);
+	}
+	add_log(fp);
+	add_results(hc,fp);
+	fclose(fp);
+	close(hc->conn_fd);
+	hpool_exit(EXIT_SUCCESS);
+}
+#endif /* KEYIMP_SPOOL */
+
 /*! manage "pks/add" url interface */
 void hkp_add( httpd_conn* hc ) {
-#define INPUT_MAX (1<<17) /* 1<<17 = 128ko */
-	size_t c;
 	ssize_t r;
 
 	gpgme_ctx_t gpglctx;
@@ -76,83 +468,63 @@ void hkp_add( httpd_conn* hc ) {
 	char * uid2=NULL;
 #endif
 
-	char * buff;
-	int i=0, buffsize, rcode=200, mergeonly=(hc->hs->bfield & HS_PKS_ADD_MERGE_ONLY);
+	char buff[1024];
+	int buffsize=sizeof(buff), rcode=200, mergeonly=(hc->hs->bfield & HS_PKS_ADD_MERGE_ONLY);
 
+#ifdef KEYIMP_SPOOL
+	if ( hc->method == METHOD_GET )
+		add_status(hc);
+#endif
 	if (hc->contentlength < 12) {
 		httpd_send_err(hc, 411, err411title, "", "Content-Length is absent or too short (%.80s)", "12");
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
-	if ( hc->contentlength >= INPUT_MAX ) {
+	if ( hc->contentlength > PKS_ADD_MAXBODY ) {
 		httpd_send_err(hc, 413, err413title, "", "your POST is too big", "");
-		exit(EXIT_FAILURE);
-	}
-
-	buffsize=hc->contentlength;
-	buff=malloc(buffsize+1);
-	if (buff)
-		buff[buffsize]='\0'; /*security for strdecode */
-	else {
-		httpd_send_err(hc, 500, err500title, "", err500form, "m" );
-		exit(EXIT_FAILURE);
-	}
-
-	c = hc->read_idx - hc->checked_idx;
-	if ( c > 0 )
-		memcpy(buff,&(hc->read_buf[hc->checked_idx]), c);
-	while ( c < hc->contentlength ) {
-		r = read( hc->conn_fd, buff+c, hc->contentlength - c );
-		if ( r < 0 && ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ) ) {
-			struct timespec tim={0, 300000000}; /* 300 ms */
-			nanosleep(&tim, NULL);
-			if (i++>50) { /* 50*300ms = 15 seconds */
-				httpd_send_err(hc, 408, httpd_err408title, "", httpd_err408form, "" );
-				exit(EXIT_FAILURE);
-			}
-			continue;
-		} else
-			i=0;
-		if ( r <= 0 ) {
-			httpd_send_err(hc, 500, err500title, "", err500form, "read error" );
-			exit(EXIT_FAILURE);
-		}
-		c += r;
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	/* create context */
 	gpgerr=gpgme_new(&gpglctx);
 	if ( gpgerr  != GPG_ERR_NO_ERROR ) {
 		httpd_send_err(hc, 500, err500title, "", err500form, gpgme_strerror(gpgerr) );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
-	if (!strncmp(buff,"keytext=",8)) {
-		int r;
-		r=strdecodequery(buff,buff+8);
-		//gpgme_set_armor(gpglctx,1);
-		gpgerr = gpgme_data_new_from_mem(&gpgdata,buff,r,0);
-	} else {
-		gpgerr = gpgme_data_new_from_mem(&gpgdata,buff,buffsize,0); /* yes: that feature is not in HKP draft */
-	}
+	/* (a raw body, if not "keytext=...": that feature is not in HKP draft) */
+#ifdef KEYIMP_SPOOL
+	/* (keyimp_submit() reads it twice, cf. KEYIMP_DEDUP) */
+	gpgerr = addbody_open(hc,&gpgdata,1);
+#else
+	gpgerr = addbody_open(hc,&gpgdata,0);
+#endif /* KEYIMP_SPOOL */
 
 	if ( gpgerr  != GPG_ERR_NO_ERROR ) {
 		httpd_send_err(hc, 500, err500title, "", err500form, gpgme_strerror(gpgerr) );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
-	if ( (gpgerr=gpgme_op_import (gpglctx, gpgdata)) != GPG_ERR_NO_ERROR ) {
+#ifdef KEYIMP_SPOOL
+	/* (doesn't return) */
+	gpgme_release(gpglctx);
+	add_queued(hc,gpgdata,mergeonly);
+#endif
+	gpgerr=gpgme_op_import (gpglctx, gpgdata);
+	gpgme_data_release(gpgdata);
+	addbody_check(hc);
+	if ( gpgerr != GPG_ERR_NO_ERROR ) {
 		httpd_send_err(hc, 400, httpd_err400title, "", err500form, gpgme_strerror(gpgerr) );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	if ((gpgimport=gpgme_op_import_result(gpglctx)) == NULL )  {
 		httpd_send_err(hc, 500, err500title, "", err500form, "r" );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	if ( gpgimport->considered == 0 ) {
 		httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "" );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	/* Check (and eventually delete) imported keys */
@@ -170,7 +542,7 @@ void hkp_add( httpd_conn* hc ) {
 			if ( (gpgerr=gpgme_get_key (gpglctx,gpgikey->fpr,&gpgkey,0)) != GPG_ERR_NO_ERROR ) {
 				/* should not happen */
 				httpd_send_err(hc, 500, err500title, "", err500form, "" );
-				exit(EXIT_FAILURE);
+				hpool_exit(EXIT_FAILURE);
 			}
 			if (mergeonly) {
 				PKSADDLOG("pks/add:reject:%d:%s:%s:",gpgikey->status,gpgikey->fpr,gpgkey->uids->uid);
@@ -194,6 +566,16 @@ void hkp_add( httpd_conn* hc ) {
 			gpgme_key_unref(gpgkey);
 		} else
 			PKSADDLOG("pks/add:update:%d:%s:",gpgikey->status,gpgikey->fpr);
+#ifdef KEYIDX_SLOTS
+		/* let the server update its index (and its filter, with the subkeys) */
+		if ( gpgikey->status ) {
+			if ( gpgme_get_key(gpglctx,gpgikey->fpr,&gpgkey,0) == GPG_ERR_NO_ERROR ) {
+				keyidx_changed(gpgikey->fpr,gpgkey);
+				gpgme_key_unref(gpgkey);
+			} else
+				keyidx_changed(gpgikey->fpr,(gpgme_key_t) 0);
+		}
+#endif
 
 		gpgikey=gpgikey->next;
 	}
@@ -215,27 +597,88 @@ void hkp_add( httpd_conn* hc ) {
 
 	close(hc->conn_fd);
 	gpgme_release(gpglctx);
-	exit(EXIT_SUCCESS);
+	hpool_exit(EXIT_SUCCESS);
 
 	/* TODO:
-	 *  Note in memory the fpr in gpgme_import_status_t of all keys imported to :
-	 *  - revoke the one with with an usable secret key.
-	 *  - propagate them to other ludd key server.
+	 *  Note in memory the fpr in gpgme_import_status_t of all keys imported to
+	 *  revoke the one with with an usable secret key.
+	 *  (they reach the other ludd key servers through recon.c)
 	 */
 
 }
 
+/* send the headers of the response of hkp_lookup(), whose body is then
+ * written through resp_write() or resp_printf(), gzip compressed if the
+ * client accepts it (and it's not to be signed) */
+static void resp_head( httpd_conn* hc, char * type ) {
+#ifdef HKP_GZIP_LEVEL
+	char mode[8];
+	int fd;
+
+	(void) snprintf(mode,sizeof(mode),"wb%d",HKP_GZIP_LEVEL);
+	resp_gz=(gzFile) 0;
+	if ( ! (hc->bfield & HC_DETACH_SIGN) && httpd_accepts_encoding(hc,"gzip") && (fd=dup(hc->conn_fd)) >= 0 ) {
+		if ( ! (resp_gz=gzdopen(fd,mode)) )
+			close(fd);
+	}
+	send_mime(hc, 200, ok200title, resp_gz ? "gzip" : "", "Vary: Accept-Encoding\015\012", type,(off_t) -1, hc->sb.st_mtime );
+#else
+	send_mime(hc, 200, ok200title, "", "", type,(off_t) -1, hc->sb.st_mtime );
+#endif
+	httpd_write_response(hc);
+}
+
+static ssize_t resp_write( httpd_conn* hc, const void * buffer, size_t size ) {
+#ifdef HKP_GZIP_LEVEL
+	if ( resp_gz )
+		return ( size == 0 || gzwrite(resp_gz,buffer,size) == (int) size ) ? (ssize_t) size : -1;
+#endif
+	return httpd_write_fully(hc->conn_fd,buffer,size);
+}
+
+static void resp_printf( FILE * fp, const char * format, ... ) {
+	va_list ap;
+#ifdef HKP_GZIP_LEVEL
+	char buff[4096];
+	int r;
+
+	if ( resp_gz ) {
+		va_start(ap, format);
+		r = vsnprintf(buff, sizeof(buff), format, ap);
+		va_end(ap);
+		if ( r > 0 )
+			(void) gzwrite(resp_gz,buff,MIN(r,sizeof(buff)-1));
+		return;
+	}
+#endif
+	va_start(ap, format);
+	(void) vfprintf(fp, format, ap);
+	va_end(ap);
+}
+
+/* end the compressed body of the response of hkp_lookup(), if any */
+static void resp_end( void ) {
+#ifdef HKP_GZIP_LEVEL
+	if ( resp_gz )
+		(void) gzclose(resp_gz);
+	resp_gz=(gzFile) 0;
+#endif
+}
+
 /* callback for gpgme_op_export_ext to write directly the response */
 static ssize_t gpgdata4export_cb(struct gpgdata4export_handle * h, void *buffer, size_t size)
 {
+	char head[512];
+	int r;
+
 	if (!export_start) {
-		send_mime(h->hc, 200, ok200title, "", "", "text/html; charset=%s",(off_t) -1, h->hc->sb.st_mtime );
-		httpd_write_response(h->hc);
-		httpd_dprintf(h->hc->conn_fd,"<html><head><title>"SOFTWARE_NAME" Public Key Server -- Get: %.80s (%d+)</title></head><body><h1>Public Key Server -- Get: %.80s (%d+)</h1><pre>\n",h->searchs[0],h->nsearchs-1,h->searchs[0],h->nsearchs-1);
+		resp_head(h->hc, "text/html; charset=%s");
+		r = snprintf(head,sizeof(head),"<html><head><title>"SOFTWARE_NAME" Public Key Server -- Get: %.80s (%d+)</title></head><body><h1>Public Key Server -- Get: %.80s (%d+)</h1><pre>\n",h->searchs[0],h->nsearchs-1,h->searchs[0],h->nsearchs-1);
+		(void) resp_write(h->hc,head,MIN(r,sizeof(head)-1));
 		export_start=1;
 	}
 
-	return httpd_write_fully(h->hc->conn_fd,buffer,size);
+	return resp_write(h->hc,buffer,size);
 }
 /* dummy function for callback based gpgme data objects */
 static void gpg_data_release_cb(void *handle)
@@ -243,6 +686,28 @@ static void gpg_data_release_cb(void *handle)
 	    /* must just be present... bug or feature?!? */
 }
 
+/*! exact_search make search (decoded, malloc()ed) an exact search for gpg
+ * (exact=on): a keyid, a fingerprint or an email address between '<' and '>'
+ * is left as is, else the whole user ID has to match ('=' prefix).
+ * \return the search, or NULL if out of memory (search is then freed).
+ */
+static char * exact_search( char * search ) {
+	char * pchar, * exact;
+	size_t len;
+
+	pchar = search + ( search[0] == '0' && ( search[1] == 'x' || search[1] == 'X' ) ? 2 : 0 );
+	len = strspn(pchar,"0123456789abcdefABCDEF");
+	if ( *search == '<' || *search == '='
+			|| ( pchar[len] == '\0' && ( len == 8 || len == 16 || len == 32 || len == 40 || len == 64 ) ) )
+		return search;
+	if ( (exact=malloc(strlen(search)+2)) ) {
+		exact[0]='=';
+		strcpy(exact+1,search);
+	}
+	free(search);
+	return exact;
+}
+
 /*! manage "pks/lookup" url interface */
 void hkp_lookup( httpd_conn* hc ) {
 
@@ -266,13 +731,13 @@ void hkp_lookup( httpd_conn* hc ) {
 		close(hc->conn_fd); \
 		pthread_join(tparse, NULL); \
 	} \
-	exit(code); \
+	hpool_exit(code); \
 }\
 
 	pchar=hc->query;
 	if (! pchar || *pchar == '\0' ) {
 		httpd_send_err(hc, 400, httpd_err400title, "", "Error handling request: there is no query string", "" );
-		exit(EXIT_SUCCESS);
+		hpool_exit(EXIT_SUCCESS);
 	}
 
 	while (pchar && *pchar) {
@@ -308,26 +773,26 @@ void hkp_lookup( httpd_conn* hc ) {
 	if (exact) {
 		if (!strcmp(exact,"off")) {
 			exact=(char *) 0; /* off is default */
-		} else if (!strcmp(exact,"on")) {
-			httpd_send_err(hc, 501, err501title, "", err501form, "exact=on" );
-			exit(EXIT_FAILURE);
-		} else {
+		} else if (strcmp(exact,"on")) {
 			httpd_send_err(hc, 400, httpd_err400title, "", "\"exact\" parameter only take \"on\" or \"off\" as argument.", "" );
-			exit(EXIT_SUCCESS);
+			hpool_exit(EXIT_SUCCESS);
 		}
 	}
 
 	if ( ! search[0] ) {
 		/* (mandatory parameter) */
 		httpd_send_err(hc, 400, httpd_err400title, "", "Missing a \"search\" value in the query.</h1></body></html>","");
-		exit(EXIT_SUCCESS);
+		hpool_exit(EXIT_SUCCESS);
 	} else {
 		for (i=0;i<nsearchs;i++) {
-			if ( (searchdec[i]=malloc(strlen(search[i])*sizeof(char)+1)) )
+			if ( (searchdec[i]=malloc(strlen(search[i])*sizeof(char)+1)) ) {
 				strdecodequery(searchdec[i],search[i]);
-			else {
+				if (exact)
+					searchdec[i]=exact_search(searchdec[i]);
+			}
+			if ( ! searchdec[i] ) {
 				httpd_send_err(hc, 500, err500title, "", err500form, "m" );
-				exit(EXIT_FAILURE);
+				hpool_exit(EXIT_FAILURE);
 			}
 		}
 	}
@@ -339,14 +804,14 @@ void hkp_lookup( httpd_conn* hc ) {
 	gpgerr=gpgme_new(&gpglctx);
 	if ( gpgerr  != GPG_ERR_NO_ERROR ) {
 		httpd_send_err(hc, 500, err500title, "", err500form, "g01" );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	if (hc->bfield & HC_DETACH_SIGN) {
 		if ( pipe( p ) < 0 ) {
 			syslog( LOG_ERR, "pipe - %m" );
 			httpd_send_err( hc, 500, err500title, "", err500form, "p" );
-			exit(EXIT_FAILURE);
+			hpool_exit(EXIT_FAILURE);
 		}
 		/* Create a thread for input */
 		args.rfd=p[0];
@@ -356,12 +821,12 @@ void hkp_lookup( httpd_conn* hc ) {
 
 		if (args.wfd < 0) {
 			httpd_send_err( hc, 500, err500title, "", err500form, "d" );
-			exit(EXIT_FAILURE);
+			hpool_exit(EXIT_FAILURE);
 		}
 		/* move p[1] to hc->conn_fd */
 		if ( dup2(p[1],hc->conn_fd) < 0 ) {
 			httpd_send_err( hc, 500, err500title, "", err500form, "d" );
-			exit(EXIT_FAILURE);
+			hpool_exit(EXIT_FAILURE);
 		}
 		close(p[1]);
 
@@ -369,7 +834,7 @@ void hkp_lookup( httpd_conn* hc ) {
 		if ( terrno !=0 ) {
 			errno=terrno;
 			httpd_send_err( hc, 500, err500title, "", err500form, "c" );
-			exit(EXIT_FAILURE);
+			hpool_exit(EXIT_FAILURE);
 		}
 	}
 
@@ -399,10 +864,12 @@ void hkp_lookup( httpd_conn* hc ) {
 
 		gpgerr = gpgme_op_export_ext(gpglctx,(const char **)searchdec,0,gpgdata);
 		if ( gpgerr != GPG_ERR_NO_ERROR) {
+			resp_end();
 			httpd_send_err(hc, 500, err500title, "", err500form, "g11" );
 			HKP_LOOKUP_EXIT(EXIT_FAILURE);
 		} else if (export_start) {
-			httpd_write_fully(hc->conn_fd,"\n</pre></body></html>\n",sizeof("\n</pre></body></html>\n")-1);
+			resp_write(hc,"\n</pre></body></html>\n",sizeof("\n</pre></body></html>\n")-1);
+			resp_end();
 		} else {
 			httpd_send_err(hc, 404, err404title, "", "Get: %.80s (...): No key found ! :-(", search[0]);
 		}
@@ -435,16 +902,15 @@ void hkp_lookup( httpd_conn* hc ) {
 		gpgerr = gpgme_op_keylist_next (gpglctx, &gpgkey);
 		while (gpgerr == GPG_ERR_NO_ERROR) {
 			if (!begin) {
-				send_mime(hc, 200, ok200title, "", "", "text/plain; charset=%s",(off_t) -1, hc->sb.st_mtime );
-				httpd_write_response(hc);
+				resp_head(hc, "text/plain; charset=%s");
 				begin=1;
 				/* Luckily: info "header" is optionnal, see draft-shaw-openpgp-hkp-00.txt */
 			}
 			/* first subkey is the main key */
-			fprintf(fp,"pub:%s:%d:%d:%ld:%ld\n",gpgkey->subkeys->fpr,gpgkey->subkeys->pubkey_algo,gpgkey->subkeys->length,gpgkey->subkeys->timestamp,(gpgkey->subkeys->expires?gpgkey->subkeys->expires:-1));
+			resp_printf(fp,"pub:%s:%d:%d:%ld:%ld\n",gpgkey->subkeys->fpr,gpgkey->subkeys->pubkey_algo,gpgkey->subkeys->length,gpgkey->subkeys->timestamp,(gpgkey->subkeys->expires?gpgkey->subkeys->expires:-1));
 			gpguid=gpgkey->uids;
 			while (gpguid) {
-				fprintf(fp,"uid:%s (%s) <%s>:\n",gpguid->name,gpguid->comment,gpguid->email);
+				resp_printf(fp,"uid:%s (%s) <%s>:\n",gpguid->name,gpguid->comment,gpguid->email);
 				gpguid=gpguid->next;
 			}
 			gpgme_key_unref(gpgkey);
@@ -455,6 +921,7 @@ void hkp_lookup( httpd_conn* hc ) {
 			httpd_send_err(hc, 404, err404title, "", "Get: %.80s (...): No key found ! :-(", search[0]);
 			HKP_LOOKUP_EXIT(EXIT_SUCCESS);
 		}
+		resp_end();
 		(void) fclose( fp );
 		HKP_LOOKUP_EXIT(EXIT_SUCCESS);
 
@@ -467,3 +934,480 @@ void hkp_lookup( httpd_conn* hc ) {
 	}
 }
 
+#ifdef GPGIO_MAX_OPS
+extern gpgme_ctx_t main_gpgctx;
+
+/* a "pks/lookup" request run by the server process (cf. hkp_lookup_start()) */
+typedef struct {
+	httpd_conn* hc;
+	gpgme_ctx_t ctx;
+	gpgme_data_t in; /* the body, to sign */
+	gpgme_data_t out; /* exported keys, then signature */
+	int get; /* 1 for op=get, 0 for op=index */
+	int signing; /* 1 once the body is being signed */
+	int nkeys; /* number of keys listed (op=index) */
+	int overflow; /* 1 if the body would exceed HKP_LOOKUP_MAXLEN */
+	size_t len; /* of hc->body */
+	size_t start; /* of the exported keys in hc->body (op=get) */
+	char * query; /* copy of hc->query, cut at each '&' */
+	int nsearchs;
+	char * search[HKP_MAX_SEARCHS+1]; /* (in query) */
+	char * searchdec[HKP_MAX_SEARCHS+1];
+	char heads[96]; /* extra headers of the response (Vary, ETag for op=get) */
+#ifdef HKP_GZIP_LEVEL
+	int gzip; /* 1 if the body is to be sent gzip compressed */
+#endif
+#ifdef KEYIDX_SLOTS
+	char cachefpr[65]; /* key whose export is to be cached (op=get) */
+	unsigned long gen; /* keyidx_generation() when the export started */
+#endif
+} hkp_job_t;
+
+static void lookup_free( hkp_job_t * job ) {
+	int i;
+
+	if ( job->ctx ) {
+		gpgio_detach(job->ctx);
+		gpgme_release(job->ctx);
+	}
+	gpgme_data_release(job->in);
+	gpgme_data_release(job->out);
+	for (i=0;i<job->nsearchs;i++)
+		free(job->searchdec[i]);
+	free(job->query);
+	job->hc->gpgjob = (void *) 0;
+	job->hc->bfield &= ~HC_GPG_WAIT;
+	free(job);
+}
+
+void hkp_lookup_abort( httpd_conn* hc ) {
+	if ( hc->gpgjob )
+		lookup_free((hkp_job_t *) hc->gpgjob);
+	hc->bfield &= ~HC_GPG_WAIT;
+}
+
+/* append to the body of the response */
+static void lookup_printf( hkp_job_t * job, const char * format, ... ) {
+	httpd_conn* hc = job->hc;
+	va_list ap;
+	int r;
+
+	va_start(ap, format);
+	r = vsnprintf(hc->body + job->len, hc->maxbody + 1 - job->len, format, ap);
+	va_end(ap);
+	if ( r > 0 && job->len + r > hc->maxbody ) {
+		httpd_realloc_str(&hc->body, &hc->maxbody, job->len + r);
+		va_start(ap, format);
+		r = vsnprintf(hc->body + job->len, hc->maxbody + 1 - job->len, format, ap);
+		va_end(ap);
+	}
+	if ( r > 0 )
+		job->len += r;
+}
+
+#ifdef HKP_GZIP_LEVEL
+/*! lookup_deflate compress the body (job->len bytes of hc->body) with gzip.
+ * \return 0, or -1 on error (the body is then unchanged).
+ */
+static int lookup_deflate( hkp_job_t * job ) {
+	static char * out = (char *) 0; /* (swapped with hc->body) */
+	static size_t maxout = 0;
+	httpd_conn* hc = job->hc;
+	z_stream zs;
+	char * swap;
+	size_t maxswap;
+	int r;
+
+	memset(&zs, 0, sizeof(zs));
+	/* (15+16 windowBits for a gzip header and trailer) */
+	if ( (r=deflateInit2(&zs, HKP_GZIP_LEVEL, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY)) != Z_OK ) {
+		syslog(LOG_ERR, "pks/lookup: deflateInit2 - %d", r);
+		return -1;
+	}
+	httpd_realloc_str(&out, &maxout, deflateBound(&zs, job->len));
+	zs.next_in = (Bytef *) hc->body;
+	zs.avail_in = job->len;
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = maxout;
+	r = deflate(&zs, Z_FINISH);
+	(void) deflateEnd(&zs);
+	if ( r != Z_STREAM_END ) {
+		syslog(LOG_ERR, "pks/lookup: deflate - %d", r);
+		return -1;
+	}
+	job->len = zs.total_out;
+	swap = hc->body; hc->body = out; out = swap;
+	maxswap = hc->maxbody; hc->maxbody = maxout; maxout = maxswap;
+	return 0;
+}
+#endif /* HKP_GZIP_LEVEL */
+
+/* send the body (signed if err is GPG_ERR_NO_ERROR and job->out contains the signature) */
+static void lookup_send( hkp_job_t * job, gpgme_error_t err ) {
+	httpd_conn* hc = job->hc;
+	char * type = job->get ? "text/html; charset=%s" : "text/plain; charset=%s";
+	char * encodings = "";
+	char * sig;
+	size_t siglen;
+
+	if ( err != GPG_ERR_NO_ERROR ) {
+		syslog(LOG_ERR, "pks/lookup: signing - %s", gpgme_strerror(err));
+		httpd_send_err(hc, 500, err500title, "", err500form, "s" );
+	} else if ( hc->bfield & HC_DETACH_SIGN ) {
+		sig = gpgme_data_release_and_get_mem(job->out, &siglen);
+		job->out = (gpgme_data_t) 0;
+		httpd_send_body(hc, 200, ok200title, "", type, job->heads, job->len, sig, siglen);
+		gpgme_free(sig);
+	} else {
+#ifdef HKP_GZIP_LEVEL
+		if ( job->gzip && lookup_deflate(job) == 0 )
+			encodings = "gzip";
+#endif
+		httpd_send_body(hc, 200, ok200title, encodings, type, job->heads, job->len, (char *) 0, 0);
+	}
+	lookup_free(job);
+}
+
+static void lookup_sign( hkp_job_t * job ) {
+	gpgme_error_t gpgerr;
+	gpgme_key_t gpgkey;
+
+	gpgme_data_release(job->out);
+	job->out = (gpgme_data_t) 0;
+	gpgerr = gpgme_data_new_from_mem(&job->in, job->hc->body, job->len, 0);
+	if ( gpgerr == GPG_ERR_NO_ERROR )
+		gpgerr = gpgme_data_new(&job->out);
+	if ( gpgerr == GPG_ERR_NO_ERROR )
+		gpgerr = natsig_sign(job->in, job->out);
+	if ( gpgerr == NATSIG_UNAVAILABLE ) {
+		/* Let gpg make it, with the key of the main context */
+		gpgme_signers_clear(job->ctx);
+		if ( (gpgkey=gpgme_signers_enum(main_gpgctx, 0)) ) {
+			gpgerr = gpgme_signers_add(job->ctx, gpgkey);
+			gpgme_key_unref(gpgkey);
+		} else
+			gpgerr = gpgme_error(GPG_ERR_NO_SECKEY);
+		if ( gpgerr == GPG_ERR_NO_ERROR )
+			gpgerr = gpgme_op_sign_start(job->ctx, job->in, job->out, GPGME_SIG_MODE_DETACH);
+		if ( gpgerr == GPG_ERR_NO_ERROR ) {
+			job->signing = 1;
+			return;
+		}
+	}
+	lookup_send(job, gpgerr);
+}
+
+/* gpgio callback for each listed key (op=index) */
+static void lookup_key_cb( void * arg, gpgme_key_t gpgkey ) {
+	hkp_job_t * job = (hkp_job_t *) arg;
+	gpgme_user_id_t gpguid;
+
+	if ( job->overflow ) {
+		gpgme_key_unref(gpgkey);
+		return;
+	}
+	/* first subkey is the main key */
+	lookup_printf(job,"pub:%s:%d:%d:%ld:%ld\n",gpgkey->subkeys->fpr,gpgkey->subkeys->pubkey_algo,gpgkey->subkeys->length,gpgkey->subkeys->timestamp,(gpgkey->subkeys->expires?gpgkey->subkeys->expires:-1));
+	for (gpguid=gpgkey->uids; gpguid; gpguid=gpguid->next)
+		lookup_printf(job,"uid:%s (%s) <%s>:\n",gpguid->name,gpguid->comment,gpguid->email);
+	job->nkeys++;
+	gpgme_key_unref(gpgkey);
+	if ( job->len > HKP_LOOKUP_MAXLEN ) {
+		job->overflow = 1;
+		gpgio_cancel(job->ctx);
+	}
+}
+
+/* gpgme data callback for the exported keys (op=get): append them to the
+ * body, up to HKP_LOOKUP_MAXLEN bytes */
+static ssize_t lookup_write_cb( void * handle, const void * buffer, size_t size ) {
+	hkp_job_t * job = (hkp_job_t *) handle;
+	httpd_conn* hc = job->hc;
+
+	if ( job->len + size > HKP_LOOKUP_MAXLEN ) {
+		job->overflow = 1;
+		errno = EFBIG;
+		return -1;
+	}
+	httpd_realloc_str(&hc->body, &hc->maxbody, job->len + size);
+	memcpy(hc->body + job->len, buffer, size);
+	job->len += size;
+	return size;
+}
+
+/* begin the body of an op=get response */
+static void lookup_get_head( hkp_job_t * job ) {
+	lookup_printf(job,"<html><head><title>"SOFTWARE_NAME" Public Key Server -- Get: %.80s (%d+)</title></head><body><h1>Public Key Server -- Get: %.80s (%d+)</h1><pre>\n",job->search[0],job->nsearchs-1,job->search[0],job->nsearchs-1);
+}
+
+/*! lookup_etag set the ETag of an op=get response, made of the hash of its
+ * body (and of its encoding).
+ * \return 1 if the client already has it (then a 304 is sent), else 0.
+ */
+static int lookup_etag( hkp_job_t * job ) {
+	httpd_conn* hc = job->hc;
+	unsigned long long h = 14695981039346656037ULL;
+	char tag[24];
+	size_t i, len;
+
+	for (i=0;i<job->len;i++)
+		h = ( h ^ (unsigned char) hc->body[i] ) * 1099511628211ULL;
+#ifdef HKP_GZIP_LEVEL
+	(void) snprintf(tag,sizeof(tag),"\"%016llx%s\"",h,job->gzip?"-gz":"");
+#else
+	(void) snprintf(tag,sizeof(tag),"\"%016llx\"",h);
+#endif
+	len = strlen(job->heads);
+	(void) snprintf(job->heads+len,sizeof(job->heads)-len,"ETag: %s\015\012",tag);
+	if ( strstr(hc->ifnonematch,tag) || !strcmp(hc->ifnonematch,"*") ) {
+		send_mime(hc, 304, err304title, "", job->heads, "text/html; charset=%s", (off_t) -1, (time_t) 0);
+		lookup_free(job);
+		return 1;
+	}
+	return 0;
+}
+
+/* send the response once its body is made */
+static void lookup_reply( hkp_job_t * job ) {
+	httpd_conn* hc = job->hc;
+
+	if ( job->len == 0 ) {
+		httpd_send_err(hc, 404, err404title, "", "Get: %.80s (...): No key found ! :-(", job->search[0]);
+		lookup_free(job);
+		return;
+	}
+#ifdef HKP_GZIP_LEVEL
+	job->gzip = ( ! (hc->bfield & HC_DETACH_SIGN) && job->len >= HKP_GZIP_MIN && httpd_accepts_encoding(hc, "gzip") );
+	(void) strcpy(job->heads, "Vary: Accept-Encoding\015\012");
+#endif
+	if ( job->get && lookup_etag(job) )
+		return;
+	else if ( hc->bfield & HC_DETACH_SIGN )
+		lookup_sign(job);
+	else
+		lookup_send(job, GPG_ERR_NO_ERROR);
+}
+
+/* gpgio callback once the export, the key listing, or the signature has ended */
+static void lookup_done_cb( void * arg, gpgme_error_t err ) {
+	hkp_job_t * job = (hkp_job_t *) arg;
+	httpd_conn* hc = job->hc;
+	gpgme_sign_result_t gpgsign;
+
+	if ( job->signing ) {
+		if ( err == GPG_ERR_NO_ERROR
+				&& ( ! (gpgsign=gpgme_op_sign_result(job->ctx)) || gpgsign->invalid_signers ) )
+			err = gpgme_error(GPG_ERR_UNUSABLE_SECKEY);
+		lookup_send(job, err);
+		return;
+	}
+
+	/* Too big to be held by the server process: let a forked one stream it */
+	if ( job->overflow ) {
+		syslog(LOG_DEBUG, "pks/lookup: more than %d bytes for '%.80s', forking", HKP_LOOKUP_MAXLEN, job->search[0]);
+		lookup_free(job);
+		hc->bfield |= HC_GPG_FORK;
+		return;
+	}
+
+	if ( job->get ) {
+		if ( err != GPG_ERR_NO_ERROR ) {
+			httpd_send_err(hc, 500, err500title, "", err500form, "g11" );
+			lookup_free(job);
+			return;
+		}
+		if ( job->len > job->start ) {
+#ifdef KEYIDX_SLOTS
+			if ( job->cachefpr[0] )
+				keyidx_export_put(job->cachefpr, job->gen, hc->body + job->start, job->len - job->start);
+#endif
+			lookup_printf(job,"\n</pre></body></html>\n");
+		} else
+			job->len = 0;
+	}
+
+	lookup_reply(job);
+}
+
+#ifdef KEYIDX_SLOTS
+#define HKP_INDEX_MAX 64
+
+/*! lookup_index answer an op=index request from the in-memory index of the
+ * keyring (cf. keyidx.c), as lookup_key_cb() would have.
+ * \return 0 if answered, or -1 if the index can't tell (then gpg has to list the keys).
+ */
+static int lookup_index( hkp_job_t * job ) {
+	keyidx_key_t * keys[HKP_INDEX_MAX], * found[HKP_INDEX_MAX];
+	int i, j, k, n=0, r;
+
+	for (i=0;i<job->nsearchs;i++) {
+		if ( (r=keyidx_lookup(job->searchdec[i], found, HKP_INDEX_MAX)) < 0 )
+			return -1;
+		/* (each key once) */
+		for (j=0;j<r;j++) {
+			for (k=0;k<n && keys[k]!=found[j];k++)
+				;
+			if ( k < n )
+				continue;
+			if ( n >= HKP_INDEX_MAX )
+				return -1;
+			keys[n++]=found[j];
+		}
+	}
+
+	job->hc->gpgjob = job;
+	job->hc->bfield |= HC_GPG_WAIT;
+	for (i=0;i<n;i++)
+		lookup_printf(job,"%s",keys[i]->text);
+	job->nkeys=n;
+	lookup_reply(job);
+	return 0;
+}
+
+/*! lookup_cached answer an op=get request for a single key from its cached
+ * export, or note which key it is to cache its export once made.
+ * \return 0 if answered, or -1 if gpg has to export the keys.
+ */
+static int lookup_cached( hkp_job_t * job ) {
+	httpd_conn* hc = job->hc;
+	keyidx_key_t * keys[2], * key=(keyidx_key_t *) 0;
+	const char * armor;
+	size_t len;
+	int i;
+
+	for (i=0;i<job->nsearchs;i++) {
+		if ( keyidx_lookup(job->searchdec[i], keys, 2) != 1 || ( key && keys[0] != key ) )
+			return -1;
+		key=keys[0];
+	}
+	if ( ! key )
+		return -1;
+	if ( ! (armor=keyidx_export_get(key, &len)) ) {
+		(void) snprintf(job->cachefpr, sizeof(job->cachefpr), "%s", key->names);
+		job->gen = keyidx_generation();
+		return -1;
+	}
+
+	hc->gpgjob = job;
+	hc->bfield |= HC_GPG_WAIT;
+	lookup_get_head(job);
+	httpd_realloc_str(&hc->body, &hc->maxbody, job->len + len);
+	memcpy(hc->body + job->len, armor, len);
+	job->len += len;
+	lookup_printf(job,"\n</pre></body></html>\n");
+	lookup_reply(job);
+	return 0;
+}
+#endif /* KEYIDX_SLOTS */
+
+int hkp_lookup_start( httpd_conn* hc ) {
+	static struct gpgme_data_cbs lookup_cbs = {
+		NULL,			/* read method */
+		lookup_write_cb,	/* write method */
+		NULL,			/* seek method */
+		NULL			/* release method */
+	};
+	hkp_job_t * job;
+	char * pchar, * op=(char *)0, * exact=(char *)0;
+	gpgme_error_t gpgerr;
+	int i;
+
+	if ( hc->method != METHOD_GET || hc->query[0] == '\0' )
+		return -1;
+	if ( ! (job=calloc(1, sizeof(hkp_job_t))) )
+		return -1;
+	job->hc = hc;
+	if ( ! (job->query=strdup(hc->query)) ) {
+		lookup_free(job);
+		return -1;
+	}
+
+	/* (same parsing as hkp_lookup()) */
+	pchar=job->query;
+	while (pchar && *pchar) {
+		if (!strncmp(pchar,"op=",3)) {
+			pchar+=3;
+			op=pchar;
+		} else if (!strncmp(pchar,"search=",7)) {
+			pchar+=7;
+			if ( *pchar != '\0' && *pchar != '&' ) {
+				job->search[job->nsearchs]=pchar;
+				job->nsearchs=MIN(HKP_MAX_SEARCHS-1,job->nsearchs+1);
+			}
+		} else if (!strncmp(pchar,"exact=",6)) {
+			pchar+=6;
+			exact=pchar;
+		}
+		pchar=strchr(pchar,'&');
+		if (pchar) {
+			*pchar='\0';
+			pchar++;
+		}
+	}
+
+	/* Errors and unsupported requests are left to hkp_lookup() */
+	if ( ! job->search[0] || ( exact && strcmp(exact,"off") && strcmp(exact,"on") )
+			|| ( op && strcmp(op,"get") && strcmp(op,"index") ) ) {
+		lookup_free(job);
+		return -1;
+	}
+	job->get = ( op && !strcmp(op,"get") );
+
+	for (i=0;i<job->nsearchs;i++) {
+		if ( ! (job->searchdec[i]=malloc(strlen(job->search[i])+1)) ) {
+			job->nsearchs=i;
+			lookup_free(job);
+			return -1;
+		}
+		strdecodequery(job->searchdec[i],job->search[i]);
+		if ( exact && !strcmp(exact,"on") && ! (job->searchdec[i]=exact_search(job->searchdec[i])) ) {
+			job->nsearchs=i;
+			lookup_free(job);
+			return -1;
+		}
+	}
+#ifdef KEYIDX_SLOTS
+	/* Keys we definitely don't have: no need to ask gpg */
+	for (i=0;i<job->nsearchs && keyidx_absent(job->searchdec[i]);i++)
+		;
+	if ( i == job->nsearchs ) {
+		httpd_send_err(hc, 404, err404title, "", "Get: %.80s (...): No key found ! :-(", job->search[0]);
+		lookup_free(job);
+		return 0;
+	}
+#endif
+
+	if ( gpgme_new(&job->ctx) != GPG_ERR_NO_ERROR ) {
+		job->ctx = (gpgme_ctx_t) 0;
+		lookup_free(job);
+		return -1;
+	}
+	if ( gpgio_attach(job->ctx, lookup_done_cb, job->get ? (gpgio_key_cb_t) 0 : lookup_key_cb, job) < 0 ) {
+		lookup_free(job);
+		return -1;
+	}
+	gpgme_set_armor(job->ctx,1);
+#ifdef KEYIDX_SLOTS
+	/* (lookup_sign() may still need job->ctx) */
+	if ( job->get ? lookup_cached(job) == 0 : lookup_index(job) == 0 )
+		return 0;
+#endif
+	if ( job->get ) {
+		/* (the keys are exported right after the head) */
+		lookup_get_head(job);
+		job->start = job->len;
+		gpgerr = gpgme_data_new_from_cbs(&job->out, &lookup_cbs, job);
+		if ( gpgerr == GPG_ERR_NO_ERROR )
+			gpgerr = gpgme_op_export_ext_start(job->ctx,(const char **)job->searchdec,0,job->out);
+	} else
+		gpgerr = gpgme_op_keylist_ext_start(job->ctx,(const char **)job->searchdec,0,0);
+	if ( gpgerr != GPG_ERR_NO_ERROR ) {
+		lookup_free(job);
+		return -1;
+	}
+
+	hc->gpgjob = job;
+	hc->bfield |= HC_GPG_WAIT;
+	return 0;
+}
+#endif /* GPGIO_MAX_OPS */
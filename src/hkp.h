@@ -11,6 +11,8 @@
 #ifndef _HKP_H_
 #define _HKP_H_
 
+#include <gpgme.h>
+
 #include "config.h"
 #include "libhttpd.h"
 
@@ -24,4 +26,28 @@ void hkp_add( httpd_conn* hc );
  */
 void hkp_lookup( httpd_conn* hc );
 
+#ifdef KEYIMP_SPOOL
+/*! hkp_add_policy the policy of the server about a new key (cf.
+ * keyimp_submit()), arg pointing to an int set if it only merges keys.
+ * \return the user ID to report if it's accepted, or NULL.
+ */
+const char * hkp_add_policy( gpgme_key_t gpgkey, void * arg );
+#endif /* KEYIMP_SPOOL */
+
+#ifdef GPGIO_MAX_OPS
+/*! hkp_lookup_start start a "pks/lookup" request (GET, op=get or op=index)
+ * in the server process: its gpgme operations are driven by the main loop (cf.
+ * gpgio.c), HC_GPG_WAIT being set until the response is ready to be sent, or
+ * until HC_GPG_FORK is set because it would exceed HKP_LOOKUP_MAXLEN.
+ * \return 0 if the request is handled (or already answered), or -1 if it has
+ * to be handled by hkp_lookup() in a forked process.
+ */
+int hkp_lookup_start( httpd_conn* hc );
+
+/*! hkp_lookup_abort cancel the gpgme operation of a request started by
+ * hkp_lookup_start(), if any, and clear HC_GPG_WAIT.
+ */
+void hkp_lookup_abort( httpd_conn* hc );
+#endif /* GPGIO_MAX_OPS */
+
 #endif /* _HKP_H_ */
@@ -0,0 +1,482 @@
+/* hpool.c - pool of pre-forked request handlers
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Instead of forking the whole server for each "pks/" or "udc/" request (or
+* directory listing), a manager process is forked once at startup, which
+* forks HPOOL_WORKERS handlers and replaces them when they exit.
+*
+* The server and the handlers share a SOCK_SEQPACKET socket pair: the server
+* sends on its end, as one message, the function to call and the request as
+* it was read, with the connection attached (SCM_RIGHTS). The idle handlers
+* all wait on the other end, and the one which gets the message parses the
+* request again (httpd_adopt_conn()) and calls the function.
+*
+* The number of idle handlers is kept in a memory area shared by all these
+* processes, so that the server forks as before when none is idle instead of
+* queuing the request. A handler exits after HPOOL_REQUESTS requests (what a
+* request leaked is then freed), and an alarm of CGI_TIMELIMIT seconds is set
+* for each request, as a watchdog.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <syslog.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "hpool.h"
+#include "libhttpd.h"
+
+#ifdef HPOOL_WORKERS
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Max size of a request passed to a handler (bigger ones are forked) */
+#define HPOOL_MAXREQ 65536
+/* Number of descriptors closed after each request, from the lowest which was free before */
+#define HPOOL_MAXFDS 64
+
+#define HW_DEAD 0
+#define HW_IDLE 1
+#define HW_BUSY 2
+
+typedef struct {
+	pthread_mutex_t mutex;
+	int idle; /* handlers waiting for a request, not yet given one */
+	char state[HPOOL_WORKERS]; /* HW_* */
+	long passed, forked, handled, killed, respawned;
+} hpool_board_t;
+
+typedef struct {
+	void (*funct)( httpd_conn* );
+	size_t len; /* of the request which follow */
+} hpool_req_t;
+
+extern char* argv0;
+
+/* Globals (shared by all processes). */
+static hpool_board_t* board = (hpool_board_t*) 0;
+static httpd_server* hpool_hs = (httpd_server*) 0;
+
+/* Globals (of the server process). */
+static pid_t hpool_pid = 0;
+static int pool_fd = -1;
+
+/* Globals (of the manager and handlers). */
+static volatile sig_atomic_t got_term = 0;
+static int in_request = 0;
+static sigjmp_buf request_jmp;
+
+/* Forwards. */
+static void hpool_manager( int sfd );
+static pid_t hpool_spawn( int w, int sfd );
+static void hpool_worker( int w, int sfd );
+static void board_lock( void );
+
+/* Lock the board, and make it consistent again if its previous owner died
+ * holding it (the idle count is then recounted from the states). */
+static void board_lock( void ) {
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	int w;
+
+	if ( pthread_mutex_lock(&board->mutex) == EOWNERDEAD ) {
+		board->idle = 0;
+		for ( w = 0; w < HPOOL_WORKERS; w++ )
+			if ( board->state[w] == HW_IDLE )
+				board->idle++;
+		pthread_mutex_consistent(&board->mutex);
+		syslog( LOG_WARNING, "hpool: a process died holding the board, %d idle handlers", board->idle );
+	}
+#else /* HAVE_PTHREAD_MUTEXATTR_SETROBUST */
+	pthread_mutex_lock(&board->mutex);
+#endif /* HAVE_PTHREAD_MUTEXATTR_SETROBUST */
+}
+
+static void handle_term( int sig ) {
+	got_term = 1;
+}
+
+static void handle_chld( int sig ) {
+	/* (only to interrupt the manager's poll) */
+}
+
+pid_t hpool_start( httpd_server* hs ) {
+	pthread_mutexattr_t attr;
+	int sv[2];
+	pid_t pid;
+
+	hpool_hs = hs;
+	if ( ! board ) {
+		board = mmap(NULL, sizeof(hpool_board_t), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if ( board == MAP_FAILED ) {
+			syslog( LOG_ERR, "hpool: mmap - %m" );
+			board = (hpool_board_t*) 0;
+			return -1;
+		}
+		memset(board, 0, sizeof(hpool_board_t));
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+		/* a handler may be killed holding it (CGI_TIMELIMIT, hpool_stop...) */
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif /* HAVE_PTHREAD_MUTEXATTR_SETROBUST */
+		pthread_mutex_init(&board->mutex, &attr);
+		pthread_mutexattr_destroy(&attr);
+	}
+	board_lock();
+	board->idle = 0;
+	memset(board->state, HW_DEAD, sizeof(board->state));
+	pthread_mutex_unlock(&board->mutex);
+
+	if ( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0 ) {
+		syslog( LOG_ERR, "hpool: socketpair - %m" );
+		return -1;
+	}
+
+	pid = fork();
+	if ( pid < 0 ) {
+		syslog( LOG_ERR, "hpool: fork - %m" );
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if ( pid > 0 ) {
+		/* Parent process: never wait for the handlers */
+		close(sv[1]);
+		pool_fd = sv[0];
+		(void) httpd_set_ndelay( pool_fd );
+		/* (not to leak it to the spawned CGI) */
+		(void) fcntl( pool_fd, F_SETFD, FD_CLOEXEC );
+		hpool_pid = pid;
+		syslog( LOG_INFO, "handler pool started (pid %d, %d handlers)", pid, HPOOL_WORKERS );
+		return pid;
+	}
+
+	/* Child process: the manager. */
+	close(sv[0]);
+	hpool_manager(sv[1]);
+	exit(0);
+}
+
+/* Main loop of the manager: keep HPOOL_WORKERS handlers alive. */
+static void hpool_manager( int sfd ) {
+	pid_t pids[HPOOL_WORKERS], ppid = getppid(), pid;
+	int i, status;
+
+	httpd_close_inherited( hpool_hs );
+#ifdef HAVE_SIGSET
+	(void) sigset( SIGTERM, handle_term );
+	(void) sigset( SIGINT, handle_term );
+	(void) sigset( SIGCHLD, handle_chld );
+	(void) sigset( SIGPIPE, SIG_IGN );
+	(void) sigset( SIGHUP, SIG_IGN );
+	(void) sigset( SIGUSR1, SIG_IGN );
+	(void) sigset( SIGUSR2, SIG_IGN );
+#else /* HAVE_SIGSET */
+	(void) signal( SIGTERM, handle_term );
+	(void) signal( SIGINT, handle_term );
+	(void) signal( SIGCHLD, handle_chld );
+	(void) signal( SIGPIPE, SIG_IGN );
+	(void) signal( SIGHUP, SIG_IGN );
+	(void) signal( SIGUSR1, SIG_IGN );
+	(void) signal( SIGUSR2, SIG_IGN );
+#endif /* HAVE_SIGSET */
+
+	for ( i = 0; i < HPOOL_WORKERS; i++ )
+		pids[i] = hpool_spawn(i, sfd);
+
+	for (;;) {
+		if ( got_term || getppid() != ppid ) {
+			for ( i = 0; i < HPOOL_WORKERS; i++ )
+				if ( pids[i] > 0 )
+					kill( pids[i], SIGTERM );
+			exit(0);
+		}
+
+		while ( (pid=waitpid((pid_t) -1, &status, WNOHANG)) > 0 ) {
+			for ( i = 0; i < HPOOL_WORKERS && pids[i] != pid; i++ )
+				;
+			if ( i >= HPOOL_WORKERS )
+				continue;
+			board_lock();
+			if ( board->state[i] == HW_IDLE )
+				board->idle--;
+			board->state[i] = HW_DEAD;
+			if ( WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM )
+				board->killed++;
+			pthread_mutex_unlock(&board->mutex);
+			if ( WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM )
+				syslog( LOG_WARNING, "handler %d killed by its watchdog", pid );
+			else if ( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+				syslog( LOG_ERR, "handler %d died (status %d)", pid, status );
+			pids[i] = 0;
+		}
+
+		for ( i = 0; i < HPOOL_WORKERS; i++ )
+			if ( pids[i] <= 0 ) {
+				pids[i] = hpool_spawn(i, sfd);
+				if ( pids[i] > 0 ) {
+					board_lock();
+					board->respawned++;
+					pthread_mutex_unlock(&board->mutex);
+				}
+			}
+
+		/* (interrupted by SIGCHLD) */
+		(void) poll((struct pollfd*) 0, 0, 1000);
+	}
+}
+
+static pid_t hpool_spawn( int w, int sfd ) {
+	pid_t pid;
+
+	pid = fork();
+	if ( pid < 0 ) {
+		syslog( LOG_ERR, "hpool: fork - %m" );
+		return -1;
+	}
+	if ( pid == 0 )
+		hpool_worker(w, sfd);
+	return pid;
+}
+
+/* Main loop of a handler. */
+static void hpool_worker( int w, int sfd ) {
+	static httpd_conn hc;
+	hpool_req_t req;
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr* cmsg;
+	union {
+		struct cmsghdr cm;
+		char control[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	char * buf;
+	ssize_t r;
+	int n, fd, lowfd, s;
+
+#ifdef HAVE_SIGSET
+	(void) sigset( SIGTERM, SIG_DFL );
+	(void) sigset( SIGINT, SIG_DFL );
+	(void) sigset( SIGCHLD, SIG_DFL );
+	(void) sigset( SIGALRM, SIG_DFL );
+#else /* HAVE_SIGSET */
+	(void) signal( SIGTERM, SIG_DFL );
+	(void) signal( SIGINT, SIG_DFL );
+	(void) signal( SIGCHLD, SIG_DFL );
+	(void) signal( SIGALRM, SIG_DFL );
+#endif /* HAVE_SIGSET */
+	/* (SIGPIPE stay ignored: a gone client must not kill the handler) */
+
+#ifdef CGI_NICE
+	(void) nice( CGI_NICE );
+#endif /* CGI_NICE */
+
+	if ( ! (buf=malloc(HPOOL_MAXREQ)) ) {
+		syslog( LOG_ERR, "hpool: malloc - %m" );
+		exit(1);
+	}
+
+	for ( n = 0; n < HPOOL_REQUESTS; n++ ) {
+		board_lock();
+		board->state[w] = HW_IDLE;
+		board->idle++;
+		pthread_mutex_unlock(&board->mutex);
+
+		/* All the descriptors from lowfd will be opened for the request */
+		lowfd = fcntl(sfd, F_DUPFD, 0);
+		close(lowfd);
+
+		iov[0].iov_base = &req;
+		iov[0].iov_len = sizeof(req);
+		iov[1].iov_base = buf;
+		iov[1].iov_len = HPOOL_MAXREQ;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		msg.msg_control = ctl.control;
+		msg.msg_controllen = sizeof(ctl.control);
+		do
+			r = recvmsg(sfd, &msg, 0);
+		while ( r < 0 && errno == EINTR );
+		if ( r <= 0 )
+			/* The server is gone (or stopped the pool) */
+			exit(0);
+
+		/* (the server already decremented board->idle) */
+		board_lock();
+		board->state[w] = HW_BUSY;
+		pthread_mutex_unlock(&board->mutex);
+
+		fd = -1;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if ( cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+		if ( fd < 0 || r < sizeof(req) || req.len != r - sizeof(req) || (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) ) {
+			syslog( LOG_ERR, "hpool: malformed request message" );
+			if ( fd >= 0 )
+				close(fd);
+			continue;
+		}
+
+#ifdef CGI_TIMELIMIT
+		alarm( CGI_TIMELIMIT );
+#endif /* CGI_TIMELIMIT */
+		if ( httpd_adopt_conn( hpool_hs, fd, buf, req.len, &hc ) < 0 )
+			httpd_write_response( &hc );
+		else {
+			/* activate TCP_NODELAY, as for spawned process (cf. child_r_start()) */
+			s = 1;
+			(void) setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, (char*) &s, sizeof(s) );
+			if ( sigsetjmp( request_jmp, 1 ) == 0 ) {
+				in_request = 1;
+				req.funct( &hc );
+			}
+			in_request = 0;
+		}
+#ifdef CGI_TIMELIMIT
+		alarm( 0 );
+#endif /* CGI_TIMELIMIT */
+
+		/* Clean what a forked child would have left at exit */
+		(void) fflush( (FILE*) 0 );
+		httpd_close_conn( &hc, (struct timeval*) 0 );
+		closelog();
+		for ( fd = lowfd; fd < lowfd + HPOOL_MAXFDS; fd++ )
+			(void) close( fd );
+		openlog( argv0, LOG_NDELAY|LOG_PID, LOG_FACILITY );
+
+		board_lock();
+		board->handled++;
+		pthread_mutex_unlock(&board->mutex);
+	}
+	exit(0);
+}
+
+void hpool_exit( int status ) {
+	if ( in_request )
+		siglongjmp( request_jmp, 1 );
+	exit( status );
+}
+
+int hpool_submit( void (*funct)( httpd_conn* ), httpd_conn* hc ) {
+	hpool_req_t req;
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr* cmsg;
+	union {
+		struct cmsghdr cm;
+		char control[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	int ok;
+
+	if ( pool_fd < 0 || hc->rawreqlen == 0 || hc->rawreqlen > HPOOL_MAXREQ )
+		return -1;
+
+	board_lock();
+	ok = ( board->idle > 0 );
+	if ( ok )
+		board->idle--;
+	else
+		board->forked++;
+	pthread_mutex_unlock(&board->mutex);
+	if ( ! ok )
+		return -1;
+
+	req.funct = funct;
+	req.len = hc->rawreqlen;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof(req);
+	iov[1].iov_base = hc->rawreq;
+	iov[1].iov_len = hc->rawreqlen;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = ctl.control;
+	msg.msg_controllen = sizeof(ctl.control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &hc->conn_fd, sizeof(int));
+
+	if ( sendmsg(pool_fd, &msg, MSG_NOSIGNAL) < 0 ) {
+		if ( errno != EAGAIN && errno != EWOULDBLOCK )
+			syslog( LOG_ERR, "hpool: sendmsg - %m" );
+		board_lock();
+		board->idle++;
+		board->forked++;
+		pthread_mutex_unlock(&board->mutex);
+		return -1;
+	}
+
+	board_lock();
+	board->passed++;
+	pthread_mutex_unlock(&board->mutex);
+	return 0;
+}
+
+int hpool_reaped( pid_t pid ) {
+	if ( hpool_pid <= 0 || pid != hpool_pid )
+		return 0;
+	hpool_pid = 0;
+	return 1;
+}
+
+void hpool_check( void ) {
+	if ( hpool_pid == 0 && hpool_hs ) {
+		syslog( LOG_WARNING, "handler pool died, restarting it" );
+		/* (its handlers get EOF and exit) */
+		if ( pool_fd >= 0 )
+			close(pool_fd);
+		pool_fd = -1;
+		hpool_pid = -1; /* don't retry before next call if failing */
+		(void) hpool_start( hpool_hs );
+	} else if ( hpool_pid < 0 )
+		hpool_pid = 0;
+}
+
+void hpool_stop( void ) {
+	if ( hpool_pid > 0 )
+		kill( hpool_pid, SIGTERM );
+	hpool_pid = -2;
+	if ( pool_fd >= 0 )
+		close(pool_fd);
+	pool_fd = -1;
+	hpool_hs = (httpd_server*) 0;
+}
+
+void hpool_logstats( long secs ) {
+	if ( ! board )
+		return;
+	board_lock();
+	syslog( LOG_INFO,
+		"  hpool - %d/%d handlers idle, %ld requests passed (%g/sec), %ld forked instead, %ld handled, %ld killed by watchdog, %ld respawned",
+		board->idle, HPOOL_WORKERS, board->passed, (float) board->passed / secs, board->forked,
+		board->handled, board->killed, board->respawned );
+	board->passed = board->forked = board->handled = board->killed = board->respawned = 0;
+	pthread_mutex_unlock(&board->mutex);
+}
+
+#endif /* HPOOL_WORKERS */
@@ -0,0 +1,54 @@
+/* hpool.h - header file for the pool of pre-forked request handlers
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _HPOOL_H_
+#define _HPOOL_H_
+
+#include <sys/types.h>
+#include <stdlib.h>
+
+#include "config.h"
+#include "libhttpd.h"
+
+#ifdef HPOOL_WORKERS
+
+/*! hpool_start fork the pool manager, which fork and keep alive
+ * HPOOL_WORKERS handler processes.
+ * \return the pid of the manager, or -1 on error.
+ */
+pid_t hpool_start( httpd_server* hs );
+
+/*! hpool_submit pass the connection of hc, and its request, to an idle
+ * handler which will call funct, like a child forked for it would do.
+ * \return 0 if a handler took it, or -1 if none is idle (then fork as before).
+ */
+int hpool_submit( void (*funct)( httpd_conn* ), httpd_conn* hc );
+
+/*! hpool_exit end the request being handled: in a handler of the pool, go
+ * back waiting for the next one, else exit(status). Handlers have to call it
+ * instead of exit().
+ */
+void hpool_exit( int status );
+
+/* To call for each child reaped by the server. Return 1 if pid was the pool manager. */
+int hpool_reaped( pid_t pid );
+
+/* Restart the pool if its manager died. Should be called periodically. */
+void hpool_check( void );
+
+/* Stop the pool, usually in preparation for exitting. */
+void hpool_stop( void );
+
+/* Generate debugging statistics syslog message. */
+void hpool_logstats( long secs );
+
+#else /* HPOOL_WORKERS */
+
+#define hpool_exit(status) exit(status)
+
+#endif /* HPOOL_WORKERS */
+
+#endif /* _HPOOL_H_ */
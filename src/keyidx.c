@@ -0,0 +1,1183 @@
+/* keyidx.c - in-memory index of the public keyring
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* The pks/lookup requests (op=index) for a keyid, a fingerprint or an email
+* address between '<' and '>' are answered from memory, instead of asking
+* gpg to look for them in the keyring. The index is built from the main loop
+* by a gpgme keylist operation (cf. gpgio.c). The processes which import keys
+* (pks/add) send their fingerprints through a datagram socket, and these keys
+* are then listed again to update the index, which isn't used until it's done.
+*
+* It's an open addressing hash table (with linear probing), mapping each of
+* the names of a key (the uppercase keyids and fingerprints of the key and of
+* its subkeys, its lowercase email addresses, and its user IDs after a '=')
+* to the key. For the searches of a part of a user ID, an other table maps
+* each trigram (3 consecutive bytes) of the lowercase user IDs to the keys
+* having it: the candidates are the keys of the least common trigram of the
+* search, which are then checked.
+*
+* A Bloom filter (of KEYIDX_BLOOM_BITS) of the fingerprints and keyids is
+* kept beside: the importers send the fingerprints of the subkeys with the
+* key's, so it's right while the index is updated, and requests for keys we
+* don't have get a 404 without running gpg (cf. keyidx_absent()), as long as
+* the keyrings didn't change since the last of these messages.
+*
+* The armored exports of the keys (op=get) are also kept in the index, within
+* KEYIDX_EXPORT_BYTES: they go with the key when it changes.
+*
+* The keyrings are stat before each answer (cf. gpgio_ring_stat()): if they
+* differ from those the index comes from, the request goes to gpg, and if no
+* importer tells which keys changed within KEYIDX_STALE seconds (eg. after a
+* gpg --import run by hand), the whole keyring is listed again.
+*
+* Once it has changed, the index is saved in KEYIDX_SNAPSHOT, with the stat
+* of the keyring it comes from: at startup, it's read back from there if the
+* keyring didn't change since.
+*
+* Each key has a state: the sum of the (mixed) hashes of its subkeys, user
+* IDs and, when the peers reconcile their keyrings (cf. RECON_INTERVAL), of
+* the signatures of its user IDs, so that it doesn't depend on the order gpg
+* lists them. The states are kept in the prefix tree of recon.c.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <gpgme.h>
+
+#include "config.h"
+#include "fdwatch.h"
+#include "gpgio.h"
+#include "keyidx.h"
+#include "recon.h"
+
+#ifdef KEYIDX_SLOTS
+
+#ifndef GPGIO_MAX_OPS
+#error "KEYIDX_SLOTS needs GPGIO_MAX_OPS"
+#endif
+
+/* maximum number of keys listed again by one operation */
+#define KEYIDX_RELIST 64
+/* maximum number of keys waiting for that (beyond, the whole keyring is listed again) */
+#define KEYIDX_PENDING 1024
+/* seconds the keyrings may differ from the index before it's listed again
+ * (the importers' messages come sooner) */
+#define KEYIDX_STALE 5
+/* maximum length of a name */
+#define KEYIDX_NAME_MAX 256
+/* maximum length of a message of the importers (a key and its subkeys) */
+#define KEYIDX_MSG_MAX 4096
+/* number of hash functions of the Bloom filter */
+#define KEYIDX_BLOOM_K 7
+#ifdef RECON_INTERVAL
+#define KEYIDX_MAGIC 0x4b495854 /* "KIXT": the states cover the signatures */
+#else
+#define KEYIDX_MAGIC 0x4b495833 /* "KIX3" */
+#endif
+
+/* the trigram at s (3 bytes, none null) */
+#define TRI(s) ( (uint32_t) (unsigned char) (s)[0] << 16 | (uint32_t) (unsigned char) (s)[1] << 8 | (uint32_t) (unsigned char) (s)[2] )
+
+typedef struct {
+	const char * name; /* NULL if the slot is free */
+	keyidx_key_t * key;
+} KeySlot;
+
+typedef struct {
+	uint32_t tri; /* 0 if the slot is free */
+	int n, size;
+	keyidx_key_t ** keys;
+} TriSlot;
+
+/* The beginning of the snapshot */
+typedef struct {
+	uint32_t magic, pad;
+	int64_t ring[GPGIO_RING_STAT];
+	int64_t nkeys;
+} SnapHead;
+
+/* A key in the snapshot (followed by its text, names and uids) */
+typedef struct {
+	uint32_t len, nameslen, nnames, uidslen;
+	int64_t timestamp;
+	uint64_t state;
+} SnapKey;
+
+static KeySlot * slots = (KeySlot *) 0;
+static size_t num_slots = 0, used_slots = 0;
+static TriSlot * tris = (TriSlot *) 0;
+static size_t num_tris = 0, used_tris = 0;
+static long num_keys = 0;
+static unsigned long generation = 0;
+static size_t export_bytes = 0;
+static long exports_count = 0, export_hits = 0, export_misses = 0;
+static unsigned char * bloom = (unsigned char *) 0;
+static int bloom_ready = 0; /* all the keys are in the filter */
+static long bloom_set = 0, absent_count = 0, falsepos_count = 0;
+static int fds[2] = { -1, -1 }; /* fds[1] is written by the importers */
+static gpgme_ctx_t ctx = (gpgme_ctx_t) 0;
+static int listing = 0; /* 1 for the whole keyring, 2 for some keys */
+static int ready = 0;   /* the index is complete */
+static int reload = 1;  /* the whole keyring has to be listed */
+static int failed = 0;  /* a key couldn't be added to the index */
+static char pending[KEYIDX_PENDING][65]; /* (64 hexadecimal digits for v5 keys) */
+static int num_pending = 0;
+static char relisted[KEYIDX_RELIST][65];
+static const char * patterns[KEYIDX_RELIST+1];
+static long found_count = 0, unable_count = 0, changed_count = 0, listed_count = 0, searched_count = 0;
+static int64_t ring[GPGIO_RING_STAT];   /* stat of the keyrings the index comes from */
+static int64_t listed[GPGIO_RING_STAT]; /* the same when the running listing started */
+static int64_t filtered[GPGIO_RING_STAT]; /* the same for the Bloom filter */
+static time_t stale = 0;    /* when the keyrings were first seen changed since */
+#ifdef KEYIDX_SNAPSHOT
+static int dirty = 0;       /* the index changed since it was saved */
+#endif
+
+/* Forwards. */
+static int grow( void );
+static int tri_grow( void );
+static void key_cb( void * arg, gpgme_key_t gpgkey );
+static void done_cb( void * arg, gpgme_error_t err );
+
+/* FNV-1a */
+static size_t hash( const char * str ) {
+	size_t h = 2166136261U;
+
+	while ( *str )
+		h = ( h ^ (unsigned char) *str++ ) * 16777619U;
+	return h;
+}
+
+static int slot_add( const char * name, keyidx_key_t * key ) {
+	size_t i, mask;
+
+	if ( ( used_slots + 1 ) * 2 > num_slots && grow() < 0 )
+		return -1;
+	mask = num_slots - 1;
+	for ( i = hash(name) & mask; slots[i].name; i = ( i + 1 ) & mask )
+		;
+	slots[i].name = name;
+	slots[i].key = key;
+	used_slots++;
+	return 0;
+}
+
+static void slot_del( const char * name, keyidx_key_t * key ) {
+	size_t i, j, k, mask = num_slots - 1;
+
+	for ( i = hash(name) & mask; slots[i].name; i = ( i + 1 ) & mask )
+		if ( slots[i].key == key && ! strcmp(slots[i].name, name) )
+			break;
+	if ( ! slots[i].name )
+		return;
+	/* move back the next names which couldn't be reached anymore */
+	for ( j = i; ; ) {
+		j = ( j + 1 ) & mask;
+		if ( ! slots[j].name )
+			break;
+		k = hash(slots[j].name) & mask;
+		if ( i <= j ? ( i < k && k <= j ) : ( i < k || k <= j ) )
+			continue;
+		slots[i] = slots[j];
+		i = j;
+	}
+	slots[i].name = (const char *) 0;
+	used_slots--;
+}
+
+/* double the size of the table (KEYIDX_SLOTS initially) */
+static int grow( void ) {
+	KeySlot * old = slots;
+	size_t i, n = num_slots;
+
+	slots = calloc(n ? n * 2 : KEYIDX_SLOTS, sizeof(KeySlot));
+	if ( ! slots ) {
+		slots = old;
+		syslog(LOG_ERR, "keyidx: out of memory");
+		return -1;
+	}
+	num_slots = n ? n * 2 : KEYIDX_SLOTS;
+	used_slots = 0;
+	for ( i = 0; i < n; i++ )
+		if ( old[i].name )
+			(void) slot_add(old[i].name, old[i].key);
+	free(old);
+	return 0;
+}
+
+static size_t tri_hash( uint32_t tri ) {
+	tri ^= tri >> 15;
+	tri *= 0x2c1b3c6dU;
+	tri ^= tri >> 12;
+	return tri;
+}
+
+/* the slot of tri (a new one if create) */
+static TriSlot * tri_find( uint32_t tri, int create ) {
+	size_t i, mask;
+
+	if ( create && ( used_tris + 1 ) * 2 > num_tris && tri_grow() < 0 )
+		return (TriSlot *) 0;
+	mask = num_tris - 1;
+	for ( i = tri_hash(tri) & mask; tris[i].tri; i = ( i + 1 ) & mask )
+		if ( tris[i].tri == tri )
+			return &tris[i];
+	if ( ! create )
+		return (TriSlot *) 0;
+	tris[i].tri = tri;
+	used_tris++;
+	return &tris[i];
+}
+
+/* double the size of the trigram table (KEYIDX_SLOTS/4 initially) */
+static int tri_grow( void ) {
+	TriSlot * old = tris;
+	size_t i, j, mask, n = num_tris;
+
+	tris = calloc(n ? n * 2 : KEYIDX_SLOTS / 4, sizeof(TriSlot));
+	if ( ! tris ) {
+		tris = old;
+		syslog(LOG_ERR, "keyidx: out of memory");
+		return -1;
+	}
+	num_tris = n ? n * 2 : KEYIDX_SLOTS / 4;
+	mask = num_tris - 1;
+	for ( i = 0; i < n; i++ )
+		if ( old[i].tri ) {
+			for ( j = tri_hash(old[i].tri) & mask; tris[j].tri; j = ( j + 1 ) & mask )
+				;
+			tris[j] = old[i];
+		}
+	free(old);
+	return 0;
+}
+
+/* add key to the keys of each trigram of its user IDs */
+static int tri_add( keyidx_key_t * key ) {
+	keyidx_key_t ** keys;
+	TriSlot * t;
+	const char * p;
+
+	for ( p = key->uids; p[0] && p[1] && p[2]; p++ ) {
+		if ( p[0] == '\n' || p[1] == '\n' || p[2] == '\n' )
+			continue;
+		if ( ! (t=tri_find(TRI(p), 1)) )
+			return -1;
+		/* (its trigrams are added one after the other) */
+		if ( t->n > 0 && t->keys[t->n - 1] == key )
+			continue;
+		if ( t->n >= t->size ) {
+			if ( ! (keys=realloc(t->keys, ( t->size ? t->size * 2 : 4 ) * sizeof(keyidx_key_t *))) )
+				return -1;
+			t->keys = keys;
+			t->size = t->size ? t->size * 2 : 4;
+		}
+		t->keys[t->n++] = key;
+	}
+	return 0;
+}
+
+static void tri_del( keyidx_key_t * key ) {
+	TriSlot * t;
+	const char * p;
+	int i;
+
+	for ( p = key->uids; p[0] && p[1] && p[2]; p++ ) {
+		if ( p[0] == '\n' || p[1] == '\n' || p[2] == '\n' )
+			continue;
+		if ( ! (t=tri_find(TRI(p), 0)) )
+			continue;
+		for ( i = t->n - 1; i >= 0 && t->keys[i] != key; i-- )
+			;
+		if ( i >= 0 )
+			t->keys[i] = t->keys[--t->n];
+	}
+}
+
+/* the bits of name in the Bloom filter (double hashing of a 64 bits FNV-1a) */
+static void bloom_bits( const char * name, uint32_t * bits ) {
+	uint64_t h = 14695981039346656037ULL;
+	uint32_t a, b;
+	int i;
+
+	while ( *name )
+		h = ( h ^ (unsigned char) *name++ ) * 1099511628211ULL;
+	a = (uint32_t) h;
+	b = (uint32_t) ( h >> 32 ) | 1;
+	for ( i = 0; i < KEYIDX_BLOOM_K; i++ )
+		bits[i] = ( a + i * b ) % KEYIDX_BLOOM_BITS;
+}
+
+static void bloom_add( const char * name ) {
+	uint32_t bits[KEYIDX_BLOOM_K];
+	int i;
+
+	bloom_bits(name, bits);
+	for ( i = 0; i < KEYIDX_BLOOM_K; i++ )
+		if ( ! ( bloom[bits[i] >> 3] & ( 1 << ( bits[i] & 7 ) ) ) ) {
+			bloom[bits[i] >> 3] |= 1 << ( bits[i] & 7 );
+			bloom_set++;
+		}
+}
+
+static int bloom_has( const char * name ) {
+	uint32_t bits[KEYIDX_BLOOM_K];
+	int i;
+
+	bloom_bits(name, bits);
+	for ( i = 0; i < KEYIDX_BLOOM_K; i++ )
+		if ( ! ( bloom[bits[i] >> 3] & ( 1 << ( bits[i] & 7 ) ) ) )
+			return 0;
+	return 1;
+}
+
+/* add to the filter the fingerprint fpr, and the keyids it gives */
+static void bloom_add_fpr( const char * fpr ) {
+	char keyid[17];
+	size_t len = strlen(fpr);
+
+	bloom_add(fpr);
+	if ( len == 40 ) {
+		/* (v4: the keyid ends the fingerprint) */
+		bloom_add(fpr + 24);
+		bloom_add(fpr + 32);
+	} else if ( len == 64 ) {
+		/* (v5: it begins it) */
+		memcpy(keyid, fpr, 16);
+		keyid[16] = '\0';
+		bloom_add(keyid);
+		bloom_add(keyid + 8);
+	}
+}
+
+static void key_free( keyidx_key_t * key ) {
+	const char * name;
+	int i;
+
+#ifdef RECON_INTERVAL
+	recon_del(key);
+#endif
+	for ( i = 0, name = key->names; i < key->nnames; i++, name += strlen(name) + 1 )
+		slot_del(name, key);
+	if ( key->uids )
+		tri_del(key);
+	if ( key->armor ) {
+		export_bytes -= key->armorlen;
+		exports_count--;
+	}
+	free(key->names);
+	free(key->uids);
+	free(key->text);
+	free(key->armor);
+	free(key);
+	num_keys--;
+	generation++;
+#ifdef KEYIDX_SNAPSHOT
+	dirty = 1;
+#endif
+}
+
+/* index key, whose names and uids are set */
+static int key_insert( keyidx_key_t * key ) {
+	const char * name;
+	int i;
+
+	num_keys++;
+#ifdef KEYIDX_SNAPSHOT
+	dirty = 1;
+#endif
+	for ( i = 0, name = key->names; i < key->nnames; i++, name += strlen(name) + 1 ) {
+		if ( slot_add(name, key) < 0 ) {
+			key->nnames = i;
+			key_free(key);
+			return -1;
+		}
+		/* (the keyids and fingerprints) */
+		if ( name[strspn(name, "0123456789ABCDEF")] == '\0' )
+			bloom_add(name);
+	}
+	if ( tri_add(key) < 0 ) {
+		key_free(key);
+		return -1;
+	}
+#ifdef RECON_INTERVAL
+	if ( recon_add(key) < 0 ) {
+		key_free(key);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+/* the key whose fingerprint is fpr */
+static keyidx_key_t * key_find( const char * fpr ) {
+	size_t i, mask = num_slots - 1;
+
+	for ( i = hash(fpr) & mask; slots[i].name; i = ( i + 1 ) & mask )
+		if ( slots[i].name == slots[i].key->names && ! strcmp(slots[i].name, fpr) )
+			return slots[i].key;
+	return (keyidx_key_t *) 0;
+}
+
+static void keys_clear( void ) {
+	size_t i;
+
+#ifdef RECON_INTERVAL
+	recon_clear();
+#endif
+	/* (each key once: by its fingerprint) */
+	for ( i = 0; i < num_slots; i++ )
+		if ( slots[i].name && slots[i].name != slots[i].key->names )
+			slots[i].name = (const char *) 0;
+	for ( i = 0; i < num_slots; i++ )
+		if ( slots[i].name ) {
+			free(slots[i].key->names);
+			free(slots[i].key->armor);
+			free(slots[i].key->uids);
+			free(slots[i].key->text);
+			free(slots[i].key);
+		}
+	memset(slots, 0, num_slots * sizeof(KeySlot));
+	used_slots = 0;
+	for ( i = 0; i < num_tris; i++ )
+		free(tris[i].keys);
+	memset(tris, 0, num_tris * sizeof(TriSlot));
+	used_tris = 0;
+	num_keys = 0;
+	export_bytes = 0;
+	exports_count = 0;
+	generation++;
+#ifdef KEYIDX_SNAPSHOT
+	dirty = 1;
+#endif
+}
+
+/* append to the text of key (*size being allocated) */
+static int text_printf( keyidx_key_t * key, size_t * size, const char * format, ... ) {
+	va_list ap;
+	char * text;
+	int r;
+
+	va_start(ap, format);
+	r = vsnprintf(key->text + key->len, *size - key->len, format, ap);
+	va_end(ap);
+	if ( r < 0 )
+		return -1;
+	if ( key->len + r >= *size ) {
+		*size = ( key->len + r ) * 2;
+		if ( ! (text=realloc(key->text, *size)) )
+			return -1;
+		key->text = text;
+		va_start(ap, format);
+		r = vsnprintf(key->text + key->len, *size - key->len, format, ap);
+		va_end(ap);
+	}
+	key->len += r;
+	return 0;
+}
+
+/* append prefix and name (lowercased if lower) to the names of key, if not already there */
+static void name_add( keyidx_key_t * key, char ** end, const char * prefix, const char * name, int lower ) {
+	const char * prev;
+	char * pchar;
+	int i;
+
+	if ( ! name || ! *name || strlen(prefix) + strlen(name) >= KEYIDX_NAME_MAX )
+		return;
+	for ( pchar = *end; *prefix; prefix++ )
+		*pchar++ = *prefix;
+	for ( ; *name; name++ )
+		*pchar++ = lower ? tolower((unsigned char) *name) : *name;
+	*pchar = '\0';
+	for ( i = 0, prev = key->names; i < key->nnames; i++, prev += strlen(prev) + 1 )
+		if ( ! strcmp(prev, *end) )
+			return;
+	*end = pchar + 1;
+	key->nnames++;
+}
+
+/* add to state the hash of an element of a key (so that their order doesn't matter) */
+static void state_add( uint64_t * state, const char * format, ... ) {
+	char buf[1024];
+	uint64_t h = 14695981039346656037ULL;
+	va_list ap;
+	int i, r;
+
+	va_start(ap, format);
+	r = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	if ( r < 0 )
+		return;
+	if ( r >= (int) sizeof(buf) )
+		r = sizeof(buf) - 1;
+	for ( i = 0; i < r; i++ )
+		h = ( h ^ (unsigned char) buf[i] ) * 1099511628211ULL;
+	/* (mixed, not to sum up hashes of similar elements) */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	*state += h;
+}
+
+/*! key_add add gpgkey to the index (replacing it if it was already there)
+ * \return 0, or -1 on error (out of memory).
+ */
+static int key_add( gpgme_key_t gpgkey ) {
+	keyidx_key_t * key;
+	gpgme_subkey_t gpgsub;
+	gpgme_user_id_t gpguid;
+	gpgme_key_sig_t gpgsig;
+	size_t size = 0;
+	const char * p;
+	char * end;
+
+	if ( ! gpgkey->subkeys || ! gpgkey->subkeys->fpr )
+		return 0;
+	if ( (key=key_find(gpgkey->subkeys->fpr)) )
+		key_free(key);
+	if ( ! (key=calloc(1, sizeof(keyidx_key_t))) )
+		return -1;
+
+	/* the same lines as lookup_key_cb() in hkp.c */
+	if ( text_printf(key, &size, "pub:%s:%d:%d:%ld:%ld\n",gpgkey->subkeys->fpr,gpgkey->subkeys->pubkey_algo,gpgkey->subkeys->length,gpgkey->subkeys->timestamp,(gpgkey->subkeys->expires?gpgkey->subkeys->expires:-1)) < 0 )
+		goto nomem;
+	for (gpguid=gpgkey->uids; gpguid; gpguid=gpguid->next)
+		if ( text_printf(key, &size, "uid:%s (%s) <%s>:\n",gpguid->name,gpguid->comment,gpguid->email) < 0 )
+			goto nomem;
+
+	/* first the fingerprint, then the keyids, the email addresses and the user IDs */
+	size = 0;
+	for (gpgsub=gpgkey->subkeys; gpgsub; gpgsub=gpgsub->next)
+		size += ( gpgsub->fpr ? strlen(gpgsub->fpr) + 1 : 0 ) + ( gpgsub->keyid ? strlen(gpgsub->keyid) + 10 : 0 );
+	for (gpguid=gpgkey->uids; gpguid; gpguid=gpguid->next)
+		size += ( gpguid->email ? strlen(gpguid->email) + 1 : 0 ) + ( gpguid->uid ? strlen(gpguid->uid) + 2 : 0 );
+	if ( ! (key->names=malloc(size)) )
+		goto nomem;
+	end = key->names;
+	for (gpgsub=gpgkey->subkeys; gpgsub; gpgsub=gpgsub->next) {
+		name_add(key, &end, "", gpgsub->fpr, 0);
+		name_add(key, &end, "", gpgsub->keyid, 0);
+		if ( gpgsub->keyid && strlen(gpgsub->keyid) == 16 )
+			name_add(key, &end, "", gpgsub->keyid + 8, 0);
+	}
+	for (gpguid=gpgkey->uids; gpguid; gpguid=gpguid->next)
+		name_add(key, &end, "", gpguid->email, 1);
+	for (gpguid=gpgkey->uids; gpguid; gpguid=gpguid->next)
+		name_add(key, &end, "=", gpguid->uid, 0);
+
+	size = 1;
+	for (gpguid=gpgkey->uids; gpguid; gpguid=gpguid->next)
+		size += gpguid->uid ? strlen(gpguid->uid) + 1 : 0;
+	if ( ! (key->uids=malloc(size)) )
+		goto nomem;
+	end = key->uids;
+	for (gpguid=gpgkey->uids; gpguid; gpguid=gpguid->next) {
+		if ( ! gpguid->uid )
+			continue;
+		if ( end > key->uids )
+			*end++ = '\n';
+		for ( p = gpguid->uid; *p; p++ )
+			*end++ = *p == '\n' ? ' ' : tolower((unsigned char) *p);
+	}
+	*end = '\0';
+	key->timestamp = gpgkey->subkeys->timestamp;
+
+	/* (not the validities, which are ours) */
+	for (gpgsub=gpgkey->subkeys; gpgsub; gpgsub=gpgsub->next)
+		state_add(&key->state, "sub:%s:%d:%u:%ld:%ld:%d", gpgsub->fpr ? gpgsub->fpr : gpgsub->keyid,
+			gpgsub->pubkey_algo, gpgsub->length, gpgsub->timestamp, gpgsub->expires, gpgsub->revoked);
+	for (gpguid=gpgkey->uids; gpguid; gpguid=gpguid->next) {
+		p = gpguid->uid ? gpguid->uid : "";
+		state_add(&key->state, "uid:%s:%d", p, gpguid->revoked);
+		for (gpgsig=gpguid->signatures; gpgsig; gpgsig=gpgsig->next)
+			state_add(&key->state, "sig:%s:%s:%ld:%ld:%u:%d", p, gpgsig->keyid ? gpgsig->keyid : "",
+				gpgsig->timestamp, gpgsig->expires, gpgsig->sig_class, gpgsig->revoked);
+	}
+
+	return key_insert(key);
+
+  nomem:
+	free(key->names);
+	free(key->uids);
+	free(key->text);
+	free(key);
+	return -1;
+}
+
+/* tell if the keyrings are still those of stat st (or can't be stat) */
+static int ring_same( const int64_t * st ) {
+	int64_t now[GPGIO_RING_STAT];
+
+	return gpgio_ring_stat(now) < 0 || ! memcmp(now, st, sizeof(now));
+}
+
+/*! ring_current tell if the keyrings are still those the index comes from.
+ * If not, they have been changed either by an importer (whose message is on
+ * its way) or by an other program (eg. gpg --import run by hand): in both
+ * cases the index can't tell until it's updated (cf. keyidx_dispatch()).
+ * \return 1 if they are (or can't be stat), 0 if not.
+ */
+static int ring_current( void ) {
+	if ( ring_same(ring) ) {
+		stale = 0;
+		return 1;
+	}
+	if ( ! stale )
+		stale = time( (time_t*) 0 );
+	return 0;
+}
+
+#ifdef KEYIDX_SNAPSHOT
+/* write the index in KEYIDX_SNAPSHOT */
+static void snap_save( void ) {
+	keyidx_key_t * key;
+	const char * name;
+	SnapHead head;
+	SnapKey sk;
+	FILE * fp;
+	size_t i;
+	int j;
+
+	if ( ! (fp=fopen(KEYIDX_SNAPSHOT".new", "w")) ) {
+		syslog(LOG_ERR, "fopen %s - %m", KEYIDX_SNAPSHOT".new");
+		return;
+	}
+	memset(&head, 0, sizeof(head));
+	head.magic = KEYIDX_MAGIC;
+	memcpy(head.ring, ring, sizeof(ring));
+	head.nkeys = num_keys;
+	(void) fwrite(&head, sizeof(head), 1, fp);
+	for ( i = 0; i < num_slots; i++ ) {
+		if ( ! slots[i].name || slots[i].name != slots[i].key->names )
+			continue;
+		key = slots[i].key;
+		for ( j = 0, name = key->names; j < key->nnames; j++ )
+			name += strlen(name) + 1;
+		sk.len = key->len;
+		sk.nameslen = name - key->names;
+		sk.nnames = key->nnames;
+		sk.uidslen = strlen(key->uids);
+		sk.timestamp = key->timestamp;
+		sk.state = key->state;
+		(void) fwrite(&sk, sizeof(sk), 1, fp);
+		(void) fwrite(key->text, 1, sk.len, fp);
+		(void) fwrite(key->names, 1, sk.nameslen, fp);
+		(void) fwrite(key->uids, 1, sk.uidslen, fp);
+	}
+	if ( ferror(fp) | fclose(fp) ) {
+		syslog(LOG_ERR, "write %s - %m", KEYIDX_SNAPSHOT".new");
+		(void) unlink(KEYIDX_SNAPSHOT".new");
+		return;
+	}
+	if ( rename(KEYIDX_SNAPSHOT".new", KEYIDX_SNAPSHOT) < 0 ) {
+		syslog(LOG_ERR, "rename %s - %m", KEYIDX_SNAPSHOT".new");
+		(void) unlink(KEYIDX_SNAPSHOT".new");
+		return;
+	}
+	dirty = 0;
+}
+
+/* read back the index from KEYIDX_SNAPSHOT (if the keyrings didn't change since) */
+static int snap_load( void ) {
+	keyidx_key_t * key;
+	const char * name;
+	int64_t st[GPGIO_RING_STAT];
+	SnapHead head;
+	SnapKey sk;
+	FILE * fp;
+	int64_t n;
+	uint32_t i;
+
+	if ( gpgio_ring_stat(st) < 0 || ! (fp=fopen(KEYIDX_SNAPSHOT, "r")) )
+		return -1;
+	if ( fread(&head, sizeof(head), 1, fp) != 1 || head.magic != KEYIDX_MAGIC
+			|| memcmp(head.ring, st, sizeof(st)) ) {
+		(void) fclose(fp);
+		return -1;
+	}
+	for ( n = 0; n < head.nkeys; n++ ) {
+		if ( fread(&sk, sizeof(sk), 1, fp) != 1 || sk.len >= (1<<24)
+				|| sk.nameslen == 0 || sk.nameslen >= (1<<24) || sk.uidslen >= (1<<24) )
+			break;
+		if ( ! (key=calloc(1, sizeof(keyidx_key_t))) )
+			break;
+		key->text = malloc(sk.len + 1);
+		key->names = malloc(sk.nameslen);
+		key->uids = malloc(sk.uidslen + 1);
+		if ( ! key->text || ! key->names || ! key->uids
+				|| fread(key->text, 1, sk.len, fp) != sk.len
+				|| fread(key->names, 1, sk.nameslen, fp) != sk.nameslen
+				|| fread(key->uids, 1, sk.uidslen, fp) != sk.uidslen
+				|| key->names[sk.nameslen - 1] != '\0' ) {
+			free(key->text);
+			free(key->names);
+			free(key->uids);
+			free(key);
+			break;
+		}
+		key->text[sk.len] = key->uids[sk.uidslen] = '\0';
+		key->len = sk.len;
+		key->timestamp = sk.timestamp;
+		key->state = sk.state;
+		/* (as many names as there are) */
+		for ( i = 0, name = key->names; i < sk.nnames && name < key->names + sk.nameslen; i++ )
+			name += strlen(name) + 1;
+		key->nnames = i;
+		if ( key_insert(key) < 0 )
+			break;
+	}
+	(void) fclose(fp);
+	if ( n < head.nkeys ) {
+		syslog(LOG_WARNING, "keyidx: %s is damaged, the keyring will be listed", KEYIDX_SNAPSHOT);
+		keys_clear();
+		return -1;
+	}
+	memcpy(ring, st, sizeof(st));
+	memcpy(filtered, st, sizeof(st));
+	dirty = 0;
+	syslog(LOG_INFO, "keyidx: %ld keys read from %s", num_keys, KEYIDX_SNAPSHOT);
+	return 0;
+}
+#endif /* KEYIDX_SNAPSHOT */
+
+int keyidx_init( void ) {
+	gpgme_error_t gpgerr;
+
+	if ( socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0 ) {
+		syslog(LOG_ERR, "keyidx: socketpair - %m");
+		fds[0] = fds[1] = -1;
+		return -1;
+	}
+	/* (not for the CGI programs) */
+	(void) fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	(void) fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	if ( grow() < 0 || tri_grow() < 0 )
+		goto err;
+	if ( ! (bloom=calloc(KEYIDX_BLOOM_BITS / 8, 1)) ) {
+		syslog(LOG_ERR, "keyidx: out of memory");
+		goto err;
+	}
+#ifdef KEYIDX_SNAPSHOT
+	if ( snap_load() == 0 ) {
+		ready = bloom_ready = 1;
+		reload = 0;
+	}
+#endif
+	if ( (gpgerr=gpgme_new(&ctx)) != GPG_ERR_NO_ERROR ) {
+		syslog(LOG_ERR, "keyidx: gpgme_new - %s", gpgme_strerror(gpgerr));
+		ctx = (gpgme_ctx_t) 0;
+		goto err;
+	}
+#ifdef RECON_INTERVAL
+	/* (for the states of the keys) */
+	(void) gpgme_set_keylist_mode(ctx, GPGME_KEYLIST_MODE_LOCAL | GPGME_KEYLIST_MODE_SIGS);
+#endif
+	if ( gpgio_attach(ctx, done_cb, key_cb, (void *) 0) < 0 ) {
+		syslog(LOG_ERR, "keyidx: no room for a gpgme operation");
+		gpgme_release(ctx);
+		ctx = (gpgme_ctx_t) 0;
+		goto err;
+	}
+	fdwatch_add_fd(fds[0], (void*) 0, FDW_READ);
+	return 0;
+
+  err:
+	ready = bloom_ready = 0;
+	(void) close(fds[0]);
+	(void) close(fds[1]);
+	fds[0] = fds[1] = -1;
+	return -1;
+}
+
+void keyidx_changed( const char * fpr, gpgme_key_t key ) {
+	char msg[KEYIDX_MSG_MAX];
+	gpgme_subkey_t gpgsub;
+	size_t len;
+
+	if ( fds[1] < 0 || ! fpr )
+		return;
+	/* "FPR[ SUBFPR...]", or "FPR *" if they don't fit (the filter is then rebuilt) */
+	len = snprintf(msg, sizeof(msg), "%s", fpr);
+	for (gpgsub=key?key->subkeys:(gpgme_subkey_t) 0; gpgsub && len < sizeof(msg); gpgsub=gpgsub->next)
+		if ( gpgsub->fpr && strcmp(gpgsub->fpr, fpr) )
+			len += snprintf(msg + len, sizeof(msg) - len, " %s", gpgsub->fpr);
+	if ( len >= sizeof(msg) )
+		len = snprintf(msg, sizeof(msg), "%s *", fpr);
+	if ( send(fds[1], msg, len, 0) < 0 )
+		syslog(LOG_ERR, "keyidx: send - %m");
+}
+
+/* put in name (of KEYIDX_NAME_MAX) the name of the keys which gpg would find with search,
+ * or the part of user ID it looks for (lowercased)
+ * \return 0 for a name, 1 for a part of user ID, or -1 if the index can't tell
+ */
+static int normalize( const char * search, char * name ) {
+	const char * end, * hex;
+	size_t i, len;
+
+	while ( *search == ' ' )
+		search++;
+	if ( *search == '=' ) {
+		len = strlen(search);
+		if ( len < 2 || len >= KEYIDX_NAME_MAX )
+			return -1;
+		memcpy(name, search, len + 1);
+		return 0;
+	}
+	if ( *search == '<' ) {
+		search++;
+		end = strchr(search, '>');
+		if ( ! end || end[1] != '\0' )
+			return -1;
+		len = end - search;
+		if ( len == 0 || len >= KEYIDX_NAME_MAX || ! memchr(search, '@', len) )
+			return -1;
+		for ( i = 0; i < len; i++ )
+			name[i] = tolower((unsigned char) search[i]);
+		name[len] = '\0';
+		return 0;
+	}
+	hex = ( search[0] == '0' && ( search[1] == 'x' || search[1] == 'X' ) ) ? search + 2 : search;
+	len = strspn(hex, "0123456789abcdefABCDEF");
+	if ( hex[len] == '\0' && ( len == 8 || len == 16 || len == 32 || len == 40 || len == 64 ) ) {
+		for ( i = 0; i <= len; i++ )
+			name[i] = toupper((unsigned char) hex[i]);
+		return 0;
+	}
+	if ( hex != search )
+		return -1;
+
+	/* a part of user ID (gpg's other prefixes are left to it) */
+	if ( *search == '*' )
+		search++;
+	else if ( strchr("@.+#&^%:", *search) )
+		return -1;
+	len = strlen(search);
+	if ( len < 3 || len >= KEYIDX_NAME_MAX || strchr(search, '\n') )
+		return -1;
+	for ( i = 0; i <= len; i++ )
+		name[i] = tolower((unsigned char) search[i]);
+	return 1;
+}
+
+/* 3 if a user ID of uids is part, 2 if part begins one of its words, 1 if it's elsewhere, 0 if not */
+static int rank( const char * uids, const char * part, size_t len ) {
+	const char * p;
+	int r, best = 0;
+
+	for ( p = uids; best < 3 && (p=strstr(p, part)); p++ ) {
+		if ( p == uids || p[-1] == '\n' )
+			r = ( p[len] == '\0' || p[len] == '\n' ) ? 3 : 2;
+		else
+			r = isalnum((unsigned char) p[-1]) ? 1 : 2;
+		if ( r > best )
+			best = r;
+	}
+	return best;
+}
+
+/* put in keys the max keys having part in a user ID, the best ranked first */
+static int search_part( const char * part, keyidx_key_t ** keys, int max ) {
+	TriSlot * t, * fewest = (TriSlot *) 0;
+	keyidx_key_t * key;
+	const char * p;
+	size_t len = strlen(part);
+	int * ranks;
+	int i, j, r, n = 0;
+
+	for ( p = part; p[2]; p++ ) {
+		if ( ! (t=tri_find(TRI(p), 0)) || t->n == 0 )
+			return 0;
+		if ( ! fewest || t->n < fewest->n )
+			fewest = t;
+	}
+	if ( max <= 0 || ! (ranks=malloc(max * sizeof(int))) )
+		return -1;
+	for ( i = 0; i < fewest->n; i++ ) {
+		key = fewest->keys[i];
+		if ( ! (r=rank(key->uids, part, len)) )
+			continue;
+		for ( j = n; j > 0 && ( ranks[j - 1] < r || ( ranks[j - 1] == r && keys[j - 1]->timestamp < key->timestamp ) ); j-- )
+			;
+		if ( j >= max )
+			continue;
+		if ( n < max )
+			n++;
+		memmove(keys + j + 1, keys + j, ( n - 1 - j ) * sizeof(keyidx_key_t *));
+		memmove(ranks + j + 1, ranks + j, ( n - 1 - j ) * sizeof(int));
+		keys[j] = key;
+		ranks[j] = r;
+	}
+	free(ranks);
+	return n;
+}
+
+int keyidx_absent( const char * search ) {
+	char name[KEYIDX_NAME_MAX];
+	size_t i, mask = num_slots - 1;
+
+	if ( ! bloom_ready || normalize(search, name) != 0 || name[strspn(name, "0123456789ABCDEF")] != '\0' )
+		return 0;
+	if ( ! bloom_has(name) ) {
+		/* (unless the keyrings changed since the filter was: it may be new) */
+		if ( ! ring_same(filtered) ) {
+			(void) ring_current();
+			return 0;
+		}
+		absent_count++;
+		return 1;
+	}
+	/* (to tell the false positives, when the index can) */
+	if ( ready && ! listing && ! num_pending ) {
+		for ( i = hash(name) & mask; slots[i].name && strcmp(slots[i].name, name); i = ( i + 1 ) & mask )
+			;
+		if ( ! slots[i].name )
+			falsepos_count++;
+	}
+	return 0;
+}
+
+int keyidx_lookup( const char * search, keyidx_key_t ** keys, int max ) {
+	char name[KEYIDX_NAME_MAX];
+	size_t i, mask = num_slots - 1;
+	int j, n = 0;
+
+	if ( ! ready || listing || num_pending || (j=normalize(search, name)) < 0 || ! ring_current() ) {
+		unable_count++;
+		return -1;
+	}
+	if ( j == 1 ) {
+		searched_count++;
+		return search_part(name, keys, max);
+	}
+	for ( i = hash(name) & mask; slots[i].name; i = ( i + 1 ) & mask ) {
+		if ( strcmp(slots[i].name, name) )
+			continue;
+		for ( j = 0; j < n && keys[j] != slots[i].key; j++ )
+			;
+		if ( j < n )
+			continue;
+		if ( n >= max ) {
+			unable_count++;
+			return -1;
+		}
+		keys[n++] = slots[i].key;
+	}
+	found_count++;
+	return n;
+}
+
+int keyidx_ready( void ) {
+	return ready;
+}
+
+unsigned long keyidx_generation( void ) {
+	return generation;
+}
+
+const char * keyidx_export_get( keyidx_key_t * key, size_t * lenP ) {
+	if ( ! key->armor ) {
+		export_misses++;
+		return (const char *) 0;
+	}
+	export_hits++;
+	*lenP = key->armorlen;
+	return key->armor;
+}
+
+void keyidx_export_put( const char * fpr, unsigned long gen, const char * armor, size_t len ) {
+	keyidx_key_t * key;
+
+	if ( gen != generation || ! (key=key_find(fpr)) || key->armor
+			|| export_bytes + len > KEYIDX_EXPORT_BYTES )
+		return;
+	if ( ! (key->armor=malloc(len)) )
+		return;
+	memcpy(key->armor, armor, len);
+	key->armorlen = len;
+	export_bytes += len;
+	exports_count++;
+}
+
+/* the key fpr has to be listed again */
+static void pending_add( const char * fpr ) {
+	int i;
+
+	if ( strlen(fpr) > 64 || fpr[strspn(fpr, "0123456789ABCDEF")] != '\0' )
+		return;
+	if ( reload )
+		return;
+	for ( i = 0; i < num_pending && strcmp(pending[i], fpr); i++ )
+		;
+	if ( i < num_pending )
+		return;
+	if ( num_pending >= KEYIDX_PENDING ) {
+		reload = 1;
+		num_pending = 0;
+		return;
+	}
+	strcpy(pending[num_pending++], fpr);
+}
+
+void keyidx_dispatch( void ) {
+	keyidx_key_t * key;
+	gpgme_error_t gpgerr;
+	char buf[KEYIDX_MSG_MAX + 1], * fpr, * next;
+	ssize_t r;
+	int i, n;
+
+	if ( ! ctx )
+		return;
+
+	if ( fdwatch_check_fd(fds[0]) ) {
+		n = 0;
+		while ( (r=recv(fds[0], buf, sizeof(buf) - 1, 0)) > 0 ) {
+			n++;
+			buf[r] = '\0';
+			changed_count++;
+			if ( (next=strchr(buf, ' ')) )
+				*next++ = '\0';
+			pending_add(buf);
+			bloom_add_fpr(buf);
+			for ( fpr = next; fpr; fpr = next ) {
+				if ( (next=strchr(fpr, ' ')) )
+					*next++ = '\0';
+				if ( ! strcmp(fpr, "*") ) {
+					/* (some subkeys are missing) */
+					bloom_ready = 0;
+					reload = 1;
+				} else
+					bloom_add_fpr(fpr);
+			}
+		}
+		/* (the importers send once the keyring is written) */
+		if ( n )
+			(void) gpgio_ring_stat(filtered);
+	}
+
+	/* keyrings changed without any message for a while: by an other program */
+	if ( stale && ! listing && ! reload && ! num_pending
+			&& time( (time_t*) 0 ) - stale >= KEYIDX_STALE && ! ring_current() ) {
+		syslog(LOG_NOTICE, "keyidx: the keyring was changed by an other program, listing it again");
+		reload = 1;
+	}
+
+	if ( listing || ( ! reload && ! num_pending ) )
+		return;
+	(void) gpgio_ring_stat(listed);
+	if ( reload ) {
+		/* (lookups go to gpg meanwhile) */
+		keys_clear();
+		memset(bloom, 0, KEYIDX_BLOOM_BITS / 8);
+		bloom_set = 0;
+		ready = bloom_ready = reload = failed = 0;
+		num_pending = 0;
+		if ( (gpgerr=gpgme_op_keylist_start(ctx, (const char *) 0, 0)) != GPG_ERR_NO_ERROR ) {
+			syslog(LOG_ERR, "keyidx: gpgme_op_keylist_start - %s", gpgme_strerror(gpgerr));
+			return;
+		}
+		listing = 1;
+	} else if ( num_pending ) {
+		n = num_pending < KEYIDX_RELIST ? num_pending : KEYIDX_RELIST;
+		for ( i = 0; i < n; i++ ) {
+			strcpy(relisted[i], pending[i]);
+			patterns[i] = relisted[i];
+			/* (it may have been deleted) */
+			if ( (key=key_find(relisted[i])) )
+				key_free(key);
+		}
+		patterns[n] = (const char *) 0;
+		num_pending -= n;
+		memmove(pending, pending + n, num_pending * sizeof(pending[0]));
+		if ( (gpgerr=gpgme_op_keylist_ext_start(ctx, patterns, 0, 0)) != GPG_ERR_NO_ERROR ) {
+			syslog(LOG_ERR, "keyidx: gpgme_op_keylist_ext_start - %s", gpgme_strerror(gpgerr));
+			reload = 1;
+			return;
+		}
+		listing = 2;
+	}
+}
+
+/* gpgio callback for each listed key */
+static void key_cb( void * arg, gpgme_key_t gpgkey ) {
+	if ( key_add(gpgkey) < 0 )
+		failed = 1;
+	listed_count++;
+	gpgme_key_unref(gpgkey);
+}
+
+/* gpgio callback once the listing has ended */
+static void done_cb( void * arg, gpgme_error_t err ) {
+	if ( err == GPG_ERR_NO_ERROR && failed )
+		err = gpgme_error(GPG_ERR_ENOMEM);
+	if ( err != GPG_ERR_NO_ERROR && gpgme_err_code(err) != GPG_ERR_EOF ) {
+		syslog(LOG_ERR, "keyidx: listing the keys - %s", gpgme_strerror(err));
+		/* (keys may be missing: keyidx_check() will list them all again) */
+		ready = 0;
+	} else {
+		if ( listing == 1 ) {
+			syslog(LOG_INFO, "keyidx: %ld keys indexed", num_keys);
+			ready = bloom_ready = 1;
+			memcpy(filtered, listed, sizeof(filtered));
+		}
+		memcpy(ring, listed, sizeof(ring));
+		stale = 0;
+	}
+	listing = 0;
+}
+
+void keyidx_check( void ) {
+	if ( ctx && ! ready && ! listing )
+		reload = 1;
+	/* (so that keyidx_dispatch() notices the changes made while no lookup came) */
+	if ( ctx && ready && ! listing && ! num_pending )
+		(void) ring_current();
+#ifdef KEYIDX_SNAPSHOT
+	if ( dirty && ready && ! listing && ! num_pending )
+		snap_save();
+#endif
+}
+
+void keyidx_logstats( long secs ) {
+	double fill;
+	int i;
+
+	syslog(
+		LOG_INFO, "  keyidx - %ld keys, %ld/%ld slots used, %ld/%ld trigrams, %s; %ld lookups answered (%ld searches), %ld not, %ld keys changed, %ld listed",
+		num_keys, (long) used_slots, (long) num_slots, (long) used_tris, (long) num_tris, ready ? "ready" : "not ready",
+		found_count + searched_count, searched_count, unable_count, changed_count, listed_count );
+	syslog(
+		LOG_INFO, "  keyidx - %ld exports cached (%ld bytes), %ld hits, %ld misses",
+		exports_count, (long) export_bytes, export_hits, export_misses );
+	for ( i = 0, fill = 1.0; i < KEYIDX_BLOOM_K; i++ )
+		fill *= (double) bloom_set / KEYIDX_BLOOM_BITS;
+	syslog(
+		LOG_INFO, "  keyidx - Bloom filter %ld/%ld bits set (%.3f%% false positives expected), %ld keys found absent, %ld false positives (%.3f%%)",
+		bloom_set, (long) KEYIDX_BLOOM_BITS, 100.0 * fill,
+		absent_count, falsepos_count, absent_count + falsepos_count ? 100.0 * falsepos_count / ( absent_count + falsepos_count ) : 0.0 );
+	found_count = unable_count = changed_count = listed_count = searched_count = 0;
+	export_hits = export_misses = absent_count = falsepos_count = 0;
+}
+
+#endif /* KEYIDX_SLOTS */
@@ -0,0 +1,101 @@
+/* keyidx.h - header file for the in-memory index of the public keyring
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _KEYIDX_H_
+#define _KEYIDX_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <gpgme.h>
+
+#include "config.h"
+
+#ifdef KEYIDX_SLOTS
+
+/* A key of the index */
+typedef struct {
+	char * text;  /* its "pub:" and "uid:" lines of a pks/lookup op=index */
+	size_t len;
+	char * names; /* the strings it is indexed with, one after the other */
+	int nnames;   /* (the first one is its fingerprint) */
+	char * uids;  /* its user IDs, lowercase, one per line */
+	long timestamp;
+	char * armor; /* its armored export, once cached (cf. keyidx_export_put()) */
+	size_t armorlen;
+	uint64_t state; /* hash of its subkeys, user IDs and signatures (order independent) */
+} keyidx_key_t;
+
+/*! keyidx_init prepare the index, which will be built by the main loop (cf.
+ * keyidx_dispatch()). To call before forking the processes which may import
+ * keys (cf. keyidx_changed()).
+ * \return 0, or -1 on error (logged).
+ */
+int keyidx_init( void );
+
+/*! keyidx_changed tell the server process that the key fpr may have been
+ * imported, updated or deleted: to call from the process which did it, with
+ * the key as it is now in the keyring (NULL if deleted), so that the filter
+ * of keyidx_absent() gets its subkeys right away.
+ */
+void keyidx_changed( const char * fpr, gpgme_key_t key );
+
+/*! keyidx_absent tell if search is a keyid or a fingerprint of a key which is
+ * definitely not in the keyring, according to a Bloom filter of all of them
+ * (which, unlike the index, is right while some keys are being listed again).
+ * The filter can't tell once the keyrings changed by an other mean than the
+ * importers (cf. keyidx_changed()), until they are listed again.
+ * \return 1 if so, or 0 if the key may be there (or the filter can't tell).
+ */
+int keyidx_absent( const char * search );
+
+/*! keyidx_lookup find in the index the keys matching search, as gpg would
+ * do: a keyid (8 or 16 hexadecimal digits, "0x" prefixed or not) or a
+ * fingerprint, an email address between '<' and '>', a whole user ID after
+ * '=', or else a part of a user ID (case insensitive, at least 3 characters,
+ * '*' prefixed or not). For a part of a user ID, only the max best matches
+ * are kept: the keys with a user ID equal to it, then those where it begins
+ * a word, then the others, the most recent first.
+ * \return the number of keys found (put in keys), or -1 if the index can't
+ * tell (not built yet, being updated, other search, or more than max keys).
+ */
+int keyidx_lookup( const char * search, keyidx_key_t ** keys, int max );
+
+/*! keyidx_ready tell if the index has all the keys of the keyring (some of
+ * them may be being listed again, after they changed).
+ */
+int keyidx_ready( void );
+
+/*! keyidx_generation tell the version of the index, which changes when
+ * keys are updated, deleted or listed again.
+ */
+unsigned long keyidx_generation( void );
+
+/*! keyidx_export_get the cached armored export of key (to count the hits).
+ * \return the export (its length put in *lenP), or NULL if not cached.
+ */
+const char * keyidx_export_get( keyidx_key_t * key, size_t * lenP );
+
+/*! keyidx_export_put cache the armored export (of len bytes) of the key fpr,
+ * made since keyidx_generation() returned gen. Nothing is done if the index
+ * changed since, or if KEYIDX_EXPORT_BYTES are already cached.
+ */
+void keyidx_export_put( const char * fpr, unsigned long gen, const char * armor, size_t len );
+
+/*! keyidx_dispatch carry on the building and the updating of the index (to
+ * call after fdwatch()).
+ */
+void keyidx_dispatch( void );
+
+/* Rebuild the index if its building failed, and save it in KEYIDX_SNAPSHOT
+ * (if defined) if it changed. Should be called periodically. */
+void keyidx_check( void );
+
+/* Generate debugging statistics syslog message. */
+void keyidx_logstats( long secs );
+
+#endif /* KEYIDX_SLOTS */
+
+#endif /* _KEYIDX_H_ */
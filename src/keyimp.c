@@ -0,0 +1,877 @@
+/* keyimp.c - import pipeline of pks/add
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Each pks/add submission is first imported in a private keyring (a temporary
+* directory of KEYIMP_SPOOL), where its new keys are checked as per the policy
+* of the server, so that a rejected key never reaches the keyring. The keys
+* accepted are exported from there to the spool ("ID.keys"), with the list of
+* the decisions ("ID.list"), then the private keyring is removed.
+*
+* The queued submissions are imported by batches, each in a single gpg
+* operation: the processes waiting for their results take turns (through a
+* lock on KEYIMP_SPOOL/lock) as the importer, which imports the oldest ones
+* first, so concurrent submissions don't contend anymore for the keyring. The
+* processes which don't wait without limit watch the spool with inotify, to
+* know as soon as their results are there or the lock is released.
+* The results of each submission are written in "ID.done", which is kept
+* KEYIMP_KEEP seconds for the clients which didn't wait for them.
+*
+* Clients and peers often submit again the same keys: the SHA256 of the key
+* material of the submissions (the content of the armored blocks, without
+* their headers nor line ends) is remembered, with their id, in a set
+* associative table shared by all the processes (cf. KEYIMP_DEDUP). Within
+* KEYIMP_DEDUP_WINDOW seconds, the same submission gets the same results (its
+* keys being unchanged) without running gpg, unless one of its keys has been
+* changed since by an other submission. As the keyrings may also change
+* otherwise (eg. an admin's gpg --import), they are stat (cf. gpgio_ring_stat())
+* before each batch and each answer given again: if they aren't as the last
+* batch left them, all the submissions remembered are forgotten.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#include <gpgme.h>
+#ifdef HAVE_LIBGCRYPT
+#include <gcrypt.h>
+#endif
+
+#include "config.h"
+#include "keyimp.h"
+#include "keyidx.h"
+#include "gpgio.h"
+
+#ifdef KEYIMP_SPOOL
+
+#define KEYIMP_LOCK KEYIMP_SPOOL"/lock"
+/* size of the path of a file of the spool (with an extension of at most 8) */
+#define KEYIMP_PATH_LEN ( sizeof(KEYIMP_SPOOL) + KEYIMP_ID_LEN + 16 )
+/* maximum length of a line of a list */
+#define KEYIMP_LINE_MAX 1024
+
+static unsigned int submitted = 0;
+
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+#define DEDUP_WAYS 4
+/* maximum number of keys of a submission remembered */
+#define DEDUP_KEYS 8
+typedef struct {
+	unsigned char hash[32];    /* SHA256 of the key material */
+	char id[KEYIMP_ID_LEN+1];  /* the submission which has the results */
+	int nkeys;
+	uint64_t keys[DEDUP_KEYS]; /* hashes of the fingerprints of its keys */
+	int64_t added;
+	unsigned int stamp;        /* for LRU replacement, 0 if unused */
+} Submitted;
+typedef struct {
+	pthread_mutex_t mutex;
+	unsigned int clock;
+	long hit_count, miss_count, forgot_count;
+	int ringed;                    /* the keyrings could be stat */
+	int64_t ring[GPGIO_RING_STAT]; /* the keyrings as left by the last batch */
+	pid_t importer;                /* the process importing a batch, or 0 */
+	Submitted entries[KEYIMP_DEDUP];
+} DedupCache;
+static DedupCache * dcache = (DedupCache *) 0;
+#endif /* KEYIMP_DEDUP && HAVE_LIBGCRYPT */
+
+/* put in path the path of the file id.ext of the spool (bounded, so that
+ * it always fits in KEYIMP_PATH_LEN) */
+static void spool_path( char * path, const char * id, const char * ext ) {
+	snprintf(path, KEYIMP_PATH_LEN, "%s/%.*s.%.8s", KEYIMP_SPOOL, KEYIMP_ID_LEN, id, ext);
+}
+
+/* remove the directory path and all it contains */
+static void rm_tree( const char * path ) {
+	char sub[512];
+	struct stat sb;
+	struct dirent * de;
+	DIR * dp;
+
+	if ( (dp=opendir(path)) ) {
+		while ( (de=readdir(dp)) ) {
+			if ( ! strcmp(de->d_name, ".") || ! strcmp(de->d_name, "..") )
+				continue;
+			snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+			if ( lstat(sub, &sb) == 0 && S_ISDIR(sb.st_mode) )
+				rm_tree(sub);
+			else
+				unlink(sub);
+		}
+		closedir(dp);
+	}
+	rmdir(path);
+}
+
+/* write a line of a list (the user ID being the last field, it may contain ':') */
+static void put_line( FILE * fp, const char * decision, const char * fpr, const char * uid ) {
+	fprintf(fp, "%s:%s:", decision, fpr);
+	for ( ; uid && *uid; uid++ )
+		putc(*uid == '\n' || *uid == '\r' ? ' ' : *uid, fp);
+	putc('\n', fp);
+}
+
+/* put in id the id of a new submission */
+static void new_id( char * id ) {
+	snprintf(id, KEYIMP_ID_LEN + 1, "%08lx-%08x-%04x", (unsigned long) time((time_t *) 0), (unsigned int) getpid(), submitted++ & 0xffff);
+}
+
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+/* hash a line of the key material (cf. material_hash()), as per the state:
+ * 0 out of an armored block, 1 in its headers, 2 in its content */
+static void material_line( gcry_md_hd_t md, int * stateP, const char * line, size_t len ) {
+	while ( len > 0 && isspace((unsigned char) line[len-1]) )
+		len--;
+	switch ( *stateP ) {
+	case 0:
+		/* (its type matters) */
+		if ( len > 14 && ! strncmp(line, "-----BEGIN PGP", 14) ) {
+			gcry_md_write(md, line, len);
+			gcry_md_write(md, "\n", 1);
+			*stateP = 1;
+		}
+		break;
+	case 1:
+		if ( len > 0 && memchr(line, ':', len) )
+			break;
+		*stateP = 2;
+		/* (no empty line after the headers: it's the content already) */
+		if ( len == 0 )
+			break;
+	case 2:
+		if ( len >= 8 && ! strncmp(line, "-----END", 8) )
+			*stateP = 0;
+		else if ( len > 0 && line[0] != '=' ) /* (not the checksum) */
+			gcry_md_write(md, line, len);
+		break;
+	}
+}
+
+/* Put in hash the SHA256 of the key material of data: the type and content
+ * of its armored blocks, else the data as is if it's binary.
+ * \return 0, or -1 if there is none, or if data can't be read again. */
+static int material_hash( gpgme_data_t data, unsigned char * hash ) {
+	char buf[4096], line[KEYIMP_LINE_MAX];
+	gcry_md_hd_t md;
+	ssize_t r, i;
+	size_t len = 0;
+	int state = 0, binary = -1, found = 0;
+
+	if ( gpgme_data_seek(data, 0, SEEK_SET) != 0 || gcry_md_open(&md, GCRY_MD_SHA256, 0) )
+		return -1;
+	while ( (r=gpgme_data_read(data, buf, sizeof(buf))) > 0 ) {
+		if ( binary < 0 )
+			binary = found = ( (unsigned char) buf[0] & 0x80 ); /* (an OpenPGP packet tag) */
+		if ( binary ) {
+			gcry_md_write(md, buf, r);
+			continue;
+		}
+		for ( i = 0; i < r; i++ ) {
+			if ( buf[i] != '\n' ) {
+				/* (the lines of base64 are never longer) */
+				if ( len < sizeof(line) )
+					line[len++] = buf[i];
+				continue;
+			}
+			material_line(md, &state, line, len);
+			found |= state;
+			len = 0;
+		}
+	}
+	if ( ! binary )
+		material_line(md, &state, line, len);
+	if ( gpgme_data_seek(data, 0, SEEK_SET) != 0 || r < 0 || ! found ) {
+		gcry_md_close(md);
+		return -1;
+	}
+	memcpy(hash, gcry_md_read(md, 0), 32);
+	gcry_md_close(md);
+	return 0;
+}
+
+/* hash of a fingerprint (64 bits FNV-1a) */
+static uint64_t fpr_hash( const char * fpr ) {
+	uint64_t h = 14695981039346656037ULL;
+
+	while ( *fpr )
+		h = ( h ^ (unsigned char) *fpr++ ) * 1099511628211ULL;
+	return h;
+}
+
+/* the set of the table where the key material hash may be */
+static Submitted * dedup_set( const unsigned char * hash ) {
+	return &dcache->entries[((hash[0] << 16 | hash[1] << 8 | hash[2]) % (KEYIMP_DEDUP / DEDUP_WAYS)) * DEDUP_WAYS];
+}
+
+/* Remember the submission id of the key material hash, in place of the least
+ * recently used of its set, unless it had errors or too many keys. */
+static void dedup_add( const unsigned char * hash, const char * id ) {
+	char path[KEYIMP_PATH_LEN], line[KEYIMP_LINE_MAX], * fpr;
+	Submitted sub, * set, * v;
+	FILE * fp;
+	int i;
+
+	spool_path(path, id, "done");
+	if ( ! (fp=fopen(path, "r")) )
+		return;
+	memset(&sub, 0, sizeof(sub));
+	while ( fgets(line, sizeof(line), fp) ) {
+		if ( ! strncmp(line, "error:", 6) || sub.nkeys >= DEDUP_KEYS || ! (fpr=strchr(line, ':')) ) {
+			fclose(fp);
+			return;
+		}
+		fpr++;
+		fpr[strcspn(fpr, ":")] = '\0';
+		sub.keys[sub.nkeys++] = fpr_hash(fpr);
+	}
+	fclose(fp);
+	if ( sub.nkeys == 0 )
+		return;
+	memcpy(sub.hash, hash, sizeof(sub.hash));
+	memcpy(sub.id, id, sizeof(sub.id));
+	sub.added = time((time_t *) 0);
+
+	pthread_mutex_lock(&dcache->mutex);
+	set = dedup_set(hash);
+	for ( v = set, i = 0; i < DEDUP_WAYS; i++ ) {
+		if ( set[i].stamp && ! memcmp(set[i].hash, hash, sizeof(sub.hash)) ) {
+			v = &set[i];
+			break;
+		}
+		if ( set[i].stamp < v->stamp )
+			v = &set[i];
+	}
+	sub.stamp = ++dcache->clock;
+	*v = sub;
+	pthread_mutex_unlock(&dcache->mutex);
+}
+
+/* Forget the submissions with the key fpr, which changed. */
+static void dedup_forget( const char * fpr ) {
+	uint64_t h = fpr_hash(fpr);
+	Submitted * v;
+	int i;
+
+	pthread_mutex_lock(&dcache->mutex);
+	for ( v = dcache->entries; v < dcache->entries + KEYIMP_DEDUP; v++ )
+		for ( i = 0; v->stamp && i < v->nkeys; i++ )
+			if ( v->keys[i] == h ) {
+				v->stamp = 0;
+				dcache->forgot_count++;
+			}
+	pthread_mutex_unlock(&dcache->mutex);
+}
+
+/* Forget all the submissions if the keyrings aren't as the last batch left
+ * them (the mutex being held), changed by some other process. */
+static void dedup_check_ring( void ) {
+	int64_t now[GPGIO_RING_STAT];
+	Submitted * v;
+	int n = 0;
+
+	if ( ! dcache->ringed || ( gpgio_ring_stat(now) == 0 && ! memcmp(now, dcache->ring, sizeof(now)) ) )
+		return;
+	for ( v = dcache->entries; v < dcache->entries + KEYIMP_DEDUP; v++ )
+		if ( v->stamp ) {
+			v->stamp = 0;
+			n++;
+		}
+	dcache->forgot_count += n;
+	memcpy(dcache->ring, now, sizeof(now));
+	if ( n > 0 )
+		syslog(LOG_INFO, "keyimp: the keyrings changed outside of the imports, %d submissions forgotten", n);
+}
+
+/* Mark the start (start=1) or the end of the import of a batch: the changes
+ * of the keyrings by other processes are checked before, and the keyrings as
+ * left after are the reference for the next checks. */
+static void dedup_batch( int start ) {
+	if ( ! dcache )
+		return;
+	pthread_mutex_lock(&dcache->mutex);
+	if ( start ) {
+		dedup_check_ring();
+		dcache->importer = getpid();
+	} else {
+		dcache->ringed = ( gpgio_ring_stat(dcache->ring) == 0 );
+		dcache->importer = 0;
+	}
+	pthread_mutex_unlock(&dcache->mutex);
+}
+
+/* Give to a new submission (its id put in id) the results of the same key
+ * material submitted before, the keys it imported being now unchanged.
+ * \return the number of keys, or -1 if it wasn't submitted recently. */
+static int dedup_replay( const unsigned char * hash, char * id ) {
+	char src[KEYIMP_ID_LEN+1], path[KEYIMP_PATH_LEN], tmp[KEYIMP_PATH_LEN], line[KEYIMP_LINE_MAX], * fpr, * uid;
+	Submitted * set;
+	FILE * in, * out;
+	int i, n = 0;
+
+	pthread_mutex_lock(&dcache->mutex);
+	/* (while a batch is imported, the keyrings are changing) */
+	if ( dcache->importer && kill(dcache->importer, 0) == 0 )
+		i = DEDUP_WAYS;
+	else {
+		dcache->importer = 0;
+		dedup_check_ring();
+		set = dedup_set(hash);
+		for ( i = 0; i < DEDUP_WAYS && ! ( set[i].stamp && ! memcmp(set[i].hash, hash, sizeof(set[i].hash)) ); i++ )
+			;
+	}
+	if ( i < DEDUP_WAYS && set[i].added >= time((time_t *) 0) - KEYIMP_DEDUP_WINDOW ) {
+		memcpy(src, set[i].id, sizeof(src));
+		set[i].stamp = ++dcache->clock;
+		dcache->hit_count++;
+	} else {
+		src[0] = '\0';
+		dcache->miss_count++;
+	}
+	pthread_mutex_unlock(&dcache->mutex);
+	if ( ! src[0] )
+		return -1;
+
+	/* (its results may be outdated already) */
+	spool_path(path, src, "done");
+	if ( ! (in=fopen(path, "r")) )
+		return -1;
+	new_id(id);
+	spool_path(tmp, id, "tmp");
+	if ( ! (out=fopen(tmp, "w")) ) {
+		syslog(LOG_ERR, "keyimp: fopen %s - %m", tmp);
+		fclose(in);
+		return -1;
+	}
+	while ( fgets(line, sizeof(line), in) ) {
+		line[strcspn(line, "\n")] = '\0';
+		if ( ! (fpr=strchr(line, ':')) || ! (uid=strchr(fpr + 1, ':')) )
+			continue;
+		*fpr++ = '\0';
+		*uid++ = '\0';
+		if ( strcmp(line, "reject") )
+			put_line(out, "unchanged", fpr, "");
+		else
+			put_line(out, line, fpr, uid);
+		n++;
+	}
+	fclose(in);
+	spool_path(path, id, "done");
+	if ( fclose(out) != 0 || n == 0 || rename(tmp, path) < 0 ) {
+		unlink(tmp);
+		return -1;
+	}
+	return n;
+}
+
+/* hexadecimal of the hash of the key material (of 65 bytes) */
+static void hash_hex( char * hex, const unsigned char * hash ) {
+	int i;
+
+	for ( i = 0; i < 32; i++ )
+		sprintf(hex + 2 * i, "%02x", hash[i]);
+}
+
+/* the hash of the key material in hexadecimal hex.
+ * \return 0, or -1 if it isn't. */
+static int hex_hash( unsigned char * hash, const char * hex ) {
+	unsigned int b;
+	int i;
+
+	if ( strspn(hex, "0123456789abcdef") != 64 )
+		return -1;
+	for ( i = 0; i < 32; i++ ) {
+		sscanf(hex + 2 * i, "%2x", &b);
+		hash[i] = b;
+	}
+	return 0;
+}
+#endif /* KEYIMP_DEDUP && HAVE_LIBGCRYPT */
+
+int keyimp_init( void ) {
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	pthread_mutexattr_t attr;
+
+	if ( ! gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P) ) {
+		if ( ! gcry_check_version(GCRYPT_VERSION) ) {
+			syslog(LOG_WARNING, "keyimp: libgcrypt is older than %s", GCRYPT_VERSION);
+			return -1;
+		}
+		gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+		gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+	}
+	dcache = mmap(NULL, sizeof(DedupCache), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if ( dcache == MAP_FAILED ) {
+		syslog(LOG_ERR, "keyimp: mmap - %m");
+		dcache = (DedupCache *) 0;
+		return -1;
+	}
+	memset(dcache, 0, sizeof(DedupCache));
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&dcache->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	if ( ! (dcache->ringed=( gpgio_ring_stat(dcache->ring) == 0 )) )
+		syslog(LOG_NOTICE, "keyimp: the keyrings can't be stat, their changes outside of the imports won't be seen by KEYIMP_DEDUP");
+#elif defined(KEYIMP_DEDUP)
+	syslog(LOG_NOTICE, "keyimp: built without libgcrypt, the submissions made again are imported again (no KEYIMP_DEDUP)");
+#endif /* KEYIMP_DEDUP && HAVE_LIBGCRYPT */
+	return 0;
+}
+
+int keyimp_submit( gpgme_data_t data, keyimp_policy_t policy, void * arg, char * id ) {
+	char dir[sizeof(KEYIMP_SPOOL) + 16], path[KEYIMP_PATH_LEN], tmp[KEYIMP_PATH_LEN];
+	gpgme_ctx_t sctx = (gpgme_ctx_t) 0, mctx = (gpgme_ctx_t) 0;
+	gpgme_error_t gpgerr = GPG_ERR_NO_ERROR;
+	gpgme_import_result_t gpgimport;
+	gpgme_import_status_t gpgikey;
+	gpgme_key_t gpgkey, mkey, * keys = (gpgme_key_t *) 0;
+	gpgme_data_t out = (gpgme_data_t) 0;
+	const char * uid;
+	FILE * list = (FILE *) 0;
+	int i, n = 0, nkeys = 0, fd = -1, r = -1;
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	unsigned char hash[32];
+	char hex[65];
+	int hashed = 0;
+#endif
+
+	if ( mkdir(KEYIMP_SPOOL, 0700) < 0 && errno != EEXIST ) {
+		syslog(LOG_ERR, "keyimp: mkdir %s - %m", KEYIMP_SPOOL);
+		return -1;
+	}
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	/* Submitted again ? */
+	if ( dcache && material_hash(data, hash) == 0 ) {
+		if ( (r=dedup_replay(hash, id)) > 0 )
+			return r;
+		r = -1;
+		hashed = 1;
+	}
+#endif
+	snprintf(dir, sizeof(dir), "%s/stage.XXXXXX", KEYIMP_SPOOL);
+	if ( ! mkdtemp(dir) ) {
+		syslog(LOG_ERR, "keyimp: mkdtemp %s - %m", dir);
+		return -1;
+	}
+	if ( (gpgerr=gpgme_new(&sctx)) != GPG_ERR_NO_ERROR
+			|| (gpgerr=gpgme_ctx_set_engine_info(sctx, GPGME_PROTOCOL_OpenPGP, (const char *) 0, dir)) != GPG_ERR_NO_ERROR
+			|| (gpgerr=gpgme_new(&mctx)) != GPG_ERR_NO_ERROR ) {
+		syslog(LOG_ERR, "keyimp: gpgme - %s", gpgme_strerror(gpgerr));
+		goto end;
+	}
+
+	/* (an error there comes from the data) */
+	if ( gpgme_op_import(sctx, data) != GPG_ERR_NO_ERROR || ! (gpgimport=gpgme_op_import_result(sctx))
+			|| gpgimport->considered == 0 ) {
+		r = 0;
+		goto end;
+	}
+	for (gpgikey=gpgimport->imports; gpgikey; gpgikey=gpgikey->next)
+		n++;
+	if ( ! (keys=calloc(n + 1, sizeof(gpgme_key_t))) ) {
+		syslog(LOG_ERR, "keyimp: out of memory");
+		goto end;
+	}
+
+	new_id(id);
+	spool_path(tmp, id, "tmp");
+	if ( ! (list=fopen(tmp, "w")) ) {
+		syslog(LOG_ERR, "keyimp: fopen %s - %m", tmp);
+		goto end;
+	}
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	/* (for the importer to remember it, cf. results()) */
+	if ( hashed ) {
+		hash_hex(hex, hash);
+		fprintf(list, "#%s\n", hex);
+	}
+#endif
+	for (gpgikey=gpgimport->imports; gpgikey; gpgikey=gpgikey->next) {
+		if ( gpgikey->result != GPG_ERR_NO_ERROR || ! gpgikey->fpr )
+			continue; /* erroneous key */
+		if ( gpgme_get_key(sctx, gpgikey->fpr, &gpgkey, 0) != GPG_ERR_NO_ERROR ) {
+			put_line(list, "error", gpgikey->fpr, "");
+			continue;
+		}
+		/* (the policy is about the new keys) */
+		if ( gpgme_get_key(mctx, gpgikey->fpr, &mkey, 0) == GPG_ERR_NO_ERROR ) {
+			gpgme_key_unref(mkey);
+			put_line(list, "update", gpgikey->fpr, "");
+		} else if ( (uid=policy(gpgkey, arg)) )
+			put_line(list, "accept", gpgikey->fpr, uid);
+		else {
+			put_line(list, "reject", gpgikey->fpr, gpgkey->uids ? gpgkey->uids->uid : "");
+			gpgme_key_unref(gpgkey);
+			continue;
+		}
+		keys[nkeys++] = gpgkey;
+	}
+	keys[nkeys] = (gpgme_key_t) 0;
+
+	if ( nkeys > 0 ) {
+		spool_path(path, id, "keys");
+		if ( (fd=open(path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0 ) {
+			syslog(LOG_ERR, "keyimp: open %s - %m", path);
+			goto end;
+		}
+		if ( (gpgerr=gpgme_data_new_from_fd(&out, fd)) != GPG_ERR_NO_ERROR
+				|| (gpgerr=gpgme_op_export_keys(sctx, keys, 0, out)) != GPG_ERR_NO_ERROR ) {
+			syslog(LOG_ERR, "keyimp: export - %s", gpgme_strerror(gpgerr));
+			unlink(path);
+			goto end;
+		}
+	}
+	/* Queued (or done already, if there's nothing to import) */
+	spool_path(path, id, nkeys > 0 ? "list" : "done");
+	i = fclose(list);
+	list = (FILE *) 0;
+	if ( i != 0 || rename(tmp, path) < 0 ) {
+		syslog(LOG_ERR, "keyimp: writing %s - %m", path);
+		unlink(tmp);
+		goto end;
+	}
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	if ( hashed && nkeys == 0 )
+		dedup_add(hash, id);
+#endif
+	r = gpgimport->considered;
+
+  end:
+	if ( list ) {
+		fclose(list);
+		unlink(tmp);
+	}
+	gpgme_data_release(out);
+	if ( fd >= 0 )
+		close(fd);
+	for ( i = 0; i < nkeys; i++ )
+		gpgme_key_unref(keys[i]);
+	free(keys);
+	if ( mctx )
+		gpgme_release(mctx);
+	if ( sctx )
+		gpgme_release(sctx);
+	rm_tree(dir);
+	return r;
+}
+
+/* Write the results of the submission id, as per the import gpgimport
+ * (NULL if it failed), then remove it from the queue. */
+static void results( const char * id, gpgme_import_result_t gpgimport ) {
+	char path[KEYIMP_PATH_LEN], tmp[KEYIMP_PATH_LEN], line[KEYIMP_LINE_MAX], * fpr, * uid;
+	const char * decision;
+	gpgme_import_status_t gpgikey;
+	FILE * list, * done = (FILE *) 0;
+	int status;
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	unsigned char hash[32];
+	int hashed = 0;
+#endif
+
+	spool_path(path, id, "list");
+	spool_path(tmp, id, "tmp");
+	if ( ! (list=fopen(path, "r")) || ! (done=fopen(tmp, "w")) ) {
+		syslog(LOG_ERR, "keyimp: %s dropped - %m", id);
+		if ( list )
+			fclose(list);
+		unlink(path);
+		spool_path(path, id, "keys");
+		unlink(path);
+		return;
+	}
+	while ( fgets(line, sizeof(line), list) ) {
+		line[strcspn(line, "\n")] = '\0';
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+		if ( line[0] == '#' ) {
+			hashed = ( hex_hash(hash, line + 1) == 0 );
+			continue;
+		}
+#endif
+		if ( ! (fpr=strchr(line, ':')) || ! (uid=strchr(fpr + 1, ':')) )
+			continue;
+		*fpr++ = '\0';
+		*uid++ = '\0';
+		decision = line;
+		if ( ! strcmp(decision, "accept") || ! strcmp(decision, "update") ) {
+			/* (the key may be twice in the batch) */
+			status = -1;
+			for (gpgikey=gpgimport?gpgimport->imports:(gpgme_import_status_t) 0; gpgikey; gpgikey=gpgikey->next)
+				if ( gpgikey->result == GPG_ERR_NO_ERROR && gpgikey->fpr && ! strcmp(gpgikey->fpr, fpr) )
+					status = ( status < 0 ? 0 : status ) | gpgikey->status;
+			if ( status < 0 )
+				decision = "error";
+			else if ( status == 0 )
+				decision = "unchanged";
+		}
+		put_line(done, decision, fpr, uid);
+	}
+	fclose(list);
+	spool_path(path, id, "done");
+	if ( fclose(done) != 0 || rename(tmp, path) < 0 ) {
+		syslog(LOG_ERR, "keyimp: writing %s - %m", path);
+		unlink(tmp);
+	}
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	else if ( hashed )
+		dedup_add(hash, id);
+#endif
+	spool_path(path, id, "list");
+	unlink(path);
+	spool_path(path, id, "keys");
+	unlink(path);
+}
+
+/* Import the oldest submissions queued (the lock being held), and remove
+ * what's outdated in the spool.
+ * \return the number of submissions imported, or -1 on error (logged).
+ */
+static int batch( void ) {
+	char ids[KEYIMP_BATCH][KEYIMP_ID_LEN+1], path[KEYIMP_PATH_LEN], buf[16384];
+	gpgme_ctx_t ctx;
+	gpgme_error_t gpgerr;
+	gpgme_data_t in;
+	gpgme_import_result_t gpgimport = (gpgme_import_result_t) 0;
+	gpgme_import_status_t gpgikey;
+#ifdef KEYIDX_SLOTS
+	gpgme_key_t gpgkey;
+#endif
+	struct dirent * de;
+	struct stat sb;
+	time_t now = time((time_t *) 0);
+	size_t len;
+	ssize_t r;
+	int i, n = 0, fd;
+	DIR * dp;
+
+	if ( ! (dp=opendir(KEYIMP_SPOOL)) ) {
+		syslog(LOG_ERR, "keyimp: opendir %s - %m", KEYIMP_SPOOL);
+		return -1;
+	}
+	while ( (de=readdir(dp)) ) {
+		len = strlen(de->d_name);
+		if ( len == KEYIMP_ID_LEN + 5 && ! strcmp(de->d_name + KEYIMP_ID_LEN, ".list") ) {
+			/* (keep the KEYIMP_BATCH first ids, in order) */
+			for ( i = n; i > 0 && strncmp(ids[i-1], de->d_name, KEYIMP_ID_LEN) > 0; i-- )
+				;
+			if ( i >= KEYIMP_BATCH )
+				continue;
+			if ( n < KEYIMP_BATCH )
+				n++;
+			memmove(ids[i+1], ids[i], ( n - 1 - i ) * sizeof(ids[0]));
+			memcpy(ids[i], de->d_name, KEYIMP_ID_LEN);
+			ids[i][KEYIMP_ID_LEN] = '\0';
+			continue;
+		}
+		/* Results nobody came for, and leftovers of processes which died */
+		if ( de->d_name[0] == '.' || ! strcmp(de->d_name, "lock") || len > KEYIMP_ID_LEN + 8 )
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", KEYIMP_SPOOL, de->d_name);
+		if ( lstat(path, &sb) == 0 && sb.st_mtime < now - KEYIMP_KEEP ) {
+			if ( S_ISDIR(sb.st_mode) )
+				rm_tree(path);
+			else
+				unlink(path);
+		}
+	}
+	closedir(dp);
+	if ( n == 0 )
+		return 0;
+
+	if ( (gpgerr=gpgme_new(&ctx)) != GPG_ERR_NO_ERROR ) {
+		syslog(LOG_ERR, "keyimp: gpgme_new - %s", gpgme_strerror(gpgerr));
+		return -1;
+	}
+	if ( (gpgerr=gpgme_data_new(&in)) != GPG_ERR_NO_ERROR ) {
+		syslog(LOG_ERR, "keyimp: gpgme_data_new - %s", gpgme_strerror(gpgerr));
+		gpgme_release(ctx);
+		return -1;
+	}
+	/* (the binary exports of the submissions just follow each other) */
+	for ( i = 0; i < n; i++ ) {
+		spool_path(path, ids[i], "keys");
+		if ( (fd=open(path, O_RDONLY)) < 0 )
+			continue;
+		while ( (r=read(fd, buf, sizeof(buf))) > 0 )
+			gpgme_data_write(in, buf, r);
+		close(fd);
+	}
+	gpgme_data_seek(in, 0, SEEK_SET);
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	dedup_batch(1);
+#endif
+	if ( (gpgerr=gpgme_op_import(ctx, in)) == GPG_ERR_NO_ERROR )
+		gpgimport = gpgme_op_import_result(ctx);
+	else
+		syslog(LOG_ERR, "keyimp: import - %s", gpgme_strerror(gpgerr));
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	/* (the submissions of before with the keys which changed are outdated) */
+	for (gpgikey=gpgimport?gpgimport->imports:(gpgme_import_status_t) 0; dcache && gpgikey; gpgikey=gpgikey->next)
+		if ( gpgikey->result == GPG_ERR_NO_ERROR && gpgikey->status && gpgikey->fpr )
+			dedup_forget(gpgikey->fpr);
+	dedup_batch(0);
+#endif
+	for ( i = 0; i < n; i++ )
+		results(ids[i], gpgimport);
+	if ( gpgimport )
+		syslog(LOG_DEBUG, "keyimp: %d submissions imported (%d keys, %d new)", n, gpgimport->considered, gpgimport->imported);
+
+#ifdef KEYIDX_SLOTS
+	/* let the server update its index (and its filter, with the subkeys) */
+	for (gpgikey=gpgimport?gpgimport->imports:(gpgme_import_status_t) 0; gpgikey; gpgikey=gpgikey->next) {
+		if ( gpgikey->result != GPG_ERR_NO_ERROR || ! gpgikey->status )
+			continue;
+		if ( gpgme_get_key(ctx, gpgikey->fpr, &gpgkey, 0) == GPG_ERR_NO_ERROR ) {
+			keyidx_changed(gpgikey->fpr, gpgkey);
+			gpgme_key_unref(gpgkey);
+		} else
+			keyidx_changed(gpgikey->fpr, (gpgme_key_t) 0);
+	}
+#endif
+	gpgme_data_release(in);
+	gpgme_release(ctx);
+	return n;
+}
+
+/* tell if the submission id has its results */
+static int imported( const char * id ) {
+	char path[KEYIMP_PATH_LEN];
+
+	spool_path(path, id, "done");
+	return access(path, F_OK) == 0;
+}
+
+/* wait at most secs seconds for a change in the spool (results written, or
+ * the lock closed by an importer), or 100 ms without ifd */
+static void spool_wait( int ifd, time_t secs ) {
+	struct timespec tim = { 0, 100000000 }; /* 100 ms */
+#ifdef HAVE_SYS_INOTIFY_H
+	char buf[sizeof(struct inotify_event) * 16 + 256];
+	struct pollfd pfd;
+
+	if ( ifd >= 0 ) {
+		pfd.fd = ifd;
+		pfd.events = POLLIN;
+		if ( poll(&pfd, 1, secs * 1000) > 0 )
+			/* (which one doesn't matter) */
+			(void) read(ifd, buf, sizeof(buf));
+		return;
+	}
+#endif /* HAVE_SYS_INOTIFY_H */
+	nanosleep(&tim, (struct timespec *) 0);
+}
+
+int keyimp_run( const char * id, int wait ) {
+	time_t end = time((time_t *) 0) + wait, now;
+	int fd, ifd = -1, r = 0, locked = 0;
+
+	if ( imported(id) )
+		return 1;
+#ifdef HAVE_SYS_INOTIFY_H
+	/* (watched before trying the lock, not to miss its release) */
+	if ( wait >= 0 && (ifd=inotify_init()) >= 0 ) {
+		(void) fcntl(ifd, F_SETFD, FD_CLOEXEC);
+		(void) fcntl(ifd, F_SETFL, O_NONBLOCK);
+		if ( inotify_add_watch(ifd, KEYIMP_SPOOL, IN_MOVED_TO|IN_CLOSE) < 0 ) {
+			syslog(LOG_WARNING, "keyimp: inotify_add_watch %s - %m", KEYIMP_SPOOL);
+			close(ifd);
+			ifd = -1;
+		}
+	}
+#endif /* HAVE_SYS_INOTIFY_H */
+	if ( (fd=open(KEYIMP_LOCK, O_RDWR|O_CREAT, 0600)) < 0 ) {
+		syslog(LOG_ERR, "keyimp: open %s - %m", KEYIMP_LOCK);
+		if ( ifd >= 0 )
+			close(ifd);
+		return -1;
+	}
+	/* Wait for our turn as the importer, unless an other one imports us */
+	for (;;) {
+		if ( flock(fd, wait < 0 ? LOCK_EX : LOCK_EX|LOCK_NB) == 0 ) {
+			locked = 1;
+			break;
+		}
+		if ( errno != EWOULDBLOCK && errno != EINTR ) {
+			syslog(LOG_ERR, "keyimp: flock %s - %m", KEYIMP_LOCK);
+			r = -1;
+			break;
+		}
+		if ( imported(id) ) {
+			r = 1;
+			break;
+		}
+		if ( wait >= 0 ) {
+			if ( (now=time((time_t *) 0)) >= end )
+				break;
+			spool_wait(ifd, end - now);
+		}
+	}
+	if ( ifd >= 0 )
+		close(ifd);
+	if ( ! locked ) {
+		close(fd);
+		return r;
+	}
+	while ( ! imported(id) && (r=batch()) > 0 )
+		;
+	flock(fd, LOCK_UN);
+	close(fd);
+	if ( imported(id) )
+		return 1;
+	if ( r == 0 )
+		syslog(LOG_ERR, "keyimp: %s lost", id);
+	return -1;
+}
+
+FILE * keyimp_result( const char * id ) {
+	char path[KEYIMP_PATH_LEN];
+	FILE * fp;
+	int queued;
+
+	/* (in this order, as the list is removed once the results are there) */
+	spool_path(path, id, "list");
+	queued = ( access(path, F_OK) == 0 );
+	spool_path(path, id, "done");
+	if ( (fp=fopen(path, "r")) )
+		return fp;
+	errno = queued ? EAGAIN : ENOENT;
+	return (FILE *) 0;
+}
+
+void keyimp_logstats( long secs ) {
+#if defined(KEYIMP_DEDUP) && defined(HAVE_LIBGCRYPT)
+	if ( ! dcache )
+		return;
+	pthread_mutex_lock(&dcache->mutex);
+	syslog(
+		LOG_INFO, "  keyimp - %ld submissions answered again without gpg, %ld not, %ld forgotten as their keys changed",
+		dcache->hit_count, dcache->miss_count, dcache->forgot_count );
+	dcache->hit_count = dcache->miss_count = dcache->forgot_count = 0;
+	pthread_mutex_unlock(&dcache->mutex);
+#endif /* KEYIMP_DEDUP && HAVE_LIBGCRYPT */
+}
+
+#endif /* KEYIMP_SPOOL */
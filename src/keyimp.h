@@ -0,0 +1,63 @@
+/* keyimp.h - header file for the import pipeline of pks/add
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _KEYIMP_H_
+#define _KEYIMP_H_
+
+#include <stdio.h>
+#include <gpgme.h>
+
+#include "config.h"
+
+#ifdef KEYIMP_SPOOL
+
+/* length of the id of a submission */
+#define KEYIMP_ID_LEN 22
+
+/* The policy about a new key: return the user ID to report if it's
+ * accepted, or NULL to reject it. */
+typedef const char * (*keyimp_policy_t)( gpgme_key_t key, void * arg );
+
+/*! keyimp_init prepare the memory of the submissions remembered (cf.
+ * KEYIMP_DEDUP), shared by the processes forked after.
+ * \return 0, or -1 on error (logged).
+ */
+int keyimp_init( void );
+
+/*! keyimp_submit validate the keys of data: they are imported in a private
+ * keyring, then policy is asked about each of them which is not in the
+ * keyring yet, and the keys it accepts (and the updates) are queued in
+ * KEYIMP_SPOOL for the importer (cf. keyimp_run()). So the rejected keys
+ * never reach the keyring. If the same key material was submitted recently,
+ * and its keys didn't change since, the results of then are given again
+ * (the keys imported being now unchanged) without running gpg.
+ * \return the number of keys found in data, the id of the submission being
+ * put in id (of KEYIMP_ID_LEN+1 bytes), or -1 on error (logged).
+ */
+int keyimp_submit( gpgme_data_t data, keyimp_policy_t policy, void * arg, char * id );
+
+/*! keyimp_run wait until the submission id is imported, at most wait seconds
+ * (without limit if negative) for an other process importing. Processes take
+ * turns as the importer: it imports all the queued submissions, by batches
+ * of at most KEYIMP_BATCH, each in a single gpg operation.
+ * \return 1 once imported, 0 if wait expired, or -1 on error (logged).
+ */
+int keyimp_run( const char * id, int wait );
+
+/*! keyimp_result open the results of the submission id: one line per key,
+ * "accept:", "update:", "unchanged:", "reject:" or "error:" followed by its
+ * fingerprint, ':' and the user ID reported for it.
+ * \return the opened file, or NULL if the submission is unknown (errno
+ * ENOENT), or not imported yet (errno EAGAIN).
+ */
+FILE * keyimp_result( const char * id );
+
+/* Generate debugging statistics syslog message. */
+void keyimp_logstats( long secs );
+
+#endif /* KEYIMP_SPOOL */
+
+#endif /* _KEYIMP_H_ */
@@ -26,6 +26,9 @@
 ** SUCH DAMAGE.
 */
 
+#if defined(HAVE_SPLICE) && ! defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for splice() */
+#endif
 
 #include "config.h"
 #include "version.h"
@@ -57,6 +60,9 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <gpgme.h>
 
 #ifdef HAVE_DIRENT_H
@@ -98,9 +104,22 @@ extern char* crypt( const char* key, const char* setting );
 #include "match.h"
 #include "tdate_parse.h"
 #include "hkp.h"
+#include "recon.h"
+#include "hpool.h"
+#include "fcgi.h"
+#ifdef GPGIO_MAX_OPS
+#include "gpgio.h"
+#endif /* GPGIO_MAX_OPS */
 #ifdef OPENUDC
 #include "udc.h"
 #endif /* OPENUDC */
+#include "natsig.h"
+#ifdef SIGSERV_WORKERS
+#include "sigserv.h"
+#endif /* SIGSERV_WORKERS */
+#ifdef SIG_CACHEDIR
+#include "sigc.h"
+#endif /* SIG_CACHEDIR */
 
 #ifndef SHUT_WR
 #define SHUT_WR 1
@@ -135,6 +154,7 @@ struct fp2fd_gpg_data_handle {
 static void free_httpd_server( httpd_server* hs );
 static int init_listen_sockets(const char * hostname, unsigned short port, int * listen_fds,  size_t size);
 static void add_response( httpd_conn* hc, char* str );
+static void add_response_len( httpd_conn* hc, const char* str, size_t len );
 static void send_response_tail( httpd_conn* hc );
 static void defang(const char* str, char* dfstr, int dfsize );
 #ifdef AUTH_FILE
@@ -170,8 +190,35 @@ static char** make_argp( httpd_conn* hc );
 static void cgi_interpose_input(interpose_args_t * args);
 static ssize_t fp2fd_gpg_data_rd_cb(struct fp2fd_gpg_data_handle * handle, void *buffer, size_t size);
 static void gpg_data_release_cb(void *handle);
+static int cgi_interposed( const httpd_conn* hc );
+static pid_t cgi_spawn( httpd_conn* hc, char** argp, char** envp, int in_fd, int out_fd, int newpgrp );
+static pid_t cgi_spawn_conn( httpd_conn* hc );
+static int cgi_relayable( const httpd_conn* hc );
+static pid_t cgi_spawn_relay( httpd_conn* hc );
+static int fcgi_launch( httpd_conn* hc );
+static int admit_class_of( const char* type );
+static int admit_wait( httpd_conn* hc, int class );
+#ifdef ADAPT_LIMITS
+static void adapt_init( int cgi_limit );
+static void adapt_spawned( pid_t pid, int class );
+static void adapt_reaped( httpd_server* hs, pid_t pid, struct timeval* nowP );
+static void adapt_window( int class, struct timeval* nowP );
+static void adapt_cut( int class, double factor, struct timeval* nowP );
+static void adapt_child( httpd_conn* hc );
+static void adapt_exit( void );
+#endif /* ADAPT_LIMITS */
+static ssize_t write_fully( int fd, const void* buf, size_t nbytes );
+static void admit_leave( httpd_conn* hc );
+static int relay_headers( httpd_conn* hc, size_t hlen );
+static int relay_blocked( httpd_conn* hc );
 static void cgi_child( httpd_conn* hc );
 static void make_log_entry(const httpd_conn* hc, time_t now, int status);
+static int send_mime_signed( httpd_conn* hc, int status, char* title, char* type, char* encodings, char* range, char* extraheads, off_t partsize, const char* sig, size_t siglen, time_t mod );
+#ifdef SIG_CACHEDIR
+static int send_mime_cachedsig( httpd_conn* hc );
+#endif /* SIG_CACHEDIR */
+static int send_file( httpd_conn* hc );
+static int range_honored( const httpd_conn* hc );
 static inline int sockaddr_check( const struct sockaddr * sa );
 static inline size_t sockaddr_len( const struct sockaddr * sa );
 
@@ -186,6 +233,8 @@ free_httpd_server( httpd_server* hs )
 		free( (void*) hs->cgi_pattern );
 	if ( hs->sig_pattern != (char*) 0 )
 		free( (void*) hs->sig_pattern );
+	if ( hs->fastcgi_saddr != (struct sockaddr *) 0 )
+		free( (void*) hs->fastcgi_saddr );
 	free( (void*) hs );
 	}
 
@@ -244,7 +293,12 @@ httpd_server* httpd_initialize( char* hostname, unsigned short port,
 
 	if ( fastcgi_pass == (char*) 0 )
 		hs->fastcgi_saddr = (struct sockaddr *) 0;
-	/* else ... */
+	else
+		{
+		hs->fastcgi_saddr = fcgi_parse_addr( fastcgi_pass );
+		if ( hs->fastcgi_saddr == (struct sockaddr *) 0 )
+			return (httpd_server*) 0;
+		}
 
 	if ( sig_pattern == (char*) 0 )
 		hs->sig_pattern = (char*) 0;
@@ -265,6 +319,9 @@ httpd_server* httpd_initialize( char* hostname, unsigned short port,
 		}
 	hs->cgi_limit = cgi_limit;
 	hs->cgi_count = 0;
+#ifdef ADAPT_LIMITS
+	adapt_init( cgi_limit );
+#endif /* ADAPT_LIMITS */
 	hs->cwd = strdup( cwd );
 	if ( hs->cwd == (char*) 0 )
 		{
@@ -425,6 +482,30 @@ void httpd_unlisten( httpd_server* hs ) {
 	}
 }
 
+/* Call in a long-lived process forked by the server, to close what it
+** inherited: the listening sockets, the connections of the clients (it
+** would else keep them open after the server closed them), and the pipes
+** of the gpg and FastCGI operations of the server.
+*/
+void httpd_close_inherited( httpd_server* hs ) {
+	struct sockaddr_storage ss;
+	socklen_t sz;
+	long fd, maxfd;
+
+	httpd_unlisten( hs );
+	maxfd = sysconf( _SC_OPEN_MAX );
+	for ( fd = STDERR_FILENO + 1; fd < maxfd; fd++ ) {
+		sz = sizeof(ss);
+		if ( getsockname( fd, (struct sockaddr*) &ss, &sz ) == 0
+				&& ( ss.ss_family == AF_INET || ss.ss_family == AF_INET6 ) )
+			(void) close( fd );
+	}
+#ifdef GPGIO_MAX_OPS
+	gpgio_close_fds();
+#endif /* GPGIO_MAX_OPS */
+	fcgi_close_fds();
+}
+
 
 /* Conditional macro to allow two alternate forms for use in the built-in
 ** error pages.  If EXPLICIT_ERROR_PAGES is defined, the second and more
@@ -469,6 +550,9 @@ char* httpd_err408title = "Request Timeout";
 char* httpd_err408form =
 	"No request appeared within a reasonable time period.\n";
 
+char * err406title = "Not Acceptable";
+char * err406form =
+	"The response of the URL '%.80s' can't be signed, ask it without multipart/msigned.\n";
 char * err411title = "Length Required";
 char * err413title = "Request Entity Too Large";
 char * err415title = "Unsupported Media Type";
@@ -490,9 +574,13 @@ char* httpd_err503form =
 static void
 add_response( httpd_conn* hc, char* str )
 	{
-	size_t len;
+	add_response_len( hc, str, strlen( str ) );
+	}
 
-	len = strlen( str );
+/* Same, with len bytes which may not be a string. */
+static void
+add_response_len( httpd_conn* hc, const char* str, size_t len )
+	{
 	httpd_realloc_str( &hc->response, &hc->maxresponse, hc->responselen + len );
 	(void) memmove( &(hc->response[hc->responselen]), str, len );
 	hc->responselen += len;
@@ -505,6 +593,10 @@ void httpd_write_response( httpd_conn* hc ) {
 		(void) httpd_write_fully( hc->conn_fd, hc->response, hc->responselen );
 		hc->responselen = 0;
 	}
+	if ( hc->trailerlen > 0 ) {
+		(void) httpd_write_fully( hc->conn_fd, hc->trailer, hc->trailerlen );
+		hc->trailerlen = 0;
+	}
 }
 
 /* Set non-blocking (previously a.k.a. O_NDELAY) mode on a socket, pipe...
@@ -1372,12 +1464,9 @@ expand_symlinks( char* path, char** restP, int no_symlink_check )
 	}
 #endif
 
-int
-httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
+static void
+conn_alloc( httpd_conn* hc )
 	{
-	struct sockaddr sa;
-	socklen_t sz;
-
 	if ( ! hc->initialized )
 		{
 		hc->read_size = 0;
@@ -1386,7 +1475,8 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 			hc->maxorigfilename = hc->maxencodings =
 			hc->maxtmpbuff = hc->maxquery = hc->maxaccept =
 			hc->maxaccepte = hc->maxreqhost = hc->maxhostdir =
-			hc->maxremoteuser = hc->maxresponse = 0;
+			hc->maxremoteuser = hc->maxresponse = hc->maxtrailer =
+			hc->maxbody = hc->maxrawreq = 0;
 		httpd_realloc_str( &hc->decodedurl, &hc->maxdecodedurl, 1 );
 		httpd_realloc_str( &hc->origfilename, &hc->maxorigfilename, 1 );
 		httpd_realloc_str( &hc->encodings, &hc->maxencodings, 0 );
@@ -1397,29 +1487,18 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 		httpd_realloc_str( &hc->hostdir, &hc->maxhostdir, 0 );
 		httpd_realloc_str( &hc->remoteuser, &hc->maxremoteuser, 0 );
 		httpd_realloc_str( &hc->response, &hc->maxresponse, 0 );
+		httpd_realloc_str( &hc->trailer, &hc->maxtrailer, 0 );
+		httpd_realloc_str( &hc->body, &hc->maxbody, 0 );
+		httpd_realloc_str( &hc->rawreq, &hc->maxrawreq, 0 );
 		hc->initialized = 1;
 		}
+	}
 
-	/* Accept the new connection. */
-	sz = sizeof(sa);
-	hc->conn_fd = accept( listen_fd, &sa, &sz );
-	if ( hc->conn_fd < 0 )
-		{
-		if ( errno == EWOULDBLOCK )
-			return GC_NO_MORE;
-		syslog( LOG_ERR, "accept - %m" );
-		return GC_FAIL;
-		}
-	if ( ! sockaddr_check( &sa ) )
-		{
-		syslog( LOG_ERR, "unknown sockaddr family" );
-		close( hc->conn_fd );
-		hc->conn_fd = -1;
-		return GC_FAIL;
-		}
-	(void) fcntl( hc->conn_fd, F_SETFD, 1 );
-	hc->hs = hs;
-	hc->client_addr=get_ip_str(&sa);
+
+/* Reset the fields of hc for a new request. */
+static void
+conn_reset( httpd_conn* hc )
+	{
 	hc->read_idx = 0;
 	hc->checked_idx = 0;
 	hc->checked_state = CHST_FIRSTWORD;
@@ -1439,6 +1518,7 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 	hc->accepte[0] = '\0';
 	hc->acceptl = "";
 	hc->cookie = "";
+	hc->ifnonematch = "";
 	hc->contenttype = "";
 	hc->reqhost[0] = '\0';
 	hc->hdrhost = "";
@@ -1448,6 +1528,13 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 	hc->remoteuser[0] = '\0';
 	hc->response[0] = '\0';
 	hc->responselen = 0;
+	hc->trailerlen = 0;
+	hc->rawreqlen = 0;
+	hc->bodylen = 0;
+	hc->sigc_fd = -1;
+	hc->gpgjob = (void*) 0;
+	hc->cgi_fd = -1;
+	hc->fcgijob = (void*) 0;
 	hc->bytesranges = "";
 	hc->if_modified_since = (time_t) -1;
 	hc->range_if = (time_t) -1;
@@ -1459,10 +1546,77 @@ httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
 	hc->bfield=0;
 	hc->file_address = (char*) 0;
 	hc->boundary[0] = '\0';
+	}
+
+
+int
+httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc )
+	{
+	struct sockaddr sa;
+	socklen_t sz;
+
+	conn_alloc( hc );
+
+	/* Accept the new connection. */
+	sz = sizeof(sa);
+	hc->conn_fd = accept( listen_fd, &sa, &sz );
+	if ( hc->conn_fd < 0 )
+		{
+		if ( errno == EWOULDBLOCK )
+			return GC_NO_MORE;
+		syslog( LOG_ERR, "accept - %m" );
+		return GC_FAIL;
+		}
+	if ( ! sockaddr_check( &sa ) )
+		{
+		syslog( LOG_ERR, "unknown sockaddr family" );
+		close( hc->conn_fd );
+		hc->conn_fd = -1;
+		return GC_FAIL;
+		}
+	(void) fcntl( hc->conn_fd, F_SETFD, 1 );
+	hc->hs = hs;
+	hc->client_addr=get_ip_str(&sa);
+	conn_reset( hc );
 	return GC_OK;
 	}
 
 
+int
+httpd_adopt_conn( httpd_server* hs, int conn_fd, char* req, size_t reqlen, httpd_conn* hc )
+	{
+	struct sockaddr_storage ss;
+	socklen_t sz;
+
+	if ( hc->initialized )
+		free( (void*) hc->client_addr );
+	conn_alloc( hc );
+	conn_reset( hc );
+	(void) fcntl( conn_fd, F_SETFD, 1 );
+	hc->hs = hs;
+	hc->conn_fd = conn_fd;
+	sz = sizeof(ss);
+	if ( getpeername( conn_fd, (struct sockaddr*) &ss, &sz ) < 0
+			|| ! sockaddr_check( (struct sockaddr*) &ss ) )
+		{
+		syslog( LOG_ERR, "getpeername - %m" );
+		hc->client_addr = strdup( "?" );
+		return -1;
+		}
+	hc->client_addr = get_ip_str( (struct sockaddr*) &ss );
+
+	httpd_realloc_str( &hc->read_buf, &hc->read_size, reqlen );
+	(void) memcpy( hc->read_buf, req, reqlen );
+	hc->read_idx = reqlen;
+	if ( httpd_got_request( hc ) != GR_GOT_REQUEST )
+		{
+		httpd_send_err( hc, 400, httpd_err400title, "", httpd_err400form, "" );
+		return -1;
+		}
+	return httpd_parse_request( hc );
+	}
+
+
 /* Checks hc->read_buf to see whether a complete request has been read so far;
 ** either the first line has two words (an HTTP/0.9 request), or the first
 ** line has three words and there's a blank line present.
@@ -1642,6 +1796,12 @@ httpd_parse_request( httpd_conn* hc )
 	char* eol;
 	char* cp;
 
+#ifdef HPOOL_WORKERS
+	/* (parsing is destructive, keep a copy to pass the request to a handler) */
+	httpd_realloc_str( &hc->rawreq, &hc->maxrawreq, hc->read_idx );
+	(void) memcpy( hc->rawreq, hc->read_buf, hc->read_idx );
+	hc->rawreqlen = hc->read_idx;
+#endif /* HPOOL_WORKERS */
 	hc->checked_idx = 0;		/* reset */
 	method_str = bufgets( hc );
 	url = strpbrk( method_str, " \t\012\015" );
@@ -1840,6 +2000,12 @@ httpd_parse_request( httpd_conn* hc )
 				if ( hc->if_modified_since == (time_t) -1 )
 					syslog( LOG_DEBUG, "unparsable time: %.80s", cp );
 				}
+			else if ( strncasecmp( buf, "If-None-Match:", 14 ) == 0 )
+				{
+				cp = &buf[14];
+				cp += strspn( cp, " \t" );
+				hc->ifnonematch = cp;
+				}
 			else if ( strncasecmp( buf, "Cookie:", 7 ) == 0 )
 				{
 				cp = &buf[7];
@@ -2153,11 +2319,25 @@ void
 httpd_close_conn( httpd_conn* hc, struct timeval* nowP )
 	{
 
+#ifdef GPGIO_MAX_OPS
+	if ( hc->bfield & HC_GPG_WAIT )
+		hkp_lookup_abort( hc );
+#endif /* GPGIO_MAX_OPS */
+	if ( hc->fcgijob != (void*) 0 )
+		fcgi_abort( hc );
+	if ( hc->bfield & HC_ADMIT_WAIT )
+		admit_leave( hc );
 	if ( hc->file_address != (char*) 0 )
 		{
-		mmc_unmap( hc->file_address, &(hc->sb), nowP );
+		if ( ! ( hc->bfield & HC_BODY ) )
+			mmc_unmap( hc->file_address, &(hc->sb), nowP );
 		hc->file_address = (char*) 0;
 		}
+	if ( hc->cgi_fd >= 0 )
+		{
+		(void) close( hc->cgi_fd );
+		hc->cgi_fd = -1;
+		}
 	if ( hc->conn_fd >= 0 )
 		{
 		(void) close( hc->conn_fd );
@@ -2184,6 +2364,9 @@ httpd_destroy_conn( httpd_conn* hc )
 		free( (void*) hc->hostdir );
 		free( (void*) hc->remoteuser );
 		free( (void*) hc->response );
+		free( (void*) hc->trailer );
+		free( (void*) hc->body );
+		free( (void*) hc->rawreq );
 		hc->initialized = 0;
 		}
 	}
@@ -2363,10 +2546,14 @@ static void drop_child(const char * type,pid_t pid,httpd_conn* hc) {
 	httpd_conn** tmphcs;
 
 	++hc->hs->cgi_count;
+#ifdef ADAPT_LIMITS
+	adapt_spawned( pid, admit_class_of( type ) );
+#endif /* ADAPT_LIMITS */
 	syslog( LOG_DEBUG, "%s spawned %s process %d for '%.200s'", hc->client_addr, type, pid, hc->origfilename);
 
-	/* set the process group id to a new one for hard killing of all the process group (cgi_kill2,...)) */
-	if (setpgid(pid,0)) {
+	/* set the process group id to a new one for hard killing of all the process group (cgi_kill2,...))
+	 * (unless it already did, as spawned CGI do) */
+	if (getpgid(pid) != pid && setpgid(pid,0)) {
 		syslog( LOG_ERR, "hard-kill %d because %s fail - %m", pid,"setpgid");
 		kill( pid, SIGKILL );
 	}
@@ -2423,6 +2610,15 @@ static void child_r_start(httpd_conn* hc) {
 	int s=1;
 
 	httpd_unlisten( hc->hs );
+#ifdef ADAPT_LIMITS
+	adapt_child( hc );
+#endif /* ADAPT_LIMITS */
+#ifdef GPGIO_MAX_OPS
+	/* (not to keep open the pipes of the gpg run by the server) */
+	gpgio_close_fds();
+#endif /* GPGIO_MAX_OPS */
+	/* (nor the pipes of the FastCGI requests) */
+	fcgi_close_fds();
 
 	/* set signals to default behavior. */
 #ifdef HAVE_SIGSET
@@ -2457,24 +2653,323 @@ static void child_r_start(httpd_conn* hc) {
 		syslog( LOG_WARNING, "setsockopt TCP_NODELAY - %m");
 }
 
+static const char* admit_names[ADMIT_CLASSES] = { "hkp", "udc", "signing", "CGI" };
+static int admit_depth[ADMIT_CLASSES];
+static long admit_count[ADMIT_CLASSES], admit_timeouts[ADMIT_CLASSES], admit_refused[ADMIT_CLASSES];
+static long admit_msecs[ADMIT_CLASSES], admit_maxmsecs[ADMIT_CLASSES];
+static long admit_seq = 0;
+
+#ifdef ADAPT_LIMITS
+/* Processes being waited for, to measure how long they take */
+#define ADAPT_TRACKED 1024
+static struct {
+	pid_t pid; /* 0 if the slot is free */
+	int class;
+	struct timeval started;
+} adapt_kids[ADAPT_TRACKED];
+static int adapt_running[ADMIT_CLASSES];
+static double adapt_limit[ADMIT_CLASSES];
+static time_t adapt_cut_at[ADMIT_CLASSES];
+static long adapt_raised[ADMIT_CLASSES], adapt_cuts[ADMIT_CLASSES];
+/* Run times of the last processes of each class, and their percentile once
+ * ADAPT_SAMPLES of them were reaped, compared to the baseline which follows it
+ * over ADAPT_WINDOWS windows */
+#define ADAPT_WINDOWS 10
+static double adapt_samples[ADMIT_CLASSES][ADAPT_SAMPLES];
+static int adapt_nsamples[ADMIT_CLASSES], adapt_degraded[ADMIT_CLASSES];
+static double adapt_recent[ADMIT_CLASSES], adapt_baseline[ADMIT_CLASSES];
+/* How long each request process spent writing to its client, which is not
+ * part of its run time: left by the process (at the slot of its pid modulo
+ * ADAPT_TRACKED) when it exits */
+typedef struct {
+	pid_t pid;
+	long msecs;
+} adapt_sent_t;
+static adapt_sent_t* adapt_sent = (adapt_sent_t*) 0;
+/* (in a request process: its client, and how long it has written to it) */
+static int adapt_client_fd = -1;
+static double adapt_sent_msecs;
+
+static void adapt_init( int cgi_limit ) {
+	int class;
+
+	for ( class = 0; class < ADMIT_CLASSES; class++ )
+		adapt_limit[class] = ( cgi_limit > 0 && cgi_limit < ADAPT_START ) ? cgi_limit : ADAPT_START;
+	if ( ! adapt_sent ) {
+		adapt_sent = mmap( NULL, ADAPT_TRACKED * sizeof(adapt_sent_t), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0 );
+		if ( adapt_sent == MAP_FAILED ) {
+			/* (the run times will include the transfers) */
+			syslog( LOG_WARNING, "adapt: mmap - %m" );
+			adapt_sent = (adapt_sent_t*) 0;
+		}
+	}
+}
+
+/*! adapt_child start measuring how long the request process hc is in
+ * writes to its client (cf. httpd_write_fully()). */
+static void adapt_child( httpd_conn* hc ) {
+	if ( ! adapt_sent )
+		return;
+	adapt_client_fd = hc->conn_fd;
+	adapt_sent_msecs = 0;
+	(void) atexit( adapt_exit );
+}
+
+/*! adapt_exit leave to the server how long the request process wrote. */
+static void adapt_exit( void ) {
+	adapt_sent_t* s = &adapt_sent[getpid() % ADAPT_TRACKED];
+
+	s->msecs = (long) adapt_sent_msecs;
+	s->pid = getpid();
+}
+
+/*! adapt_spawned note that pid, of class, has been forked. */
+static void adapt_spawned( pid_t pid, int class ) {
+	int i;
+
+	for ( i = 0; i < ADAPT_TRACKED; i++ )
+		if ( adapt_kids[i].pid == 0 ) {
+			adapt_kids[i].pid = pid;
+			adapt_kids[i].class = class;
+			(void) gettimeofday( &adapt_kids[i].started, (struct timezone*) 0 );
+			adapt_running[class]++;
+			return;
+		}
+	/* (too many: that one won't be counted) */
+}
+
+/*! adapt_cut multiply the limit of class by factor, once a second at most
+ * (the processes which were running meanwhile were all slowed down alike). */
+static void adapt_cut( int class, double factor, struct timeval* nowP ) {
+	if ( nowP->tv_sec == adapt_cut_at[class] )
+		return;
+	adapt_cut_at[class] = nowP->tv_sec;
+	adapt_limit[class] *= factor;
+	if ( adapt_limit[class] < ADAPT_MIN )
+		adapt_limit[class] = ADAPT_MIN;
+	adapt_cuts[class]++;
+}
+
+/*! adapt_reaped adapt the limit of the class of pid, from how long it ran
+ * (without the time it spent writing to its client). */
+static void adapt_reaped( httpd_server* hs, pid_t pid, struct timeval* nowP ) {
+	double msecs, max = ( hs->cgi_limit > 0 ? hs->cgi_limit : ADAPT_MAX );
+	adapt_sent_t* s;
+	int i, class, old;
+
+	for ( i = 0; i < ADAPT_TRACKED && adapt_kids[i].pid != pid; i++ )
+		;
+	if ( i >= ADAPT_TRACKED )
+		return;
+	adapt_kids[i].pid = 0;
+	class = adapt_kids[i].class;
+	msecs = ( nowP->tv_sec - adapt_kids[i].started.tv_sec ) * 1000.0 + ( nowP->tv_usec - adapt_kids[i].started.tv_usec ) / 1000.0;
+	if ( adapt_sent ) {
+		s = &adapt_sent[pid % ADAPT_TRACKED];
+		if ( s->pid == pid ) {
+			msecs -= s->msecs;
+			s->pid = 0;
+		}
+		if ( msecs < 0 )
+			msecs = 0;
+	}
+
+	if ( ! adapt_degraded[class] && 2 * adapt_running[class] >= (int) adapt_limit[class] ) {
+		/* In time, while the limit was used: +1 once as many ended */
+		old = (int) adapt_limit[class];
+		adapt_limit[class] += 1.0 / adapt_limit[class];
+		if ( adapt_limit[class] > max )
+			adapt_limit[class] = max;
+		if ( (int) adapt_limit[class] > old )
+			adapt_raised[class]++;
+	}
+	adapt_running[class]--;
+
+	adapt_samples[class][adapt_nsamples[class]++] = msecs;
+	if ( adapt_nsamples[class] >= ADAPT_SAMPLES ) {
+		adapt_window( class, nowP );
+		adapt_nsamples[class] = 0;
+	}
+}
+
+static int adapt_compare( const void* a, const void* b ) {
+	double d = *(const double*) a - *(const double*) b;
+
+	return ( d < 0 ? -1 : d > 0 );
+}
+
+/*! adapt_window compare the ADAPT_PERCENTILE percentile of the run times of
+ * the last window of class to its baseline: once it's more than
+ * ADAPT_TOLERANCE times longer, the limit is cut in the same ratio (by half
+ * at most), and isn't raised until a window is in time again. */
+static void adapt_window( int class, struct timeval* nowP ) {
+	double sorted[ADAPT_SAMPLES], recent, gradient;
+
+	(void) memcpy( sorted, adapt_samples[class], sizeof(sorted) );
+	qsort( sorted, ADAPT_SAMPLES, sizeof(double), adapt_compare );
+	recent = sorted[( ADAPT_SAMPLES - 1 ) * ADAPT_PERCENTILE / 100];
+	if ( adapt_baseline[class] <= 0 )
+		adapt_baseline[class] = recent;
+
+	gradient = ( adapt_baseline[class] * ADAPT_TOLERANCE + 1.0 ) / ( recent + 1.0 );
+	adapt_degraded[class] = ( gradient < 1.0 );
+	if ( gradient < 1.0 )
+		adapt_cut( class, gradient < 0.5 ? 0.5 : gradient, nowP );
+
+	/* (so that it follows the requests if they change) */
+	adapt_baseline[class] += ( recent - adapt_baseline[class] ) / ADAPT_WINDOWS;
+	adapt_recent[class] = recent;
+}
+
+void httpd_adapt( httpd_server* hs, struct timeval* nowP ) {
+#ifdef HAVE_GETLOADAVG
+	double load;
+	long ncpu;
+#endif /* HAVE_GETLOADAVG */
+	int i, class;
+
+	/* Forget the processes which were reaped by someone else */
+	for ( i = 0; i < ADAPT_TRACKED; i++ )
+		if ( adapt_kids[i].pid != 0 && kill( adapt_kids[i].pid, 0 ) < 0 && errno == ESRCH ) {
+			adapt_running[adapt_kids[i].class]--;
+			adapt_kids[i].pid = 0;
+		}
+#ifdef HAVE_GETLOADAVG
+	ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+	if ( getloadavg( &load, 1 ) == 1 && load > ADAPT_LOAD * ( ncpu > 0 ? ncpu : 1 ) )
+		for ( class = 0; class < ADMIT_CLASSES; class++ )
+			if ( adapt_running[class] > 0 )
+				adapt_cut( class, ADAPT_BACKOFF, nowP );
+#endif /* HAVE_GETLOADAVG */
+}
+#endif /* ADAPT_LIMITS */
+
+void httpd_reaped( httpd_server* hs, pid_t pid, struct timeval* nowP ) {
+	/* Only the request processes (cf. drop_child()) are accounted, not the
+	 * other children of the server (eg. those of gpgme) */
+	if ( pid < hctab.pidmin || pid >= hctab.pidmax || ! hctab.hcs[pid-hctab.pidmin] )
+		return;
+	/* (its hc may have been freed since) */
+	hctab.hcs[pid-hctab.pidmin] = (httpd_conn*) 0;
+	if ( hs->cgi_count > 0 )
+		--hs->cgi_count;
+#ifdef ADAPT_LIMITS
+	adapt_reaped( hs, pid, nowP );
+#endif /* ADAPT_LIMITS */
+}
+
+/*! admit_class_of tell the admission class of a process by its type (as
+ * given to drop_child()). */
+static int admit_class_of( const char* type ) {
+	if ( ! strcmp( type, "hkp" ) )
+		return ADMIT_HKP;
+	if ( ! strcmp( type, "udc" ) )
+		return ADMIT_UDC;
+	if ( ! strcmp( type, "parse_resp" ) )
+		return ADMIT_SIGN;
+	return ADMIT_CGI;
+}
+
+int httpd_admissible( const httpd_server* hs, int class ) {
+	if ( hs->cgi_limit > 0 && hs->cgi_count >= hs->cgi_limit )
+		return 0;
+#ifdef ADAPT_LIMITS
+	return ( adapt_running[class] < (int) adapt_limit[class] );
+#else /* ADAPT_LIMITS */
+	return 1;
+#endif /* ADAPT_LIMITS */
+}
+
+int httpd_admit_before( const httpd_conn* a, const httpd_conn* b ) {
+#ifdef ADMIT_PRIORITY
+	if ( a->admit_class != b->admit_class )
+		return ( a->admit_class < b->admit_class );
+#endif /* ADMIT_PRIORITY */
+	return ( a->admit_seq < b->admit_seq );
+}
+
+/*! admit_wait put hc in the admission queue of class, unless it's full: the
+ * server will resume it (cf. httpd_resume_request()) once a process exited.
+ * \return 0 if hc is waiting (HC_ADMIT_WAIT), or -1.
+ */
+static int admit_wait( httpd_conn* hc, int class ) {
+#ifdef ADMIT_QUEUE_DEPTH
+	if ( admit_depth[class] >= ADMIT_QUEUE_DEPTH ) {
+		admit_refused[class]++;
+		return -1;
+	}
+	admit_depth[class]++;
+	hc->admit_class = class;
+	hc->admit_seq = ++admit_seq;
+	(void) gettimeofday( &hc->admit_since, (struct timezone*) 0 );
+	hc->bfield |= HC_ADMIT_WAIT;
+	return 0;
+#else /* ADMIT_QUEUE_DEPTH */
+	admit_refused[class]++;
+	return -1;
+#endif /* ADMIT_QUEUE_DEPTH */
+}
+
+/*! admit_leave take hc out of its admission queue. */
+static void admit_leave( httpd_conn* hc ) {
+	hc->bfield &= ~HC_ADMIT_WAIT;
+	admit_depth[hc->admit_class]--;
+}
+
+int httpd_admit_expire( httpd_conn* hc, struct timeval* nowP ) {
+	admit_leave( hc );
+	admit_timeouts[hc->admit_class]++;
+	if ( hc->admit_class == ADMIT_SIGN ) {
+		/* (as if the queue was full) */
+		hc->bfield &= ~HC_DETACH_SIGN;
+		return send_file( hc );
+	}
+	httpd_send_err( hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl );
+	return -1;
+}
+
 /*
  * \param methods: accepted HTTP methods (bitwise-or of METHOD_GET or METHOD_POST).
- * \return a negative number to finish the connection, or 0 if it have fork.
+ * \return a negative number to finish the connection, or 0 if it have fork
+ * (or waits to be admitted).
  */
 static int launch_process(void (*funct) (httpd_conn* ), httpd_conn* hc, int methods, char * fname) {
 	int r;
+	int class = admit_class_of( fname );
 
 	if ( ! (hc->method & methods) ) {
 		httpd_send_err( hc, 501, err501title, "", err501form, httpd_method_str( hc->method ) );
 		return(-1);
 	}
 
-	/* To much forks already running */
-	if ( hc->hs->cgi_limit > 0 && hc->hs->cgi_count >= hc->hs->cgi_limit ) {
+#ifdef HPOOL_WORKERS
+	/* An idle handler of the pool will take it (but CGI have to exec) */
+	if ( funct != cgi_child && hpool_submit( funct, hc ) == 0 ) {
+		syslog( LOG_DEBUG, "%s passed '%.200s' to a %s handler", hc->client_addr, hc->origfilename, fname );
+		hc->status = 200;
+		hc->bytes_sent = CGI_BYTECOUNT;
+		hc->bfield &= ~HC_SHOULD_LINGER;
+		/* The handler should hold the log */
+		hc->bfield |= HC_LOG_DONE;
+		return(0);
+	}
+#endif /* HPOOL_WORKERS */
+
+	/* To much forks already running: wait for one to exit, if the queue isn't full */
+	if ( ! httpd_admissible( hc->hs, class ) ) {
+		if ( admit_wait( hc, class ) == 0 )
+			return(0);
 		httpd_send_err(hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl );
 		return(-1);
 	}
-	r = fork( );
+	/* A CGI which doesn't need an interposer is spawned without any fork,
+	 * and so is one whose output the server can relay itself */
+	if ( funct == cgi_child && ! cgi_interposed( hc ) )
+		r = cgi_spawn_conn( hc );
+	else if ( funct == cgi_child && cgi_relayable( hc ) )
+		r = cgi_spawn_relay( hc );
+	else
+		r = fork( );
 	if ( r < 0 ) {
 		httpd_send_err(hc, 500, err500title, "", err500form, "f" );
 		return(-1);
@@ -2482,6 +2977,12 @@ static int launch_process(void (*funct) (httpd_conn* ), httpd_conn* hc, int meth
 	if ( r > 0 ) {
 		/* Parent process. */
 		drop_child(fname,r,hc);
+		if ( hc->bfield & HC_CGI_RELAY ) {
+			/* (but the response is ours, cf. httpd_relay_cgi()) */
+			hc->status = 0;
+			hc->bytes_sent = 0;
+			hc->bfield &= ~HC_LOG_DONE;
+		}
 		return(0);
 	}
 
@@ -2529,7 +3030,7 @@ static void ls(httpd_conn* hc) {
 	if ( dirp == (DIR*) 0 ) {
 		syslog( LOG_ERR, "opendir %.80s - %m", hc->realfilename );
 		httpd_send_err( hc, 404, err404title, "", err404form, hc->encodedurl );
-		exit(1);
+		hpool_exit(1);
 	}
 
 	send_mime(
@@ -2538,7 +3039,7 @@ static void ls(httpd_conn* hc) {
 	httpd_write_response( hc );
 
 	if ( hc->method == METHOD_HEAD )
-		exit(0);
+		hpool_exit(0);
 
 	/* Open a stdio stream so that we can use fprintf, which is more
 	** efficient than a bunch of separate write()s.  We don't have
@@ -2553,7 +3054,7 @@ static void ls(httpd_conn* hc) {
 		httpd_send_err(
 			hc, 500, err500title, "", err500form, hc->encodedurl );
 		closedir( dirp );
-		exit( 1 );
+		hpool_exit( 1 );
 		}
 
 	(void) fprintf( fp, "\
@@ -2587,7 +3088,7 @@ mode  links  bytes  last-changed  name\n\
 			if ( names == (char*) 0 || nameptrs == (char**) 0 )
 				{
 				syslog( LOG_ERR, "out of memory reallocating directory names" );
-				exit( 1 );
+				hpool_exit( 1 );
 				}
 			for ( i = 0; i < maxnames; ++i )
 				nameptrs[i] = &names[i * ( MAXPATHLEN + 1 )];
@@ -2719,7 +3220,7 @@ mode  links  bytes  last-changed  name\n\
 
 	(void) fprintf( fp, "</PRE></BODY>\n</HTML>\n" );
 	(void) fclose( fp );
-	exit( 0 );
+	hpool_exit( 0 );
 }
 
 #endif /* GENERATE_INDEXES */
@@ -2747,8 +3248,8 @@ build_env( char* fmt, char* arg )
 	}
 
 /* Set up environment variables. Be real careful here to avoid
-** letting malicious clients overrun a buffer.  We don't have
-** to worry about freeing stuff since we're a sub-process.
+** letting malicious clients overrun a buffer.  Every variable is
+** allocated, so that the server can free them after a cgi_spawn_conn().
 */
 static char**
 make_envp( httpd_conn* hc )
@@ -2768,7 +3269,7 @@ make_envp( httpd_conn* hc )
 	cp = hc->hs->server_hostname;
 	if ( cp != (char*) 0 )
 		envp[envn++] = build_env( "SERVER_NAME=%s", cp );
-	envp[envn++] = "GATEWAY_INTERFACE=CGI/1.1";
+	envp[envn++] = build_env( "GATEWAY_INTERFACE=%s", "CGI/1.1" );
 	envp[envn++] = build_env("SERVER_PROTOCOL=%s", hc->protocol);
 	(void) snprintf( buf, sizeof(buf), "%d", (int) hc->hs->port );
 	envp[envn++] = build_env( "SERVER_PORT=%s", buf );
@@ -2820,9 +3321,8 @@ make_envp( httpd_conn* hc )
 	}
 
 
-/* Set up argument vector.  Again, we don't have to worry about freeing stuff
-** since we're a sub-process.  This gets done after make_envp() because we
-** scribble on hc->query.
+/* Set up argument vector (only the vector itself is allocated).  This gets
+** done after make_envp() because we scribble on hc->query.
 */
 static char**
 make_argp( httpd_conn* hc )
@@ -2961,63 +3461,6 @@ static void gpg_data_release_cb(void *handle)
 	    /* must just be present... bug or feature?!? */
 }
 
-/*! Check the dirname of a file path, and create missing directories if needed
- * \return like mkdir: 0 on succes, -1 on error (cf. errno) */
-static int mk_path(const char * path) {
-	char * cp , * dir=strdup(path);
-	struct stat std;
-
-	if (!dir)
-		return(-1);
-
-	cp=dir;
-
-	while (*cp == '/')
-		cp++;
-
-	cp=strchr(cp,'/');
-	while (cp) {
-		*cp='\0';
-		if ( stat(dir,&std) < 0 && mkdir(dir,0755) < 0) {
-		/* If the path does not exist and we fail to create it */
-			free(dir);
-			return -1;
-		}
-		*cp='/';
-		while (*cp == '/') /* in case of mutiple ///// ... */
-			cp++;
-		cp=strchr(cp,'/');
-	}
-	free(dir);
-	return 0;
-}
-
-/*! Chdir into the dirname of a file path.
- * \return the basename of the file path, or NULL on error (cf. errno)
- * \Note: if input is not a file path (eg finishing with a '/') it will return an empty string (""). */
-static const char * chdir_path(const char * path) {
-	char * directory, * binary;
-
-	directory = strdup(path);
-	if (! directory)
-		return NULL;
-
-	binary = strrchr( directory, '/' );
-	if ( ! binary ) {
-		free(directory);
-		return path;
-	} else {
-		*binary = '\0';
-		if ( chdir(directory) == 0 ) {
-			free(directory);
-			return &path[(binary-directory+1)];
-		} else {
-			free(directory);
-			return(NULL);
-		}
-	}
-}
-
 /*! parse an HTTP response (CGI or not) from rfd, sign it if status in it is 2XX, and write it to the hc->conn_fd.
  * \param fd: the file descriptor to read the response from
  * \param cgi: If set, the function won't sign if Content-type is already "multipart/signed" or if HC_DETACH_SIGN is unset, and won't cache the signature. If unset, the function will always sign (regardless of HC_DETACH_SIGN) and will use cached signature if HC_GOT_RANGE is unset.
@@ -3027,7 +3470,6 @@ static const char * chdir_path(const char * path) {
 void httpd_parse_resp(interpose_args_t * args) {
 	const httpd_conn * hc=args->hc;
 	int optcgi=args->option;
-#define SIG_CACHE_DIR "../"SIG_CACHEDIR
 #define HTTP_MAX_CONTENTHEADERS 9
 #define HTTP_MAX_HEADERS 40
 
@@ -3052,12 +3494,12 @@ void httpd_parse_resp(interpose_args_t * args) {
 	char * buf=malloc(buflen);
 	int status=-1,i;
 	char * title, * cp;
-	char fcache[MAXPATHLEN];
-	struct stat sts;
+	char * cachedsig=(char *)0;
+	size_t cachedsiglen=0;
 
 
 	do_sign=(optcgi?0:1);
-	use_cache=0; /* will be set to 1 (use cache) or 2 (do the cache) if ( !optcgi and SIG_CACHE_DIR exist) later */
+	use_cache=0; /* will be set to 1 (use cache) or 2 (do the cache) if ( !optcgi and SIG_CACHEDIR defined) later */
 
 	/* use a file descriptor for getline (which is POSIX since 2008, glibc >= 2.10 )*/
 	if ( !(fp=fdopen(args->rfd,"r")) ) {
@@ -3175,21 +3617,11 @@ void httpd_parse_resp(interpose_args_t * args) {
 		}
 	} else {
 #ifdef SIG_CACHEDIR
-		if ( stat(SIG_CACHE_DIR,&sts) < 0 || !S_ISDIR(sts.st_mode) ) {
-			syslog( LOG_ERR,"invalid cache dir %s - %m",SIG_CACHE_DIR);
-		} else if ( snprintf(fcache,MAXPATHLEN,"%s/%s",SIG_CACHE_DIR,hc->realfilename) >= MAXPATHLEN ) {
-			syslog( LOG_ERR,"too big cache path - %s",hc->realfilename);
-		} else if (!(hc->bfield & HC_GOT_RANGE)){
+		if (!(hc->bfield & HC_GOT_RANGE)){
 			use_cache=2; /* by default: do the cache */
-			if ( stat(fcache,&sts) == 0 ) {
-				if ( ! S_ISREG(sts.st_mode) ) {
-					/* May happen ... */
-					remove(fcache);
-					syslog( LOG_WARNING,"remove %s - %m",fcache);
-				} else if ( sts.st_mtime > hc->sb.st_mtime )
-				/* The cached signature seems newer than file */
-					use_cache=1; /* just use it */
-			}
+			/* (The index is the one of the server at the time we were forked) */
+			if ( (cachedsig=sigc_lookup(&hc->sb,&cachedsiglen,(struct timeval*) 0)) )
+				use_cache=1; /* just use it */
 		}
 #else /* SIG_CACHEDIR */
 		use_cache=0;
@@ -3281,14 +3713,22 @@ void httpd_parse_resp(interpose_args_t * args) {
 				}
 			}
 			gpgerr=GPG_ERR_NO_ERROR;
-		} else
-			gpgerr = gpgme_op_sign (main_gpgctx, gpgdata,gpgsig,GPGME_SIG_MODE_DETACH);
+		} else {
+			gpgerr = natsig_sign(gpgdata,gpgsig);
+#ifdef SIGSERV_WORKERS
+			if ( gpgerr == NATSIG_UNAVAILABLE )
+				gpgerr = sigserv_sign(gpgdata,gpgsig);
+			if ( gpgerr == SIGSERV_UNAVAILABLE )
+#else
+			if ( gpgerr == NATSIG_UNAVAILABLE )
+#endif
+				gpgerr = gpgme_op_sign (main_gpgctx, gpgdata,gpgsig,GPGME_SIG_MODE_DETACH);
+		}
 
 		if ( gpgerr == GPG_ERR_NO_ERROR) {
 			off_t siglen;
-			FILE * sigfile;
 			if (use_cache==1)
-				siglen=sts.st_size;
+				siglen=cachedsiglen;
 			else {
 				siglen=gpgme_data_seek(gpgsig, 0, SEEK_END);
 				gpgme_data_seek(gpgsig, 0, SEEK_SET);
@@ -3300,29 +3740,22 @@ void httpd_parse_resp(interpose_args_t * args) {
 				HTTPD_PARSE_RESP_RETURN(-1);
 			}
 
+#ifdef SIG_CACHEDIR
 			if (use_cache==2) {
 			/* (Try to) Cache the signature */
-				if ( mk_path(fcache) == 0 && (sigfile=fopen(fcache,"w")) ) {
-					while ( (r=gpgme_data_read(gpgsig, buf, buflen)) > 0 )
-						if (fwrite(buf,sizeof(char),r,sigfile) != r) {
-						   unlink(fcache);
-						   break;
-						}
-					fclose(sigfile);
-					gpgme_data_seek(gpgsig, 0, SEEK_SET);
-				}
+				char * sig=malloc(siglen);
+				if ( sig && gpgme_data_read(gpgsig, sig, siglen) == siglen )
+					sigc_append(&hc->sb, sig, siglen);
+				free(sig);
+				gpgme_data_seek(gpgsig, 0, SEEK_SET);
 			}
+#endif /* SIG_CACHEDIR */
 
 			if (use_cache==1) {
 			/* output cached signature */
-				sigfile=fopen(fcache,"r");
-				if (sigfile) {
-					while ( (r=fread(buf,sizeof(char), buflen-1, sigfile)) )
-						if ( httpd_write_fully(args->wfd, buf, r ) != r ) {
-							HTTPD_PARSE_SIGN_CLEAN();
-							HTTPD_PARSE_RESP_RETURN(-1);
-						}
-					fclose(sigfile);
+				if ( httpd_write_fully(args->wfd, cachedsig, cachedsiglen ) != cachedsiglen ) {
+					HTTPD_PARSE_SIGN_CLEAN();
+					HTTPD_PARSE_RESP_RETURN(-1);
 				}
 			} else {
 				while ( (r=gpgme_data_read(gpgsig, buf, buflen)) > 0 )
@@ -3382,170 +3815,652 @@ void httpd_parse_resp(interpose_args_t * args) {
 	}
 }
 
-/* CGI child process. */
+/*! cgi_interposed tell whether the CGI of hc needs an interposer process (cf.
+ * cgi_child()): to parse (and sign) its output, or to feed it with the part of
+ * the body we already read.
+ */
+static int cgi_interposed( const httpd_conn* hc ) {
+	const char * binary;
+
+	binary = strrchr( hc->realfilename, '/' );
+	binary = binary ? binary + 1 : hc->realfilename;
+	return ( hc->method == METHOD_POST && hc->read_idx > hc->checked_idx )
+		|| ( strncmp( binary, "nph-", 4 ) && hc->http_version > 9 );
+}
+
+/*! cgi_spawn run the CGI of hc with vfork(), so that the address space of the
+ * caller (the whole server, mmc mappings included) is not copied: argp, envp
+ * and the directory to chdir into are prepared before, the child only wires
+ * in_fd to its standard input, out_fd to its standard output and error, and
+ * calls execve().
+ * \param newpgrp: if set, the CGI gets its own process group (cf. cgi_kill()).
+ * \return the pid of the CGI, or -1 on error (cf. errno, also if execve failed).
+ */
+static pid_t cgi_spawn( httpd_conn* hc, char** argp, char** envp, int in_fd, int out_fd, int newpgrp ) {
+	static const int sigs[] = { SIGTERM, SIGINT, SIGCHLD, SIGPIPE, SIGHUP, SIGUSR1, SIGUSR2, SIGALRM, SIGBUS };
+	volatile int child_errno = 0;
+	char * directory, * binary;
+	sigset_t all, old;
+	pid_t pid;
+	int i;
+
+	/* Split the program into directory and binary, so the child can chdir()
+	** to the program's own directory.  This isn't in the CGI 1.1 spec,
+	** but it's what other HTTP servers do. */
+	directory = strdup( hc->realfilename );
+	if ( ! directory )
+		return -1;
+	binary = strrchr( directory, '/' );
+	if ( binary )
+		*binary++ = '\0';
+
+	/* Until execve(), the child runs in our memory: our handlers must not run in it */
+	(void) sigfillset( &all );
+	(void) sigprocmask( SIG_SETMASK, &all, &old );
+	pid = vfork( );
+	if ( pid == 0 ) {
+		/* Child: only system calls from here, and no return */
+		for ( i = 0; i < sizeof(sigs)/sizeof(sigs[0]); i++ )
+			(void) signal( sigs[i], SIG_DFL );
+		(void) sigprocmask( SIG_SETMASK, &old, (sigset_t*) 0 );
+		if ( newpgrp )
+			(void) setpgid( 0, 0 );
+#ifdef CGI_NICE
+		(void) nice( CGI_NICE );
+#endif /* CGI_NICE */
+		if ( ( in_fd != STDIN_FILENO && dup2( in_fd, STDIN_FILENO ) < 0 )
+				|| ( out_fd != STDOUT_FILENO && dup2( out_fd, STDOUT_FILENO ) < 0 )
+				|| dup2( out_fd, STDERR_FILENO ) < 0 ) {
+			child_errno = errno;
+			_exit( 127 );
+		}
+#ifdef GPGIO_MAX_OPS
+		/* (the pipes of the gpg run by the server) */
+		gpgio_close_fds();
+#endif /* GPGIO_MAX_OPS */
+#ifdef HAVE_CLOSEFROM
+		closefrom( STDERR_FILENO+1 );
+#else
+		/* Note: the connections, listen sockets, logfile... are close-on-exec */
+		for ( i = STDERR_FILENO+1; i < 10; i++ )
+			(void) close( i );
+#endif
+		/* cgi don't have to manage EINTR or EAGAIN, turn off no-delay mode. */
+		(void) httpd_clear_ndelay( STDIN_FILENO );
+		(void) httpd_clear_ndelay( STDOUT_FILENO );
+		if ( binary && chdir( directory ) < 0 ) {
+			child_errno = errno;
+			_exit( 127 );
+		}
+		(void) execve( binary ? binary : directory, argp, envp );
+		child_errno = errno;
+		_exit( 127 );
+	}
+	if ( pid < 0 )
+		child_errno = errno;
+	(void) sigprocmask( SIG_SETMASK, &old, (sigset_t*) 0 );
+	free( directory );
+	if ( child_errno ) {
+		/* (a child which failed has exited, and is reaped as any other) */
+		errno = child_errno;
+		return -1;
+	}
+	return pid;
+}
+
+/*! cgi_spawn_conn spawn, right from the server, a CGI which doesn't need an
+ * interposer: it gets the connection as standard input, output and error.
+ * \return the pid of the CGI, or -1 on error.
+ */
+static pid_t cgi_spawn_conn( httpd_conn* hc ) {
+	char** argp;
+	char** envp;
+	pid_t pid;
+	int i, s = 1;
+
+	envp = make_envp( hc );
+	argp = make_argp( hc );
+	if ( argp == (char**) 0 )
+		pid = -1;
+	else {
+		/* activate TCP_NODELAY, as for spawned process (cf. child_r_start()) */
+		(void) setsockopt( hc->conn_fd, IPPROTO_TCP, TCP_NODELAY, (char*) &s, sizeof(s) );
+		pid = cgi_spawn( hc, argp, envp, hc->conn_fd, hc->conn_fd, 1 );
+		if ( pid < 0 )
+			syslog( LOG_ERR, "execve %.80s - %m", hc->realfilename );
+		else
+			/* Log now as there is no output interposer to do it */
+			make_log_entry( hc, 0, 200 );
+	}
+	for ( i = 0; envp[i] != (char*) 0; i++ )
+		free( (void*) envp[i] );
+	free( (void*) argp );
+	return pid;
+}
+
+/* CGI interposer process (cf. cgi_interposed()): spawn the CGI with pipe(s)
+ * instead of the connection, feed it with the body and/or parse its output. */
 static void
 cgi_child( httpd_conn* hc ) {
 	char** argp;
 	char** envp;
 	int interpose_input,interpose_output;
-
-	/* Unset close-on-exec flag for this socket.  This actually shouldn't
-	** be necessary, according to POSIX a dup()'d file descriptor does
-	** *not* inherit the close-on-exec flag, its flag is always clear.
-	** However, Linux messes this up and does copy the flag to the
-	** dup()'d descriptor, so we have to clear it.
-	* TODO: This could be ifdeffed for Linux only.
-	*/
-	(void) fcntl( hc->conn_fd, F_SETFD, 0 );
+	int pin[2],pou[2];
+	interpose_args_t agin,agou;
+	pthread_t tin,tou;
+	pid_t pid;
+	int s;
 
 	/* Make the environment vector. */
 	envp = make_envp( hc );
 	/* Make the argument vector. */
 	argp = make_argp( hc );
+	if ( argp == (char**) 0 ) {
+		httpd_send_err( hc, 500, err500title, "", err500form, "a" );
+		exit(EXIT_FAILURE);
+	}
 
 	interpose_input=(hc->method == METHOD_POST && hc->read_idx > hc->checked_idx );
 	interpose_output=( strncmp(argp[0], "nph-", 4) && hc->http_version > 9 );
 
-	//syslog( LOG_ERR, "in:%d out:%d read_idx:%d checked_idx:%d",interpose_input,interpose_output,hc->read_idx,hc->checked_idx);
-
-	/* First duplicate the socket to stdin/stdout/stderr, if there
-	** was already something on it,we clobber it, but that doesn't matter
-	** since at this point the only fd of interest is the connection.
-	** All others will be closed on exec.
-	** Note: if syslog use stdin,stdout or stderr, it will be closed. But it should use a fd > 2 since it was open before to close them in thttpd.c.
-	*/
+	/* Create needed pipe(s), the CGI use the connection for the others */
+	if ( interpose_input ) {
+		if ( pipe( pin ) < 0 ) {
+			httpd_send_err( hc, 500, err500title, "", err500form, "p" );
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ( interpose_output ) {
+		if ( pipe( pou ) < 0 ) {
+			httpd_send_err( hc, 500, err500title, "", err500form, "p" );
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	if ( dup2(hc->conn_fd,STDIN_FILENO) < 0
-			|| dup2(hc->conn_fd,STDOUT_FILENO) < 0
-			|| dup2(hc->conn_fd,STDERR_FILENO) < 0 ) {
-		httpd_send_err( hc, 500, err500title, "", err500form, "d" );
+	/* (in the process group of the interposer, for cgi_kill()) */
+	pid = cgi_spawn( hc, argp, envp,
+		interpose_input ? pin[0] : hc->conn_fd,
+		interpose_output ? pou[1] : hc->conn_fd, 0 );
+	if ( pid < 0 ) {
+		syslog( LOG_ERR, "execve %.80s - %m", hc->realfilename );
+		httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+		shutdown( hc->conn_fd, SHUT_WR );
 		exit(EXIT_FAILURE);
-	} else if (!interpose_output)
+	}
+	if ( ! interpose_output )
 		/* Log now as there is no output interposer to do it */
 		make_log_entry(hc, 0, 200);
 
-	if ( interpose_input || interpose_output ) {
-		/* we will need to create an interposer process */
-		pid_t ipid;
-		int pin[2],pou[2];
+	if ( interpose_input ) {
+		close(pin[0]);
+		/* Create a thread for input */
+		agin.rfd=hc->conn_fd;
+		agin.wfd=pin[1];
+		agin.hc=hc;
+		s=pthread_create(&tin, NULL,(void * (*)(void *)) &cgi_interpose_input, &agin);
+		if ( s !=0 ) {
+			errno=s;
+			httpd_send_err( hc, 500, err500title, "", err500form, "thc" );
+			exit(EXIT_FAILURE);
+		}
+	}
 
-		/* hc->conn_fd should be stdin,stdout and stderr. So save it first */
-		hc->conn_fd=dup(hc->conn_fd);
-		if ( hc->conn_fd < 0 ) {
-			httpd_send_err( hc, 500, err500title, "", err500form, "d" );
+	if ( interpose_output ) {
+		close(pou[1]);
+		/* And parse output */
+		agou.rfd=pou[0];
+		agou.wfd=hc->conn_fd;
+		agou.hc=hc;
+		agou.option=1;
+		s=pthread_create(&tou, NULL,(void * (*)(void *)) &httpd_parse_resp, &agou);
+		if ( s !=0 ) {
+			errno=s;
+			httpd_send_err( hc, 500, err500title, "", err500form, "thc" );
 			exit(EXIT_FAILURE);
 		}
+	}
 
-		/* Then create needed pipe(s) : */
-		if ( interpose_input ) {
-			if ( pipe( pin ) < 0 ) {
-				httpd_send_err( hc, 500, err500title, "", err500form, "p" );
-				exit(EXIT_FAILURE);
-			}
+	if (waitpid(pid, &s, 0) == -1) {
+		httpd_send_err( hc, 500, err500title, "", err500form, "wait" );
+		exit(EXIT_FAILURE);
+	}
+
+	if ( interpose_output ) {
+		pthread_join(tou, NULL);
+	}
+	shutdown( hc->conn_fd, SHUT_RDWR );
+	exit(EXIT_SUCCESS);
+}
+
+/*! cgi_relayable tell whether the server can relay the output of the CGI of
+ * hc itself, instead of forking an interposer: when no signature is asked,
+ * and the whole body (if any) is already read and fits in a pipe.
+ */
+static int cgi_relayable( const httpd_conn* hc ) {
+	size_t c = hc->read_idx - hc->checked_idx;
+
+	if ( hc->bfield & HC_DETACH_SIGN )
+		return 0;
+	if ( hc->method != METHOD_POST )
+		return 1;
+	return ( hc->contentlength <= (ssize_t) c && c <= PIPE_BUF );
+}
+
+/*! cgi_spawn_relay spawn, right from the server, a CGI whose output will be
+ * relayed by httpd_relay_cgi() (cf. cgi_relayable()): its standard input is
+ * a pipe filled with the body (if any), its output goes to hc->cgi_fd.
+ * \return the pid of the CGI, or -1 on error.
+ */
+static pid_t cgi_spawn_relay( httpd_conn* hc ) {
+	char** argp;
+	char** envp;
+	int pin[2], pou[2];
+	size_t c = hc->read_idx - hc->checked_idx;
+	pid_t pid = -1;
+	int i;
+
+	if ( pipe( pin ) < 0 )
+		return -1;
+	if ( pipe( pou ) < 0 ) {
+		close( pin[0] );
+		close( pin[1] );
+		return -1;
+	}
+	/* (the CGI gets EOF after the body) */
+	if ( hc->method == METHOD_POST && c > 0 && write( pin[1], &(hc->read_buf[hc->checked_idx]), c ) != c )
+		syslog( LOG_ERR, "write to CGI pipe - %m" );
+	else {
+		envp = make_envp( hc );
+		argp = make_argp( hc );
+		if ( argp != (char**) 0 ) {
+			pid = cgi_spawn( hc, argp, envp, pin[0], pou[1], 1 );
+			if ( pid < 0 )
+				syslog( LOG_ERR, "execve %.80s - %m", hc->realfilename );
+		}
+		for ( i = 0; envp[i] != (char*) 0; i++ )
+			free( (void*) envp[i] );
+		free( (void*) argp );
+	}
+	close( pin[0] );
+	close( pin[1] );
+	close( pou[1] );
+	if ( pid < 0 ) {
+		close( pou[0] );
+		return -1;
+	}
+	(void) fcntl( pou[0], F_SETFD, FD_CLOEXEC );
+	(void) httpd_set_ndelay( pou[0] );
+	hc->cgi_fd = pou[0];
+	hc->bfield |= HC_CGI_RELAY;
+	return pid;
+}
+
+/*! fcgi_launch pass the request to the FastCGI application (cf. fcgi.c),
+ * whose response will be relayed as the output of a CGI. As the server
+ * relays it without interposer, it can't be signed: a signature asked is
+ * answered by 406 rather than dropped.
+ * \return 0, or -1 if an error response was sent.
+ */
+static int fcgi_launch( httpd_conn* hc ) {
+	char** envp;
+	int r, i;
+
+	if ( hc->bfield & HC_DETACH_SIGN ) {
+		httpd_send_err( hc, 406, err406title, "", err406form, hc->encodedurl );
+		return -1;
+	}
+	if ( hc->method == METHOD_POST && hc->contentlength > FCGI_MAXBODY ) {
+		httpd_send_err( hc, 413, err413title, "",
+			ERROR_FORM( httpd_err400form, "The body of the request to '%.80s' is too large.\n" ),
+			hc->encodedurl );
+		return -1;
+	}
+	envp = make_envp( hc );
+	r = fcgi_start( hc, envp );
+	for ( i = 0; envp[i] != (char*) 0; i++ )
+		free( (void*) envp[i] );
+	if ( r < 0 ) {
+		httpd_send_err( hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl );
+		return -1;
+	}
+	return 0;
+}
+
+/* Max size of the headers of a relayed CGI output */
+#define RELAY_MAXHEADERS 16384
+/* Max bytes relayed in one call of httpd_relay_cgi() */
+#define RELAY_CHUNK 65536
+
+/*! relay_headers make the headers of the response from the hlen first bytes
+ * of the CGI output in hc->body (as httpd_parse_resp() does without signing),
+ * and buffer them in hc->response, followed by the rest of hc->body.
+ * \return 0, or -1 if the CGI output isn't a valid response.
+ */
+static int relay_headers( httpd_conn* hc, size_t hlen ) {
+	char * line, * eol, * title, * cp;
+	char buf[100];
+	int status = -1, gotcontent = 0, pass;
+
+	/* Figure out the status.  Look for a Status: or Location: header;
+	** else if there's an HTTP header line, get it from there; else
+	** default to 200.
+	*/
+	for ( line = hc->body; line < hc->body + hlen; line = eol + 1 ) {
+		eol = memchr( line, '\n', hc->body + hlen - line );
+		if ( eol == line || ( eol == line + 1 && *line == '\015' ) )
+			break;
+		if ( ! strncasecmp( line, "Content-", 8 ) )
+			gotcontent = 1;
+		else if ( status < 0 ) {
+			if ( ! strncmp( line, "HTTP/", 5 ) ) {
+				cp = line + 5;
+				cp += strcspn( cp, " \t" );
+				status = atoi( cp );
+			} else if ( ! strncasecmp( line, "Status:", 7 ) ) {
+				cp = line + 7;
+				cp += strspn( cp, " \t" );
+				status = atoi( cp );
+			} else if ( ! strncasecmp( line, "Location:", 9 ) )
+				status = 302;
 		}
-		if ( interpose_output ) {
-			if ( pipe( pou ) < 0 ) {
-				httpd_send_err( hc, 500, err500title, "", err500form, "p" );
-				exit( 1 );
+	}
+	/* If there were no "Content-*:" headers, bail. */
+	if ( ! gotcontent ) {
+		syslog( LOG_ERR, "no header (relayed CGI %.80s)", hc->encodedurl );
+		return -1;
+	}
+	if ( status < 0 )
+		status = 200;
+	hc->status = status;
+
+	if ( strncmp( hc->body, "HTTP/", 5 ) ) {
+		/* Insert the status line. */
+		switch ( status )
+			{
+			case 200: title = ok200title; break;
+			case 302: title = err302title; break;
+			case 304: title = err304title; break;
+			case 400: title = httpd_err400title; break;
+#ifdef AUTH_FILE
+			case 401: title = err401title; break;
+#endif /* AUTH_FILE */
+			case 403: title = err403title; break;
+			case 404: title = err404title; break;
+			case 408: title = httpd_err408title; break;
+			case 411: title = err411title; break;
+			case 413: title = err413title; break;
+			case 415: title = err415title; break;
+			case 500: title = err500title; break;
+			case 501: title = err501title; break;
+			case 503: title = httpd_err503title; break;
+			default: title = "Something"; break;
 			}
+		(void) snprintf( buf, sizeof(buf), "HTTP/1.0 %d %s\015\012", status, title );
+		add_response( hc, buf );
+	}
+	/* The other headers first, then the "Content-*" ones */
+	for ( pass = 0; pass < 2; pass++ )
+		for ( line = hc->body; line < hc->body + hlen; line = eol + 1 ) {
+			eol = memchr( line, '\n', hc->body + hlen - line );
+			if ( eol == line || ( eol == line + 1 && *line == '\015' ) )
+				break;
+			if ( ( strncasecmp( line, "Content-", 8 ) == 0 ) == pass )
+				add_response_len( hc, line, eol + 1 - line );
 		}
+	add_response( hc, "\015\012" );
+	/* And what was read of the content */
+	add_response_len( hc, hc->body + hlen, hc->bodylen - hlen );
+	hc->bodylen = 0;
+	return 0;
+}
 
-		/* Now we fork */
-		ipid = fork( );
-		if ( ipid < 0 ) {
-			httpd_send_err( hc, 500, err500title, "", err500form, "f" );
-			exit(EXIT_FAILURE);
+/*! relay_blocked tell which side made a splice() fail with EAGAIN. */
+static int relay_blocked( httpd_conn* hc ) {
+	int n = 0;
+
+	if ( ioctl( hc->cgi_fd, FIONREAD, &n ) == 0 && n > 0 )
+		return RC_WAIT_CONN;
+	return RC_WAIT_CGI;
+}
+
+int httpd_relay_cgi( httpd_conn* hc ) {
+#ifdef HAVE_SPLICE
+	static int nosplice = 0;
+#endif /* HAVE_SPLICE */
+	size_t moved = 0, hlen;
+	ssize_t r;
+	char * eol;
+
+	while ( moved < RELAY_CHUNK ) {
+		/* Pass first the rest of the body to the FastCGI application */
+		if ( hc->bfield & HC_FCGI_BODY ) {
+			r = fcgi_body( hc );
+			if ( r < 0 )
+				return RC_DONE;
+			if ( r > 0 )
+				return RC_WAIT_BODY;
+			continue;
 		}
-		if ( ipid > 0 ) {
-			/* Parent Interposer process. */
-			interpose_args_t agin,agou;
-			pthread_t tin,tou;
-			int s;
-
-			if ( interpose_input ) {
-				close(pin[0]);
-				/* Create a thread for input */
-				agin.rfd=hc->conn_fd;
-				agin.wfd=pin[1];
-				agin.hc=hc;
-				s=pthread_create(&tin, NULL,(void * (*)(void *)) &cgi_interpose_input, &agin);
-				if ( s !=0 ) {
-					errno=s;
-					httpd_send_err( hc, 500, err500title, "", err500form, "thc" );
-					exit(EXIT_FAILURE);
-				}
+
+		/* Send first what is buffered: the headers, or what was read */
+		if ( hc->responselen > 0 ) {
+			r = write( hc->conn_fd, hc->response, hc->responselen );
+			if ( r < 0 ) {
+				if ( errno == EINTR )
+					continue;
+				if ( errno == EAGAIN || errno == EWOULDBLOCK )
+					return RC_WAIT_CONN;
+				/* (the client hung up, the CGI will get a SIGPIPE) */
+				return RC_DONE;
 			}
+			(void) memmove( hc->response, &(hc->response[r]), hc->responselen - r );
+			hc->responselen -= r;
+			hc->bytes_sent += r;
+			moved += r;
+			continue;
+		}
 
-			if ( interpose_output ) {
-				close(pou[1]);
-				/* And parse output */
-				agou.rfd=pou[0];
-				agou.wfd=hc->conn_fd;
-				agou.hc=hc;
-				agou.option=1;
-			    s=pthread_create(&tou, NULL,(void * (*)(void *)) &httpd_parse_resp, &agou);
-				if ( s !=0 ) {
-					errno=s;
-					httpd_send_err( hc, 500, err500title, "", err500form, "thc" );
-					exit(EXIT_FAILURE);
+		if ( ! ( hc->bfield & HC_CGI_HEADERS ) ) {
+			/* Read the headers of the CGI output */
+			httpd_realloc_str( &hc->body, &hc->maxbody, hc->bodylen + BUFSIZE );
+			r = read( hc->cgi_fd, &(hc->body[hc->bodylen]), BUFSIZE );
+			if ( r < 0 && errno == EINTR )
+				continue;
+			if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+				return RC_WAIT_CGI;
+			if ( r <= 0 ) {
+				syslog( LOG_ERR, "relayed CGI %.80s ended before its headers", hc->encodedurl );
+				httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+				return RC_DONE;
+			}
+			hc->bodylen += r;
+			/* Look for the end of the headers: an empty line */
+			hlen = 0;
+			for ( eol = hc->body; ( eol = memchr( eol, '\n', hc->body + hc->bodylen - eol ) ) != (char*) 0; eol++ )
+				if ( eol == hc->body || eol[-1] == '\n'
+						|| ( eol[-1] == '\015' && ( eol - 1 == hc->body || eol[-2] == '\n' ) ) ) {
+					hlen = eol + 1 - hc->body;
+					break;
 				}
+			if ( hlen == 0 ) {
+				if ( hc->bodylen < RELAY_MAXHEADERS )
+					continue;
+				syslog( LOG_ERR, "relayed CGI %.80s headers too long", hc->encodedurl );
+				httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+				return RC_DONE;
 			}
+			if ( relay_headers( hc, hlen ) < 0 ) {
+				httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+				return RC_DONE;
+			}
+			hc->bfield |= HC_CGI_HEADERS;
+			continue;
+		}
 
-            if (wait(&s) == -1) {
-					httpd_send_err( hc, 500, err500title, "", err500form, "wait" );
-					exit(EXIT_FAILURE);
-            }
-
-			if ( interpose_output ) {
-                pthread_join(tou, NULL);
-            }
-            shutdown( hc->conn_fd, SHUT_RDWR );
-			exit(EXIT_SUCCESS);
-		}
-		/* child process */
-		if ( interpose_input ) {
-			dup2( pin[0], STDIN_FILENO );
-#ifndef HAVE_CLOSEFROM
-            close(pin[1]);
-#endif
-        }
-		if ( interpose_output ) {
-			dup2( pou[1], STDOUT_FILENO );
-			dup2( pou[1], STDERR_FILENO );
-#ifndef HAVE_CLOSEFROM
-		    close(pou[0]);
-#endif
+		/* Then move the content */
+#ifdef HAVE_SPLICE
+		if ( ! nosplice ) {
+			r = splice( hc->cgi_fd, (loff_t*) 0, hc->conn_fd, (loff_t*) 0, RELAY_CHUNK - moved, SPLICE_F_MOVE|SPLICE_F_NONBLOCK );
+			if ( r > 0 ) {
+				hc->bytes_sent += r;
+				moved += r;
+				continue;
+			}
+			if ( r == 0 )
+				return RC_DONE;
+			if ( errno == EINTR )
+				continue;
+			if ( errno == EAGAIN )
+				return relay_blocked( hc );
+			if ( errno != EINVAL && errno != ENOSYS )
+				return RC_DONE;
+			/* (not supported here, copy it) */
+			nosplice = 1;
 		}
+#endif /* HAVE_SPLICE */
+		httpd_realloc_str( &hc->response, &hc->maxresponse, BUFSIZE );
+		r = read( hc->cgi_fd, hc->response, BUFSIZE );
+		if ( r < 0 && errno == EINTR )
+			continue;
+		if ( r < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+			return RC_WAIT_CGI;
+		if ( r <= 0 )
+			return RC_DONE;
+		hc->responselen = r;
 	}
+	return ( hc->responselen > 0 ? RC_WAIT_CONN : RC_WAIT_CGI );
+}
 
-#ifdef HAVE_CLOSEFROM
-	closefrom(STDERR_FILENO+1);
-#else
-	{
-		int i;
-	/* Note: we arbitrarily choose a limit, because it should not exist fd after. But if it's false we have to use sysconf(_SC_OPEN_MAX) instead */
-		for (i=STDERR_FILENO+1;i<10;i++)
-			close(i);
+/*! Prepare a multipart/msigned response, so that the main loop send it
+ * without any fork: the headers (up to the part headers of the content) go
+ * into hc->response, the content is the one at hc->file_address (partsize
+ * bytes, described by type, encodings and range), and the signature part goes
+ * into hc->trailer.
+ * \return 0 on success, or -1 if the part headers are too long.
+ */
+static int send_mime_signed( httpd_conn* hc, int status, char* title, char* type, char* encodings, char* range, char* extraheads, off_t partsize, const char* sig, size_t siglen, time_t mod ) {
+	const char* rfc1123fmt = "%a, %d %b %Y %T GMT";
+	char nowbuf[100], modbuf[100], part[1000], buf[1000];
+	size_t partlen, len;
+	time_t now;
+
+	random_boundary(hc->boundary,BOUNDARYLEN);
+	partlen = snprintf( part, sizeof(part),
+		"--%s\015\012Content-Type: %s\015\012%s%s%s%s%s %lld\015\012\015\012",
+		hc->boundary, type,
+		encodings[0] ? "Content-Encoding: " : "", encodings, encodings[0] ? "\015\012" : "",
+		range, "Content-Length:", (int64_t) partsize );
+	if ( partlen >= sizeof(part) )
+		return -1;
+
+	len = snprintf( buf, sizeof(buf),
+		"\015\012--%s\015\012Content-Type: application/pgp-signature\015\012Content-Length: %lld\015\012\015\012",
+		hc->boundary, (int64_t) siglen );
+	httpd_realloc_str( &hc->trailer, &hc->maxtrailer, len + siglen + BOUNDARYLEN + 8 );
+	(void) memcpy( hc->trailer, buf, len );
+	(void) memcpy( &(hc->trailer[len]), sig, siglen );
+	len += siglen;
+	len += sprintf( &(hc->trailer[len]), "\015\012--%s--\015\012", hc->boundary );
+	hc->trailerlen = len;
+
+	now = time( (time_t*) 0 );
+	if ( mod == (time_t) 0 )
+		mod = now;
+	(void) strftime( nowbuf, sizeof(nowbuf), rfc1123fmt, gmtime( &now ) );
+	(void) strftime( modbuf, sizeof(modbuf), rfc1123fmt, gmtime( &mod ) );
+	(void) snprintf( buf, sizeof(buf),
+		"%.20s %d %s\015\012Server: %s\015\012Date: %s\015\012Last-Modified: %s\015\012Accept-Ranges: bytes\015\012Connection: close\015\012%s %s; %s=%s\015\012%s %lld\015\012%s\015\012",
+		hc->protocol, status, title, EXPOSED_SERVER_SOFTWARE, nowbuf, modbuf,
+		"Content-Type:", "multipart/msigned", "boundary", hc->boundary,
+		"Content-Length:", (int64_t) ( partlen + partsize + hc->trailerlen ), extraheads );
+	add_response( hc, buf );
+	add_response( hc, part );
+
+	hc->status = status;
+	make_log_entry( hc, now, status );
+	hc->bfield |= HC_LOG_DONE;
+	return 0;
+}
+
+#ifdef SIG_CACHEDIR
+/*! Prepare a multipart/msigned response of a static file whose signature is
+ * already cached (the file is the mmap'ed one).
+ * If HC_GOT_RANGE is set (the range have to be honored), the response is a
+ * 206 whose first part is only the range, marked by its Content-Range header,
+ * and whose signature is still the one of the whole file.
+ * \return 0 on success, or -1 if there is no valid cached signature.
+ */
+static int send_mime_cachedsig( httpd_conn* hc ) {
+	char fixed_type[500], range[100];
+	char * sig;
+	size_t siglen;
+	off_t partsize;
+	int status;
+
+	if ( hc->http_version <= 9
+			|| ! (sig=sigc_lookup( &hc->sb, &siglen, (struct timeval*) 0 )) )
+		return -1;
+
+	if ( hc->bfield & HC_GOT_RANGE ) {
+		status = 206;
+		partsize = hc->last_byte_index - hc->first_byte_index + 1;
+		(void) snprintf( range, sizeof(range), "Content-Range: bytes %lld-%lld/%lld\015\012",
+			(int64_t) hc->first_byte_index, (int64_t) hc->last_byte_index, (int64_t) hc->sb.st_size );
+	} else {
+		status = 200;
+		partsize = hc->sb.st_size;
+		range[0] = '\0';
 	}
-#endif
 
-	/* cgi don't have to manage EINTR or EAGAIN, turn off no-delay mode. */
-	httpd_clear_ndelay( STDIN_FILENO );
-	httpd_clear_ndelay( STDOUT_FILENO );
-	httpd_clear_ndelay( STDERR_FILENO ); //should be useless ass STDOUT_FILENO and STDERR_FILENO describe the same file
-
-	/* Split the program into directory and binary, so we can chdir()
-	** to the program's own directory.  This isn't in the CGI 1.1
-	** spec, but it's what other HTTP servers do,
-	** and run it. */
-	execve(chdir_path(hc->realfilename), argp, envp );
-
-	/* Something went wrong. */
-	openlog( argv0, LOG_NDELAY|LOG_PID, LOG_FACILITY );
-	syslog( LOG_ERR, "execve %.80s - %m", hc->realfilename );
-	httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-	shutdown( hc->conn_fd, SHUT_WR );
-	exit(EXIT_FAILURE);
+	(void) snprintf( fixed_type, sizeof(fixed_type), hc->type, DEFAULT_CHARSET );
+	hc->bytes_to_send = hc->sb.st_size;
+	return send_mime_signed( hc, status, status == 206 ? ok206title : ok200title,
+		fixed_type, hc->encodings, range, "", partsize, sig, siglen, hc->sb.st_mtime );
+}
+#endif /* SIG_CACHEDIR */
+
+void httpd_send_body( httpd_conn* hc, int status, char* title, char* encodings, char* type, char* extraheads, size_t len, const char* sig, size_t siglen ) {
+	char fixed_type[500];
+
+	hc->bfield &= ~HC_GOT_RANGE;
+	if ( sig && hc->http_version > 9 ) {
+		(void) snprintf( fixed_type, sizeof(fixed_type), type, DEFAULT_CHARSET );
+		hc->bytes_to_send = len;
+		if ( send_mime_signed( hc, status, title, fixed_type, encodings, "", extraheads, len, sig, siglen, (time_t) 0 ) < 0 ) {
+			httpd_send_err( hc, 500, err500title, "", err500form, "h" );
+			return;
+		}
+	} else
+		send_mime( hc, status, title, encodings, extraheads, type, len, (time_t) 0 );
+	hc->file_address = hc->body;
+	hc->bfield |= HC_BODY;
+}
+
+int httpd_accepts_encoding( httpd_conn* hc, const char* coding ) {
+	const char* cp = hc->accepte;
+	const char* param;
+	size_t len;
+	int q, listed = -1, star = 0;
+
+	for (;;) {
+		cp += strspn( cp, " \t," );
+		if ( *cp == '\0' )
+			break;
+		len = strcspn( cp, " \t;," );
+		/* parameters, only q matters */
+		q = 1;
+		for ( param = cp + len; *param != '\0' && *param != ','; param += strcspn( param, ";," ) ) {
+			param += strspn( param, " \t;" );
+			if ( strncasecmp( param, "q=", 2 ) == 0 )
+				q = ( atof( param + 2 ) > 0 );
+		}
+		if ( len == strlen( coding ) && strncasecmp( cp, coding, len ) == 0 )
+			listed = q;
+		else if ( len == 1 && *cp == '*' )
+			star = q;
+		cp = param;
+	}
+	return listed >= 0 ? listed : star;
 }
 
 /*
@@ -3567,10 +4482,26 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 
 	/* Embedded action(s) on specific url */
 	if ( !strncmp(hc->origfilename,"pks/",4) ) {
-		if ( !strcmp(hc->origfilename+4,"lookup") )
+		if ( !strcmp(hc->origfilename+4,"lookup") ) {
+#ifdef GPGIO_MAX_OPS
+			/* (from the main loop if possible) */
+			if ( hkp_lookup_start(hc) == 0 )
+				return 0;
+#endif /* GPGIO_MAX_OPS */
 			return launch_process(hkp_lookup, hc, METHOD_GET, "hkp");
+		}
 		if ( !strcmp(hc->origfilename+4,"add") )
+#ifdef KEYIMP_SPOOL
+			/* (GET for the results of a queued submission) */
+			return launch_process(hkp_add, hc, METHOD_GET | METHOD_POST, "hkp");
+#else
 			return launch_process(hkp_add, hc, METHOD_POST, "hkp");
+#endif /* KEYIMP_SPOOL */
+#ifdef RECON_INTERVAL
+		/* (from the prefix tree of the server) */
+		if ( !strcmp(hc->origfilename+4,"recon") )
+			return recon_answer(hc);
+#endif /* RECON_INTERVAL */
 	}
 #ifdef OPENUDC
 	if ( !strncmp(hc->origfilename,"udc/",4) ) {
@@ -3581,6 +4512,11 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 	}
 #endif
 
+	/* Scripts of the FastCGI application (which may not be local files) */
+	if ( hc->hs->fastcgi_saddr != (struct sockaddr*) 0 && hc->hs->cgi_pattern != (char*) 0
+			&& match( hc->hs->cgi_pattern, hc->origfilename ) )
+		return fcgi_launch( hc );
+
 	/* If there's no realfilename, it's should be a non-existent file. */
 	if ( ! hc->realfilename ) {
 		httpd_send_err( hc, 404, err404title, "", err404form, hc->encodedurl );
@@ -3792,12 +4728,7 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 	figure_mime( hc );
 
 	if ( hc->method == METHOD_HEAD ) {
-		if ( (hc->bfield & HC_GOT_RANGE) &&
-			 ( hc->last_byte_index >= hc->first_byte_index ) &&
-			 ( ( hc->last_byte_index != hc->sb.st_size - 1 ) ||
-			   ( hc->first_byte_index > 0 ) ) &&
-			 ( hc->range_if == (time_t) -1 ||
-			   hc->range_if == hc->sb.st_mtime ) )
+		if ( (hc->bfield & HC_GOT_RANGE) && range_honored( hc ) )
 		{
 			send_mime(hc, 206, ok206title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
 		}
@@ -3818,58 +4749,132 @@ httpd_start_request( httpd_conn* hc, struct timeval* nowP ) {
 			httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
 			return -1;
 		}
-		/* (Won't sign If To much forks are already running )*/
-		if (hc->bfield & HC_DETACH_SIGN && ( hc->hs->cgi_limit <= 0 || hc->hs->cgi_count < hc->hs->cgi_limit ) ) {
-			int ipid,p[2];
+		return send_file( hc );
+	}
+	return 0;
+}
 
-			if ( pipe( p ) < 0 ) {
-				httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-				return(-1);
-			}
-			ipid = fork( );
-			if ( ipid < 0 ) {
-				httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
-				return(-1);
-			}
-			if ( ipid == 0 ) {
-				/* Child Interposer process. */
-				interpose_args_t args = { p[0], hc->conn_fd, hc , 0 };
-				child_r_start(hc);
-				close(p[1]);
-				httpd_parse_resp(&args);
-				exit( 0 );
-			}
-			/* Parent process. */
-			close(p[0]);
-			drop_child("parse_resp",ipid,hc);
-			/* overwrite hc->conn_fd by the pipe output */
-			if ( dup2(p[1],hc->conn_fd) < 0 ) {
-				httpd_send_err( hc, 500, err500title, "", err500form, "d" );
-				close(p[1]); /* To end child */
-				return(-1);
-			}
-			close(p[1]); /* it have been dupped on hc->conn_fd */
-			/* Set the pipe write end to no-delay mode. */
-			httpd_set_ndelay(hc->conn_fd);
+int httpd_resume_request( httpd_conn* hc, struct timeval* nowP ) {
+	long msecs;
+
+#ifdef GPGIO_MAX_OPS
+	if ( hc->bfield & HC_GPG_FORK ) {
+		hc->bfield &= ~HC_GPG_FORK;
+		return launch_process(hkp_lookup, hc, METHOD_GET, "hkp");
+	}
+#endif /* GPGIO_MAX_OPS */
+	if ( hc->bfield & HC_ADMIT_WAIT ) {
+		admit_leave( hc );
+		msecs = ( nowP->tv_sec - hc->admit_since.tv_sec ) * 1000L + ( nowP->tv_usec - hc->admit_since.tv_usec ) / 1000L;
+		admit_count[hc->admit_class]++;
+		admit_msecs[hc->admit_class] += msecs;
+		if ( msecs > admit_maxmsecs[hc->admit_class] )
+			admit_maxmsecs[hc->admit_class] = msecs;
+		/* (nothing was started for the others: start them again) */
+		if ( hc->admit_class != ADMIT_SIGN )
+			return httpd_start_request( hc, nowP );
+	}
+	hc->bfield &= ~HC_SIGN_WAIT;
+	return send_file( hc );
+}
+
+#ifdef SIG_CACHEDIR
+#define RELEASE_SIGC_JOB(hc) { \
+	if ( (hc)->sigc_fd >= 0 ) { \
+		sigc_release( (hc)->sigc_fd ); \
+		(hc)->sigc_fd = -1; \
+	} \
+}
+#else /* SIG_CACHEDIR */
+#define RELEASE_SIGC_JOB(hc)
+#endif /* SIG_CACHEDIR */
+
+/*! send_file send the (mapped) file of hc, through an interposer if it have to be signed.
+ * \return like httpd_start_request() */
+static int send_file( httpd_conn* hc ) {
+	if ( (hc->bfield & HC_GOT_RANGE) && ! range_honored( hc ) )
+		hc->bfield &= ~HC_GOT_RANGE;
+#ifdef SIG_CACHEDIR
+	if ( hc->bfield & HC_DETACH_SIGN ) {
+		/* If the signature is already cached, no need to fork an interposer
+		 * (and a range can be sent with the signature of the whole file) */
+		if ( send_mime_cachedsig( hc ) == 0 )
+			return 0;
+		/* If another interposer is signing this file, wait for its signature */
+		if ( sigc_claim( &hc->sb, &hc->sigc_fd ) == 1 ) {
+			hc->bfield |= HC_SIGN_WAIT;
+			return 0;
 		}
+	}
+#endif /* SIG_CACHEDIR */
+	/* If too many processes are running, wait for one to exit (no one else
+	 * can have waited for the job just claimed) */
+	if ( ( hc->bfield & HC_DETACH_SIGN ) && ! httpd_admissible( hc->hs, ADMIT_SIGN ) && admit_wait( hc, ADMIT_SIGN ) == 0 ) {
+		RELEASE_SIGC_JOB( hc );
+		return 0;
+	}
+	/* (Won't sign If To much forks are already running, and the queue is full )*/
+	if (hc->bfield & HC_DETACH_SIGN && httpd_admissible( hc->hs, ADMIT_SIGN ) ) {
+		int ipid,p[2];
 
-		if ( (hc->bfield & HC_GOT_RANGE) &&
-			 ( hc->last_byte_index >= hc->first_byte_index ) &&
-			 ( ( hc->last_byte_index != hc->sb.st_size - 1 ) ||
-			   ( hc->first_byte_index > 0 ) ) &&
-			 ( hc->range_if == (time_t) -1 ||
-			   hc->range_if == hc->sb.st_mtime ) )
-		{
-			send_mime(hc, 206, ok206title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
+		/* A signature of a part of the file would be useless: send the
+		 * whole file (its signature will be cached for next ranges). */
+		hc->bfield &= ~HC_GOT_RANGE;
+
+		if ( pipe( p ) < 0 ) {
+			httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+			RELEASE_SIGC_JOB( hc );
+			return(-1);
 		}
-		else {
-			send_mime(hc, 200, ok200title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
-			hc->bfield &= ~HC_GOT_RANGE;
+		ipid = fork( );
+		if ( ipid < 0 ) {
+			httpd_send_err( hc, 500, err500title, "", err500form, hc->encodedurl );
+			RELEASE_SIGC_JOB( hc );
+			return(-1);
 		}
-	}
+		if ( ipid == 0 ) {
+			/* Child Interposer process. */
+			interpose_args_t args = { p[0], hc->conn_fd, hc , 0 };
+			child_r_start(hc);
+			close(p[1]);
+			httpd_parse_resp(&args);
+			exit( 0 );
+		}
+		/* Parent process. */
+		close(p[0]);
+#ifdef SIG_CACHEDIR
+		/* (The interposer will notify the waiters once it has cached the signature) */
+		if ( hc->sigc_fd >= 0 )
+			sigc_forked( hc->sigc_fd );
+#endif /* SIG_CACHEDIR */
+		drop_child("parse_resp",ipid,hc);
+		/* overwrite hc->conn_fd by the pipe output */
+		if ( dup2(p[1],hc->conn_fd) < 0 ) {
+			httpd_send_err( hc, 500, err500title, "", err500form, "d" );
+			close(p[1]); /* To end child */
+			return(-1);
+		}
+		close(p[1]); /* it have been dupped on hc->conn_fd */
+		/* Set the pipe write end to no-delay mode. */
+		httpd_set_ndelay(hc->conn_fd);
+	} else
+		RELEASE_SIGC_JOB( hc );
+
+	if ( hc->bfield & HC_GOT_RANGE )
+		send_mime(hc, 206, ok206title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
+	else
+		send_mime(hc, 200, ok200title, hc->encodings, "", hc->type, hc->sb.st_size,hc->sb.st_mtime );
 	return 0;
 }
 
+/*! \return 1 if the range asked (HC_GOT_RANGE) is to be honored: it is a real
+ * part of the file, and If-Range (if any) match it. */
+static int range_honored( const httpd_conn* hc ) {
+	return ( hc->last_byte_index >= hc->first_byte_index ) &&
+		( ( hc->last_byte_index != hc->sb.st_size - 1 ) || ( hc->first_byte_index > 0 ) ) &&
+		( hc->range_if == (time_t) -1 || hc->range_if == hc->sb.st_mtime );
+}
+
 static void make_log_entry(const httpd_conn* hc, time_t now, int status) {
 	char* ru;
 	char* rfc1413;
@@ -4085,6 +5090,23 @@ httpd_read_fully( int fd, void* buf, size_t nbytes )
  * \return the effective number of bytes written.
  */
 ssize_t httpd_write_fully( int fd, const void* buf, size_t nbytes ) {
+#ifdef ADAPT_LIMITS
+	struct timeval before, after;
+	ssize_t r;
+
+	if ( fd >= 0 && fd == adapt_client_fd ) {
+		/* (the time waiting for the client isn't part of the run time) */
+		(void) gettimeofday( &before, (struct timezone*) 0 );
+		r = write_fully( fd, buf, nbytes );
+		(void) gettimeofday( &after, (struct timezone*) 0 );
+		adapt_sent_msecs += ( after.tv_sec - before.tv_sec ) * 1000.0 + ( after.tv_usec - before.tv_usec ) / 1000.0;
+		return r;
+	}
+#endif /* ADAPT_LIMITS */
+	return write_fully( fd, buf, nbytes );
+}
+
+static ssize_t write_fully( int fd, const void* buf, size_t nbytes ) {
 	ssize_t nwritten=0;
 
 	while ( nwritten < nbytes ) {
@@ -4112,11 +5134,38 @@ ssize_t httpd_write_fully( int fd, const void* buf, size_t nbytes ) {
 void
 httpd_logstats( long secs )
 	{
+	int class;
+
 	if ( str_alloc_count > 0 )
 		syslog( LOG_INFO,
 			"  libhttpd - %d strings allocated, %lu bytes (%g bytes/str)",
 			str_alloc_count, (unsigned long) str_alloc_size,
 			(float) str_alloc_size / str_alloc_count );
+	for ( class = 0; class < ADMIT_CLASSES; class++ )
+		{
+		if ( admit_depth[class] == 0 && admit_count[class] == 0 && admit_timeouts[class] == 0 && admit_refused[class] == 0 )
+			continue;
+		syslog( LOG_INFO,
+			"  libhttpd - %s queue: %d waiting, %ld admitted (%ld ms avg, %ld max), %ld timed out, %ld refused",
+			admit_names[class], admit_depth[class], admit_count[class],
+			admit_count[class] > 0 ? admit_msecs[class] / admit_count[class] : 0L,
+			admit_maxmsecs[class], admit_timeouts[class], admit_refused[class] );
+		admit_count[class] = admit_timeouts[class] = admit_refused[class] = 0;
+		admit_msecs[class] = admit_maxmsecs[class] = 0;
+		}
+#ifdef ADAPT_LIMITS
+	for ( class = 0; class < ADMIT_CLASSES; class++ )
+		{
+		if ( adapt_running[class] == 0 && adapt_raised[class] == 0 && adapt_cuts[class] == 0 )
+			continue;
+		syslog( LOG_INFO,
+			"  libhttpd - %s processes: %d running, limit %d (raised %ld, cut %ld times), p%d %ld ms (baseline %ld ms)",
+			admit_names[class], adapt_running[class], (int) adapt_limit[class],
+			adapt_raised[class], adapt_cuts[class], ADAPT_PERCENTILE,
+			(long) adapt_recent[class], (long) adapt_baseline[class] );
+		adapt_raised[class] = adapt_cuts[class] = 0;
+		}
+#endif /* ADAPT_LIMITS */
 	}
 
 /* Generate a random string of size len from charset [G-Vg-v]
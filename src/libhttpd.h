@@ -102,6 +102,7 @@ typedef struct {
 	char* accepte; /* Accept-Encoding header */
 	char* acceptl; /* Accept-Language header */
 	char* cookie;
+	char* ifnonematch; /* If-None-Match header */
 	char* contenttype;
 	char* reqhost;
 	char* hdrhost;
@@ -110,11 +111,14 @@ typedef struct {
 	char* forwardedfor;
 	char* remoteuser;
 	char* response;
+	char* trailer; /* sent after the file (eg. the signature part of a multipart/msigned) */
+	char* rawreq; /* the request as it was read, before being parsed (cf. hpool.c) */
+	char* body; /* content of a response made in the server process (cf. httpd_send_body()) */
 	char* tmpbuff; /* used to prepare string as parsing and starting request is now multithread, it replace some previous static buff */
 	size_t maxdecodedurl, maxorigfilename, maxencodings,
 		maxtmpbuff, maxquery, maxaccept, maxaccepte, maxreqhost, maxhostdir,
-		maxremoteuser, maxresponse;
-	size_t responselen;
+		maxremoteuser, maxresponse, maxtrailer, maxbody, maxrawreq;
+	size_t responselen, trailerlen, rawreqlen, bodylen;
 	time_t if_modified_since, range_if;
 	ssize_t contentlength; /* maybe use off_t to be able to make bigger POST on 32-bits archs ? */
 	char* type;				/* not malloc()ed */
@@ -123,15 +127,30 @@ typedef struct {
 	off_t first_byte_index, last_byte_index;
 	struct stat sb;
 	int conn_fd;
+	int sigc_fd; /* signing job this request owns (cf. sigc_claim()), to be watched by the server */
+	void* gpgjob; /* gpgme operation run for this request by the server process (cf. gpgio.c) */
+	int cgi_fd; /* output of the CGI, when it's relayed by the server (cf. httpd_relay_cgi()) */
+	void* fcgijob; /* request passed to the FastCGI application (cf. fcgi.c) */
+	int admit_class; /* class of the process it waits for (cf. HC_ADMIT_WAIT) */
+	long admit_seq;
+	struct timeval admit_since;
 	char* file_address;
 	char boundary[BOUNDARYLEN+1];
 	} httpd_conn;
 
-#define HC_GOT_RANGE (1<<1)  /* if match "d-d" or "d-" , which is only supported (except when asked multipart/msigned on a local file) */
+#define HC_GOT_RANGE (1<<1)  /* if match "d-d" or "d-" , which is only supported (signed, only if the signature of the whole file is cached) */
 #define HC_KEEP_ALIVE (1<<2)
 #define HC_SHOULD_LINGER (1<<3)
 #define HC_DETACH_SIGN (1<<4)
 #define HC_LOG_DONE (1<<5)
+#define HC_SIGN_WAIT (1<<6) /* waiting for the signature another request is making */
+#define HC_BODY (1<<7) /* file_address is hc->body (not to unmap) */
+#define HC_GPG_WAIT (1<<8) /* waiting for its gpgme operation (cf. gpgjob) */
+#define HC_CGI_RELAY (1<<9) /* the output of its CGI is relayed by the server (cf. cgi_fd) */
+#define HC_CGI_HEADERS (1<<10) /* the headers of that output have been parsed */
+#define HC_FCGI_BODY (1<<11) /* the body is still to be passed to the FastCGI application */
+#define HC_ADMIT_WAIT (1<<12) /* waiting for a process to exit, to fork one (cf. ADMIT_QUEUE_DEPTH) */
+#define HC_GPG_FORK (1<<13) /* its gpgme operation gave up: to be handled by a forked process */
 
 /* Useless macros. BTW: if u really think it improves readability, u may use them */
 #define HX_SET(hx,mask) { (hx)->bfield |= (mask); }
@@ -146,7 +165,7 @@ typedef struct {
 	int option;
 } interpose_args_t;
 
-/* used to reference all active child (term security, cf. drop_child(), handle_chld() and shut_down().*/
+/* used to reference all active child (term security, cf. drop_child(), httpd_reaped() and shut_down().*/
 typedef struct {
 	pid_t pidmin;
 	pid_t pidmax;
@@ -196,6 +215,12 @@ void httpd_terminate( httpd_server* hs );
 /* Call to unlisten/close socket(s) listening for new connections. */
 void httpd_unlisten( httpd_server* hs );
 
+/* Call in a long-lived process forked by the server, to close the sockets
+** and pipes it inherited (listening sockets, client connections, gpg and
+** FastCGI operations).
+*/
+void httpd_close_inherited( httpd_server* hs );
+
 /* When a listen fd is ready to read, call this.  It does the accept() and
 ** returns an httpd_conn* which includes the fd to read the request from and
 ** write the response to.  Returns an indication of whether the accept()
@@ -210,6 +235,14 @@ int httpd_get_conn( httpd_server* hs, int listen_fd, httpd_conn* hc );
 #define GC_OK 1
 #define GC_NO_MORE 2
 
+/* Take over a connection accepted by another process, whose request (req, of
+** reqlen bytes) it has already read, and parse that request again. Like for
+** httpd_get_conn(), hc has to be zeroed before the first call.
+**
+** Returns -1 on error (an error response may then be buffered).
+*/
+int httpd_adopt_conn( httpd_server* hs, int conn_fd, char* req, size_t reqlen, httpd_conn* hc );
+
 /* Checks whether the data in hc->read_buf constitutes a complete request
 ** yet.  The caller reads data into hc->read_buf[hc->read_idx] and advances
 ** hc->read_idx.  This routine checks what has been read so far, using
@@ -244,7 +277,81 @@ void send_mime( httpd_conn* hc, int status, char* title, char* encodings, char*
 */
 int httpd_start_request( httpd_conn* hc, struct timeval* nowP );
 
-/* Actually sends any buffered response text. */
+/* Carry on a request which httpd_start_request() left waiting (HC_SIGN_WAIT)
+** for a signature being made for another one (once that job has ended), or
+** waiting to be admitted (HC_ADMIT_WAIT) once httpd_admissible() tells so,
+** or whose gpgme operation gave up (HC_GPG_FORK), to fork for it.
+** Returns like httpd_start_request(), and the request may wait again.
+*/
+int httpd_resume_request( httpd_conn* hc, struct timeval* nowP );
+
+/* Admission classes of the requests which need a process forked: in the
+** order they are admitted if ADMIT_PRIORITY is defined.
+*/
+#define ADMIT_HKP 0
+#define ADMIT_UDC 1
+#define ADMIT_SIGN 2
+#define ADMIT_CGI 3
+#define ADMIT_CLASSES 4
+
+/* Tells if a process of the admission class can be forked now. */
+int httpd_admissible( const httpd_server* hs, int class );
+
+/* Tells if the waiting request a has to be admitted before b. */
+int httpd_admit_before( const httpd_conn* a, const httpd_conn* b );
+
+/* To call from the main loop for each child reaped: if it's a request
+** process (cf. drop_child()), it's no more counted, and how long the
+** processes of each class take adapts their limit (cf. ADAPT_LIMITS).
+*/
+void httpd_reaped( httpd_server* hs, pid_t pid, struct timeval* nowP );
+
+#ifdef ADAPT_LIMITS
+
+/* Lowers the limits if the host is overloaded.  Should be called every few
+** seconds.
+*/
+void httpd_adapt( httpd_server* hs, struct timeval* nowP );
+#endif /* ADAPT_LIMITS */
+
+/* Ends the wait of a request which waited too long to be admitted: it gets a
+** 503 (returns -1), or if it was to be signed, is sent unsigned.  Returns like
+** httpd_start_request().
+*/
+int httpd_admit_expire( httpd_conn* hc, struct timeval* nowP );
+
+/* Relays the output of the CGI that httpd_start_request() left to the server
+** (HC_CGI_RELAY): parses its headers, then moves its content to the
+** connection, until one side would block.  The caller has then to wait for
+** hc->cgi_fd to be readable (RC_WAIT_CGI), for hc->conn_fd to be writable
+** (RC_WAIT_CONN), or, while the body is passed to a FastCGI application
+** (HC_FCGI_BODY), for hc->conn_fd to be readable (RC_WAIT_BODY) before
+** calling it again.
+**
+** Returns RC_DONE at the end of the output, or on error.
+*/
+int httpd_relay_cgi( httpd_conn* hc );
+#define RC_DONE 0
+#define RC_WAIT_CGI 1
+#define RC_WAIT_CONN 2
+#define RC_WAIT_BODY 3
+
+/* Prepare the response of a request whose content (of len bytes) has been
+** made into hc->body by the server process, so that the main loop sends it as
+** it would send a file. If sig is not null, the response is a
+** multipart/msigned whose signature part is sig. encodings is the
+** Content-Encoding of the content ("" if none), and extraheads are added to
+** the headers of the response.
+*/
+void httpd_send_body( httpd_conn* hc, int status, char* title, char* encodings, char* type, char* extraheads, size_t len, const char* sig, size_t siglen );
+
+/* Tells whether the client accepts the content coding (eg. "gzip"), as per
+** its Accept-Encoding header: 1 if it's listed, or matched by "*", with a
+** non-zero q value, else 0.
+*/
+int httpd_accepts_encoding( httpd_conn* hc, const char* coding );
+
+/* Actually sends any buffered response text (and trailer). */
 void httpd_write_response( httpd_conn* hc );
 
 /* Call this to close down a connection and free the data.  A fine point,
@@ -280,6 +387,8 @@ extern char* ok206title;
 extern char* err302title;
 extern char* err302form;
 extern char* err304title;
+extern char* err406title;
+extern char* err406form;
 extern char* err411title;
 extern char* err413title;
 extern char* err415title;
@@ -0,0 +1,1223 @@
+/* natsig.c - native signing and verification engine
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* gpgme_op_sign() spawns a gpg process, which talks (assuan) to gpg-agent,
+* for each signature. If libgcrypt is available, the secret key of the bot is
+* exported once at startup, and its signing (sub)key loaded in memory: the
+* OpenPGP v4 detached signatures are then made in process (SHA256 digest,
+* with a signature creation time and issuer fingerprint hashed subpackets,
+* and an issuer key ID unhashed one, like gpg does).
+*
+* Only unprotected (no passphrase, which is the case of bot keys) RSA and
+* Ed25519 keys are supported. Else natsig_init() fails, and gpgme stays the
+* one which signs.
+*
+* Likewise, natsig_verify() verify signatures made by RSA or Ed25519 keys
+* loaded in memory by natsig_load_keys(), and remember the good ones in a
+* table shared by all processes, so that a document received many times is
+* verified only once. The signatures of other keys are left to gpgme.
+*
+* Once the keyring has changed (a key may have been revoked), each process
+* loads the keys again, at most every NATSIG_RELOAD seconds: meanwhile, the
+* signatures are left to gpgme.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <gpgme.h>
+
+#include "config.h"
+#include "gpgio.h"
+#include "natsig.h"
+
+#ifdef HAVE_LIBGCRYPT
+
+#include <gcrypt.h>
+
+#define PGP_PK_RSA 1
+#define PGP_PK_RSA_S 3
+#define PGP_PK_EDDSA 22
+#define PGP_HASH_SHA256 8
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* minimum seconds between two loadings of the public keys */
+#define NATSIG_RELOAD 60
+
+/* 1.3.6.1.4.1.11591.15.1 */
+static const unsigned char ed25519_oid[] = { 0x2B, 0x06, 0x01, 0x04, 0x01, 0xDA, 0x47, 0x0F, 0x01 };
+
+/* The loaded signing key. */
+static gcry_sexp_t sec_key = (gcry_sexp_t) 0;
+static int key_algo;
+static unsigned char key_fpr[20];
+
+typedef struct {
+	const unsigned char * p;
+	size_t len;
+} natsig_buf_t;
+
+/* The public (sub)keys which can sign, sorted by fingerprint. */
+typedef struct {
+	unsigned char fpr[20];
+	unsigned char primary[20];
+	gcry_sexp_t key;
+	int algo;
+	int revoked;
+	time_t expires;
+} PubKey;
+static PubKey * pubkeys = (PubKey*) 0;
+static int num_pubkeys = 0;
+static char ** load_patterns = (char**) 0; /* (NULL for all the keyring) */
+static int64_t loaded_ring[GPGIO_RING_STAT]; /* stat of the keyring they come from */
+static time_t loaded_at = 0;
+static pthread_rwlock_t keys_lock = PTHREAD_RWLOCK_INITIALIZER; /* (write locked to load them again) */
+
+/* The verified signatures: a set associative table in a memory area shared
+ * by the processes forked after natsig_load_keys().
+ */
+#define VERIFIED_WAYS 4
+typedef struct {
+	unsigned char pair[32]; /* SHA256 of the signature, then of the data (16 bytes each) */
+	unsigned char fpr[20]; /* of the (sub)key which made it */
+	unsigned int stamp; /* for LRU replacement, 0 if unused */
+	int64_t created;
+} Verified;
+typedef struct {
+	pthread_mutex_t mutex;
+	unsigned int clock;
+	long verified_count, bad_count, hit_count, unverifiable_count;
+	Verified entries[NATSIG_VERIFIED];
+} VerifiedCache;
+static VerifiedCache * vcache = (VerifiedCache*) 0;
+
+/* Forwards. */
+static const char * signing_subkey( gpgme_ctx_t ctx, const char * fpr, gpgme_key_t * keyP );
+static int load_key( const unsigned char * buf, size_t len, const char * fpr );
+static int load_packet( const unsigned char * body, size_t len, const char * fpr );
+static int read_mpi( natsig_buf_t * b, natsig_buf_t * mpi );
+static gpgme_error_t make_sig( const unsigned char * digest, natsig_buf_t * header, time_t now, unsigned char ** pktP, size_t * lenP );
+static size_t put_mpi( unsigned char * out, const unsigned char * p, size_t len );
+static gpgme_error_t armor( gpgme_data_t sig, const unsigned char * pkt, size_t len );
+static int gcry_ready( void );
+static int next_packet( const unsigned char * buf, size_t len, size_t * iP, int * tagP, size_t * plenP );
+static size_t parse_pubkey( const unsigned char * body, size_t len, int * algoP, natsig_buf_t * n, natsig_buf_t * e, natsig_buf_t * q, unsigned char * fpr );
+static void hex_fpr( char * hex, const unsigned char * fpr );
+static int unhex_fpr( unsigned char * fpr, const char * hex );
+static int pubkey_cmp( const void * v1, const void * v2 );
+static PubKey * find_pubkey( const unsigned char * fpr, const unsigned char * keyid );
+static size_t dearmor( const char * in, size_t inlen, unsigned char * out );
+static int key_validity( const PubKey * pk, natsig_result_t * res );
+static int check_sig( PubKey * pk, int hash_algo, const unsigned char * digest, natsig_buf_t * b );
+static int load_keys( void );
+static int keys_current( void );
+static int verify( int loaded, const char * sig, size_t siglen, const char * data, size_t datalen, natsig_result_t * res );
+static void vcache_lock( void );
+static Verified * verified_find( const unsigned char * pair );
+static void verified_add( const unsigned char * pair, const unsigned char * fpr, time_t created );
+
+int natsig_init( gpgme_ctx_t ctx, const char * fpr ) {
+#ifdef GPGME_EXPORT_MODE_SECRET
+	gpgme_data_t keydata;
+	gpgme_error_t gpgerr;
+	gpgme_ctx_t ectx;
+	gpgme_key_t key;
+	const char * subfpr;
+	char * buf = (char *) 0;
+	size_t len;
+	int r;
+
+	if ( gcry_ready() < 0 )
+		return -1;
+
+	subfpr = signing_subkey(ctx, fpr, &key);
+	if ( ! subfpr )
+		return -1;
+
+	/* (a context of our own, to not change the armor of ctx) */
+	gpgerr = gpgme_new(&ectx);
+	if ( gpgerr == GPG_ERR_NO_ERROR ) {
+#if GPGME_VERSION_NUMBER >= 0x010400
+		/* A protected key can't be loaded anyway: don't ask for its passphrase */
+		(void) gpgme_set_pinentry_mode(ectx, GPGME_PINENTRY_MODE_CANCEL);
+#endif
+		gpgerr = gpgme_data_new(&keydata);
+		if ( gpgerr == GPG_ERR_NO_ERROR ) {
+			gpgerr = gpgme_op_export(ectx, fpr, GPGME_EXPORT_MODE_SECRET, keydata);
+			buf = gpgme_data_release_and_get_mem(keydata, &len);
+		}
+		gpgme_release(ectx);
+	}
+	if ( gpgerr != GPG_ERR_NO_ERROR ) {
+		syslog( LOG_WARNING, "natsig: exporting secret key %s - %s", fpr, gpgme_strerror(gpgerr));
+		gpgme_key_unref(key);
+		return -1;
+	}
+	r = -1;
+	if ( buf ) {
+		r = load_key((unsigned char *) buf, len, subfpr);
+		memset(buf, 0, len);
+		gpgme_free(buf);
+	}
+	gpgme_key_unref(key);
+	return r;
+#else /* GPGME_EXPORT_MODE_SECRET */
+	syslog( LOG_WARNING, "natsig: gpgme is too old to export secret keys");
+	return -1;
+#endif /* GPGME_EXPORT_MODE_SECRET */
+}
+
+/* Initialize libgcrypt once. Return 0, or -1 if it is too old. */
+static int gcry_ready( void ) {
+	if ( gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P) )
+		return 0;
+	if ( ! gcry_check_version(GCRYPT_VERSION) ) {
+		syslog( LOG_WARNING, "natsig: libgcrypt is older than %s", GCRYPT_VERSION);
+		return -1;
+	}
+	gcry_control(GCRYCTL_DISABLE_SECMEM, 0);
+	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+	return 0;
+}
+
+/*! signing_subkey find the (sub)key of fpr gpg would sign with: the most
+ * recent valid one which can sign, and whose secret part is available.
+ * \return its fingerprint (which live as long as *keyP), or NULL. */
+static const char * signing_subkey( gpgme_ctx_t ctx, const char * fpr, gpgme_key_t * keyP ) {
+	gpgme_error_t gpgerr;
+	gpgme_subkey_t sk, best = (gpgme_subkey_t) 0;
+
+	gpgerr = gpgme_get_key(ctx, fpr, keyP, 1);
+	if ( gpgerr != GPG_ERR_NO_ERROR ) {
+		syslog( LOG_WARNING, "natsig: gpgme_get_key(%s) - %s", fpr, gpgme_strerror(gpgerr));
+		return (const char *) 0;
+	}
+	for ( sk = (*keyP)->subkeys; sk; sk = sk->next )
+		if ( sk->can_sign && sk->secret && ! sk->revoked && ! sk->expired && ! sk->disabled && ! sk->invalid
+				&& sk->fpr && ( ! best || sk->timestamp >= best->timestamp ) )
+			best = sk;
+	if ( ! best ) {
+		syslog( LOG_WARNING, "natsig: %s has no usable signing key", fpr);
+		gpgme_key_unref(*keyP);
+		return (const char *) 0;
+	}
+	return best->fpr;
+}
+
+/*! load_key parse the transferable secret key buf, and load its (sub)key
+ * whose fingerprint is fpr.
+ * \return 0 on success, or -1 on error. */
+static int load_key( const unsigned char * buf, size_t len, const char * fpr ) {
+	size_t i = 0, plen;
+	int tag;
+	gcry_sexp_t s_data = (gcry_sexp_t) 0, s_sig = (gcry_sexp_t) 0;
+	unsigned char digest[32];
+
+	if ( sec_key )
+		gcry_sexp_release(sec_key);
+	sec_key = (gcry_sexp_t) 0;
+	while ( next_packet(buf, len, &i, &tag, &plen) == 0 ) {
+		/* secret key or secret subkey packets */
+		if ( (tag == 5 || tag == 7) && load_packet(buf + i, plen, fpr) == 0 )
+			break;
+		i += plen;
+	}
+	if ( ! sec_key ) {
+		syslog( LOG_WARNING, "natsig: no usable (unprotected RSA or Ed25519) signing key in %s", fpr);
+		return -1;
+	}
+
+	/* Check the key with a signature */
+	memset(digest, 0x5A, sizeof(digest));
+	if ( key_algo == PGP_PK_EDDSA )
+		gcry_sexp_build(&s_data, NULL, "(data(flags eddsa)(hash-algo sha512)(value %b))", (int) sizeof(digest), digest);
+	else
+		gcry_sexp_build(&s_data, NULL, "(data(flags pkcs1)(hash sha256 %b))", (int) sizeof(digest), digest);
+	if ( ! s_data || gcry_pk_sign(&s_sig, s_data, sec_key) || gcry_pk_verify(s_sig, s_data, sec_key) ) {
+		syslog( LOG_WARNING, "natsig: the key of %s doesn't pass the self test", fpr);
+		gcry_sexp_release(sec_key);
+		sec_key = (gcry_sexp_t) 0;
+	}
+	gcry_sexp_release(s_data);
+	gcry_sexp_release(s_sig);
+	if ( ! sec_key )
+		return -1;
+	syslog( LOG_INFO, "natsig: %s key loaded, signatures will be made natively", key_algo == PGP_PK_EDDSA ? "Ed25519" : "RSA");
+	return 0;
+}
+
+/*! next_packet find the packet at *iP in buf, and move *iP to its body.
+ * \return 0, or -1 if there is no more (complete) packet. */
+static int next_packet( const unsigned char * buf, size_t len, size_t * iP, int * tagP, size_t * plenP ) {
+	size_t i = *iP, plen;
+	int lt;
+
+	if ( i >= len || ! (buf[i] & 0x80) )
+		return -1;
+	if ( buf[i] & 0x40 ) {
+		/* new format */
+		*tagP = buf[i++] & 0x3F;
+		if ( i >= len )
+			return -1;
+		if ( buf[i] < 192 )
+			plen = buf[i++];
+		else if ( buf[i] < 224 ) {
+			if ( i + 1 >= len )
+				return -1;
+			plen = ((buf[i] - 192) << 8) + buf[i+1] + 192;
+			i += 2;
+		} else if ( buf[i] == 255 ) {
+			if ( i + 4 >= len )
+				return -1;
+			plen = ((size_t) buf[i+1] << 24) | (buf[i+2] << 16) | (buf[i+3] << 8) | buf[i+4];
+			i += 5;
+		} else
+			return -1; /* partial lengths are not for keys nor signatures */
+	} else {
+		/* old format */
+		*tagP = (buf[i] >> 2) & 0x0F;
+		lt = buf[i++] & 3;
+		if ( lt == 3 || i + (1 << lt) > len )
+			return -1;
+		for ( plen = 0, lt = 1 << lt; lt > 0; lt-- )
+			plen = (plen << 8) | buf[i++];
+	}
+	if ( plen > len - i )
+		return -1;
+	*iP = i;
+	*plenP = plen;
+	return 0;
+}
+
+/*! parse_pubkey read the public part of a v4 RSA or Ed25519 (sub)key packet,
+ * and compute its fingerprint.
+ * \return the length of the public part, or 0 if the key isn't supported. */
+static size_t parse_pubkey( const unsigned char * body, size_t len, int * algoP, natsig_buf_t * n, natsig_buf_t * e, natsig_buf_t * q, unsigned char * fpr ) {
+	natsig_buf_t b = { body, len }, oid;
+	unsigned char hdr[3];
+	gcry_md_hd_t md;
+	size_t publen;
+	int algo;
+
+	if ( len < 6 || body[0] != 4 )
+		return 0;
+	algo = body[5];
+	b.p += 6; b.len -= 6;
+	if ( algo == PGP_PK_RSA || algo == PGP_PK_RSA_S ) {
+		if ( read_mpi(&b, n) || read_mpi(&b, e) )
+			return 0;
+		algo = PGP_PK_RSA;
+	} else if ( algo == PGP_PK_EDDSA ) {
+		if ( b.len < 1 || b.p[0] + 1 > b.len )
+			return 0;
+		oid.p = b.p + 1; oid.len = b.p[0];
+		b.p += 1 + oid.len; b.len -= 1 + oid.len;
+		if ( oid.len != sizeof(ed25519_oid) || memcmp(oid.p, ed25519_oid, oid.len)
+				|| read_mpi(&b, q) || q->len != 33 || q->p[0] != 0x40 )
+			return 0;
+	} else
+		return 0;
+	publen = b.p - body;
+
+	/* v4 fingerprint */
+	hdr[0] = 0x99; hdr[1] = (publen >> 8) & 0xFF; hdr[2] = publen & 0xFF;
+	if ( gcry_md_open(&md, GCRY_MD_SHA1, 0) )
+		return 0;
+	gcry_md_write(md, hdr, 3);
+	gcry_md_write(md, body, publen);
+	memcpy(fpr, gcry_md_read(md, 0), 20);
+	gcry_md_close(md);
+	*algoP = algo;
+	return publen;
+}
+
+/*! load_packet load the key of a secret (sub)key packet, if its fingerprint
+ * is fpr and if it is usable.
+ * \return 0 if the key have been loaded, -1 if not. */
+static int load_packet( const unsigned char * body, size_t len, const char * fpr ) {
+	natsig_buf_t b, n, e, d, p, q, u;
+	unsigned char fprbuf[20], seed[32];
+	char hexfpr[41];
+	gcry_sexp_t key = (gcry_sexp_t) 0;
+	gcry_mpi_t mn, me, md, mp, mq, mu;
+	size_t publen;
+	int algo;
+
+	publen = parse_pubkey(body, len, &algo, &n, &e, &q, fprbuf);
+	if ( publen == 0 )
+		return -1;
+	hex_fpr(hexfpr, fprbuf);
+	if ( strcasecmp(hexfpr, fpr) )
+		return -1;
+	b.p = body + publen;
+	b.len = len - publen;
+
+	/* secret part: only unprotected keys */
+	if ( b.len < 1 || b.p[0] != 0 )
+		return -1;
+	b.p++; b.len--;
+	if ( algo == PGP_PK_EDDSA ) {
+		if ( read_mpi(&b, &d) || d.len > 32 )
+			return -1;
+		memset(seed, 0, sizeof(seed));
+		memcpy(seed + 32 - d.len, d.p, d.len);
+		gcry_sexp_build(&key, NULL, "(private-key(ecc(curve Ed25519)(flags eddsa)(q %b)(d %b)))",
+			(int) q.len, q.p, (int) sizeof(seed), seed);
+		memset(seed, 0, sizeof(seed));
+	} else {
+		if ( read_mpi(&b, &d) || read_mpi(&b, &p) || read_mpi(&b, &q) || read_mpi(&b, &u) )
+			return -1;
+		mn = me = md = mp = mq = mu = (gcry_mpi_t) 0;
+		if ( ! gcry_mpi_scan(&mn, GCRYMPI_FMT_USG, n.p, n.len, NULL)
+				&& ! gcry_mpi_scan(&me, GCRYMPI_FMT_USG, e.p, e.len, NULL)
+				&& ! gcry_mpi_scan(&md, GCRYMPI_FMT_USG, d.p, d.len, NULL)
+				&& ! gcry_mpi_scan(&mp, GCRYMPI_FMT_USG, p.p, p.len, NULL)
+				&& ! gcry_mpi_scan(&mq, GCRYMPI_FMT_USG, q.p, q.len, NULL)
+				&& ! gcry_mpi_scan(&mu, GCRYMPI_FMT_USG, u.p, u.len, NULL) )
+			/* (OpenPGP and libgcrypt both want p < q and u = p^-1 mod q) */
+			gcry_sexp_build(&key, NULL, "(private-key(rsa(n %m)(e %m)(d %m)(p %m)(q %m)(u %m)))",
+				mn, me, md, mp, mq, mu);
+		gcry_mpi_release(mn); gcry_mpi_release(me); gcry_mpi_release(md);
+		gcry_mpi_release(mp); gcry_mpi_release(mq); gcry_mpi_release(mu);
+	}
+	if ( ! key )
+		return -1;
+
+	sec_key = key;
+	key_algo = algo;
+	memcpy(key_fpr, fprbuf, 20);
+	return 0;
+}
+
+/* Read an MPI (without its leading zeros) from b. Return 0, or -1 on error. */
+static int read_mpi( natsig_buf_t * b, natsig_buf_t * mpi ) {
+	size_t bits, len;
+
+	if ( b->len < 2 )
+		return -1;
+	bits = (b->p[0] << 8) | b->p[1];
+	len = (bits + 7) / 8;
+	if ( len > b->len - 2 )
+		return -1;
+	mpi->p = b->p + 2;
+	mpi->len = len;
+	b->p += 2 + len;
+	b->len -= 2 + len;
+	return 0;
+}
+
+gpgme_error_t natsig_sign( gpgme_data_t in, gpgme_data_t sig ) {
+	unsigned char buf[8192], hashed[6 + 6 + 23];
+	natsig_buf_t header = { hashed, sizeof(hashed) };
+	unsigned char * pkt = (unsigned char *) 0;
+	size_t pktlen = 0;
+	gcry_md_hd_t md;
+	gpgme_error_t gpgerr;
+	time_t now = time( (time_t*) 0 );
+	ssize_t r;
+
+	if ( ! sec_key )
+		return NATSIG_UNAVAILABLE;
+
+	/* version, type (binary document), algos, hashed subpackets */
+	hashed[0] = 4;
+	hashed[1] = 0x00;
+	hashed[2] = key_algo;
+	hashed[3] = PGP_HASH_SHA256;
+	hashed[4] = 0;
+	hashed[5] = 6 + 23;
+	hashed[6] = 5; hashed[7] = 2; /* signature creation time */
+	hashed[8] = (now >> 24) & 0xFF; hashed[9] = (now >> 16) & 0xFF;
+	hashed[10] = (now >> 8) & 0xFF; hashed[11] = now & 0xFF;
+	hashed[12] = 22; hashed[13] = 33; hashed[14] = 4; /* issuer fingerprint */
+	memcpy(hashed + 15, key_fpr, 20);
+
+	if ( gcry_md_open(&md, GCRY_MD_SHA256, 0) )
+		return gpgme_error_from_errno(ENOMEM);
+	while ( (r=gpgme_data_read(in, buf, sizeof(buf))) > 0 )
+		gcry_md_write(md, buf, r);
+	if ( r < 0 ) {
+		gpgerr = gpgme_error_from_errno(errno);
+		gcry_md_close(md);
+		return gpgerr;
+	}
+	gcry_md_write(md, hashed, sizeof(hashed));
+	buf[0] = 4; buf[1] = 0xFF;
+	buf[2] = 0; buf[3] = 0; buf[4] = 0; buf[5] = sizeof(hashed);
+	gcry_md_write(md, buf, 6);
+
+	gpgerr = make_sig(gcry_md_read(md, 0), &header, now, &pkt, &pktlen);
+	gcry_md_close(md);
+	if ( gpgerr == GPG_ERR_NO_ERROR ) {
+		gpgerr = armor(sig, pkt, pktlen);
+		free(pkt);
+	}
+	return gpgerr;
+}
+
+/*! make_sig sign digest and build the signature packet.
+ * \return GPG_ERR_NO_ERROR, or a gpgme error. */
+static gpgme_error_t make_sig( const unsigned char * digest, natsig_buf_t * header, time_t now, unsigned char ** pktP, size_t * lenP ) {
+	gcry_sexp_t s_data = (gcry_sexp_t) 0, s_sig = (gcry_sexp_t) 0, l;
+	const char * names[2];
+	size_t vlen[2], i, n, bodylen;
+	void * vals[2] = { NULL, NULL };
+	unsigned char * pkt;
+	int nvals, err;
+
+	if ( key_algo == PGP_PK_EDDSA ) {
+		err = gcry_sexp_build(&s_data, NULL, "(data(flags eddsa)(hash-algo sha512)(value %b))", 32, digest);
+		names[0] = "r"; names[1] = "s"; nvals = 2;
+	} else {
+		err = gcry_sexp_build(&s_data, NULL, "(data(flags pkcs1)(hash sha256 %b))", 32, digest);
+		names[0] = "s"; nvals = 1;
+	}
+	if ( ! err )
+		err = gcry_pk_sign(&s_sig, s_data, sec_key);
+	gcry_sexp_release(s_data);
+	if ( err ) {
+		syslog( LOG_ERR, "natsig: %s", gcry_strerror(err));
+		return gpgme_error(GPG_ERR_GENERAL);
+	}
+	for ( i = 0; i < nvals; i++ ) {
+		l = gcry_sexp_find_token(s_sig, names[i], 0);
+		if ( l )
+			vals[i] = gcry_sexp_nth_buffer(l, 1, &vlen[i]);
+		gcry_sexp_release(l);
+		if ( ! vals[i] ) {
+			gcry_sexp_release(s_sig);
+			gcry_free(vals[0]);
+			return gpgme_error(GPG_ERR_GENERAL);
+		}
+	}
+	gcry_sexp_release(s_sig);
+
+	/* header + unhashed (issuer key id) + left 16 bits + MPIs */
+	bodylen = header->len + 2 + 10 + 2;
+	for ( i = 0; i < nvals; i++ )
+		bodylen += 2 + vlen[i];
+	pkt = malloc(6 + bodylen);
+	if ( ! pkt ) {
+		for ( i = 0; i < nvals; i++ )
+			gcry_free(vals[i]);
+		return gpgme_error_from_errno(ENOMEM);
+	}
+	n = 0;
+	pkt[n++] = 0xC2; /* new format, tag 2 (signature) */
+	/* (length filled below, once known) */
+	n += 5;
+	memcpy(pkt + n, header->p, header->len);
+	n += header->len;
+	pkt[n++] = 0; pkt[n++] = 10;
+	pkt[n++] = 9; pkt[n++] = 16; /* issuer key id */
+	memcpy(pkt + n, key_fpr + 12, 8);
+	n += 8;
+	pkt[n++] = digest[0]; pkt[n++] = digest[1];
+	for ( i = 0; i < nvals; i++ ) {
+		n += put_mpi(pkt + n, vals[i], vlen[i]);
+		gcry_free(vals[i]);
+	}
+	bodylen = n - 6;
+	if ( bodylen < 192 ) {
+		pkt[4] = 0xC2;
+		pkt[5] = bodylen;
+		memmove(pkt, pkt + 4, n - 4);
+		n -= 4;
+	} else if ( bodylen < 8384 ) {
+		pkt[3] = 0xC2;
+		pkt[4] = ((bodylen - 192) >> 8) + 192;
+		pkt[5] = (bodylen - 192) & 0xFF;
+		memmove(pkt, pkt + 3, n - 3);
+		n -= 3;
+	} else {
+		pkt[1] = 0xFF;
+		pkt[2] = (bodylen >> 24) & 0xFF; pkt[3] = (bodylen >> 16) & 0xFF;
+		pkt[4] = (bodylen >> 8) & 0xFF; pkt[5] = bodylen & 0xFF;
+	}
+	*pktP = pkt;
+	*lenP = n;
+	return GPG_ERR_NO_ERROR;
+}
+
+/* Write p (big endian, unsigned) as an OpenPGP MPI. Return the bytes written. */
+static size_t put_mpi( unsigned char * out, const unsigned char * p, size_t len ) {
+	size_t bits;
+	unsigned char c;
+
+	while ( len > 0 && *p == 0 ) {
+		p++;
+		len--;
+	}
+	bits = len * 8;
+	if ( len > 0 )
+		for ( c = p[0]; ! (c & 0x80); c <<= 1 )
+			bits--;
+	out[0] = (bits >> 8) & 0xFF;
+	out[1] = bits & 0xFF;
+	memcpy(out + 2, p, len);
+	return 2 + len;
+}
+
+/* ASCII armor pkt into sig (with its CRC24, like gpg do). */
+static gpgme_error_t armor( gpgme_data_t sig, const unsigned char * pkt, size_t len ) {
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char head[] = "-----BEGIN PGP SIGNATURE-----\n\n";
+	static const char tail[] = "-----END PGP SIGNATURE-----\n";
+	char * out, * cp;
+	unsigned long crc = 0xB704CEL, v;
+	size_t i, j, outlen;
+	ssize_t r;
+
+	for ( i = 0; i < len; i++ ) {
+		crc ^= (unsigned long) pkt[i] << 16;
+		for ( j = 0; j < 8; j++ ) {
+			crc <<= 1;
+			if ( crc & 0x1000000 )
+				crc ^= 0x1864CFBL;
+		}
+	}
+	crc &= 0xFFFFFF;
+
+	outlen = sizeof(head) + (len + 2) / 3 * 4 + len / 48 + 2 + 6 + sizeof(tail);
+	out = malloc(outlen);
+	if ( ! out )
+		return gpgme_error_from_errno(ENOMEM);
+	cp = out;
+	memcpy(cp, head, sizeof(head) - 1);
+	cp += sizeof(head) - 1;
+	for ( i = 0; i < len; i += 3 ) {
+		v = (unsigned long) pkt[i] << 16;
+		if ( i + 1 < len )
+			v |= pkt[i+1] << 8;
+		if ( i + 2 < len )
+			v |= pkt[i+2];
+		*cp++ = b64[(v >> 18) & 0x3F];
+		*cp++ = b64[(v >> 12) & 0x3F];
+		*cp++ = i + 1 < len ? b64[(v >> 6) & 0x3F] : '=';
+		*cp++ = i + 2 < len ? b64[v & 0x3F] : '=';
+		/* 64 characters per line */
+		if ( (i / 3 + 1) % 16 == 0 || i + 3 >= len )
+			*cp++ = '\n';
+	}
+	*cp++ = '=';
+	*cp++ = b64[(crc >> 18) & 0x3F];
+	*cp++ = b64[(crc >> 12) & 0x3F];
+	*cp++ = b64[(crc >> 6) & 0x3F];
+	*cp++ = b64[crc & 0x3F];
+	*cp++ = '\n';
+	memcpy(cp, tail, sizeof(tail) - 1);
+	cp += sizeof(tail) - 1;
+
+	r = gpgme_data_write(sig, out, cp - out);
+	free(out);
+	return ( r == cp - out ) ? GPG_ERR_NO_ERROR : gpgme_error_from_errno(errno);
+}
+
+static void hex_fpr( char * hex, const unsigned char * fpr ) {
+	int i;
+
+	for ( i = 0; i < 20; i++ )
+		sprintf(hex + 2*i, "%02X", fpr[i]);
+}
+
+static int unhex_fpr( unsigned char * fpr, const char * hex ) {
+	unsigned int c;
+	int i;
+
+	if ( strlen(hex) != 40 )
+		return -1;
+	for ( i = 0; i < 20; i++ ) {
+		if ( sscanf(hex + 2*i, "%2x", &c) != 1 )
+			return -1;
+		fpr[i] = c;
+	}
+	return 0;
+}
+
+static int pubkey_cmp( const void * v1, const void * v2 ) {
+	return memcmp(((const PubKey *) v1)->fpr, ((const PubKey *) v2)->fpr, 20);
+}
+
+int natsig_load_keys( const char * patterns[] ) {
+	pthread_mutexattr_t attr;
+	int j;
+
+	if ( gcry_ready() < 0 )
+		return -1;
+
+	if ( ! vcache ) {
+		vcache = mmap(NULL, sizeof(VerifiedCache), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if ( vcache == MAP_FAILED ) {
+			syslog( LOG_ERR, "natsig: mmap - %m" );
+			vcache = (VerifiedCache*) 0;
+		} else {
+			memset(vcache, 0, sizeof(VerifiedCache));
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+			/* (a process killed while holding it must not block the others) */
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+			pthread_mutex_init(&vcache->mutex, &attr);
+			pthread_mutexattr_destroy(&attr);
+		}
+	}
+
+	/* (kept, to load them again once the keyring has changed) */
+	if ( load_patterns ) {
+		for ( j = 0; load_patterns[j]; j++ )
+			free(load_patterns[j]);
+		free(load_patterns);
+		load_patterns = (char**) 0;
+	}
+	if ( patterns ) {
+		for ( j = 0; patterns[j]; j++ )
+			;
+		if ( ! (load_patterns=calloc(j + 1, sizeof(char*))) ) {
+			syslog( LOG_ERR, "natsig: out of memory loading keys" );
+			return -1;
+		}
+		for ( j = 0; patterns[j]; j++ )
+			if ( ! (load_patterns[j]=strdup(patterns[j])) ) {
+				syslog( LOG_ERR, "natsig: out of memory loading keys" );
+				return -1;
+			}
+	}
+	return load_keys();
+}
+
+/*! load_keys load the public (sub)keys of load_patterns.
+ * \return the number of (sub)keys loaded, or -1 on error. */
+static int load_keys( void ) {
+	const char ** patterns = (const char **) load_patterns;
+	gpgme_ctx_t lctx;
+	gpgme_key_t key;
+	gpgme_subkey_t sk;
+	gpgme_data_t keydata;
+	gpgme_error_t gpgerr;
+	natsig_buf_t n, e, q;
+	PubKey pk, * pkP;
+	gcry_mpi_t mn, me;
+	unsigned char * buf = (unsigned char *) 0;
+	size_t len, i, plen;
+	int max_pubkeys = 0, tag, algo, j;
+
+	for ( j = 0; j < num_pubkeys; j++ )
+		gcry_sexp_release(pubkeys[j].key);
+	num_pubkeys = 0;
+	/* (before listing them, so that a change meanwhile isn't missed) */
+	(void) gpgio_ring_stat(loaded_ring);
+	loaded_at = time( (time_t*) 0 );
+
+	/* (a context of our own, without armor nor signatures listing) */
+	gpgerr = gpgme_new(&lctx);
+	if ( gpgerr != GPG_ERR_NO_ERROR ) {
+		syslog( LOG_ERR, "natsig: gpgme_new - %s", gpgme_strerror(gpgerr));
+		return -1;
+	}
+
+	/* First the (sub)keys which can sign, and their status */
+	gpgerr = gpgme_op_keylist_ext_start(lctx, patterns, 0, 0);
+	while ( gpgerr == GPG_ERR_NO_ERROR && (gpgerr=gpgme_op_keylist_next(lctx, &key)) == GPG_ERR_NO_ERROR ) {
+		for ( sk = key->subkeys; sk; sk = sk->next ) {
+			if ( ! sk->can_sign || ! sk->fpr || unhex_fpr(pk.fpr, sk->fpr) < 0
+					|| unhex_fpr(pk.primary, key->subkeys->fpr) < 0 )
+				continue;
+			pk.key = (gcry_sexp_t) 0;
+			pk.algo = 0;
+			pk.revoked = key->revoked || sk->revoked;
+			pk.expires = sk->expires;
+			if ( num_pubkeys >= max_pubkeys ) {
+				max_pubkeys = max_pubkeys ? max_pubkeys * 2 : 256;
+				pkP = realloc(pubkeys, max_pubkeys * sizeof(PubKey));
+				if ( ! pkP ) {
+					syslog( LOG_ERR, "natsig: out of memory loading keys" );
+					break;
+				}
+				pubkeys = pkP;
+			}
+			pubkeys[num_pubkeys++] = pk;
+		}
+		gpgme_key_unref(key);
+	}
+	if ( gpg_err_code(gpgerr) != GPG_ERR_EOF )
+		syslog( LOG_ERR, "natsig: gpgme_op_keylist_next - %s", gpgme_strerror(gpgerr));
+	(void) gpgme_op_keylist_end(lctx);
+	if ( num_pubkeys > 0 )
+		qsort(pubkeys, num_pubkeys, sizeof(PubKey), pubkey_cmp);
+
+	/* Then their material */
+	gpgerr = gpgme_data_new(&keydata);
+	if ( gpgerr == GPG_ERR_NO_ERROR ) {
+		gpgerr = gpgme_op_export_ext(lctx, patterns, 0, keydata);
+		buf = (unsigned char *) gpgme_data_release_and_get_mem(keydata, &len);
+	}
+	gpgme_release(lctx);
+	if ( gpgerr != GPG_ERR_NO_ERROR )
+		syslog( LOG_ERR, "natsig: exporting public keys - %s", gpgme_strerror(gpgerr));
+	for ( i = 0; buf && next_packet(buf, len, &i, &tag, &plen) == 0; i += plen ) {
+		/* public key or public subkey packets */
+		if ( (tag != 6 && tag != 14) || parse_pubkey(buf + i, plen, &algo, &n, &e, &q, pk.fpr) == 0 )
+			continue;
+		pkP = bsearch(&pk, pubkeys, num_pubkeys, sizeof(PubKey), pubkey_cmp);
+		if ( ! pkP || pkP->key )
+			continue;
+		if ( algo == PGP_PK_EDDSA )
+			gcry_sexp_build(&pkP->key, NULL, "(public-key(ecc(curve Ed25519)(flags eddsa)(q %b)))", (int) q.len, q.p);
+		else {
+			mn = me = (gcry_mpi_t) 0;
+			if ( ! gcry_mpi_scan(&mn, GCRYMPI_FMT_USG, n.p, n.len, NULL)
+					&& ! gcry_mpi_scan(&me, GCRYMPI_FMT_USG, e.p, e.len, NULL) )
+				gcry_sexp_build(&pkP->key, NULL, "(public-key(rsa(n %m)(e %m)))", mn, me);
+			gcry_mpi_release(mn);
+			gcry_mpi_release(me);
+		}
+		pkP->algo = algo;
+	}
+	if ( buf )
+		gpgme_free(buf);
+
+	/* Drop the keys of unsupported algorithms (their signatures are left to gpgme) */
+	for ( i = j = 0; j < num_pubkeys; j++ )
+		if ( pubkeys[j].key )
+			pubkeys[i++] = pubkeys[j];
+	num_pubkeys = i;
+	syslog( LOG_INFO, "natsig: %d public (sub)keys loaded, their signatures will be verified natively", num_pubkeys);
+	return num_pubkeys;
+}
+
+/*! keys_current tell if the loaded keys are still those of the keyring, and
+ * load them again if it changed (unless they were loaded less than
+ * NATSIG_RELOAD seconds ago).
+ * \return 1 if so, 0 if not (their status may be wrong). */
+static int keys_current( void ) {
+	int64_t st[GPGIO_RING_STAT];
+	int same, late;
+
+	if ( gpgio_ring_stat(st) < 0 )
+		return 1;
+	pthread_rwlock_rdlock(&keys_lock);
+	same = ! memcmp(st, loaded_ring, sizeof(st));
+	late = time( (time_t*) 0 ) - loaded_at >= NATSIG_RELOAD;
+	pthread_rwlock_unlock(&keys_lock);
+	if ( same || ! late )
+		return same;
+	pthread_rwlock_wrlock(&keys_lock);
+	/* (unless an other thread just did it) */
+	if ( memcmp(st, loaded_ring, sizeof(st)) && time( (time_t*) 0 ) - loaded_at >= NATSIG_RELOAD ) {
+		syslog( LOG_INFO, "natsig: the keyring has changed, loading the public keys again");
+		(void) load_keys();
+	}
+	same = ! memcmp(st, loaded_ring, sizeof(st));
+	pthread_rwlock_unlock(&keys_lock);
+	return same;
+}
+
+/* Find the loaded key of fingerprint fpr, or else of key ID keyid. */
+static PubKey * find_pubkey( const unsigned char * fpr, const unsigned char * keyid ) {
+	PubKey pk;
+	int i;
+
+	if ( fpr ) {
+		memcpy(pk.fpr, fpr, 20);
+		return bsearch(&pk, pubkeys, num_pubkeys, sizeof(PubKey), pubkey_cmp);
+	}
+	if ( keyid )
+		for ( i = 0; i < num_pubkeys; i++ )
+			if ( ! memcmp(pubkeys[i].fpr + 12, keyid, 8) )
+				return &pubkeys[i];
+	return (PubKey*) 0;
+}
+
+/*! dearmor decode into out (which must be inlen bytes long) the ASCII armored
+ * in. If in is not armored, it is just copied.
+ * \return the number of decoded bytes, or 0 on error. */
+static size_t dearmor( const char * in, size_t inlen, unsigned char * out ) {
+	const char * cp, * end = in + inlen;
+	unsigned long v = 0;
+	size_t n = 0;
+	int bits = 0, c;
+
+	if ( inlen < 5 || strncmp(in, "-----", 5) ) {
+		memcpy(out, in, inlen);
+		return inlen;
+	}
+	/* skip the armor header line and the armor headers, up to an empty line */
+	for ( cp = in; cp < end; ) {
+		while ( cp < end && *cp != '\n' )
+			cp++;
+		if ( cp < end )
+			cp++;
+		if ( cp < end && *cp == '\r' )
+			cp++;
+		if ( cp < end && *cp == '\n' ) {
+			cp++;
+			break;
+		}
+	}
+	for ( ; cp < end; cp++ ) {
+		c = *cp;
+		if ( c >= 'A' && c <= 'Z' )
+			c -= 'A';
+		else if ( c >= 'a' && c <= 'z' )
+			c -= 'a' - 26;
+		else if ( c >= '0' && c <= '9' )
+			c -= '0' - 52;
+		else if ( c == '+' )
+			c = 62;
+		else if ( c == '/' )
+			c = 63;
+		else if ( c == '=' || c == '-' )
+			break; /* padding, checksum or armor tail */
+		else
+			continue;
+		v = (v << 6) | c;
+		bits += 6;
+		if ( bits >= 8 ) {
+			bits -= 8;
+			out[n++] = (v >> bits) & 0xFF;
+		}
+	}
+	return n;
+}
+
+/* Set res->validity from the status of the key pk. */
+static int key_validity( const PubKey * pk, natsig_result_t * res ) {
+	hex_fpr(res->fpr, pk->fpr);
+	hex_fpr(res->primary, pk->primary);
+	if ( pk->revoked )
+		res->validity = NATSIG_KEYREVOKED;
+	else if ( pk->expires && pk->expires < time( (time_t*) 0 ) )
+		res->validity = NATSIG_KEYEXPIRED;
+	else
+		res->validity = NATSIG_GOOD;
+	return res->validity;
+}
+
+int natsig_verify( const char * sig, size_t siglen, const char * data, size_t datalen, natsig_result_t * res ) {
+	int loaded, r;
+
+	loaded = keys_current();
+	pthread_rwlock_rdlock(&keys_lock);
+	r = verify(loaded, sig, siglen, data, datalen, res);
+	pthread_rwlock_unlock(&keys_lock);
+	return r;
+}
+
+/*! verify is natsig_verify() once the keys are read locked, with the keys
+ * not to be trusted if not loaded.
+ * \return res->validity. */
+static int verify( int loaded, const char * sig, size_t siglen, const char * data, size_t datalen, natsig_result_t * res ) {
+	static const int hash_algos[] = { 0, 0, GCRY_MD_SHA1, 0, 0, 0, 0, 0, GCRY_MD_SHA256, GCRY_MD_SHA384, GCRY_MD_SHA512, GCRY_MD_SHA224 };
+	unsigned char * pkt, pair[32], sighash[32], trailer[6];
+	const unsigned char * fpr = (const unsigned char *) 0, * keyid = (const unsigned char *) 0;
+	const unsigned char * hashed, * sp, * spend, * digest;
+	natsig_buf_t b;
+	gcry_md_hd_t md, mdd;
+	PubKey * pk;
+	Verified * v;
+	size_t len, i = 0, plen = 0, hlen, sublen, k;
+	int tag, type, hash_algo, pass, paired = 0;
+
+	memset(res, 0, sizeof(*res));
+	res->validity = NATSIG_UNSUPPORTED;
+	pkt = malloc(siglen);
+	if ( ! pkt )
+		return res->validity;
+	len = dearmor(sig, siglen, pkt);
+
+	/* The signature packet (v4, of a binary or text document) */
+	if ( next_packet(pkt, len, &i, &tag, &plen) < 0 || tag != 2 || plen < 6 || pkt[i] != 4 ) {
+		free(pkt);
+		return res->validity;
+	}
+	b.p = pkt + i;
+	b.len = plen;
+	type = b.p[1];
+	hash_algo = b.p[3] < sizeof(hash_algos)/sizeof(*hash_algos) ? hash_algos[b.p[3]] : 0;
+	hashed = b.p;
+	hlen = 6 + ((b.p[4] << 8) | b.p[5]);
+	if ( (type != 0x00 && type != 0x01) || ! hash_algo || hlen + 2 > b.len ) {
+		free(pkt);
+		return res->validity;
+	}
+
+	/* Its subpackets: creation time, issuer fingerprint and issuer key ID */
+	for ( pass = 0, sp = b.p + 6, spend = b.p + hlen; pass < 2; pass++ ) {
+		while ( sp < spend ) {
+			if ( *sp < 192 ) {
+				sublen = *sp++;
+			} else if ( *sp < 255 && sp + 1 < spend ) {
+				sublen = ((sp[0] - 192) << 8) + sp[1] + 192;
+				sp += 2;
+			} else if ( *sp == 255 && sp + 4 < spend ) {
+				sublen = ((size_t) sp[1] << 24) | (sp[2] << 16) | (sp[3] << 8) | sp[4];
+				sp += 5;
+			} else
+				break;
+			if ( sublen < 1 || sublen > (size_t) (spend - sp) )
+				break;
+			switch ( sp[0] & 0x7F ) {
+				case 2:
+					if ( pass == 0 && sublen == 5 )
+						res->created = ((time_t) sp[1] << 24) | (sp[2] << 16) | (sp[3] << 8) | sp[4];
+					break;
+				case 16:
+					if ( sublen == 9 )
+						keyid = sp + 1;
+					break;
+				case 33:
+					if ( sublen == 22 && sp[1] == 4 )
+						fpr = sp + 2;
+					break;
+			}
+			sp += sublen;
+		}
+		/* unhashed ones */
+		sp = b.p + hlen;
+		k = (sp[0] << 8) | sp[1];
+		sp += 2;
+		if ( k > b.len - hlen - 2 ) {
+			free(pkt);
+			return res->validity;
+		}
+		spend = sp + k;
+	}
+	b.p = spend;
+	b.len -= spend - hashed;
+
+	pk = loaded ? find_pubkey(fpr, keyid) : (PubKey*) 0;
+	if ( ! pk ) {
+		if ( vcache ) {
+			vcache_lock();
+			vcache->unverifiable_count++;
+			pthread_mutex_unlock(&vcache->mutex);
+		}
+		free(pkt);
+		return res->validity = NATSIG_NOKEY;
+	}
+
+	/* Hash the data (canonicalizing line endings of text documents) */
+	if ( gcry_md_open(&md, hash_algo, 0) || gcry_md_enable(md, GCRY_MD_SHA256) ) {
+		free(pkt);
+		return res->validity;
+	}
+	if ( type == 0x01 ) {
+		for ( i = k = 0; k < datalen; k++ )
+			if ( data[k] == '\n' && ( k == 0 || data[k-1] != '\r' ) ) {
+				gcry_md_write(md, data + i, k - i);
+				gcry_md_write(md, "\r\n", 2);
+				i = k + 1;
+			}
+		gcry_md_write(md, data + i, datalen - i);
+	} else
+		gcry_md_write(md, data, datalen);
+
+	/* Was it already verified ? */
+	if ( vcache && gcry_md_copy(&mdd, md) == 0 ) {
+		gcry_md_hash_buffer(GCRY_MD_SHA256, sighash, sig, siglen);
+		memcpy(pair, sighash, 16);
+		memcpy(pair + 16, gcry_md_read(mdd, GCRY_MD_SHA256), 16);
+		gcry_md_close(mdd);
+		paired = 1;
+		vcache_lock();
+		v = verified_find(pair);
+		if ( v && ! memcmp(v->fpr, pk->fpr, 20) ) {
+			v->stamp = ++vcache->clock;
+			res->created = v->created;
+			vcache->hit_count++;
+			pthread_mutex_unlock(&vcache->mutex);
+			gcry_md_close(md);
+			free(pkt);
+			return key_validity(pk, res);
+		}
+		pthread_mutex_unlock(&vcache->mutex);
+	}
+
+	/* Then the hashed part of the signature packet, and its trailer */
+	gcry_md_write(md, hashed, hlen);
+	trailer[0] = 4;
+	trailer[1] = 0xFF;
+	trailer[2] = (hlen >> 24) & 0xFF; trailer[3] = (hlen >> 16) & 0xFF;
+	trailer[4] = (hlen >> 8) & 0xFF; trailer[5] = hlen & 0xFF;
+	gcry_md_write(md, trailer, 6);
+	digest = gcry_md_read(md, hash_algo);
+
+	if ( b.len < 2 || b.p[0] != digest[0] || b.p[1] != digest[1]
+			|| check_sig(pk, hash_algo, digest, &b) < 0 ) {
+		res->validity = NATSIG_BAD;
+		if ( vcache ) {
+			vcache_lock();
+			vcache->bad_count++;
+			pthread_mutex_unlock(&vcache->mutex);
+		}
+	} else {
+		/* (not if the pair couldn't be computed) */
+		if ( vcache && paired )
+			verified_add(pair, pk->fpr, res->created);
+		key_validity(pk, res);
+	}
+	gcry_md_close(md);
+	free(pkt);
+	return res->validity;
+}
+
+/*! check_sig check the signature MPIs in b (after the left 16 bits of the
+ * digest) against digest, with the key pk.
+ * \return 0 if the signature is good, -1 if not. */
+static int check_sig( PubKey * pk, int hash_algo, const unsigned char * digest, natsig_buf_t * b ) {
+	gcry_sexp_t s_data = (gcry_sexp_t) 0, s_sig = (gcry_sexp_t) 0;
+	natsig_buf_t r, s;
+	unsigned char rs[64];
+	gcry_mpi_t ms = (gcry_mpi_t) 0;
+	int err;
+
+	b->p += 2;
+	b->len -= 2;
+	if ( read_mpi(b, &r) )
+		return -1;
+	if ( pk->algo == PGP_PK_EDDSA ) {
+		if ( read_mpi(b, &s) || r.len > 32 || s.len > 32 )
+			return -1;
+		memset(rs, 0, sizeof(rs));
+		memcpy(rs + 32 - r.len, r.p, r.len);
+		memcpy(rs + 64 - s.len, s.p, s.len);
+		err = gcry_sexp_build(&s_sig, NULL, "(sig-val(eddsa(r %b)(s %b)))", 32, rs, 32, rs + 32);
+		if ( ! err )
+			err = gcry_sexp_build(&s_data, NULL, "(data(flags eddsa)(hash-algo sha512)(value %b))",
+				(int) gcry_md_get_algo_dlen(hash_algo), digest);
+	} else {
+		err = gcry_mpi_scan(&ms, GCRYMPI_FMT_USG, r.p, r.len, NULL);
+		if ( ! err )
+			err = gcry_sexp_build(&s_sig, NULL, "(sig-val(rsa(s %m)))", ms);
+		if ( ! err )
+			err = gcry_sexp_build(&s_data, NULL, "(data(flags pkcs1)(hash %s %b))",
+				gcry_md_algo_name(hash_algo), (int) gcry_md_get_algo_dlen(hash_algo), digest);
+		gcry_mpi_release(ms);
+	}
+	if ( ! err )
+		err = gcry_pk_verify(s_sig, s_data, pk->key);
+	gcry_sexp_release(s_sig);
+	gcry_sexp_release(s_data);
+	return err ? -1 : 0;
+}
+
+/* Lock vcache->mutex. If a process died holding it, the table may be half
+ * written: it's emptied. */
+static void vcache_lock( void ) {
+#ifdef HAVE_PTHREAD_MUTEXATTR_SETROBUST
+	if ( pthread_mutex_lock(&vcache->mutex) != EOWNERDEAD )
+		return;
+	syslog( LOG_WARNING, "natsig: a process died while updating the verified signatures, they are forgotten");
+	memset(vcache->entries, 0, sizeof(vcache->entries));
+	vcache->clock = 0;
+	pthread_mutex_consistent(&vcache->mutex);
+#else
+	pthread_mutex_lock(&vcache->mutex);
+#endif
+}
+
+/* Find pair in the verified signatures (vcache->mutex must be held). */
+static Verified * verified_find( const unsigned char * pair ) {
+	Verified * set;
+	int i;
+
+	set = &vcache->entries[((pair[0] << 16 | pair[1] << 8 | pair[2]) % (NATSIG_VERIFIED / VERIFIED_WAYS)) * VERIFIED_WAYS];
+	for ( i = 0; i < VERIFIED_WAYS; i++ )
+		if ( set[i].stamp && ! memcmp(set[i].pair, pair, 32) )
+			return &set[i];
+	return (Verified*) 0;
+}
+
+/* Remember a good signature, in place of the least recently used of its set. */
+static void verified_add( const unsigned char * pair, const unsigned char * fpr, time_t created ) {
+	Verified * set, * v;
+	int i;
+
+	vcache_lock();
+	vcache->verified_count++;
+	v = verified_find(pair);
+	if ( ! v ) {
+		set = &vcache->entries[((pair[0] << 16 | pair[1] << 8 | pair[2]) % (NATSIG_VERIFIED / VERIFIED_WAYS)) * VERIFIED_WAYS];
+		for ( v = set, i = 1; i < VERIFIED_WAYS; i++ )
+			if ( set[i].stamp < v->stamp )
+				v = &set[i];
+	}
+	memcpy(v->pair, pair, 32);
+	memcpy(v->fpr, fpr, 20);
+	v->created = created;
+	v->stamp = ++vcache->clock;
+	pthread_mutex_unlock(&vcache->mutex);
+}
+
+void natsig_logstats( long secs ) {
+	if ( ! vcache )
+		return;
+	vcache_lock();
+	syslog(
+		LOG_INFO, "  natsig - %d public keys loaded; %ld good signatures verified, %ld bad, %ld already verified, %ld left to gpgme",
+		num_pubkeys, vcache->verified_count, vcache->bad_count, vcache->hit_count, vcache->unverifiable_count );
+	vcache->verified_count = vcache->bad_count = vcache->hit_count = vcache->unverifiable_count = 0;
+	pthread_mutex_unlock(&vcache->mutex);
+}
+
+void natsig_destroy( void ) {
+	int i;
+
+	if ( sec_key )
+		gcry_sexp_release(sec_key);
+	sec_key = (gcry_sexp_t) 0;
+	for ( i = 0; i < num_pubkeys; i++ )
+		gcry_sexp_release(pubkeys[i].key);
+	free(pubkeys);
+	pubkeys = (PubKey*) 0;
+	num_pubkeys = 0;
+	if ( load_patterns ) {
+		for ( i = 0; load_patterns[i]; i++ )
+			free(load_patterns[i]);
+		free(load_patterns);
+		load_patterns = (char**) 0;
+	}
+}
+
+#else /* HAVE_LIBGCRYPT */
+
+int natsig_init( gpgme_ctx_t ctx, const char * fpr ) {
+	return -1;
+}
+
+gpgme_error_t natsig_sign( gpgme_data_t in, gpgme_data_t sig ) {
+	return NATSIG_UNAVAILABLE;
+}
+
+int natsig_load_keys( const char * patterns[] ) {
+	return -1;
+}
+
+int natsig_verify( const char * sig, size_t siglen, const char * data, size_t datalen, natsig_result_t * res ) {
+	memset(res, 0, sizeof(*res));
+	return res->validity = NATSIG_UNSUPPORTED;
+}
+
+void natsig_logstats( long secs ) {
+}
+
+void natsig_destroy( void ) {
+}
+
+#endif /* HAVE_LIBGCRYPT */
@@ -0,0 +1,71 @@
+/* natsig.h - header file for the native signing and verification engine
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _NATSIG_H_
+#define _NATSIG_H_
+
+#include <time.h>
+#include <gpgme.h>
+
+/* returned by natsig_sign() if the engine has no key loaded */
+#define NATSIG_UNAVAILABLE ((gpgme_error_t) -1)
+
+/*! natsig_init export (through ctx) the secret key fpr, and load its signing
+ * (sub)key, so that next signatures are made without any gpg process.
+ * Only unprotected RSA and Ed25519 keys are supported.
+ * \return 0 on success, or -1 if signatures will still have to be made by gpg.
+ */
+int natsig_init( gpgme_ctx_t ctx, const char * fpr );
+
+/*! natsig_sign make an armored detached signature (OpenPGP v4, of a binary
+ * document) of in, and write it into sig. It is thread safe.
+ * \return GPG_ERR_NO_ERROR on success, a gpgme error if signing failed, or
+ * NATSIG_UNAVAILABLE if no key is loaded (nothing have then been read from in).
+ */
+gpgme_error_t natsig_sign( gpgme_data_t in, gpgme_data_t sig );
+
+/* validity of a verified signature */
+enum {
+	NATSIG_GOOD = 0,
+	NATSIG_BAD, /* the signature doesn't match the data */
+	NATSIG_KEYREVOKED, /* (the signature is good, but made by a revoked key) */
+	NATSIG_KEYEXPIRED, /* (the signature is good, but made by an expired key) */
+	NATSIG_NOKEY, /* the key which made it isn't loaded: ask gpgme */
+	NATSIG_UNSUPPORTED /* malformed or unsupported signature: ask gpgme */
+};
+
+typedef struct {
+	char fpr[41]; /* of the (sub)key which made the signature */
+	char primary[41]; /* of its primary key */
+	time_t created; /* signature creation time */
+	int validity; /* one of NATSIG_* above */
+} natsig_result_t;
+
+/*! natsig_load_keys load in memory the public (sub)keys which can sign of
+ * the keys matching patterns (NULL for all the keyring), so that
+ * natsig_verify() may verify their signatures without any gpg process.
+ * It also setup the cache of verified signatures, which is shared with the
+ * processes forked afterwards. It must be called before any thread or
+ * process which may verify signatures is started. Once the keyring has
+ * changed, natsig_verify() loads them again (in its process).
+ * \return the number of (sub)keys loaded, or -1 on error.
+ */
+int natsig_load_keys( const char * patterns[] );
+
+/*! natsig_verify verify the detached signature sig (armored or not) of data,
+ * and fill res. It is thread safe, and a signature already verified against
+ * the same data is not verified again.
+ * \return res->validity.
+ */
+int natsig_verify( const char * sig, size_t siglen, const char * data, size_t datalen, natsig_result_t * res );
+
+/* Generate debugging statistics syslog messages. */
+void natsig_logstats( long secs );
+
+/* Free the loaded keys. */
+void natsig_destroy( void );
+
+#endif /* _NATSIG_H_ */
@@ -0,0 +1,522 @@
+/* presign.c - background pre-signer
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Without it, the first signed request of each new or modified file pays a
+* synchronous signature (and after a content push, all of them at once).
+* A process is forked at startup, with a lower priority. It scans the
+* published tree, then watches it with inotify, and queues the regular files
+* which don't match sig_pattern (nor cgi_pattern). PRESIGN_JOBS threads, each
+* one with its own gpgme context, sign those whose signature is not yet in
+* the signature cache, and append it there.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#include <gpgme.h>
+
+#include "config.h"
+#include "presign.h"
+#include "libhttpd.h"
+#include "match.h"
+#include "sigc.h"
+#include "natsig.h"
+
+#if defined(PRESIGN_JOBS) && defined(SIG_CACHEDIR)
+
+#ifdef HAVE_SYS_INOTIFY_H
+#define PRESIGN_EVENTS (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE|IN_ONLYDIR)
+#endif
+
+typedef struct presign_job {
+	char * path;
+	struct presign_job * next;
+} presign_job_t;
+
+/* Globals (of the server process). */
+static pid_t presign_pid = 0;
+static httpd_server* presign_hs = (httpd_server*) 0;
+static char * presign_fpr = (char *) 0;
+
+/* Globals (of the pre-signer process). */
+static presign_job_t * q_head = (presign_job_t *) 0, * q_tail = (presign_job_t *) 0;
+static int q_len = 0;
+static pthread_mutex_t q_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_cond = PTHREAD_COND_INITIALIZER;
+/* the sigc package is not thread safe */
+static pthread_mutex_t sigc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t got_usr2 = 0, got_term = 0;
+#ifdef HAVE_SYS_INOTIFY_H
+static int ifd = -1;
+static char ** wd_paths = (char **) 0;
+static int n_wd_paths = 0, n_watched = 0;
+#endif
+/* stats, protected by q_mutex */
+static long stats_signed = 0, stats_failed = 0, stats_cached = 0;
+static long stats_sign_ms = 0;
+static time_t stats_time;
+
+/* Forwards. */
+static void presign_main( gpgme_ctx_t* ctxs );
+static void* presign_worker( gpgme_ctx_t ctx );
+static int presign_file( gpgme_ctx_t ctx, const char * path );
+static void presign_walk( const char * dir );
+static void presign_consider( const char * path, struct stat* sbP );
+static void presign_queue( const char * path );
+#ifdef HAVE_SYS_INOTIFY_H
+static void presign_watch( const char * dir );
+static void presign_events( void );
+#endif
+static void presign_do_logstats( void );
+
+static void handle_term( int sig ) {
+	got_term = 1;
+}
+
+static void handle_usr2( int sig ) {
+#ifndef HAVE_SIGSET
+	(void) signal( SIGUSR2, handle_usr2 );
+#endif /* ! HAVE_SIGSET */
+	got_usr2 = 1;
+}
+
+pid_t presign_start( httpd_server* hs, const char * fpr ) {
+	int i;
+	pid_t pid;
+	gpgme_ctx_t ctxs[PRESIGN_JOBS];
+	gpgme_key_t key;
+	gpgme_error_t gpgerr;
+
+	if ( presign_fpr != fpr ) {
+		free(presign_fpr);
+		if ( ! (presign_fpr=strdup(fpr)) ) {
+			syslog( LOG_ERR, "strdup - %m");
+			return -1;
+		}
+	}
+	presign_hs = hs;
+
+	pid = fork();
+	if ( pid < 0 ) {
+		syslog( LOG_ERR, "fork - %m");
+		return -1;
+	}
+	if ( pid > 0 ) {
+		presign_pid = pid;
+		syslog( LOG_INFO, "pre-signer started (pid %d, %d jobs)", pid, PRESIGN_JOBS);
+		return pid;
+	}
+
+	/* Child process: the pre-signer. */
+	httpd_close_inherited( hs );
+#ifdef HAVE_SIGSET
+	(void) sigset( SIGTERM, handle_term );
+	(void) sigset( SIGINT, handle_term );
+	(void) sigset( SIGCHLD, SIG_DFL );
+	(void) sigset( SIGPIPE, SIG_IGN );
+	(void) sigset( SIGHUP, SIG_IGN );
+	(void) sigset( SIGUSR1, SIG_IGN );
+	(void) sigset( SIGUSR2, handle_usr2 );
+#else /* HAVE_SIGSET */
+	(void) signal( SIGTERM, handle_term );
+	(void) signal( SIGINT, handle_term );
+	(void) signal( SIGCHLD, SIG_DFL );
+	(void) signal( SIGPIPE, SIG_IGN );
+	(void) signal( SIGHUP, SIG_IGN );
+	(void) signal( SIGUSR1, SIG_IGN );
+	(void) signal( SIGUSR2, handle_usr2 );
+#endif /* HAVE_SIGSET */
+
+	/* Requests go first (gpg processes inherit this priority). */
+	errno = 0;
+	if ( nice(PRESIGN_NICE) == -1 && errno != 0 )
+		syslog( LOG_WARNING, "pre-signer: nice - %m");
+
+	for ( i=0; i<PRESIGN_JOBS; i++ ) {
+		gpgerr = gpgme_new(&ctxs[i]);
+		if ( gpgerr == GPG_ERR_NO_ERROR )
+			gpgerr = gpgme_get_key(ctxs[i], presign_fpr, &key, 1);
+		if ( gpgerr == GPG_ERR_NO_ERROR ) {
+			gpgerr = gpgme_signers_add(ctxs[i], key);
+			gpgme_key_unref(key);
+		}
+		if ( gpgerr != GPG_ERR_NO_ERROR ) {
+			syslog( LOG_ERR, "pre-signer: %s", gpgme_strerror(gpgerr));
+			exit(1);
+		}
+		gpgme_set_armor(ctxs[i], 1);
+	}
+
+	presign_main(ctxs);
+	exit(0);
+}
+
+/* Main loop of the pre-signer: scan, then queue what inotify report. */
+static void presign_main( gpgme_ctx_t* ctxs ) {
+	pid_t ppid = getppid();
+	sigset_t set, oset;
+	pthread_t tid;
+	int i, r;
+#ifdef HAVE_SYS_INOTIFY_H
+	struct pollfd pfd;
+
+	ifd = inotify_init();
+	if ( ifd < 0 )
+		syslog( LOG_WARNING, "pre-signer: inotify_init - %m, only the startup scan will be done");
+#endif
+
+	/* Only this thread should handle the signals. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	for ( i=0; i<PRESIGN_JOBS; i++ )
+		if ( (r=pthread_create(&tid, NULL, (void * (*)(void *)) &presign_worker, ctxs[i])) != 0 ) {
+			errno = r;
+			syslog( LOG_ERR, "pre-signer: pthread_create - %m");
+			exit(1);
+		}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	stats_time = time( (time_t*) 0 );
+	/* Watches are set up while walking, so nothing may be missed. */
+	presign_walk(".");
+
+	for (;;) {
+#ifdef HAVE_SYS_INOTIFY_H
+		if ( ifd >= 0 ) {
+			pfd.fd = ifd;
+			pfd.events = POLLIN;
+			r = poll(&pfd, 1, OCCASIONAL_TIME * 1000L);
+		} else
+#endif
+			r = poll((struct pollfd*) 0, 0, OCCASIONAL_TIME * 1000L);
+
+		if ( got_term || getppid() != ppid )
+			exit(0);
+		if ( got_usr2 ) {
+			got_usr2 = 0;
+			presign_do_logstats();
+		}
+#ifdef HAVE_SYS_INOTIFY_H
+		if ( r > 0 )
+			presign_events();
+#endif
+	}
+}
+
+static void* presign_worker( gpgme_ctx_t ctx ) {
+	presign_job_t * job;
+
+	for (;;) {
+		pthread_mutex_lock(&q_mutex);
+		while ( q_len == 0 )
+			pthread_cond_wait(&q_cond, &q_mutex);
+		job = q_head;
+		q_head = job->next;
+		if ( ! q_head )
+			q_tail = (presign_job_t *) 0;
+		q_len--;
+		pthread_mutex_unlock(&q_mutex);
+
+		(void) presign_file(ctx, job->path);
+		free(job->path);
+		free(job);
+	}
+	return NULL;
+}
+
+/*! presign_file sign path, unless its signature is already cached.
+ * \return 0 if the cache now contains the signature, -1 otherwise.
+ */
+static int presign_file( gpgme_ctx_t ctx, const char * path ) {
+	gpgme_data_t gpgdata = (gpgme_data_t) 0, gpgsig = (gpgme_data_t) 0;
+	gpgme_error_t gpgerr;
+	struct stat sb, sa;
+	struct timeval start, end;
+	char * sig;
+	size_t siglen;
+	int fd, r;
+	long ms;
+
+	fd = open(path, O_RDONLY);
+	if ( fd < 0 )
+		return -1; /* may have been removed meanwhile */
+	if ( fstat(fd, &sb) < 0 || ! S_ISREG(sb.st_mode) ) {
+		close(fd);
+		return -1;
+	}
+
+	pthread_mutex_lock(&sigc_mutex);
+	sig = sigc_lookup(&sb, &siglen, (struct timeval*) 0);
+	pthread_mutex_unlock(&sigc_mutex);
+	if ( sig ) {
+		close(fd);
+		pthread_mutex_lock(&q_mutex);
+		stats_cached++;
+		pthread_mutex_unlock(&q_mutex);
+		return 0;
+	}
+
+	(void) gettimeofday( &start, (struct timezone*) 0 );
+	gpgerr = gpgme_data_new_from_fd(&gpgdata, fd);
+	if ( gpgerr == GPG_ERR_NO_ERROR )
+		gpgerr = gpgme_data_new(&gpgsig);
+	if ( gpgerr == GPG_ERR_NO_ERROR ) {
+		gpgerr = natsig_sign(gpgdata, gpgsig);
+		if ( gpgerr == NATSIG_UNAVAILABLE )
+			gpgerr = gpgme_op_sign(ctx, gpgdata, gpgsig, GPGME_SIG_MODE_DETACH);
+	}
+	(void) gettimeofday( &end, (struct timezone*) 0 );
+	if ( gpgdata )
+		gpgme_data_release(gpgdata);
+
+	r = -1;
+	if ( gpgerr != GPG_ERR_NO_ERROR )
+		syslog( LOG_ERR, "pre-signer: %.80s: %s", path, gpgme_strerror(gpgerr));
+	else if ( fstat(fd, &sa) == 0 && sa.st_size == sb.st_size && sa.st_mtime == sb.st_mtime ) {
+		/* (else the file changed while signing it: it will be queued again) */
+		sig = gpgme_data_release_and_get_mem(gpgsig, &siglen);
+		gpgsig = (gpgme_data_t) 0;
+		if ( sig ) {
+			pthread_mutex_lock(&sigc_mutex);
+			r = sigc_append(&sb, sig, siglen);
+			pthread_mutex_unlock(&sigc_mutex);
+			gpgme_free(sig);
+		}
+	}
+	if ( gpgsig )
+		gpgme_data_release(gpgsig);
+	close(fd);
+
+	ms = ( end.tv_sec - start.tv_sec ) * 1000L + ( end.tv_usec - start.tv_usec ) / 1000L;
+	pthread_mutex_lock(&q_mutex);
+	if ( r == 0 ) {
+		stats_signed++;
+		stats_sign_ms += ms;
+	} else
+		stats_failed++;
+	pthread_mutex_unlock(&q_mutex);
+	return r;
+}
+
+/* Queue the files of dir and of its subdirectories (and watch them). */
+static void presign_walk( const char * dir ) {
+	char path[MAXPATHLEN];
+	struct dirent * de;
+	struct stat sb;
+	DIR * dp;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	presign_watch(dir);
+#endif
+	dp = opendir(dir);
+	if ( ! dp ) {
+		syslog( LOG_WARNING, "pre-signer: opendir %.80s - %m", dir);
+		return;
+	}
+	while ( (de=readdir(dp)) ) {
+		if ( strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 )
+			continue;
+		/* Paths are relative to the web directory, like hc->origfilename */
+		if ( snprintf(path, sizeof(path), "%s%s%s", strcmp(dir, ".") ? dir : "", strcmp(dir, ".") ? "/" : "", de->d_name) >= sizeof(path) )
+			continue;
+		/* Don't follow symlinks, so we can't loop */
+		if ( lstat(path, &sb) < 0 )
+			continue;
+		if ( S_ISDIR(sb.st_mode) )
+			presign_walk(path);
+		else
+			presign_consider(path, &sb);
+	}
+	closedir(dp);
+}
+
+/* Queue path if it is a file which would be served signed. */
+static void presign_consider( const char * path, struct stat* sbP ) {
+	if ( ! S_ISREG(sbP->st_mode) || ! ( sbP->st_mode & S_IROTH ) )
+		return;
+	if ( presign_hs->sig_pattern == (char*) 0 || match(presign_hs->sig_pattern, path) )
+		return;
+	if ( presign_hs->cgi_pattern != (char*) 0 && match(presign_hs->cgi_pattern, path) )
+		return;
+	presign_queue(path);
+}
+
+static void presign_queue( const char * path ) {
+	presign_job_t * job;
+
+	pthread_mutex_lock(&q_mutex);
+	/* Writers often close the same file several times in a row */
+	if ( q_tail && strcmp(q_tail->path, path) == 0 ) {
+		pthread_mutex_unlock(&q_mutex);
+		return;
+	}
+	pthread_mutex_unlock(&q_mutex);
+
+	job = malloc(sizeof(presign_job_t));
+	if ( job )
+		job->path = strdup(path);
+	if ( ! job || ! job->path ) {
+		syslog( LOG_ERR, "pre-signer: out of memory queuing %.80s", path);
+		free(job);
+		return;
+	}
+	job->next = (presign_job_t *) 0;
+
+	pthread_mutex_lock(&q_mutex);
+	if ( q_tail )
+		q_tail->next = job;
+	else
+		q_head = job;
+	q_tail = job;
+	q_len++;
+	pthread_cond_signal(&q_cond);
+	pthread_mutex_unlock(&q_mutex);
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void presign_watch( const char * dir ) {
+	char ** tmp;
+	int wd, n;
+
+	if ( ifd < 0 )
+		return;
+	wd = inotify_add_watch(ifd, dir, PRESIGN_EVENTS);
+	if ( wd < 0 ) {
+		syslog( LOG_WARNING, "pre-signer: inotify_add_watch %.80s - %m", dir);
+		return;
+	}
+	if ( wd >= n_wd_paths ) {
+		n = MAX(wd + 1, n_wd_paths * 2);
+		tmp = realloc(wd_paths, n * sizeof(char *));
+		if ( ! tmp ) {
+			syslog( LOG_ERR, "pre-signer: out of memory watching %.80s", dir);
+			(void) inotify_rm_watch(ifd, wd);
+			return;
+		}
+		memset(tmp + n_wd_paths, 0, (n - n_wd_paths) * sizeof(char *));
+		wd_paths = tmp;
+		n_wd_paths = n;
+	}
+	if ( ! wd_paths[wd] )
+		n_watched++;
+	free(wd_paths[wd]);
+	wd_paths[wd] = strdup(dir);
+}
+
+static void presign_events( void ) {
+	char buf[sizeof(struct inotify_event) * 64 + MAXPATHLEN];
+	char path[MAXPATHLEN];
+	struct inotify_event * ev;
+	struct stat sb;
+	ssize_t r;
+	char * cp;
+
+	r = read(ifd, buf, sizeof(buf));
+	if ( r <= 0 )
+		return;
+	for ( cp = buf; cp < buf + r; cp += sizeof(struct inotify_event) + ev->len ) {
+		ev = (struct inotify_event *) cp;
+		if ( ev->mask & IN_Q_OVERFLOW ) {
+			syslog( LOG_NOTICE, "pre-signer: inotify queue overflow, rescanning");
+			presign_walk(".");
+			continue;
+		}
+		if ( ev->wd < 0 || ev->wd >= n_wd_paths || ! wd_paths[ev->wd] )
+			continue;
+		if ( ev->mask & IN_IGNORED ) {
+			free(wd_paths[ev->wd]);
+			wd_paths[ev->wd] = (char *) 0;
+			n_watched--;
+			continue;
+		}
+		if ( ev->len == 0 )
+			continue;
+		if ( snprintf(path, sizeof(path), "%s%s%s", strcmp(wd_paths[ev->wd], ".") ? wd_paths[ev->wd] : "",
+				strcmp(wd_paths[ev->wd], ".") ? "/" : "", ev->name) >= sizeof(path) )
+			continue;
+		if ( lstat(path, &sb) < 0 )
+			continue;
+		if ( S_ISDIR(sb.st_mode) ) {
+			/* a new (or moved in) directory */
+			if ( ev->mask & (IN_CREATE|IN_MOVED_TO) )
+				presign_walk(path);
+		} else if ( ev->mask & (IN_CLOSE_WRITE|IN_MOVED_TO) )
+			presign_consider(path, &sb);
+	}
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+static void presign_do_logstats( void ) {
+	time_t now = time( (time_t*) 0 );
+	long secs = now - stats_time;
+	int watched = 0;
+
+	if ( secs <= 0 )
+		secs = 1;
+	stats_time = now;
+#ifdef HAVE_SYS_INOTIFY_H
+	watched = n_watched;
+#endif
+	pthread_mutex_lock(&q_mutex);
+	syslog( LOG_INFO,
+		"  presign - %ld signatures (%g/sec), %ld already cached, %ld failed, %d queued, %d dirs watched, sign avg %ld ms",
+		stats_signed, (float) stats_signed / secs, stats_cached, stats_failed,
+		q_len, watched, stats_signed ? stats_sign_ms / stats_signed : 0 );
+	stats_signed = stats_failed = stats_cached = 0;
+	stats_sign_ms = 0;
+	pthread_mutex_unlock(&q_mutex);
+}
+
+int presign_reaped( pid_t pid ) {
+	if ( presign_pid <= 0 || pid != presign_pid )
+		return 0;
+	presign_pid = 0;
+	return 1;
+}
+
+void presign_check( void ) {
+	if ( presign_pid == 0 && presign_hs && presign_fpr ) {
+		syslog( LOG_WARNING, "pre-signer died, restarting it" );
+		presign_pid = -1; /* don't retry before next call if failing */
+		(void) presign_start( presign_hs, presign_fpr );
+	} else if ( presign_pid < 0 )
+		presign_pid = 0;
+}
+
+void presign_stop( void ) {
+	if ( presign_pid > 0 )
+		kill( presign_pid, SIGTERM );
+	presign_pid = -2;
+	presign_hs = (httpd_server*) 0;
+}
+
+void presign_logstats( long secs ) {
+	if ( presign_pid > 0 )
+		kill( presign_pid, SIGUSR2 );
+}
+
+#endif /* PRESIGN_JOBS && SIG_CACHEDIR */
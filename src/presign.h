@@ -0,0 +1,32 @@
+/* presign.h - header file for the background pre-signer
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _PRESIGN_H_
+#define _PRESIGN_H_
+
+#include "config.h"
+#include "libhttpd.h"
+
+/*! presign_start fork the pre-signer, which scan the published tree (and
+ * then watch it, if inotify is available) to put the signature of the
+ * files which don't match sig_pattern in the signature cache.
+ * \return the pid of the pre-signer, or -1 on error.
+ */
+pid_t presign_start( httpd_server* hs, const char * fpr );
+
+/* To call for each child reaped by the server. Return 1 if pid was the pre-signer. */
+int presign_reaped( pid_t pid );
+
+/* Restart the pre-signer if it died. Should be called periodically. */
+void presign_check( void );
+
+/* Stop the pre-signer, usually in preparation for exitting. */
+void presign_stop( void );
+
+/* Ask the pre-signer to generate its debugging statistics syslog message. */
+void presign_logstats( long secs );
+
+#endif /* _PRESIGN_H_ */
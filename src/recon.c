@@ -0,0 +1,812 @@
+/* recon.c - reconciliation of the keyring with the peers
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Each key of the index (cf. keyidx.c) has a state, a 64 bits hash of its
+* subkeys, user IDs and signatures. The states are kept in a prefix tree of
+* their hexadecimal digits, each node having the number and the XOR of the
+* states below it, which a leaf (of at most RECON_LEAF keys, but at the
+* bottom) lists. Peers get the nodes through "pks/recon?prefix=P" (cf.
+* recon_answer()), answered by the server process from the tree itself.
+*
+* Every RECON_INTERVAL seconds, a process is forked (with a copy of the tree
+* as it is then), which walks the tree of each peer from its root, going down
+* only into the nodes which differ from ours, so that the number of requests
+* depends on the number of differences, not on the size of the keyring. The
+* keys of the peer whose state we don't have are then fetched by pks/lookup,
+* RECON_FETCH at a time, and imported through the import pipeline (cf.
+* keyimp.c) as if they were submitted to pks/add, so the policy of the server
+* applies, and the index gets them. Each side fetches what it lacks: when a
+* key differs, it's merged on both sides once each one has walked the tree of
+* the other, and the keys then have the same state again.
+*
+* The states of the keys which brought nothing (rejected, or unchanged once
+* merged) are written in RECON_SKIPPED, so they are not fetched again by the
+* next round, as long as the peer still has them.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <gpgme.h>
+
+#include "config.h"
+#include "version.h"
+#include "libhttpd.h"
+#include "hkp.h"
+#include "keyidx.h"
+#include "keyimp.h"
+#include "peers.h"
+#include "recon.h"
+
+#ifdef RECON_INTERVAL
+
+#if ! defined(KEYIDX_SLOTS) || ! defined(KEYIMP_SPOOL)
+#error "RECON_INTERVAL needs KEYIDX_SLOTS and KEYIMP_SPOOL"
+#endif
+
+/* number of hexadecimal digits of a state */
+#define RECON_DEPTH 16
+/* maximum size of a response to pks/recon, and of the keys fetched at once */
+#define RECON_PAGE_MAX 65536
+#define RECON_KEYS_MAX (16*1024*1024)
+/* the digit of state at depth */
+#define NIBBLE(state, depth) ( (int) ( (state) >> ( 60 - 4 * (depth) ) ) & 15 )
+
+typedef struct ReconNode {
+	long count;
+	uint64_t digest;              /* XOR of the states below */
+	struct ReconNode * children;  /* 16 of them, or NULL for a leaf */
+	keyidx_key_t ** keys;         /* the keys of a leaf */
+	int size;
+} ReconNode;
+
+/* A key of a peer to fetch */
+typedef struct {
+	uint64_t state;
+	char fpr[65];
+} Fetched;
+
+static ReconNode root;
+static peer_t peers[RECON_MAX_PEERS];
+static int num_peers = 0;
+static pid_t recon_pid = 0;
+static time_t next_time = 0;
+static long syncs_count = 0, answered_count = 0, answered_bytes = 0;
+
+/* (in the reconciling process) */
+static Fetched * fetched = (Fetched *) 0;
+static int num_fetched = 0;
+static uint64_t * skipped_old = (uint64_t *) 0; /* sorted */
+static int num_skipped_old = 0;
+static uint64_t * skipped = (uint64_t *) 0;
+static int num_skipped = 0;
+static long requests_count = 0, bytes_count = 0;
+static long walked = 0; /* nodes of the peer requested */
+
+int recon_peer( const char * peer ) {
+	const char * host = peer, * colon;
+	size_t hostlen;
+	long port = 11371;
+	char * end;
+	int i;
+
+	/* (an IPv6 address between '[' and ']') */
+	if ( *peer == '[' ) {
+		if ( ! (colon=strchr(peer, ']')) || ( colon[1] != ':' && colon[1] != '\0' ) )
+			return -1;
+		host = peer + 1;
+		hostlen = colon - host;
+		colon = colon[1] ? colon + 1 : (const char *) 0;
+	} else {
+		colon = strrchr(peer, ':');
+		hostlen = colon ? (size_t) ( colon - peer ) : strlen(peer);
+	}
+	if ( colon ) {
+		port = strtol(colon + 1, &end, 10);
+		if ( *end != '\0' || port <= 0 || port > 65535 )
+			return -1;
+	}
+	if ( hostlen == 0 )
+		return -1;
+	/* (the arguments may be parsed twice) */
+	for ( i = 0; i < num_peers; i++ )
+		if ( peers[i].eport == port && strlen(peers[i].ehost) == hostlen
+				&& ! strncmp(peers[i].ehost, host, hostlen) )
+			return 0;
+	if ( num_peers >= RECON_MAX_PEERS )
+		return -1;
+	memset(&peers[num_peers], 0, sizeof(peer_t));
+	if ( ! (peers[num_peers].ehost=malloc(hostlen + 1)) )
+		return -1;
+	memcpy(peers[num_peers].ehost, host, hostlen);
+	peers[num_peers].ehost[hostlen] = '\0';
+	peers[num_peers].eport = (unsigned short) port;
+	peers[num_peers].status = PEER_STATUS_UNKNOW;
+	num_peers++;
+	return 0;
+}
+
+/* append key to the leaf node */
+static int leaf_append( ReconNode * node, keyidx_key_t * key ) {
+	keyidx_key_t ** keys;
+	int size;
+
+	if ( node->count >= node->size ) {
+		size = node->size ? node->size * 2 : 8;
+		if ( ! (keys=realloc(node->keys, size * sizeof(keyidx_key_t *))) )
+			return -1;
+		node->keys = keys;
+		node->size = size;
+	}
+	node->keys[node->count++] = key;
+	node->digest ^= key->state;
+	return 0;
+}
+
+static void node_free( ReconNode * node ) {
+	int i;
+
+	if ( node->children ) {
+		for ( i = 0; i < 16; i++ )
+			node_free(&node->children[i]);
+		free(node->children);
+	}
+	free(node->keys);
+	memset(node, 0, sizeof(ReconNode));
+}
+
+/* turn the leaf node (at depth) into an inner node if it has too many keys */
+static void node_split( ReconNode * node, int depth ) {
+	ReconNode * children;
+	int i;
+
+	if ( node->count <= RECON_LEAF || depth >= RECON_DEPTH )
+		return;
+	if ( ! (children=calloc(16, sizeof(ReconNode))) )
+		return;
+	for ( i = 0; i < node->count; i++ )
+		if ( leaf_append(&children[NIBBLE(node->keys[i]->state, depth)], node->keys[i]) < 0 ) {
+			/* (it stays a leaf) */
+			for ( i = 0; i < 16; i++ )
+				free(children[i].keys);
+			free(children);
+			return;
+		}
+	free(node->keys);
+	node->keys = (keyidx_key_t **) 0;
+	node->size = 0;
+	node->children = children;
+	for ( i = 0; i < 16; i++ )
+		node_split(&children[i], depth + 1);
+}
+
+static void node_collect( ReconNode * node, keyidx_key_t ** keys, int * n ) {
+	int i;
+
+	if ( node->children )
+		for ( i = 0; i < 16; i++ )
+			node_collect(&node->children[i], keys, n);
+	else
+		for ( i = 0; i < node->count; i++ )
+			keys[(*n)++] = node->keys[i];
+}
+
+/* turn the inner node back into a leaf */
+static void node_join( ReconNode * node ) {
+	keyidx_key_t ** keys;
+	long count = node->count;
+	uint64_t digest = node->digest;
+	int n = 0;
+
+	if ( ! (keys=malloc(( count ? count : 1 ) * sizeof(keyidx_key_t *))) )
+		return;
+	node_collect(node, keys, &n);
+	node_free(node);
+	node->count = count;
+	node->digest = digest;
+	node->keys = keys;
+	node->size = count;
+}
+
+int recon_add( keyidx_key_t * key ) {
+	ReconNode * node, * leaf;
+	int depth;
+
+	for ( leaf = &root, depth = 0; leaf->children; depth++ )
+		leaf = &leaf->children[NIBBLE(key->state, depth)];
+	if ( leaf_append(leaf, key) < 0 )
+		return -1;
+	for ( node = &root, depth = 0; node != leaf; node = &node->children[NIBBLE(key->state, depth++)] ) {
+		node->count++;
+		node->digest ^= key->state;
+	}
+	node_split(leaf, depth);
+	return 0;
+}
+
+void recon_del( keyidx_key_t * key ) {
+	ReconNode * node, * leaf, * join = (ReconNode *) 0;
+	int depth, i;
+
+	for ( leaf = &root, depth = 0; leaf->children; depth++ )
+		leaf = &leaf->children[NIBBLE(key->state, depth)];
+	for ( i = 0; i < leaf->count && leaf->keys[i] != key; i++ )
+		;
+	if ( i == leaf->count )
+		return;
+	leaf->keys[i] = leaf->keys[--leaf->count];
+	leaf->digest ^= key->state;
+	for ( node = &root, depth = 0; node != leaf; node = &node->children[NIBBLE(key->state, depth++)] ) {
+		node->count--;
+		node->digest ^= key->state;
+		/* (the highest one which has few keys left) */
+		if ( ! join && node->count <= RECON_LEAF / 2 )
+			join = node;
+	}
+	if ( join )
+		node_join(join);
+}
+
+void recon_clear( void ) {
+	node_free(&root);
+}
+
+/* tell if state begins with the len first digits of prefix */
+static int prefixed( uint64_t state, uint64_t prefix, int len ) {
+	return len == 0 || ( ( state ^ prefix ) >> ( 64 - 4 * len ) ) == 0;
+}
+
+/* the node of prefix (of len digits), or the leaf it's in (*depthP being then less than len) */
+static ReconNode * node_find( uint64_t prefix, int len, int * depthP ) {
+	ReconNode * node;
+	int depth;
+
+	for ( node = &root, depth = 0; depth < len && node->children; depth++ )
+		node = &node->children[NIBBLE(prefix, depth)];
+	*depthP = depth;
+	return node;
+}
+
+/*! summary the number and the XOR (put in *digest) of our states which begin with prefix (of len digits) */
+static long summary( uint64_t prefix, int len, uint64_t * digest ) {
+	ReconNode * node;
+	long n = 0;
+	int depth, i;
+
+	node = node_find(prefix, len, &depth);
+	if ( depth == len ) {
+		*digest = node->digest;
+		return node->count;
+	}
+	*digest = 0;
+	for ( i = 0; i < node->count; i++ )
+		if ( prefixed(node->keys[i]->state, prefix, len) ) {
+			*digest ^= node->keys[i]->state;
+			n++;
+		}
+	return n;
+}
+
+/* tell if we have a key whose state is state */
+static int have( uint64_t state ) {
+	ReconNode * node;
+	int depth, i;
+
+	node = node_find(state, RECON_DEPTH, &depth);
+	for ( i = 0; i < node->count; i++ )
+		if ( node->keys[i]->state == state )
+			return 1;
+	return 0;
+}
+
+/* append to the response (of *lenP bytes) */
+static void answer_printf( httpd_conn* hc, size_t * lenP, const char * format, ... ) {
+	va_list ap;
+	int r;
+
+	httpd_realloc_str(&hc->body, &hc->maxbody, *lenP + 128);
+	va_start(ap, format);
+	r = vsnprintf(hc->body + *lenP, hc->maxbody + 1 - *lenP, format, ap);
+	va_end(ap);
+	if ( r > 0 && *lenP + r > hc->maxbody ) {
+		httpd_realloc_str(&hc->body, &hc->maxbody, *lenP + r);
+		va_start(ap, format);
+		r = vsnprintf(hc->body + *lenP, hc->maxbody + 1 - *lenP, format, ap);
+		va_end(ap);
+	}
+	if ( r > 0 )
+		*lenP += r;
+}
+
+/* append to the response the keys of node whose state begins with prefix */
+static void answer_keys( httpd_conn* hc, size_t * lenP, ReconNode * node, uint64_t prefix, int len ) {
+	int i;
+
+	if ( node->children ) {
+		for ( i = 0; i < 16; i++ )
+			answer_keys(hc, lenP, &node->children[i], prefix, len);
+		return;
+	}
+	for ( i = 0; i < node->count; i++ )
+		if ( prefixed(node->keys[i]->state, prefix, len) )
+			/* (the first name of a key is its fingerprint) */
+			answer_printf(hc, lenP, "%016llx %s\n", (unsigned long long) node->keys[i]->state, node->keys[i]->names);
+}
+
+int recon_answer( httpd_conn* hc ) {
+	const char * digits = "", * pchar;
+	ReconNode * node;
+	uint64_t prefix = 0;
+	size_t len = 0;
+	int i, depth, plen;
+
+	if ( hc->method != METHOD_GET ) {
+		httpd_send_err(hc, 501, err501title, "", err501form, httpd_method_str(hc->method));
+		return -1;
+	}
+	for ( pchar = hc->query; pchar && *pchar; pchar = strchr(pchar, '&') ? strchr(pchar, '&') + 1 : (const char *) 0 )
+		if ( ! strncmp(pchar, "prefix=", 7) )
+			digits = pchar + 7;
+	plen = strcspn(digits, "&");
+	if ( plen > RECON_DEPTH || (int) strspn(digits, "0123456789abcdefABCDEF") < plen ) {
+		httpd_send_err(hc, 400, httpd_err400title, "", httpd_err400form, "" );
+		return -1;
+	}
+	for ( i = 0; i < plen; i++ )
+		prefix |= (uint64_t) ( isdigit((unsigned char) digits[i]) ? digits[i] - '0' : tolower((unsigned char) digits[i]) - 'a' + 10 ) << ( 60 - 4 * i );
+	/* (the tree is incomplete while the keyring is listed) */
+	if ( ! keyidx_ready() ) {
+		httpd_send_err(hc, 503, httpd_err503title, "", httpd_err503form, hc->encodedurl );
+		return -1;
+	}
+
+	node = node_find(prefix, plen, &depth);
+	if ( depth == plen && node->children && node->count > RECON_LEAF ) {
+		answer_printf(hc, &len, "children\n");
+		for ( i = 0; i < 16; i++ )
+			answer_printf(hc, &len, "%ld %016llx\n", node->children[i].count, (unsigned long long) node->children[i].digest);
+	} else {
+		answer_printf(hc, &len, "keys\n");
+		answer_keys(hc, &len, node, prefix, plen);
+	}
+	answered_count++;
+	answered_bytes += len;
+	httpd_send_body(hc, 200, ok200title, "", "text/plain; charset=%s", "", len, (const char *) 0, 0);
+	return 0;
+}
+
+/* wait (at most RECON_TIMEOUT seconds) until fd is ready for events */
+static int fd_wait( int fd, short events ) {
+	struct pollfd pfd;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	while ( (r=poll(&pfd, 1, RECON_TIMEOUT * 1000)) < 0 && errno == EINTR )
+		;
+	if ( r == 0 )
+		errno = ETIMEDOUT;
+	return r > 0 ? 0 : -1;
+}
+
+static int peer_connect( peer_t * peer ) {
+	struct addrinfo hints, * ai, * aip;
+	char port[8];
+	socklen_t len;
+	int fd = -1, err, r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	(void) snprintf(port, sizeof(port), "%u", peer->eport);
+	if ( (r=getaddrinfo(peer->ehost, port, &hints, &ai)) != 0 ) {
+		syslog(LOG_NOTICE, "recon: %s - %s", peer->ehost, gai_strerror(r));
+		return -1;
+	}
+	for ( aip = ai; aip; aip = aip->ai_next ) {
+		if ( (fd=socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol)) < 0 )
+			continue;
+		(void) fcntl(fd, F_SETFL, O_NONBLOCK);
+		if ( connect(fd, aip->ai_addr, aip->ai_addrlen) == 0 )
+			break;
+		len = sizeof(err);
+		if ( errno == EINPROGRESS && fd_wait(fd, POLLOUT) == 0
+				&& getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 ) {
+			if ( err == 0 )
+				break;
+			errno = err;
+		}
+		err = errno;
+		(void) close(fd);
+		errno = err;
+		fd = -1;
+	}
+	err = errno;
+	freeaddrinfo(ai);
+	errno = err;
+	if ( fd < 0 )
+		syslog(LOG_NOTICE, "recon: connect %s:%u - %m", peer->ehost, peer->eport);
+	return fd;
+}
+
+/*! http_get request path from peer (by HTTP/1.0)
+ * \return the body of the response (NUL terminated, to free), its length put
+ * in *lenP, or NULL if it isn't a 200 (errno ENOENT for a 404), or on error
+ * (logged).
+ */
+static char * http_get( peer_t * peer, const char * path, size_t max, size_t * lenP ) {
+	char * buf, * body;
+	size_t len, off, size = 4096;
+	ssize_t r;
+	int fd, status = 0;
+
+	requests_count++;
+	if ( (fd=peer_connect(peer)) < 0 )
+		return (char *) 0;
+	if ( ! (buf=malloc(size)) )
+		goto err;
+	len = snprintf(buf, size, "GET %s HTTP/1.0\r\nHost: %s:%u\r\nUser-Agent: %s\r\n\r\n",
+		path, peer->ehost, peer->eport, SOFTWARE_NAME"/"SOFTWARE_VERSION);
+	for ( off = 0; off < len; off += r ) {
+		if ( fd_wait(fd, POLLOUT) < 0 )
+			goto err;
+		if ( (r=write(fd, buf + off, len - off)) < 0 ) {
+			if ( errno != EINTR && errno != EAGAIN )
+				goto err;
+			r = 0;
+		}
+	}
+	for ( len = 0; ; len += r ) {
+		if ( len + 1 >= size ) {
+			if ( size > max + 4096 ) {
+				errno = EFBIG;
+				goto err;
+			}
+			if ( ! (body=realloc(buf, size * 2)) )
+				goto err;
+			buf = body;
+			size *= 2;
+		}
+		if ( fd_wait(fd, POLLIN) < 0 )
+			goto err;
+		if ( (r=read(fd, buf + len, size - 1 - len)) < 0 ) {
+			if ( errno != EINTR && errno != EAGAIN )
+				goto err;
+			r = 0;
+		} else if ( r == 0 )
+			break;
+	}
+	(void) close(fd);
+	fd = -1;
+	buf[len] = '\0';
+	bytes_count += len;
+	if ( sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1 || ! (body=strstr(buf, "\r\n\r\n")) ) {
+		errno = EPROTO;
+		goto err;
+	}
+	if ( status != 200 ) {
+		if ( status != 404 )
+			syslog(LOG_NOTICE, "recon: %s:%u%.80s - HTTP status %d", peer->ehost, peer->eport, path, status);
+		free(buf);
+		errno = ENOENT;
+		return (char *) 0;
+	}
+	body += 4;
+	len -= body - buf;
+	memmove(buf, body, len + 1);
+	*lenP = len;
+	return buf;
+
+  err:
+	syslog(LOG_NOTICE, "recon: %s:%u%.80s - %m", peer->ehost, peer->eport, path);
+	if ( fd >= 0 )
+		(void) close(fd);
+	free(buf);
+	return (char *) 0;
+}
+
+/* the next line of *textP (NUL terminated), or NULL if there is none */
+static char * next_line( char ** textP ) {
+	char * line = *textP, * end;
+
+	if ( ! line || ! *line )
+		return (char *) 0;
+	if ( (end=strchr(line, '\n')) ) {
+		*end = '\0';
+		*textP = end + 1;
+	} else
+		*textP = (char *) 0;
+	return line;
+}
+
+static int state_cmp( const void * a, const void * b ) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* remember that the key whose state is state brings nothing */
+static void skip_add( uint64_t state ) {
+	if ( num_skipped < RECON_MAX_KEYS )
+		skipped[num_skipped++] = state;
+}
+
+/* tell if the key whose state is state brought nothing the last time (and keep it so) */
+static int skip_has( uint64_t state ) {
+	if ( ! bsearch(&state, skipped_old, num_skipped_old, sizeof(uint64_t), state_cmp) )
+		return 0;
+	skip_add(state);
+	return 1;
+}
+
+static void skipped_load( void ) {
+	char line[32];
+	FILE * fp;
+
+	if ( ! (fp=fopen(RECON_SKIPPED, "r")) )
+		return;
+	while ( num_skipped_old < RECON_MAX_KEYS && fgets(line, sizeof(line), fp) )
+		skipped_old[num_skipped_old++] = strtoull(line, (char **) 0, 16);
+	(void) fclose(fp);
+	qsort(skipped_old, num_skipped_old, sizeof(uint64_t), state_cmp);
+}
+
+static void skipped_save( void ) {
+	FILE * fp;
+	int i;
+
+	if ( ! (fp=fopen(RECON_SKIPPED".new", "w")) ) {
+		syslog(LOG_ERR, "fopen %s - %m", RECON_SKIPPED".new");
+		return;
+	}
+	for ( i = 0; i < num_skipped; i++ )
+		(void) fprintf(fp, "%016llx\n", (unsigned long long) skipped[i]);
+	if ( ferror(fp) | fclose(fp) ) {
+		syslog(LOG_ERR, "write %s - %m", RECON_SKIPPED".new");
+		(void) unlink(RECON_SKIPPED".new");
+		return;
+	}
+	if ( rename(RECON_SKIPPED".new", RECON_SKIPPED) < 0 ) {
+		syslog(LOG_ERR, "rename %s - %m", RECON_SKIPPED".new");
+		(void) unlink(RECON_SKIPPED".new");
+	}
+}
+
+/*! walk compare the node prefix (of len digits) of peer with ours, walking
+ * down into its children which differ, to add to fetched the keys of peer
+ * whose state we don't have.
+ * \return 0, or -1 on error (logged).
+ */
+static int walk( peer_t * peer, uint64_t prefix, int len ) {
+	char path[64], digits[RECON_DEPTH+1], * body, * text, * line, * end;
+	uint64_t state, digest, ours, child;
+	size_t blen;
+	long count;
+	int i, r = 0;
+
+	/* (enough for this round, or a peer faking differences) */
+	if ( num_fetched >= RECON_MAX_KEYS || walked >= RECON_MAX_KEYS )
+		return 0;
+	walked++;
+	(void) snprintf(digits, sizeof(digits), "%016llx", (unsigned long long) prefix);
+	(void) snprintf(path, sizeof(path), "/pks/recon?prefix=%.*s", len, digits);
+	if ( ! (body=http_get(peer, path, RECON_PAGE_MAX, &blen)) )
+		return -1;
+	text = body;
+	line = next_line(&text);
+	if ( line && ! strcmp(line, "children") && len < RECON_DEPTH ) {
+		for ( i = 0; i < 16 && r == 0; i++ ) {
+			if ( ! (line=next_line(&text)) || (count=strtol(line, &end, 10)) < 0 || *end != ' ' ) {
+				r = -2;
+				break;
+			}
+			digest = strtoull(end + 1, (char **) 0, 16);
+			child = prefix | (uint64_t) i << ( 60 - 4 * len );
+			if ( count == 0 || ( summary(child, len + 1, &ours) == count && ours == digest ) )
+				continue;
+			r = walk(peer, child, len + 1);
+		}
+	} else if ( line && ! strcmp(line, "keys") ) {
+		while ( num_fetched < RECON_MAX_KEYS && (line=next_line(&text)) ) {
+			state = strtoull(line, &end, 16);
+			if ( *end != ' ' || strlen(end + 1) < 32 || strlen(end + 1) > 64
+					|| end[1 + strspn(end + 1, "0123456789ABCDEF")] != '\0' || ! prefixed(state, prefix, len) ) {
+				r = -2;
+				break;
+			}
+			if ( have(state) || skip_has(state) )
+				continue;
+			fetched[num_fetched].state = state;
+			strcpy(fetched[num_fetched].fpr, end + 1);
+			num_fetched++;
+		}
+	} else
+		r = -2;
+	if ( r == -2 ) {
+		syslog(LOG_NOTICE, "recon: %s:%u%s - malformed response", peer->ehost, peer->eport, path);
+		r = -1;
+	}
+	free(body);
+	return r;
+}
+
+/*! fetch import the n keys of fetched from first, from peer.
+ * \return the number of keys imported (new or updated), or -1 on error (logged).
+ */
+static int fetch( peer_t * peer, int first, int n, int mergeonly ) {
+	char path[64 + RECON_FETCH * 76], id[KEYIMP_ID_LEN+1], line[1024], * body, * fpr, * end;
+	int changed[RECON_FETCH];
+	gpgme_data_t data;
+	gpgme_error_t gpgerr;
+	size_t len;
+	FILE * fp;
+	int i, r, imported = 0;
+
+	len = snprintf(path, sizeof(path), "/pks/lookup?op=get&options=mr");
+	for ( i = 0; i < n; i++ ) {
+		len += snprintf(path + len, sizeof(path) - len, "&search=0x%s", fetched[first + i].fpr);
+		changed[i] = 0;
+	}
+	if ( (body=http_get(peer, path, RECON_KEYS_MAX, &len)) ) {
+		gpgerr = gpgme_data_new_from_mem(&data, body, len, 0);
+		if ( gpgerr != GPG_ERR_NO_ERROR ) {
+			syslog(LOG_ERR, "recon: gpgme_data_new_from_mem - %s", gpgme_strerror(gpgerr));
+			free(body);
+			return -1;
+		}
+		r = keyimp_submit(data, hkp_add_policy, &mergeonly, id);
+		gpgme_data_release(data);
+		free(body);
+		if ( r < 0 || ( r > 0 && keyimp_run(id, -1) <= 0 ) )
+			return -1;
+		if ( r > 0 && (fp=keyimp_result(id)) ) {
+			while ( fgets(line, sizeof(line), fp) ) {
+				if ( strncmp(line, "accept:", 7) && strncmp(line, "update:", 7) )
+					continue;
+				fpr = line + 7;
+				if ( (end=strchr(fpr, ':')) )
+					*end = '\0';
+				for ( i = 0; i < n; i++ )
+					if ( ! changed[i] && ! strcmp(fetched[first + i].fpr, fpr) ) {
+						changed[i] = 1;
+						imported++;
+					}
+			}
+			(void) fclose(fp);
+		}
+	} else if ( errno != ENOENT )
+		return -1;
+	/* (not to fetch the others again while they don't change) */
+	for ( i = 0; i < n; i++ )
+		if ( ! changed[i] )
+			skip_add(fetched[first + i].state);
+	return imported;
+}
+
+static void sync_peer( peer_t * peer, int mergeonly ) {
+	long requests = requests_count, bytes = bytes_count;
+	int i, n, r, imported = 0;
+
+	num_fetched = 0;
+	walked = 0;
+	/* (what was found before an error is fetched anyway) */
+	r = walk(peer, 0, 0);
+	for ( i = 0; i < num_fetched; i += n ) {
+		n = num_fetched - i < RECON_FETCH ? num_fetched - i : RECON_FETCH;
+		if ( (r=fetch(peer, i, n, mergeonly)) < 0 )
+			break;
+		imported += r;
+	}
+	if ( r < 0 )
+		peer->status = PEER_STATUS_DEAD;
+	else {
+		peer->status = PEER_STATUS_READY;
+		peer->lastatime = time((time_t *) 0);
+	}
+	syslog(LOG_INFO, "recon: %s:%u - %ld requests (%ld bytes), %d keys differ, %d imported%s",
+		peer->ehost, peer->eport, requests_count - requests, bytes_count - bytes, num_fetched, imported,
+		r < 0 ? " (interrupted)" : "");
+}
+
+/* Main of the reconciling process. */
+static void recon_main( int mergeonly ) {
+	int i;
+
+	/* (not to overlap the next round) */
+	(void) alarm(RECON_INTERVAL);
+	fetched = malloc(RECON_MAX_KEYS * sizeof(Fetched));
+	skipped = malloc(RECON_MAX_KEYS * sizeof(uint64_t));
+	skipped_old = malloc(RECON_MAX_KEYS * sizeof(uint64_t));
+	if ( ! fetched || ! skipped || ! skipped_old ) {
+		syslog(LOG_ERR, "recon: out of memory");
+		exit(1);
+	}
+	skipped_load();
+	for ( i = 0; i < num_peers; i++ )
+		sync_peer(&peers[i], mergeonly);
+	skipped_save();
+	exit(0);
+}
+
+void recon_check( httpd_server* hs ) {
+	time_t now = time((time_t *) 0);
+	pid_t pid;
+
+	if ( num_peers == 0 || recon_pid > 0 || now < next_time || ! keyidx_ready() )
+		return;
+	next_time = now + RECON_INTERVAL;
+	pid = fork();
+	if ( pid < 0 ) {
+		syslog(LOG_ERR, "recon: fork - %m");
+		return;
+	}
+	if ( pid > 0 ) {
+		recon_pid = pid;
+		syncs_count++;
+		syslog(LOG_DEBUG, "recon: reconciling process %d started", pid);
+		return;
+	}
+
+	/* Child process: the reconciling process, with the tree as it is now. */
+	httpd_close_inherited( hs );
+#ifdef HAVE_SIGSET
+	(void) sigset( SIGTERM, SIG_DFL );
+	(void) sigset( SIGINT, SIG_DFL );
+	(void) sigset( SIGCHLD, SIG_DFL );
+	(void) sigset( SIGPIPE, SIG_IGN );
+	(void) sigset( SIGHUP, SIG_IGN );
+	(void) sigset( SIGUSR1, SIG_IGN );
+	(void) sigset( SIGUSR2, SIG_IGN );
+	(void) sigset( SIGALRM, SIG_DFL );
+#else /* HAVE_SIGSET */
+	(void) signal( SIGTERM, SIG_DFL );
+	(void) signal( SIGINT, SIG_DFL );
+	(void) signal( SIGCHLD, SIG_DFL );
+	(void) signal( SIGPIPE, SIG_IGN );
+	(void) signal( SIGHUP, SIG_IGN );
+	(void) signal( SIGUSR1, SIG_IGN );
+	(void) signal( SIGUSR2, SIG_IGN );
+	(void) signal( SIGALRM, SIG_DFL );
+#endif /* HAVE_SIGSET */
+	recon_main( hs->bfield & HS_PKS_ADD_MERGE_ONLY ? 1 : 0 );
+}
+
+int recon_reaped( pid_t pid ) {
+	if ( recon_pid <= 0 || pid != recon_pid )
+		return 0;
+	recon_pid = 0;
+	return 1;
+}
+
+void recon_stop( void ) {
+	if ( recon_pid > 0 )
+		(void) kill(recon_pid, SIGTERM);
+}
+
+void recon_logstats( long secs ) {
+	syslog(
+		LOG_INFO, "  recon - %d peers, %ld reconciliations started, %ld pks/recon answered (%ld bytes), %ld keys in the tree",
+		num_peers, syncs_count, answered_count, answered_bytes, root.count );
+	syncs_count = answered_count = answered_bytes = 0;
+}
+
+#endif /* RECON_INTERVAL */
@@ -0,0 +1,61 @@
+/* recon.h - header file for the reconciliation of the keyring with the peers
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _RECON_H_
+#define _RECON_H_
+
+#include <sys/types.h>
+
+#include "config.h"
+#include "libhttpd.h"
+#include "keyidx.h"
+
+#ifdef RECON_INTERVAL
+
+/*! recon_peer add a peer ("host:port", the port being 11371 if omitted) to
+ * reconcile the keyring with.
+ * \return 0, or -1 if it's malformed or there are too many peers.
+ */
+int recon_peer( const char * peer );
+
+/*! recon_add put the state of key in the prefix tree (cf. keyidx.c).
+ * \return 0, or -1 on error (out of memory).
+ */
+int recon_add( keyidx_key_t * key );
+
+/* Remove key from the prefix tree (if it's there). */
+void recon_del( keyidx_key_t * key );
+
+/* Empty the prefix tree. */
+void recon_clear( void );
+
+/*! recon_answer answer a "pks/recon?prefix=P" request, P being the first
+ * hexadecimal digits (from 0 to 16) of the states of some keys. The
+ * response (text/plain) is either "children" followed by 16 lines "COUNT
+ * DIGEST", the number and the XOR of the states of the keys whose state
+ * begins with P0, P1... Pf, or (when they are few) "keys" followed by a line
+ * "STATE FINGERPRINT" for each key whose state begins with P.
+ * \return 0 if the response is ready, or -1 if an error was sent.
+ */
+int recon_answer( httpd_conn* hc );
+
+/* Fork the process which reconciles the keyring with the peers, every
+ * RECON_INTERVAL seconds once the index is ready. Should be called
+ * periodically. */
+void recon_check( httpd_server* hs );
+
+/* To call for each child reaped by the server. Return 1 if pid was the reconciling process. */
+int recon_reaped( pid_t pid );
+
+/* Stop the reconciling process, usually in preparation for exitting. */
+void recon_stop( void );
+
+/* Generate debugging statistics syslog message. */
+void recon_logstats( long secs );
+
+#endif /* RECON_INTERVAL */
+
+#endif /* _RECON_H_ */
@@ -0,0 +1,881 @@
+/* sigc.c - signature cache
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+**
+** Detached signatures of the static files are indexed in memory by
+** (dev, ino, size, mtime, ctime) of the signed file, the times in
+** nanoseconds where the system has them, so that a file rewritten within the
+** same second (or with its mtime set back) doesn't get the old signature.  Their data is backed by an
+** append-only store, SIG_CACHEDIR/store, in which interposer processes
+** append the signatures they make.  The most recently used signatures are
+** kept in memory within SIGC_MAX_BYTES, the others are read back from the
+** store when needed.  When the store goes over SIGC_MAX_STORE, a child
+** process rewrites it without the least recently used signatures, and
+** replaces it: the server then indexes the new one again, keeping the
+** signatures it has in memory.
+**
+** Each record carries a checksum, so a torn or mixed up record is dropped
+** instead of being served.  And a store which can't be read any further (not
+** a record where one should start) is rebuilt by the next compaction, from
+** the records indexed before that point.  And so that concurrent requests for a file not
+** yet signed don't all sign it, the server registers a signing job per
+** file: the interposer which owns it notifies the server (through a pipe)
+** once the signature is appended, and the other requests wait for that.
+*/
+
+#ifdef HAVE_DEFINES_H
+#include "defines.h"
+#endif
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <errno.h>
+
+#include "sigc.h"
+#include "libhttpd.h"
+
+#ifdef SIG_CACHEDIR
+
+#ifndef HAVE_INT64T
+typedef long long int64_t;
+#endif
+
+/* Defines. */
+#define SIGC_STORE "../"SIG_CACHEDIR"/store"
+#define SIGC_MAGIC 0x53494733	/* "SIG3" */
+#define SIGC_MAX_SIGLEN 65536	/* armored signatures are far smaller */
+#ifndef SIGC_MAX_BYTES
+#define SIGC_MAX_BYTES 16000000
+#endif
+#ifndef SIGC_MAX_STORE
+#define SIGC_MAX_STORE 100000000
+#endif
+#ifndef INITIAL_HASH_SIZE
+#define INITIAL_HASH_SIZE (1 << 10)
+#endif
+
+/* nanoseconds since the Epoch */
+#ifdef HAVE_ST_MTIM
+#define NSEC(ts) ( (int64_t) (ts).tv_sec * 1000000000 + (ts).tv_nsec )
+#define MTIME_NS(sbP) NSEC((sbP)->st_mtim)
+#define CTIME_NS(sbP) NSEC((sbP)->st_ctim)
+#else
+#define MTIME_NS(sbP) ( (int64_t) (sbP)->st_mtime * 1000000000 )
+#define CTIME_NS(sbP) ( (int64_t) (sbP)->st_ctime * 1000000000 )
+#endif
+
+
+/* A record of the store (followed by siglen bytes of signature). */
+typedef struct {
+	uint32_t magic;
+	uint32_t siglen;
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime;		/* (nanoseconds) */
+	int64_t ctime;
+	uint64_t sum;		/* of the above fields and of the signature */
+	} SigRec;
+
+/* The Sig struct. */
+typedef struct SigStruct {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	int64_t mtime;
+	int64_t ctime;
+	off_t offset;		/* of the signature in the store */
+	size_t siglen;
+	uint64_t sum;
+	char* sig;			/* (char*) 0 if not in memory */
+	time_t reftime;
+	unsigned int gen;	/* of the store it was last seen in */
+	struct SigStruct* next;		/* hash chain */
+	struct SigStruct* lru_prev;	/* list of signatures in memory */
+	struct SigStruct* lru_next;
+	} Sig;
+
+/* A signing job in flight. */
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	int64_t mtime;
+	int64_t ctime;
+	int rfd;			/* watched by the server */
+	int wfd;			/* held by the signer */
+	} SigJob;
+
+
+/* Globals. */
+static Sig** hash_table = (Sig**) 0;
+static unsigned int hash_size, hash_mask;
+static int sig_count = 0, mem_count = 0;
+static size_t mem_bytes = 0;
+static Sig* lru_head = (Sig*) 0;
+static Sig* lru_tail = (Sig*) 0;
+static int store_fd = -1;
+static off_t store_idx = 0;		/* how much of the store we have indexed */
+static unsigned int store_gen = 0;	/* incremented at each reopening */
+static int reindexing = 0;		/* indexing a new store from its start */
+static pid_t compact_pid = 0;
+static int damaged = 0;			/* the store is to be rebuilt */
+static long hit_count = 0, miss_count = 0, evict_count = 0;
+static SigJob jobs[SIGC_MAX_JOBS];
+static int job_count = 0;
+static long coalesced_count = 0, bad_count = 0;
+
+
+/* Forwards. */
+static int check_store( void );
+static int reopen( void );
+static void sweep( void );
+static void refresh( time_t now );
+static Sig* add_sig( SigRec* rp, off_t offset, time_t now );
+static void remove_sig( Sig* s );
+static void lru_unlink( Sig* s );
+static void lru_push( Sig* s );
+static void evict( Sig* keep );
+static int check_hash_size( void );
+static Sig* find_hash( dev_t dev, ino_t ino, off_t size, int64_t mtime, int64_t ctime );
+static unsigned int hash( dev_t dev, ino_t ino, off_t size, int64_t mtime, int64_t ctime );
+static int compact( void );
+static int compact_store( void );
+static int by_reftime( const void* a, const void* b );
+static uint64_t checksum( const SigRec* rp, const char* sig );
+static uint64_t sig_sum( Sig* s );
+
+
+int
+sigc_init( void )
+	{
+	store_fd = open( SIGC_STORE, O_RDWR|O_CREAT|O_APPEND, 0600 );
+	if ( store_fd < 0 )
+		{
+		syslog( LOG_ERR, "open %s - %m", SIGC_STORE );
+		return -1;
+		}
+	(void) fcntl( store_fd, F_SETFD, FD_CLOEXEC );
+	store_idx = 0;
+	refresh( time( (time_t*) 0 ) );
+	return 0;
+	}
+
+
+char*
+sigc_lookup( const struct stat* sbP, size_t* lenP, struct timeval* nowP )
+	{
+	time_t now;
+	Sig* s;
+
+	if ( store_fd < 0 )
+		return (char*) 0;
+
+	/* Get the current time, if necessary. */
+	if ( nowP != (struct timeval*) 0 )
+		now = nowP->tv_sec;
+	else
+		now = time( (time_t*) 0 );
+
+	s = find_hash( sbP->st_dev, sbP->st_ino, sbP->st_size, MTIME_NS(sbP), CTIME_NS(sbP) );
+	if ( s == (Sig*) 0 )
+		{
+		/* May have been appended by an interposer since last time. */
+		refresh( now );
+		s = find_hash( sbP->st_dev, sbP->st_ino, sbP->st_size, MTIME_NS(sbP), CTIME_NS(sbP) );
+		if ( s == (Sig*) 0 )
+			{
+			++miss_count;
+			return (char*) 0;
+			}
+		}
+
+	if ( s->sig == (char*) 0 )
+		{
+		/* Read it back from the store. */
+		s->sig = NEW( char, s->siglen );
+		if ( s->sig == (char*) 0 ||
+			 pread( store_fd, s->sig, s->siglen, s->offset ) != s->siglen )
+			{
+			syslog( LOG_ERR, "reading signature from %s - %m", SIGC_STORE );
+			free( (void*) s->sig );
+			s->sig = (char*) 0;
+			++miss_count;
+			return (char*) 0;
+			}
+		if ( sig_sum( s ) != s->sum )
+			{
+			/* Torn (or mixed up) record: forget it, it will be made again. */
+			syslog( LOG_ERR, "bad signature record in %s at %lld", SIGC_STORE, (int64_t) s->offset );
+			free( (void*) s->sig );
+			s->sig = (char*) 0;
+			remove_sig( s );
+			++bad_count;
+			++miss_count;
+			return (char*) 0;
+			}
+		mem_bytes += s->siglen;
+		++mem_count;
+		lru_push( s );
+		evict( s );
+		}
+	else
+		{
+		lru_unlink( s );
+		lru_push( s );
+		}
+	s->reftime = now;
+	++hit_count;
+	*lenP = s->siglen;
+	return s->sig;
+	}
+
+
+int
+sigc_append( const struct stat* sbP, const char* sig, size_t len )
+	{
+	SigRec* rp;
+	ssize_t r;
+	int i;
+
+	if ( store_fd < 0 || len == 0 || len > SIGC_MAX_SIGLEN )
+		return -1;
+	if ( check_store() < 0 )
+		return -1;
+	rp = (SigRec*) malloc( sizeof(SigRec) + len );
+	if ( rp == (SigRec*) 0 )
+		return -1;
+	rp->magic = SIGC_MAGIC;
+	rp->siglen = len;
+	rp->dev = sbP->st_dev;
+	rp->ino = sbP->st_ino;
+	rp->size = sbP->st_size;
+	rp->mtime = MTIME_NS(sbP);
+	rp->ctime = CTIME_NS(sbP);
+	rp->sum = checksum( rp, sig );
+	(void) memcpy( (char*) rp + sizeof(SigRec), sig, len );
+
+	/* A single write, so that records of concurrent writers don't mix. */
+	r = httpd_write_fully( store_fd, rp, sizeof(SigRec) + len );
+	free( (void*) rp );
+
+	/* If we are the owner of a signing job, let the waiters go. */
+	for ( i = 0; i < job_count; ++i )
+		if ( jobs[i].wfd >= 0 && jobs[i].ino == sbP->st_ino &&
+			 jobs[i].dev == sbP->st_dev && jobs[i].size == sbP->st_size &&
+			 jobs[i].mtime == MTIME_NS(sbP) && jobs[i].ctime == CTIME_NS(sbP) )
+			{
+			(void) write( jobs[i].wfd, "", 1 );
+			(void) close( jobs[i].wfd );
+			jobs[i].wfd = -1;
+			}
+	return ( r == sizeof(SigRec) + len ) ? 0 : -1;
+	}
+
+
+int
+sigc_claim( const struct stat* sbP, int* fdP )
+	{
+	int i, p[2];
+
+	*fdP = -1;
+	if ( store_fd < 0 )
+		return 0;
+	for ( i = 0; i < job_count; ++i )
+		if ( jobs[i].ino == sbP->st_ino && jobs[i].dev == sbP->st_dev &&
+			 jobs[i].size == sbP->st_size && jobs[i].mtime == MTIME_NS(sbP) &&
+			 jobs[i].ctime == CTIME_NS(sbP) )
+			{
+			++coalesced_count;
+			return 1;
+			}
+	if ( job_count >= SIGC_MAX_JOBS )
+		return 0;
+	if ( pipe( p ) < 0 )
+		{
+		syslog( LOG_ERR, "sigc - pipe - %m" );
+		return 0;
+		}
+	(void) fcntl( p[0], F_SETFD, FD_CLOEXEC );
+	(void) fcntl( p[1], F_SETFD, FD_CLOEXEC );
+	jobs[job_count].dev = sbP->st_dev;
+	jobs[job_count].ino = sbP->st_ino;
+	jobs[job_count].size = sbP->st_size;
+	jobs[job_count].mtime = MTIME_NS(sbP);
+	jobs[job_count].ctime = CTIME_NS(sbP);
+	jobs[job_count].rfd = p[0];
+	jobs[job_count].wfd = p[1];
+	++job_count;
+	*fdP = p[0];
+	return 0;
+	}
+
+
+void
+sigc_forked( int fd )
+	{
+	int i;
+
+	for ( i = 0; i < job_count; ++i )
+		if ( jobs[i].rfd == fd && jobs[i].wfd >= 0 )
+			{
+			(void) close( jobs[i].wfd );
+			jobs[i].wfd = -1;
+			}
+	}
+
+
+void
+sigc_release( int fd )
+	{
+	int i;
+
+	for ( i = 0; i < job_count; ++i )
+		if ( jobs[i].rfd == fd )
+			{
+			(void) close( jobs[i].rfd );
+			if ( jobs[i].wfd >= 0 )
+				(void) close( jobs[i].wfd );
+			jobs[i] = jobs[--job_count];
+			return;
+			}
+	}
+
+
+void
+sigc_cleanup( struct timeval* nowP )
+	{
+	struct stat sb;
+	time_t now;
+
+	if ( store_fd < 0 )
+		return;
+
+	/* Get the current time, if necessary. */
+	if ( nowP != (struct timeval*) 0 )
+		now = nowP->tv_sec;
+	else
+		now = time( (time_t*) 0 );
+
+	refresh( now );
+	if ( damaged || ( fstat( store_fd, &sb ) == 0 && sb.st_size > SIGC_MAX_STORE ) )
+		if ( compact() == 0 )
+			damaged = 0;
+	}
+
+
+void
+sigc_destroy( void )
+	{
+	unsigned int i;
+	Sig* s;
+
+	if ( hash_table != (Sig**) 0 )
+		{
+		for ( i = 0; i < hash_size; ++i )
+			while ( ( s = hash_table[i] ) != (Sig*) 0 )
+				remove_sig( s );
+		free( (void*) hash_table );
+		hash_table = (Sig**) 0;
+		}
+	if ( store_fd >= 0 )
+		{
+		(void) close( store_fd );
+		store_fd = -1;
+		}
+	}
+
+
+/* The store may have been replaced by a compaction since we opened it.
+** Reopen it if so, and index it again.
+*/
+static int
+check_store( void )
+	{
+	struct stat sb, fsb;
+
+	if ( stat( SIGC_STORE, &sb ) < 0 || fstat( store_fd, &fsb ) < 0 )
+		return -1;
+	if ( sb.st_dev == fsb.st_dev && sb.st_ino == fsb.st_ino )
+		return 0;
+	if ( reopen() < 0 )
+		return -1;
+	refresh( time( (time_t*) 0 ) );
+	return 0;
+	}
+
+
+/* Switch to the current store, whose records are to be indexed from its
+** start: the signatures found in it again keep their memory copy, and the
+** others are forgotten once it has been read (cf. sweep()).
+*/
+static int
+reopen( void )
+	{
+	int fd;
+
+	fd = open( SIGC_STORE, O_RDWR|O_CREAT|O_APPEND, 0600 );
+	if ( fd < 0 )
+		{
+		syslog( LOG_ERR, "open %s - %m", SIGC_STORE );
+		sigc_destroy();
+		return -1;
+		}
+	(void) fcntl( fd, F_SETFD, FD_CLOEXEC );
+	if ( store_fd >= 0 )
+		(void) close( store_fd );
+	store_fd = fd;
+	store_idx = 0;
+	++store_gen;
+	reindexing = 1;
+	return 0;
+	}
+
+
+/* Forget the signatures which are not in the store any more. */
+static void
+sweep( void )
+	{
+	unsigned int i;
+	Sig* s;
+	Sig* next;
+
+	if ( hash_table == (Sig**) 0 )
+		return;
+	for ( i = 0; i < hash_size; ++i )
+		for ( s = hash_table[i]; s != (Sig*) 0; s = next )
+			{
+			next = s->next;
+			if ( s->gen != store_gen )
+				remove_sig( s );
+			}
+	}
+
+
+/* Index the records appended to the store since last time. */
+static void
+refresh( time_t now )
+	{
+	struct stat sb;
+	SigRec rec;
+
+	if ( check_store() < 0 || fstat( store_fd, &sb ) < 0 )
+		return;
+	while ( store_idx + (off_t) sizeof(rec) <= sb.st_size )
+		{
+		if ( pread( store_fd, &rec, sizeof(rec), store_idx ) != sizeof(rec) )
+			break;
+		if ( rec.magic != SIGC_MAGIC || rec.siglen == 0 || rec.siglen > SIGC_MAX_SIGLEN )
+			{
+			syslog( LOG_ERR, "%s corrupted at %lld, dropping the rest of it", SIGC_STORE, (int64_t) store_idx );
+			/* (what is appended after this will still be indexed) */
+			store_idx = sb.st_size;
+			++bad_count;
+			damaged = 1;
+			break;
+			}
+		/* Still being written ? */
+		if ( store_idx + (off_t) sizeof(rec) + rec.siglen > sb.st_size )
+			break;
+		if ( add_sig( &rec, store_idx + sizeof(rec), now ) == (Sig*) 0 )
+			break;
+		store_idx += sizeof(rec) + rec.siglen;
+		}
+	if ( reindexing )
+		{
+		/* (what was appended to the previous store meanwhile is lost) */
+		sweep();
+		reindexing = 0;
+		}
+	}
+
+
+static Sig*
+add_sig( SigRec* rp, off_t offset, time_t now )
+	{
+	unsigned int h;
+	Sig* s;
+
+	s = find_hash( rp->dev, rp->ino, rp->size, rp->mtime, rp->ctime );
+	if ( s != (Sig*) 0 )
+		{
+		/* A newer record of the same signature (or the same record, in a
+		** store being indexed again). */
+		s->gen = store_gen;
+		if ( s->sig != (char*) 0 && s->sum != rp->sum )
+			{
+			lru_unlink( s );
+			mem_bytes -= s->siglen;
+			--mem_count;
+			free( (void*) s->sig );
+			s->sig = (char*) 0;
+			}
+		s->offset = offset;
+		s->siglen = rp->siglen;
+		s->sum = rp->sum;
+		return s;
+		}
+
+	if ( check_hash_size() < 0 )
+		{
+		syslog( LOG_ERR, "sigc - out of memory allocating the hash table" );
+		return (Sig*) 0;
+		}
+	s = NEW( Sig, 1 );
+	if ( s == (Sig*) 0 )
+		{
+		syslog( LOG_ERR, "sigc - out of memory allocating a Sig" );
+		return (Sig*) 0;
+		}
+	s->dev = rp->dev;
+	s->ino = rp->ino;
+	s->size = rp->size;
+	s->mtime = rp->mtime;
+	s->ctime = rp->ctime;
+	s->offset = offset;
+	s->siglen = rp->siglen;
+	s->sum = rp->sum;
+	s->sig = (char*) 0;
+	s->reftime = now;
+	s->gen = store_gen;
+	s->lru_prev = s->lru_next = (Sig*) 0;
+	h = hash( s->dev, s->ino, s->size, s->mtime, s->ctime );
+	s->next = hash_table[h];
+	hash_table[h] = s;
+	++sig_count;
+	return s;
+	}
+
+
+static void
+remove_sig( Sig* s )
+	{
+	Sig** sp;
+
+	for ( sp = &hash_table[hash( s->dev, s->ino, s->size, s->mtime, s->ctime )]; *sp != (Sig*) 0; sp = &(*sp)->next )
+		if ( *sp == s )
+			{
+			*sp = s->next;
+			break;
+			}
+	if ( s->sig != (char*) 0 )
+		{
+		lru_unlink( s );
+		mem_bytes -= s->siglen;
+		--mem_count;
+		free( (void*) s->sig );
+		}
+	free( (void*) s );
+	--sig_count;
+	}
+
+
+static void
+lru_unlink( Sig* s )
+	{
+	if ( s->lru_prev != (Sig*) 0 )
+		s->lru_prev->lru_next = s->lru_next;
+	else
+		lru_head = s->lru_next;
+	if ( s->lru_next != (Sig*) 0 )
+		s->lru_next->lru_prev = s->lru_prev;
+	else
+		lru_tail = s->lru_prev;
+	s->lru_prev = s->lru_next = (Sig*) 0;
+	}
+
+
+static void
+lru_push( Sig* s )
+	{
+	s->lru_prev = (Sig*) 0;
+	s->lru_next = lru_head;
+	if ( lru_head != (Sig*) 0 )
+		lru_head->lru_prev = s;
+	else
+		lru_tail = s;
+	lru_head = s;
+	}
+
+
+/* Free the least recently used signatures until we are within the budget. */
+static void
+evict( Sig* keep )
+	{
+	Sig* s;
+
+	while ( mem_bytes > SIGC_MAX_BYTES && lru_tail != (Sig*) 0 && lru_tail != keep )
+		{
+		s = lru_tail;
+		lru_unlink( s );
+		mem_bytes -= s->siglen;
+		--mem_count;
+		free( (void*) s->sig );
+		s->sig = (char*) 0;
+		++evict_count;
+		}
+	}
+
+
+/* Fork a process which rewrites the store (unless one is still at it).
+** Returns 0 if it runs, or -1.
+*/
+static int
+compact( void )
+	{
+	long fd, maxfd;
+
+	/* (it's reaped by the server, as its other children) */
+	if ( compact_pid > 0 && ( kill( compact_pid, 0 ) == 0 || errno != ESRCH ) )
+		return 0;
+	compact_pid = fork();
+	if ( compact_pid < 0 )
+		{
+		syslog( LOG_ERR, "sigc - fork - %m" );
+		compact_pid = 0;
+		return -1;
+		}
+	if ( compact_pid > 0 )
+		return 0;
+
+	/* Child process: it only needs the store. */
+	closelog();
+	maxfd = sysconf( _SC_OPEN_MAX );
+	for ( fd = STDERR_FILENO + 1; fd < maxfd; fd++ )
+		if ( fd != store_fd )
+			(void) close( fd );
+	_exit( compact_store() < 0 ? EXIT_FAILURE : EXIT_SUCCESS );
+	}
+
+
+/* Rewrite the store with the most recently used signatures only, and
+** replace it (in the compacting process, with the index it inherited).
+** Note: Signatures appended by interposers while compacting are lost, they
+** will just be made again.
+*/
+static int
+compact_store( void )
+	{
+	Sig** sigs;
+	Sig* s;
+	unsigned int i;
+	int n, fd;
+	off_t total = 0;
+	char* sig;
+	SigRec rec;
+
+	sigs = NEW( Sig*, sig_count );
+	if ( sigs == (Sig**) 0 )
+		return -1;
+	for ( n = 0, i = 0; i < hash_size; ++i )
+		for ( s = hash_table[i]; s != (Sig*) 0; s = s->next )
+			sigs[n++] = s;
+	qsort( sigs, n, sizeof(Sig*), by_reftime );
+
+	fd = open( SIGC_STORE".new", O_RDWR|O_CREAT|O_TRUNC|O_APPEND, 0600 );
+	if ( fd < 0 )
+		{
+		syslog( LOG_ERR, "open %s - %m", SIGC_STORE".new" );
+		return -1;
+		}
+	for ( i = 0; i < n; ++i )
+		{
+		s = sigs[i];
+		if ( total + sizeof(rec) + s->siglen > SIGC_MAX_STORE * 3 / 4 )
+			break;
+		sig = s->sig;
+		if ( sig == (char*) 0 )
+			{
+			sig = NEW( char, s->siglen );
+			if ( sig == (char*) 0 ||
+				 pread( store_fd, sig, s->siglen, s->offset ) != s->siglen )
+				{
+				free( (void*) sig );
+				continue;
+				}
+			}
+		rec.magic = SIGC_MAGIC;
+		rec.siglen = s->siglen;
+		rec.dev = s->dev;
+		rec.ino = s->ino;
+		rec.size = s->size;
+		rec.mtime = s->mtime;
+		rec.ctime = s->ctime;
+		rec.sum = s->sum;
+		if ( httpd_write_fully( fd, &rec, sizeof(rec) ) != sizeof(rec) ||
+			 httpd_write_fully( fd, sig, s->siglen ) != s->siglen )
+			{
+			syslog( LOG_ERR, "write %s - %m", SIGC_STORE".new" );
+			(void) unlink( SIGC_STORE".new" );
+			return -1;
+			}
+		if ( sig != s->sig )
+			free( (void*) sig );
+		total += sizeof(rec) + s->siglen;
+		}
+
+	if ( rename( SIGC_STORE".new", SIGC_STORE ) < 0 )
+		{
+		syslog( LOG_ERR, "rename %s - %m", SIGC_STORE".new" );
+		(void) unlink( SIGC_STORE".new" );
+		return -1;
+		}
+	syslog( LOG_INFO, "sigc - store compacted to %lld bytes (%d of %d signatures)", (int64_t) total, i, n );
+	return 0;
+	}
+
+
+/* FNV-1a of the key fields of a record and of its signature. */
+static uint64_t
+checksum( const SigRec* rp, const char* sig )
+	{
+	uint64_t h = 14695981039346656037ULL;
+	const unsigned char* cp;
+	size_t i;
+
+	/* (the fields before sum, so not any padding) */
+	for ( cp = (const unsigned char*) rp, i = 0; i < offsetof( SigRec, sum ); ++i )
+		h = ( h ^ cp[i] ) * 1099511628211ULL;
+	for ( cp = (const unsigned char*) sig, i = 0; i < rp->siglen; ++i )
+		h = ( h ^ cp[i] ) * 1099511628211ULL;
+	return h;
+	}
+
+
+/* Checksum of an indexed signature, which must be in memory. */
+static uint64_t
+sig_sum( Sig* s )
+	{
+	SigRec rec;
+
+	(void) memset( &rec, 0, sizeof(rec) );
+	rec.magic = SIGC_MAGIC;
+	rec.siglen = s->siglen;
+	rec.dev = s->dev;
+	rec.ino = s->ino;
+	rec.size = s->size;
+	rec.mtime = s->mtime;
+	rec.ctime = s->ctime;
+	return checksum( &rec, s->sig );
+	}
+
+
+/* qsort comparison routine: most recently used first */
+static int
+by_reftime( const void* a, const void* b )
+	{
+	time_t ra = (*(Sig**) a)->reftime, rb = (*(Sig**) b)->reftime;
+
+	return ra < rb ? 1 : ( ra > rb ? -1 : 0 );
+	}
+
+
+/* Make sure the hash table is big enough. */
+static int
+check_hash_size( void )
+	{
+	Sig** old_table;
+	unsigned int old_size, i, h;
+	Sig* s;
+	Sig* next;
+
+	/* Are we just starting out? */
+	if ( hash_table == (Sig**) 0 )
+		{
+		hash_size = INITIAL_HASH_SIZE;
+		hash_mask = hash_size - 1;
+		hash_table = (Sig**) calloc( hash_size, sizeof(Sig*) );
+		return hash_table == (Sig**) 0 ? -1 : 0;
+		}
+	/* Is it at least as big as the number of entries? */
+	if ( hash_size >= sig_count + 1 )
+		return 0;
+
+	/* No, got to expand and rehash all entries. */
+	old_table = hash_table;
+	old_size = hash_size;
+	hash_table = (Sig**) calloc( old_size << 1, sizeof(Sig*) );
+	if ( hash_table == (Sig**) 0 )
+		{
+		hash_table = old_table;
+		return -1;
+		}
+	hash_size = old_size << 1;
+	hash_mask = hash_size - 1;
+	for ( i = 0; i < old_size; ++i )
+		for ( s = old_table[i]; s != (Sig*) 0; s = next )
+			{
+			next = s->next;
+			h = hash( s->dev, s->ino, s->size, s->mtime, s->ctime );
+			s->next = hash_table[h];
+			hash_table[h] = s;
+			}
+	free( (void*) old_table );
+	return 0;
+	}
+
+
+static Sig*
+find_hash( dev_t dev, ino_t ino, off_t size, int64_t mtime, int64_t ctime )
+	{
+	Sig* s;
+
+	if ( hash_table == (Sig**) 0 )
+		return (Sig*) 0;
+	for ( s = hash_table[hash( dev, ino, size, mtime, ctime )]; s != (Sig*) 0; s = s->next )
+		if ( s->ino == ino && s->dev == dev &&
+			 s->size == size && s->mtime == mtime && s->ctime == ctime )
+			return s;
+	return (Sig*) 0;
+	}
+
+
+static unsigned int
+hash( dev_t dev, ino_t ino, off_t size, int64_t mtime, int64_t ctime )
+	{
+	unsigned int h = 177573;
+
+	h ^= ino;
+	h += h << 5;
+	h ^= dev;
+	h += h << 5;
+	h ^= size;
+	h += h << 5;
+	h ^= mtime ^ ( mtime >> 32 );
+	h += h << 5;
+	h ^= ctime ^ ( ctime >> 32 );
+
+	return h & hash_mask;
+	}
+
+
+/* Generate debugging statistics syslog message. */
+void
+sigc_logstats( long secs )
+	{
+	struct stat sb;
+
+	if ( store_fd < 0 || fstat( store_fd, &sb ) < 0 )
+		sb.st_size = 0;
+	syslog(
+		LOG_INFO, "  sig cache - %d indexed, %d in memory (%lld bytes), store %lld bytes; %ld hits, %ld misses, %ld evictions, %ld bad records; %d signing, %ld coalesced",
+		sig_count, mem_count, (int64_t) mem_bytes, (int64_t) sb.st_size,
+		hit_count, miss_count, evict_count, bad_count, job_count, coalesced_count );
+	hit_count = miss_count = evict_count = bad_count = coalesced_count = 0;
+	}
+
+#endif /* SIG_CACHEDIR */
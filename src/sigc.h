@@ -0,0 +1,60 @@
+/* sigc.h - header file for the signature cache package
+**
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _SIGC_H_
+#define _SIGC_H_
+
+/* Open (or create) the signature store and index what it contains.
+** Returns 0 on success, or -1 on errors (the cache is then disabled).
+*/
+int sigc_init( void );
+
+/* Returns the cached detached signature of the file described by sbP, and
+** put its length in *lenP, or returns (char*) 0 if there is none.  The
+** returned area is only valid until the next call of the sigc package.
+** If you have the current time, pass it in, otherwise pass 0.
+*/
+char* sigc_lookup( const struct stat* sbP, size_t* lenP, struct timeval* nowP );
+
+/* Append the detached signature of the file described by sbP to the store.
+** May be called from a child process, the server will index it on its next
+** miss.  Returns 0 on success, or -1 on errors.
+*/
+int sigc_append( const struct stat* sbP, const char* sig, size_t len );
+
+/* Maximum number of signing jobs in flight (see sigc_claim). */
+#define SIGC_MAX_JOBS 64
+
+/* Single-flight signing of the file described by sbP.  Returns 1 if another
+** interposer is already signing it: the caller should wait for the end of
+** that job.  Else returns 0, and if a job could be registered, puts in *fdP
+** a descriptor which becomes readable once the signature is appended to
+** the store (or its signer died), or -1.
+*/
+int sigc_claim( const struct stat* sbP, int* fdP );
+
+/* To call in the server once the signer of the job fd has been forked, so
+** that only the signer hold the notifying end.
+*/
+void sigc_forked( int fd );
+
+/* Forget the job fd, when it has ended or won't be signed after all. */
+void sigc_release( int fd );
+
+/* Clean up the sigc package, compacting the store if it is too big (or
+** rebuilding it if it's damaged).
+** This should be called periodically, say every five minutes.
+** If you have the current time, pass it in, otherwise pass 0.
+*/
+void sigc_cleanup( struct timeval* nowP );
+
+/* Free all storage, usually in preparation for exitting. */
+void sigc_destroy( void );
+
+/* Generate debugging statistics syslog message. */
+void sigc_logstats( long secs );
+
+#endif /* _SIGC_H_ */
@@ -0,0 +1,447 @@
+/* sigserv.c - signing service
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*
+* Instead of calling gpgme_op_sign() with the context inherited by each
+* interposer process (and so a cold gpg round trip per signed response), a
+* process is forked once at startup. It runs SIGSERV_WORKERS threads, each one
+* with its own gpgme context and the bot key loaded as signer.
+*
+* Protocol, over the unix socket SIGSERV_SOCKET:
+*  - on accept, the service answers "+" if the request is queued, or "-" if
+*    the queue is full (client should then sign by itself),
+*  - the client sends the data to sign and shutdown its writing side,
+*  - the service answers the gpgme error code followed by '\n' and, if it
+*    is 0, the armored detached signature.
+*/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <gpgme.h>
+
+#include "config.h"
+#include "sigserv.h"
+#include "libhttpd.h"
+
+#ifdef SIGSERV_WORKERS
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* How long (in ms) a client wait for the service to accept its request */
+#define SIGSERV_ACCEPT_WAIT 1000
+
+typedef struct {
+	int fd;
+	struct timeval queued_at;
+} sigreq_t;
+
+/* Globals (of the server process). */
+static struct sockaddr_un sigserv_addr;
+static pid_t sigserv_pid = 0;
+static httpd_server* sigserv_hs = (httpd_server*) 0;
+static char * sigserv_fpr = (char *) 0;
+
+/* Globals (of the service process). */
+static sigreq_t queue[SIGSERV_QUEUE];
+static int q_head = 0, q_len = 0;
+static pthread_mutex_t q_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t q_cond = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t got_usr2 = 0, got_term = 0;
+/* stats, protected by q_mutex */
+static long stats_signed = 0, stats_failed = 0, stats_rejected = 0;
+static long stats_wait_ms = 0, stats_sign_ms = 0, stats_maxsign_ms = 0;
+static int stats_maxdepth = 0;
+static time_t stats_time;
+
+/* Forwards. */
+static void sigserv_main( int lfd, gpgme_ctx_t* ctxs );
+static void* sigserv_worker( gpgme_ctx_t ctx );
+static gpgme_error_t sigserv_handle( gpgme_ctx_t ctx, int fd );
+static void sigserv_do_logstats( void );
+static long ms_since( struct timeval* tvP, struct timeval* nowP );
+static ssize_t send_fully( int fd, const void* buf, size_t nbytes );
+
+static void handle_term( int sig ) {
+	got_term = 1;
+}
+
+static void handle_usr2( int sig ) {
+#ifndef HAVE_SIGSET
+	(void) signal( SIGUSR2, handle_usr2 );
+#endif /* ! HAVE_SIGSET */
+	got_usr2 = 1;
+}
+
+pid_t sigserv_start( httpd_server* hs, const char * fpr ) {
+	int lfd, i;
+	pid_t pid;
+	gpgme_ctx_t ctxs[SIGSERV_WORKERS];
+	gpgme_key_t key;
+	gpgme_error_t gpgerr;
+
+	if ( sigserv_fpr != fpr ) {
+		free(sigserv_fpr);
+		if ( ! (sigserv_fpr=strdup(fpr)) ) {
+			syslog( LOG_ERR, "strdup - %m");
+			return -1;
+		}
+	}
+	sigserv_hs = hs;
+
+	/* The socket path have to be absolute, as cgi may have chdir */
+	memset(&sigserv_addr, 0, sizeof(sigserv_addr));
+	sigserv_addr.sun_family = AF_UNIX;
+	if ( snprintf(sigserv_addr.sun_path, sizeof(sigserv_addr.sun_path), "%s%s", hs->cwd, SIGSERV_SOCKET) >= sizeof(sigserv_addr.sun_path) ) {
+		syslog( LOG_ERR, "too long path for %s", SIGSERV_SOCKET);
+		sigserv_addr.sun_path[0] = '\0';
+		return -1;
+	}
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( lfd < 0 ) {
+		syslog( LOG_ERR, "socket - %m");
+		sigserv_addr.sun_path[0] = '\0';
+		return -1;
+	}
+	(void) unlink(sigserv_addr.sun_path);
+	if ( bind(lfd, (struct sockaddr*) &sigserv_addr, sizeof(sigserv_addr)) < 0
+			|| listen(lfd, SIGSERV_QUEUE) < 0 ) {
+		syslog( LOG_ERR, "bind/listen %.80s - %m", sigserv_addr.sun_path);
+		close(lfd);
+		sigserv_addr.sun_path[0] = '\0';
+		return -1;
+	}
+
+	pid = fork();
+	if ( pid < 0 ) {
+		syslog( LOG_ERR, "fork - %m");
+		close(lfd);
+		return -1;
+	}
+	if ( pid > 0 ) {
+		/* Parent process: only the service should hold the socket. */
+		close(lfd);
+		sigserv_pid = pid;
+		syslog( LOG_INFO, "signing service started (pid %d, %d workers)", pid, SIGSERV_WORKERS);
+		return pid;
+	}
+
+	/* Child process: the service. */
+	httpd_close_inherited( hs );
+#ifdef HAVE_SIGSET
+	(void) sigset( SIGTERM, handle_term );
+	(void) sigset( SIGINT, handle_term );
+	(void) sigset( SIGCHLD, SIG_DFL );
+	(void) sigset( SIGPIPE, SIG_IGN );
+	(void) sigset( SIGHUP, SIG_IGN );
+	(void) sigset( SIGUSR1, SIG_IGN );
+	(void) sigset( SIGUSR2, handle_usr2 );
+#else /* HAVE_SIGSET */
+	(void) signal( SIGTERM, handle_term );
+	(void) signal( SIGINT, handle_term );
+	(void) signal( SIGCHLD, SIG_DFL );
+	(void) signal( SIGPIPE, SIG_IGN );
+	(void) signal( SIGHUP, SIG_IGN );
+	(void) signal( SIGUSR1, SIG_IGN );
+	(void) signal( SIGUSR2, handle_usr2 );
+#endif /* HAVE_SIGSET */
+
+	/* Warm up the contexts before to accept anything */
+	for ( i=0; i<SIGSERV_WORKERS; i++ ) {
+		gpgerr = gpgme_new(&ctxs[i]);
+		if ( gpgerr == GPG_ERR_NO_ERROR )
+			gpgerr = gpgme_get_key(ctxs[i], sigserv_fpr, &key, 1);
+		if ( gpgerr == GPG_ERR_NO_ERROR ) {
+			gpgerr = gpgme_signers_add(ctxs[i], key);
+			gpgme_key_unref(key);
+		}
+		if ( gpgerr != GPG_ERR_NO_ERROR ) {
+			syslog( LOG_ERR, "signing service: %s", gpgme_strerror(gpgerr));
+			exit(1);
+		}
+		gpgme_set_armor(ctxs[i], 1);
+	}
+
+	sigserv_main(lfd, ctxs);
+	exit(0);
+}
+
+/* Main loop of the service: accept and queue requests. */
+static void sigserv_main( int lfd, gpgme_ctx_t* ctxs ) {
+	pid_t ppid = getppid();
+	sigset_t set, oset;
+	pthread_t tid;
+	struct pollfd pfd;
+	struct timeval tv;
+	int i, fd, r;
+
+	/* Only this thread should handle the signals. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+	for ( i=0; i<SIGSERV_WORKERS; i++ )
+		if ( (r=pthread_create(&tid, NULL, (void * (*)(void *)) &sigserv_worker, ctxs[i])) != 0 ) {
+			errno = r;
+			syslog( LOG_ERR, "signing service: pthread_create - %m");
+			exit(1);
+		}
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	stats_time = time( (time_t*) 0 );
+	for (;;) {
+		pfd.fd = lfd;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, OCCASIONAL_TIME * 1000L);
+
+		if ( got_term || getppid() != ppid ) {
+			/* Don't wait for workers: pending clients will get EOF. */
+			close(lfd);
+			exit(0);
+		}
+		if ( got_usr2 ) {
+			got_usr2 = 0;
+			sigserv_do_logstats();
+		}
+		if ( r <= 0 )
+			continue;
+
+		fd = accept(lfd, (struct sockaddr*) 0, (socklen_t*) 0);
+		if ( fd < 0 )
+			continue;
+
+		/* Only this thread add requests, so q_len may only decrease now. */
+		pthread_mutex_lock(&q_mutex);
+		r = ( q_len < SIGSERV_QUEUE );
+		if ( ! r )
+			stats_rejected++;
+		pthread_mutex_unlock(&q_mutex);
+		if ( send_fully(fd, r ? "+" : "-", 1) != 1 || ! r ) {
+			close(fd);
+			continue;
+		}
+
+		(void) gettimeofday( &tv, (struct timezone*) 0 );
+		pthread_mutex_lock(&q_mutex);
+		queue[(q_head+q_len)%SIGSERV_QUEUE].fd = fd;
+		queue[(q_head+q_len)%SIGSERV_QUEUE].queued_at = tv;
+		q_len++;
+		if ( q_len > stats_maxdepth )
+			stats_maxdepth = q_len;
+		pthread_cond_signal(&q_cond);
+		pthread_mutex_unlock(&q_mutex);
+	}
+}
+
+static void* sigserv_worker( gpgme_ctx_t ctx ) {
+	sigreq_t req;
+	struct timeval start, end;
+	gpgme_error_t gpgerr;
+	long ms;
+
+	for (;;) {
+		pthread_mutex_lock(&q_mutex);
+		while ( q_len == 0 )
+			pthread_cond_wait(&q_cond, &q_mutex);
+		req = queue[q_head];
+		q_head = (q_head+1)%SIGSERV_QUEUE;
+		q_len--;
+		pthread_mutex_unlock(&q_mutex);
+
+		(void) gettimeofday( &start, (struct timezone*) 0 );
+		gpgerr = sigserv_handle(ctx, req.fd);
+		close(req.fd);
+		(void) gettimeofday( &end, (struct timezone*) 0 );
+
+		ms = ms_since(&start, &end);
+		pthread_mutex_lock(&q_mutex);
+		if ( gpgerr == GPG_ERR_NO_ERROR )
+			stats_signed++;
+		else
+			stats_failed++;
+		stats_wait_ms += ms_since(&req.queued_at, &start);
+		stats_sign_ms += ms;
+		if ( ms > stats_maxsign_ms )
+			stats_maxsign_ms = ms;
+		pthread_mutex_unlock(&q_mutex);
+	}
+	return NULL;
+}
+
+/* Sign what is read on fd, and write back the result. */
+static gpgme_error_t sigserv_handle( gpgme_ctx_t ctx, int fd ) {
+	gpgme_data_t gpgdata = (gpgme_data_t) 0, gpgsig = (gpgme_data_t) 0;
+	gpgme_error_t gpgerr;
+	char buf[4096];
+	ssize_t r;
+
+	gpgerr = gpgme_data_new_from_fd(&gpgdata, fd);
+	if ( gpgerr == GPG_ERR_NO_ERROR )
+		gpgerr = gpgme_data_new(&gpgsig);
+	if ( gpgerr == GPG_ERR_NO_ERROR )
+		gpgerr = gpgme_op_sign(ctx, gpgdata, gpgsig, GPGME_SIG_MODE_DETACH);
+
+	r = snprintf(buf, sizeof(buf), "%u\n", (unsigned int) gpgerr);
+	if ( send_fully(fd, buf, r) == r && gpgerr == GPG_ERR_NO_ERROR ) {
+		gpgme_data_seek(gpgsig, 0, SEEK_SET);
+		while ( (r=gpgme_data_read(gpgsig, buf, sizeof(buf))) > 0 )
+			if ( send_fully(fd, buf, r) != r )
+				break;
+	}
+	if ( gpgerr != GPG_ERR_NO_ERROR )
+		syslog( LOG_ERR, "signing service: %s", gpgme_strerror(gpgerr));
+
+	if ( gpgdata )
+		gpgme_data_release(gpgdata);
+	if ( gpgsig )
+		gpgme_data_release(gpgsig);
+	return gpgerr;
+}
+
+static void sigserv_do_logstats( void ) {
+	time_t now = time( (time_t*) 0 );
+	long secs = now - stats_time, n;
+
+	if ( secs <= 0 )
+		secs = 1;
+	stats_time = now;
+	pthread_mutex_lock(&q_mutex);
+	n = stats_signed + stats_failed;
+	syslog( LOG_INFO,
+		"  sigserv - %ld signatures (%g/sec), %ld failed, %ld rejected, queue depth %d (max %d/%d), wait avg %ld ms, sign avg %ld ms max %ld ms",
+		stats_signed, (float) stats_signed / secs, stats_failed, stats_rejected,
+		q_len, stats_maxdepth, SIGSERV_QUEUE,
+		n ? stats_wait_ms / n : 0, n ? stats_sign_ms / n : 0, stats_maxsign_ms );
+	stats_signed = stats_failed = stats_rejected = 0;
+	stats_wait_ms = stats_sign_ms = stats_maxsign_ms = 0;
+	stats_maxdepth = q_len;
+	pthread_mutex_unlock(&q_mutex);
+}
+
+gpgme_error_t sigserv_sign( gpgme_data_t in, gpgme_data_t sig ) {
+	struct pollfd pfd;
+	gpgme_error_t gpgerr;
+	char buf[4096];
+	ssize_t r;
+	int fd, i;
+	char c;
+
+	if ( sigserv_addr.sun_path[0] == '\0' )
+		return SIGSERV_UNAVAILABLE;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ( fd < 0 )
+		return SIGSERV_UNAVAILABLE;
+	if ( connect(fd, (struct sockaddr*) &sigserv_addr, sizeof(sigserv_addr)) < 0 ) {
+		close(fd);
+		return SIGSERV_UNAVAILABLE;
+	}
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if ( poll(&pfd, 1, SIGSERV_ACCEPT_WAIT) <= 0 || read(fd, &c, 1) != 1 || c != '+' ) {
+		close(fd);
+		return SIGSERV_UNAVAILABLE;
+	}
+
+	/* From now "in" will be consumed, so we can't fall back anymore. */
+	while ( (r=gpgme_data_read(in, buf, sizeof(buf))) > 0 )
+		if ( send_fully(fd, buf, r) != r )
+			break;
+	if ( r != 0 ) {
+		gpgerr = gpgme_error_from_errno(errno);
+		close(fd);
+		return gpgerr;
+	}
+	shutdown(fd, SHUT_WR);
+
+	/* Read the status line */
+	for ( i=0; i<sizeof(buf)-1; i++ ) {
+		if ( httpd_read_fully(fd, &buf[i], 1) != 1 )
+			break;
+		if ( buf[i] == '\n' )
+			break;
+	}
+	if ( i == 0 || buf[i] != '\n' ) {
+		close(fd);
+		return gpgme_error_from_errno(EPROTO);
+	}
+	buf[i] = '\0';
+	gpgerr = (gpgme_error_t) strtoul(buf, (char**) 0, 10);
+
+	if ( gpgerr == GPG_ERR_NO_ERROR )
+		while ( (r=httpd_read_fully(fd, buf, sizeof(buf))) > 0 )
+			if ( gpgme_data_write(sig, buf, r) != r ) {
+				gpgerr = gpgme_error_from_errno(errno);
+				break;
+			}
+	close(fd);
+	return gpgerr;
+}
+
+int sigserv_reaped( pid_t pid ) {
+	if ( sigserv_pid <= 0 || pid != sigserv_pid )
+		return 0;
+	sigserv_pid = 0;
+	return 1;
+}
+
+void sigserv_check( void ) {
+	if ( sigserv_pid == 0 && sigserv_hs && sigserv_fpr ) {
+		syslog( LOG_WARNING, "signing service died, restarting it" );
+		sigserv_pid = -1; /* don't retry before next call if failing */
+		(void) sigserv_start( sigserv_hs, sigserv_fpr );
+	} else if ( sigserv_pid < 0 )
+		sigserv_pid = 0;
+}
+
+void sigserv_stop( void ) {
+	if ( sigserv_pid > 0 )
+		kill( sigserv_pid, SIGTERM );
+	sigserv_pid = -2;
+	if ( sigserv_addr.sun_path[0] != '\0' )
+		(void) unlink(sigserv_addr.sun_path);
+	sigserv_hs = (httpd_server*) 0;
+}
+
+void sigserv_logstats( long secs ) {
+	if ( sigserv_pid > 0 )
+		kill( sigserv_pid, SIGUSR2 );
+}
+
+static long ms_since( struct timeval* tvP, struct timeval* nowP ) {
+	return ( nowP->tv_sec - tvP->tv_sec ) * 1000L + ( nowP->tv_usec - tvP->tv_usec ) / 1000L;
+}
+
+/* like httpd_write_fully, but without raising SIGPIPE */
+static ssize_t send_fully( int fd, const void* buf, size_t nbytes ) {
+	size_t nwritten = 0;
+	ssize_t r;
+
+	while ( nwritten < nbytes ) {
+		r = send( fd, (const char*) buf + nwritten, nbytes - nwritten, MSG_NOSIGNAL );
+		if ( r < 0 && ( errno == EINTR || errno == EAGAIN ) )
+			continue;
+		if ( r <= 0 )
+			return r;
+		nwritten += r;
+	}
+	return nwritten;
+}
+
+#endif /* SIGSERV_WORKERS */
@@ -0,0 +1,44 @@
+/* sigserv.h - header file for the signing service
+*
+** Copyright © 2012-2014 by Jean-Jacques Brucker <open-udc@googlegroups.com>.
+** All rights reserved.
+*/
+
+#ifndef _SIGSERV_H_
+#define _SIGSERV_H_
+
+#include <gpgme.h>
+
+#include "config.h"
+#include "libhttpd.h"
+
+/* returned by sigserv_sign() if the service could not take the request */
+#define SIGSERV_UNAVAILABLE ((gpgme_error_t) -1)
+
+/*! sigserv_start bind the service socket and fork the signing service,
+ * whose workers keep a warm gpgme context with the key fpr as signer.
+ * \return the pid of the service, or -1 on error.
+ */
+pid_t sigserv_start( httpd_server* hs, const char * fpr );
+
+/*! sigserv_sign make a detached armored signature of in, through the signing
+ * service, and write it into sig.
+ * \return GPG_ERR_NO_ERROR on success, a gpgme error if signing failed, or
+ * SIGSERV_UNAVAILABLE if the service can't be reached or is overloaded
+ * (nothing have then been read from in, so caller may sign by itself).
+ */
+gpgme_error_t sigserv_sign( gpgme_data_t in, gpgme_data_t sig );
+
+/* To call for each child reaped by the server. Return 1 if pid was the service. */
+int sigserv_reaped( pid_t pid );
+
+/* Restart the service if it died. Should be called periodically. */
+void sigserv_check( void );
+
+/* Stop the service, usually in preparation for exitting. */
+void sigserv_stop( void );
+
+/* Ask the service to generate its debugging statistics syslog message. */
+void sigserv_logstats( long secs );
+
+#endif /* _SIGSERV_H_ */
@@ -74,6 +74,27 @@
 #ifdef OPENUDC
 #include "udc.h"
 #endif
+#include "natsig.h"
+#include "keyimp.h"
+#include "recon.h"
+#ifdef GPGIO_MAX_OPS
+#include "gpgio.h"
+#include "keyidx.h"
+#include "hkp.h"
+#endif
+#ifdef SIGSERV_WORKERS
+#include "sigserv.h"
+#endif
+#ifdef SIG_CACHEDIR
+#include "sigc.h"
+#endif
+#if defined(PRESIGN_JOBS) && defined(SIG_CACHEDIR)
+#include "presign.h"
+#endif
+#ifdef HPOOL_WORKERS
+#include "hpool.h"
+#endif
+#include "fcgi.h"
 
 #ifndef SHUT_WR
 #define SHUT_WR 1
@@ -138,6 +159,8 @@ typedef struct {
 	off_t bytes;
 	off_t end_byte_index;
 	off_t next_byte_index;
+	int relay_fd;		/* watched while relaying the output of a CGI */
+	int relay_dir;		/* (for FDW_READ or FDW_WRITE) */
 	} connecttab;
 static connecttab* connects;
 static int num_connects, max_connects, first_free_connect;
@@ -149,6 +172,10 @@ static int httpd_conn_count;
 #define CNST_SENDING 2
 #define CNST_PAUSING 3
 #define CNST_LINGERING 4
+#define CNST_SIGWAIT 5		/* waiting for a signature (not watched) */
+#define CNST_GPGWAIT 6		/* waiting for its gpgme operation (not watched) */
+#define CNST_CGIRELAY 7		/* relaying the output of its CGI (relay_fd is watched) */
+#define CNST_ADMITWAIT 8	/* waiting for a process to exit (not watched) */
 
 static httpd_server* hs = (httpd_server*) 0;
 int terminate = 0;
@@ -157,7 +184,15 @@ long stats_connections;
 off_t stats_bytes;
 int stats_simultaneous;
 
-static volatile int got_hup, got_usr1, got_bus, watchdog_flag;
+static volatile int got_hup, got_usr1, got_bus, got_chld, watchdog_flag;
+/* written by handle_chld(), so that a SIGCHLD wakes fdwatch() up */
+static int chld_pipe[2] = { -1, -1 };
+
+#ifdef SIG_CACHEDIR
+/* signing jobs owned by our interposers, cf. sigc_claim() */
+static int sigjob_fds[SIGC_MAX_JOBS];
+static int num_sigjobs = 0;
+#endif
 
 /* contain an array "hc[pid]" to kill childs on exit */
 hctab_t hctab;
@@ -190,6 +225,18 @@ static void read_throttlefile( char* throttlefile );
 static void shut_down( void );
 static int handle_newconnect( struct timeval* tvP, int listen_fd );
 static void handle_read( connecttab* c, struct timeval* tvP );
+static void start_connection( connecttab* c, struct timeval* tvP );
+#ifdef SIG_CACHEDIR
+static void watch_sigjob( httpd_conn* hc );
+static void resume_sigwaits( struct timeval* tvP );
+#endif
+#ifdef GPGIO_MAX_OPS
+static void resume_gpgwaits( struct timeval* tvP );
+#endif
+#ifdef ADMIT_QUEUE_DEPTH
+static void resume_admitwaits( struct timeval* tvP );
+#endif
+static void handle_relay( connecttab* c, struct timeval* tvP );
 static void handle_send( connecttab* c, struct timeval* tvP );
 static void handle_linger( connecttab* c, struct timeval* tvP );
 static int check_throttles( connecttab* c );
@@ -198,6 +245,7 @@ static void update_throttles( ClientData client_data, struct timeval* nowP );
 static void finish_connection( connecttab* c, struct timeval* tvP );
 static void clear_connection( connecttab* c, struct timeval* tvP );
 static void really_clear_connection( connecttab* c, struct timeval* tvP );
+static void unwatch_connection( connecttab* c );
 static void idle( ClientData client_data, struct timeval* nowP );
 static void wakeup_connection( ClientData client_data, struct timeval* nowP );
 static void linger_clear_connection( ClientData client_data, struct timeval* nowP );
@@ -226,19 +274,35 @@ static void handle_term( int sig ) {
 	exit( 1 );
 }
 
-/* SIGCHLD - a child process exitted, so we need to reap the zombie */
+/* SIGCHLD - a child process exitted: the main loop reaps it (cf.
+** reap_children()), so that the children of gpgme (which waits for them
+** itself, maybe right when the signal comes) are left alone.
+*/
 static void
 handle_chld( int sig )
 	{
 	const int oerrno = errno;
-	pid_t pid;
-	int status;
 
 #ifndef HAVE_SIGSET
 	/* Set up handler again. */
 	(void) signal( SIGCHLD, handle_chld );
 #endif /* ! HAVE_SIGSET */
-	/* Reap defunct children until there aren't any more. */
+	got_chld = 1;
+	(void) write( chld_pipe[1], "", 1 );
+
+	/* Restore previous errno. */
+	errno = oerrno;
+	}
+
+/* Reap defunct children until there aren't any more.  Called from the main
+** loop, never while gpgme is running: its children are then already reaped.
+*/
+static void
+reap_children( struct timeval* tvP )
+	{
+	pid_t pid;
+	int status;
+
 	for (;;)
 		{
 		pid = waitpid( (pid_t) -1, &status, WNOHANG );
@@ -256,31 +320,29 @@ handle_chld( int sig )
 			break;
 			}
 
-		/* Note 1: here may happen a minor race bug :
-		 * child may be killed earlier and following code which unset hctab.hcs[pid-hctab.pidmin]
-		 * may happen BEFORE we set it.
-		 * In such case shut_down() may try to kill an incorrect pid - Few chances that such pid
-		 * rely on an killable existing process (remind also that thttpd/ludd don't stay as root). */
-		if ( pid>=hctab.pidmin && pid<hctab.pidmax )
-			/* Note 2 : here we can't no more use the hc pointer because it should have been freed */
-			hctab.hcs[pid-hctab.pidmin]=(httpd_conn *)0;
-
-		/* Decrement the CGI count.  Note that this is not accurate, since
-		** each CGI can involve two or even three child processes.
-		** Decrementing for each child means that when there is heavy CGI
-		** activity, the count will be lower than it should be, and therefore
-		** more childs will be allowed than should be.
-		*/
+#ifdef SIGSERV_WORKERS
+		/* The signing service is not a request handler. */
+		if ( sigserv_reaped( pid ) )
+			continue;
+#endif
+#if defined(PRESIGN_JOBS) && defined(SIG_CACHEDIR)
+		if ( presign_reaped( pid ) )
+			continue;
+#endif
+#ifdef HPOOL_WORKERS
+		/* Neither is the manager of the handler pool. */
+		if ( hpool_reaped( pid ) )
+			continue;
+#endif
+#ifdef RECON_INTERVAL
+		if ( recon_reaped( pid ) )
+			continue;
+#endif
+
+		/* A request process is no more counted (cf. drop_child()). */
 		if ( hs != (httpd_server*) 0 )
-			{
-			if ( hs->cgi_count > 0 )
-				/* ... If a fork is called without increased the cgi_count (done by drop_child()), which is the case for cgi_interpose_output and cgi_interpose_input */
-				--hs->cgi_count;
-			}
+			httpd_reaped( hs, pid, tvP );
 		}
-
-	/* Restore previous errno. */
-	errno = oerrno;
 	}
 
 /* SIGHUP says to re-open the log file. */
@@ -695,6 +757,7 @@ main( int argc, char** argv )
 #endif /* HAVE_SIGSET */
 	got_hup = 0;
 	got_usr1 = 0;
+	got_chld = 0;
 	got_bus = 0;
 	watchdog_flag = 0;
 	(void) alarm( OCCASIONAL_TIME * 3 );
@@ -897,6 +960,71 @@ main( int argc, char** argv )
 
 	gpgme_key_unref(mygpgkey);
 
+	/* Load the signing key in memory (before forking anything), to sign without gpg */
+	if ( natsig_init( main_gpgctx, myself.fpr ) < 0 ) {
+		syslog( LOG_NOTICE, "native signing unavailable, signatures will be made by gpg" );
+#ifdef SIGSERV_WORKERS
+		/* Start the signing service (the context are warmed in it) */
+		if ( sigserv_start( hs, myself.fpr ) < 0 ) {
+			syslog( LOG_WARNING, "could not start the signing service, each response will be signed by its interposer" );
+			warnx( "could not start the signing service, each response will be signed by its interposer" );
+		}
+#endif
+	}
+#ifdef OPENUDC
+	/* Load the keys of the currency members, to verify their signatures natively */
+	{
+		const char ** patterns = malloc( (udckeyssize+1) * sizeof(const char *) );
+
+		if ( patterns != (const char **) 0 ) {
+			for ( i = 0; i < udckeyssize; i++ )
+				patterns[i] = udckeys[i].fpr;
+			patterns[udckeyssize] = (const char *) 0;
+			if ( natsig_load_keys( patterns ) < 0 )
+				syslog( LOG_NOTICE, "native verification unavailable, signatures will be verified by gpg" );
+			free( patterns );
+		}
+	}
+#endif
+
+#ifdef SIG_CACHEDIR
+	/* Index the signature store */
+	if ( sigc_init() < 0 ) {
+		syslog( LOG_WARNING, "could not open the signature store, signatures won't be cached" );
+		warnx( "could not open the signature store, signatures won't be cached" );
+	}
+#ifdef PRESIGN_JOBS
+	else if ( hs->sig_pattern != (char*) 0 && presign_start( hs, myself.fpr ) < 0 ) {
+		syslog( LOG_WARNING, "could not start the pre-signer" );
+		warnx( "could not start the pre-signer" );
+	}
+#endif
+#endif
+
+#ifdef KEYIDX_SLOTS
+	/* Index the public keyring (from the main loop), before forking the importers */
+	if ( keyidx_init() < 0 ) {
+		syslog( LOG_WARNING, "could not index the keyring, pks/lookup will always run gpg" );
+		warnx( "could not index the keyring, pks/lookup will always run gpg" );
+	}
+#endif
+
+#ifdef KEYIMP_SPOOL
+	/* (the submissions remembered are shared with the importers) */
+	if ( keyimp_init() < 0 ) {
+		syslog( LOG_WARNING, "could not remember the pks/add submissions, each will run gpg" );
+		warnx( "could not remember the pks/add submissions, each will run gpg" );
+	}
+#endif
+
+#ifdef HPOOL_WORKERS
+	/* Pre-fork the handlers of pks/ and udc/ requests */
+	if ( hpool_start( hs ) < 0 ) {
+		syslog( LOG_WARNING, "could not start the handler pool, a process will be forked for each request" );
+		warnx( "could not start the handler pool, a process will be forked for each request" );
+	}
+#endif
+
 	/* Initialize our connections table. */
 	connects = NEW( connecttab, max_connects );
 	if ( connects == (connecttab*) 0 )
@@ -916,6 +1044,18 @@ main( int argc, char** argv )
 		for ( i=0 ; hs->listen_fds[i]>=0 ; i++ )
 				fdwatch_add_fd( hs->listen_fds[i], (void*) 0, FDW_READ );
 
+	/* A SIGCHLD between the check of got_chld and fdwatch() must not wait
+	** for the next timer: the handler writes in a pipe that is watched.
+	*/
+	if ( pipe( chld_pipe ) < 0 )
+		DIE( 1, "pipe - %m" );
+	for ( i = 0; i < 2; i++ )
+		{
+		(void) fcntl( chld_pipe[i], F_SETFL, O_NONBLOCK );
+		(void) fcntl( chld_pipe[i], F_SETFD, FD_CLOEXEC );
+		}
+	fdwatch_add_fd( chld_pipe[0], (void*) 0, FDW_READ );
+
 	/* We will now only use syslog if some errors happen, so close stderr */
 	if ( debug )
 		warnx("started successfully ! (pid [%d], foreground/debug mode, usable env. var.: GPGME_DEBUG )",getpid());
@@ -944,6 +1084,17 @@ main( int argc, char** argv )
 			got_hup = 0;
 			}
 
+		/* Have some children exited? */
+		if ( got_chld )
+			{
+			got_chld = 0;
+			(void) gettimeofday( &tv, (struct timezone*) 0 );
+			reap_children( &tv );
+#ifdef ADMIT_QUEUE_DEPTH
+			resume_admitwaits( &tv );
+#endif
+			}
+
 		/* Do the fd watch. */
 		num_ready = fdwatch( tmr_mstimeout( &tv ) );
 		if ( num_ready < 0 )
@@ -955,6 +1106,14 @@ main( int argc, char** argv )
 			}
 		(void) gettimeofday( &tv, (struct timezone*) 0 );
 
+		/* Woken up by handle_chld() ? (got_chld is seen at the next turn) */
+		if ( fdwatch_check_fd( chld_pipe[0] ) )
+			{
+			char buf[64];
+			while ( read( chld_pipe[0], buf, sizeof(buf) ) > 0 )
+				;
+			}
+
 		if ( num_ready == 0 )
 			{
 			/* No fd's are ready - run the timers. */
@@ -980,13 +1139,46 @@ main( int argc, char** argv )
 				continue;
 		}
 
+#ifdef SIG_CACHEDIR
+		/* Has a signing job ended ? */
+		cont = 0;
+		for ( i = 0; i < num_sigjobs; )
+			if ( fdwatch_check_fd( sigjob_fds[i] ) )
+				{
+				fdwatch_del_fd( sigjob_fds[i] );
+				sigc_release( sigjob_fds[i] );
+				sigjob_fds[i] = sigjob_fds[--num_sigjobs];
+				cont = 1;
+				}
+			else
+				++i;
+		if ( cont )
+			resume_sigwaits( &tv );
+#endif
+
+#ifdef GPGIO_MAX_OPS
+		/* Carry on the gpgme operations run by ourself. */
+		if ( gpgio_dispatch() > 0 )
+			resume_gpgwaits( &tv );
+#endif
+#ifdef KEYIDX_SLOTS
+		/* Carry on the building of the index of the keyring. */
+		keyidx_dispatch();
+#endif
+
+		/* Carry on the requests passed to the FastCGI application. */
+		fcgi_dispatch();
+
 		/* Find the connections that need servicing. */
 		while ( ( c = (connecttab*) fdwatch_get_next_client_data() ) != (connecttab*) -1 )
 			{
 			if ( c == (connecttab*) 0 )
 				continue;
 			hc = c->hc;
-			if ( ! fdwatch_check_fd( hc->conn_fd ) )
+			if ( c->conn_state == CNST_CGIRELAY )
+				/* (its relay_fd is the one which is ready) */
+				handle_relay( c, &tv );
+			else if ( ! fdwatch_check_fd( hc->conn_fd ) )
 				/* Something went wrong. */
 				clear_connection( c, &tv );
 			else
@@ -1116,6 +1308,18 @@ parse_args( int argc, char** argv )
 			++argn;
 			myself.fpr = argv[argn];
 			}
+#ifdef RECON_INTERVAL
+		else if ( strcmp( argv[argn], "-P" ) == 0 && argn + 1 < argc )
+			{
+			++argn;
+			if ( recon_peer( argv[argn] ) < 0 )
+				{
+				(void) fprintf(
+					stderr, "%s: bad peer or too many peers '%s'\n", argv0, argv[argn] );
+				exit( 1 );
+				}
+			}
+#endif /* RECON_INTERVAL */
 		else if ( strcmp( argv[argn], "-l" ) == 0 && argn + 1 < argc )
 			{
 			++argn;
@@ -1169,6 +1373,9 @@ usage( void )
 				"	-nk         new (unknow) keys may be added in our keyring through \"pks/add\"\n"
 				"	-e PORT     external port (to be reach by peers) - default: listenning port\n"
 				"	-E HOST     external host name or IP adress - default: default hostname\n"
+#ifdef RECON_INTERVAL
+				"	-P HOST:PORT  peer to reconcile the keyring with (may be repeated) - default: none\n"
+#endif /* RECON_INTERVAL */
 				"	-fpr KeyID  fingerprint of the "SOFTWARE_NAME"'s OpenPGP key - no default, MANDATORY\n"
 				"	-V          show version and exit\n"
 				"	-D          stay in foreground (usefull to debug or monitor)\n"
@@ -1304,6 +1511,18 @@ static int read_config( char* filename )
 				value_required( name, value );
 				myself.eport = (unsigned short) atoi( value );
 			}
+#ifdef RECON_INTERVAL
+			else if ( strcasecmp( name, "peer" ) == 0 )
+				{
+				value_required( name, value );
+				if ( recon_peer( value ) < 0 )
+					{
+					(void) fprintf(
+						stderr, "%s: bad peer or too many peers '%s'\n", argv0, value );
+					exit( 1 );
+					}
+				}
+#endif /* RECON_INTERVAL */
 #ifdef SIG_EXCLUDE_PATTERN
 			else if ( strcasecmp( name, "sigpat" ) == 0 )
 				{
@@ -1472,6 +1691,18 @@ shut_down( void )
 
 	(void) gettimeofday( &tv, (struct timezone*) 0 );
 	logstats( &tv );
+#ifdef SIGSERV_WORKERS
+	sigserv_stop();
+#endif
+#if defined(PRESIGN_JOBS) && defined(SIG_CACHEDIR)
+	presign_stop();
+#endif
+#ifdef HPOOL_WORKERS
+	hpool_stop();
+#endif
+#ifdef RECON_INTERVAL
+	recon_stop();
+#endif
 
 	for ( cnum = 0; cnum < max_connects; ++cnum )
 		{
@@ -1494,6 +1725,10 @@ shut_down( void )
 		httpd_terminate( ths );
 		}
 	mmc_destroy();
+#ifdef SIG_CACHEDIR
+	sigc_destroy();
+#endif
+	natsig_destroy();
 	tmr_destroy();
 	free( (void*) connects );
 	if ( throttles != (throttletab*) 0 )
@@ -1601,7 +1836,7 @@ handle_newconnect( struct timeval* tvP, int listen_fd )
 static void
 handle_read( connecttab* c, struct timeval* tvP )
 	{
-	int sz;
+	int sz, r;
 	//ClientData client_data;
 	httpd_conn* hc = c->hc;
 
@@ -1673,12 +1908,77 @@ handle_read( connecttab* c, struct timeval* tvP )
 		}
 
 	/* Start the connection going. */
-	if ( httpd_start_request( hc, tvP ) < 0 )
+	r = httpd_start_request( hc, tvP );
+#ifdef SIG_CACHEDIR
+	watch_sigjob( hc );
+#endif
+	if ( r < 0 )
 		{
 		/* Something went wrong.  Close down the connection. */
 		finish_connection( c, tvP );
 		return;
 		}
+	start_connection( c, tvP );
+	}
+
+
+/* The request is started, set the connection to send what it has to. */
+static void
+start_connection( connecttab* c, struct timeval* tvP )
+	{
+	httpd_conn* hc = c->hc;
+
+#ifdef ADMIT_QUEUE_DEPTH
+	/* It needs a process, but too many are running. */
+	if ( hc->bfield & HC_ADMIT_WAIT )
+		{
+		if ( c->conn_state != CNST_ADMITWAIT )
+			{
+			unwatch_connection( c );
+			c->conn_state = CNST_ADMITWAIT;
+			c->active_at = tvP->tv_sec;
+			}
+		return;
+		}
+#endif
+#ifdef SIG_CACHEDIR
+	/* Its signature is being made for another request. */
+	if ( hc->bfield & HC_SIGN_WAIT )
+		{
+		if ( c->conn_state != CNST_SIGWAIT )
+			{
+			unwatch_connection( c );
+			c->conn_state = CNST_SIGWAIT;
+			c->active_at = tvP->tv_sec;
+			}
+		return;
+		}
+#endif
+#ifdef GPGIO_MAX_OPS
+	/* Its content is being made by a gpgme operation. */
+	if ( hc->bfield & HC_GPG_WAIT )
+		{
+		if ( c->conn_state != CNST_GPGWAIT )
+			{
+			unwatch_connection( c );
+			c->conn_state = CNST_GPGWAIT;
+			c->active_at = tvP->tv_sec;
+			}
+		return;
+		}
+#endif
+	/* Its content is the output of its CGI, relayed by ourself. */
+	if ( hc->bfield & HC_CGI_RELAY )
+		{
+		unwatch_connection( c );
+		c->conn_state = CNST_CGIRELAY;
+		/* (its body may have first to be read, cf. HC_FCGI_BODY) */
+		c->relay_fd = ( hc->bfield & HC_FCGI_BODY ) ? hc->conn_fd : hc->cgi_fd;
+		c->relay_dir = FDW_READ;
+		c->active_at = tvP->tv_sec;
+		fdwatch_add_fd( c->relay_fd, c, c->relay_dir );
+		return;
+		}
 
 	/* Fill in end_byte_index. */
 	if ( hc->bfield & HC_GOT_RANGE )
@@ -1710,20 +2010,146 @@ handle_read( connecttab* c, struct timeval* tvP )
 		}
 
 	/* Cool, we have a valid connection and a file to send to it. */
-	c->conn_state = CNST_SENDING;
 	c->started_at = tvP->tv_sec;
 	c->wouldblock_delay = 0;
 	//client_data.p = c;
 
-	fdwatch_del_fd( hc->conn_fd );
+	unwatch_connection( c );
+	c->conn_state = CNST_SENDING;
 	fdwatch_add_fd( hc->conn_fd, c, FDW_WRITE );
 	}
 
 
+#ifdef SIG_CACHEDIR
+/* Watch the signing job the request may have claimed. */
+static void
+watch_sigjob( httpd_conn* hc )
+	{
+	if ( hc->sigc_fd < 0 )
+		return;
+	fdwatch_add_fd( hc->sigc_fd, (void*) 0, FDW_READ );
+	sigjob_fds[num_sigjobs++] = hc->sigc_fd;
+	hc->sigc_fd = -1;
+	}
+
+
+/* A signing job ended: carry on the requests which were waiting. */
+static void
+resume_sigwaits( struct timeval* tvP )
+	{
+	int cnum, r;
+	connecttab* c;
+
+	for ( cnum = 0; cnum < max_connects; ++cnum )
+		{
+		c = &connects[cnum];
+		if ( c->conn_state != CNST_SIGWAIT )
+			continue;
+		r = httpd_resume_request( c->hc, tvP );
+		watch_sigjob( c->hc );
+		if ( r < 0 )
+			finish_connection( c, tvP );
+		else
+			start_connection( c, tvP );
+		}
+	}
+#endif
+
+
+#ifdef GPGIO_MAX_OPS
+/* Some gpgme operations ended: send the responses they made, or fork for
+** those which gave up (HC_GPG_FORK).
+*/
+static void
+resume_gpgwaits( struct timeval* tvP )
+	{
+	int cnum;
+	connecttab* c;
+
+	for ( cnum = 0; cnum < max_connects; ++cnum )
+		{
+		c = &connects[cnum];
+		if ( c->conn_state != CNST_GPGWAIT || ( c->hc->bfield & HC_GPG_WAIT ) )
+			continue;
+		if ( ( c->hc->bfield & HC_GPG_FORK ) && httpd_resume_request( c->hc, tvP ) < 0 )
+			finish_connection( c, tvP );
+		else
+			start_connection( c, tvP );
+		}
+	}
+#endif
+
+
+#ifdef ADMIT_QUEUE_DEPTH
+/* Some processes exited: start the requests which were waiting for that, in
+** their order, while there is room.
+*/
+static void
+resume_admitwaits( struct timeval* tvP )
+	{
+	int cnum, r;
+	connecttab* c;
+	connecttab* next;
+
+	for (;;)
+		{
+		next = (connecttab*) 0;
+		for ( cnum = 0; cnum < max_connects; ++cnum )
+			{
+			c = &connects[cnum];
+			if ( c->conn_state != CNST_ADMITWAIT || ! httpd_admissible( hs, c->hc->admit_class ) )
+				continue;
+			if ( next == (connecttab*) 0 || httpd_admit_before( c->hc, next->hc ) )
+				next = c;
+			}
+		if ( next == (connecttab*) 0 )
+			break;
+		r = httpd_resume_request( next->hc, tvP );
+#ifdef SIG_CACHEDIR
+		watch_sigjob( next->hc );
+#endif
+		if ( r < 0 )
+			finish_connection( next, tvP );
+		else
+			start_connection( next, tvP );
+		}
+	}
+#endif
+
+
+/* Relay what the CGI wrote, or carry on when the connection can take it. */
+static void
+handle_relay( connecttab* c, struct timeval* tvP )
+	{
+	httpd_conn* hc = c->hc;
+	int fd, dir, tind;
+
+	switch ( httpd_relay_cgi( hc ) )
+		{
+		case RC_WAIT_CGI: fd = hc->cgi_fd; dir = FDW_READ; break;
+		case RC_WAIT_CONN: fd = hc->conn_fd; dir = FDW_WRITE; break;
+		case RC_WAIT_BODY: fd = hc->conn_fd; dir = FDW_READ; break;
+		default:
+		for ( tind = 0; tind < c->numtnums; ++tind )
+			throttles[c->tnums[tind]].bytes_since_avg += hc->bytes_sent;
+		finish_connection( c, tvP );
+		return;
+		}
+	c->active_at = tvP->tv_sec;
+	if ( fd != c->relay_fd || dir != c->relay_dir )
+		{
+		fdwatch_del_fd( c->relay_fd );
+		c->relay_fd = fd;
+		c->relay_dir = dir;
+		fdwatch_add_fd( fd, c, dir );
+		}
+	}
+
+
 static void
 handle_send( connecttab* c, struct timeval* tvP )
 	{
-	size_t max_bytes;
+	size_t max_bytes, filesz;
 	int sz, coast;
 	ClientData client_data;
 	time_t elapsed;
@@ -1735,26 +2161,37 @@ handle_send( connecttab* c, struct timeval* tvP )
 	else
 		max_bytes = c->max_limit / 4;		/* send at most 1/4 seconds worth */
 
-	/* Do we need to write the headers first? */
-	if ( hc->responselen == 0 )
+	filesz = MIN( c->end_byte_index - c->next_byte_index, max_bytes );
+
+	/* Do we need to write the headers first, or a trailer after the file? */
+	if ( hc->responselen == 0 && hc->trailerlen == 0 )
 		{
 		/* No, just write the file. */
 		sz = write(
-			hc->conn_fd, &(hc->file_address[c->next_byte_index]),
-			MIN( c->end_byte_index - c->next_byte_index, max_bytes ) );
+			hc->conn_fd, &(hc->file_address[c->next_byte_index]), filesz );
 		}
 	else
 		{
-		/* Yes.  We'll combine headers and file into a single writev(),
-		** hoping that this generates a single packet.
+		/* Yes.  We'll combine headers, file and trailer into a single
+		** writev(), hoping that this generates a single packet.
 		*/
-		struct iovec iv[2];
+		struct iovec iv[3];
+		int ivn = 0;
 
-		iv[0].iov_base = hc->response;
-		iv[0].iov_len = hc->responselen;
-		iv[1].iov_base = &(hc->file_address[c->next_byte_index]);
-		iv[1].iov_len = MIN( c->end_byte_index - c->next_byte_index, max_bytes );
-		sz = writev( hc->conn_fd, iv, 2 );
+		if ( hc->responselen > 0 )
+			{
+			iv[ivn].iov_base = hc->response;
+			iv[ivn++].iov_len = hc->responselen;
+			}
+		iv[ivn].iov_base = &(hc->file_address[c->next_byte_index]);
+		iv[ivn++].iov_len = filesz;
+		/* The trailer only goes with the end of the file. */
+		if ( hc->trailerlen > 0 && c->next_byte_index + filesz >= c->end_byte_index )
+			{
+			iv[ivn].iov_base = hc->trailer;
+			iv[ivn++].iov_len = hc->trailerlen;
+			}
+		sz = writev( hc->conn_fd, iv, ivn );
 		}
 
 	if ( sz < 0 && errno == EINTR )
@@ -1829,14 +2266,22 @@ handle_send( connecttab* c, struct timeval* tvP )
 			hc->responselen = 0;
 			}
 		}
-	/* And update how much of the file we wrote. */
-	c->next_byte_index += sz;
+	/* And update how much of the file (and trailer) we wrote. */
 	c->hc->bytes_sent += sz;
 	for ( tind = 0; tind < c->numtnums; ++tind )
 		throttles[c->tnums[tind]].bytes_since_avg += sz;
+	if ( sz > filesz )
+		{
+		/* Move the unwritten part of the trailer to the front of its buffer. */
+		int newlen = hc->trailerlen - ( sz - filesz );
+		(void) memmove( hc->trailer, &(hc->trailer[sz - filesz]), newlen );
+		hc->trailerlen = newlen;
+		sz = filesz;
+		}
+	c->next_byte_index += sz;
 
 	/* Are we done? */
-	if ( c->next_byte_index >= c->end_byte_index )
+	if ( c->next_byte_index >= c->end_byte_index && hc->trailerlen == 0 )
 		{
 		/* This connection is finished! */
 		finish_connection( c, tvP );
@@ -2039,8 +2484,7 @@ clear_connection( connecttab* c, struct timeval* tvP )
 		}
 	if ( c->hc->bfield & HC_SHOULD_LINGER )
 		{
-		if ( c->conn_state != CNST_PAUSING )
-			fdwatch_del_fd( c->hc->conn_fd );
+		unwatch_connection( c );
 		c->conn_state = CNST_LINGERING;
 		shutdown( c->hc->conn_fd, SHUT_WR );
 		fdwatch_add_fd( c->hc->conn_fd, c, FDW_READ );
@@ -2064,8 +2508,7 @@ static void
 really_clear_connection( connecttab* c, struct timeval* tvP )
 	{
 	stats_bytes += c->hc->bytes_sent;
-	if ( c->conn_state != CNST_PAUSING )
-		fdwatch_del_fd( c->hc->conn_fd );
+	unwatch_connection( c );
 	httpd_close_conn( c->hc, tvP );
 	clear_throttles( c, tvP );
 	if ( c->linger_timer != (Timer*) 0 )
@@ -2080,6 +2523,27 @@ really_clear_connection( connecttab* c, struct timeval* tvP )
 	}
 
 
+/* Stop watching what the connection was waiting for (if anything). */
+static void
+unwatch_connection( connecttab* c )
+	{
+	switch ( c->conn_state )
+		{
+		case CNST_PAUSING:
+		case CNST_SIGWAIT:
+		case CNST_GPGWAIT:
+		case CNST_ADMITWAIT:
+		break;
+		case CNST_CGIRELAY:
+		fdwatch_del_fd( c->relay_fd );
+		break;
+		default:
+		fdwatch_del_fd( c->hc->conn_fd );
+		break;
+		}
+	}
+
+
 static void
 idle( ClientData client_data, struct timeval* nowP )
 	{
@@ -2112,8 +2576,69 @@ idle( ClientData client_data, struct timeval* nowP )
 				clear_connection( c, nowP );
 				}
 			break;
+#ifdef SIG_CACHEDIR
+			case CNST_SIGWAIT:
+			if ( nowP->tv_sec - c->active_at >= IDLE_SEND_TIMELIMIT )
+				{
+				syslog( LOG_INFO,
+					"%.80s connection timed out waiting for a signature",
+					c->hc->client_addr );
+				httpd_send_err(
+					c->hc, 503, httpd_err503title, "", httpd_err503form, c->hc->encodedurl );
+				finish_connection( c, nowP );
+				}
+			break;
+#endif
+#ifdef GPGIO_MAX_OPS
+			case CNST_GPGWAIT:
+			if ( nowP->tv_sec - c->active_at >= IDLE_SEND_TIMELIMIT )
+				{
+				syslog( LOG_INFO,
+					"%.80s connection timed out waiting for gpg",
+					c->hc->client_addr );
+				hkp_lookup_abort( c->hc );
+				httpd_send_err(
+					c->hc, 503, httpd_err503title, "", httpd_err503form, c->hc->encodedurl );
+				finish_connection( c, nowP );
+				}
+			break;
+#endif
+#ifdef ADMIT_QUEUE_DEPTH
+			case CNST_ADMITWAIT:
+			if ( nowP->tv_sec - c->active_at >= ADMIT_MAX_WAIT )
+				{
+				syslog( LOG_INFO,
+					"%.80s connection timed out waiting for a process",
+					c->hc->client_addr );
+				if ( httpd_admit_expire( c->hc, nowP ) < 0 )
+					finish_connection( c, nowP );
+				else
+					start_connection( c, nowP );
+				}
+			break;
+#endif
+			case CNST_CGIRELAY:
+			if ( nowP->tv_sec - c->active_at >= IDLE_SEND_TIMELIMIT )
+				{
+				syslog( LOG_INFO,
+					"%.80s connection timed out relaying a CGI",
+					c->hc->client_addr );
+				clear_connection( c, nowP );
+				}
+			break;
 			}
 		}
+
+#ifdef ADAPT_LIMITS
+	/* Adapt the process limits to the load of the host. */
+	if ( hs != (httpd_server*) 0 )
+		{
+		httpd_adapt( hs, nowP );
+#ifdef ADMIT_QUEUE_DEPTH
+		resume_admitwaits( nowP );
+#endif
+		}
+#endif
 	}
 
 
@@ -2146,7 +2671,27 @@ static void
 occasional( ClientData client_data, struct timeval* nowP )
 	{
 	mmc_cleanup( nowP );
+#ifdef SIG_CACHEDIR
+	sigc_cleanup( nowP );
+#endif
 	tmr_cleanup();
+#ifdef SIGSERV_WORKERS
+	sigserv_check();
+#endif
+#if defined(PRESIGN_JOBS) && defined(SIG_CACHEDIR)
+	presign_check();
+#endif
+#ifdef HPOOL_WORKERS
+	hpool_check();
+#endif
+#ifdef KEYIDX_SLOTS
+	keyidx_check();
+#endif
+#ifdef RECON_INTERVAL
+	/* (once the index is ready) */
+	if ( hs != (httpd_server*) 0 )
+		recon_check( hs );
+#endif
 	watchdog_flag = 1;				/* let the watchdog know that we are alive */
 	}
 
@@ -2185,8 +2730,34 @@ logstats( struct timeval* nowP )
 	thttpd_logstats( stats_secs );
 	httpd_logstats( stats_secs );
 	mmc_logstats( stats_secs );
+#ifdef SIG_CACHEDIR
+	sigc_logstats( stats_secs );
+#endif
+	natsig_logstats( stats_secs );
+#ifdef GPGIO_MAX_OPS
+	gpgio_logstats( stats_secs );
+#endif
+#ifdef KEYIDX_SLOTS
+	keyidx_logstats( stats_secs );
+#endif
+#ifdef KEYIMP_SPOOL
+	keyimp_logstats( stats_secs );
+#endif
+#ifdef RECON_INTERVAL
+	recon_logstats( stats_secs );
+#endif
+	fcgi_logstats( stats_secs );
 	fdwatch_logstats( stats_secs );
 	tmr_logstats( stats_secs );
+#ifdef SIGSERV_WORKERS
+	sigserv_logstats( stats_secs );
+#endif
+#if defined(PRESIGN_JOBS) && defined(SIG_CACHEDIR)
+	presign_logstats( stats_secs );
+#endif
+#ifdef HPOOL_WORKERS
+	hpool_logstats( stats_secs );
+#endif
 	}
 
 
@@ -22,6 +22,8 @@
 #include "config.h"
 #include "udc.h"
 #include "libhttpd.h"
+#include "natsig.h"
+#include "hpool.h"
 
 /*! read keys (and there status and times) from a keyfile, and store them in an udc_key_t array.
  * \note: The udc_key_t array is (re)allocated.
@@ -270,12 +272,14 @@ void udc_create( httpd_conn* hc ) {
 	gpgme_ctx_t gpglctx;
 	gpgme_error_t gpgerr;
 	gpgme_verify_result_t result;
+	natsig_result_t natres;
 
-	char * buff;
+	char * buff, * sheettext=NULL, ** sigtexts;
+	size_t sheetlen=0, * siglens;
 
 	if ( strncasecmp( hc->contenttype, "multipart/msigned", sizeof("multipart/msigned")-1 ) ) {
 		httpd_send_err(hc, 415, err415title, "", "%.80s unrecognized here, expected multipart/msigned.", hc->contenttype);
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	cp=hc->contenttype+sizeof("multipart/msigned")-1;
@@ -307,7 +311,7 @@ void udc_create( httpd_conn* hc ) {
 			nsigs=atoi(cp);
 			if (!nsigs) {
 				httpd_send_err(hc, 400, httpd_err400title, "", err500form, "nsigs=" );
-				exit(EXIT_FAILURE);
+				hpool_exit(EXIT_FAILURE);
 			}
 		}
 		/* find next separator (ignore unknow stuff) */
@@ -317,7 +321,7 @@ void udc_create( httpd_conn* hc ) {
 
 	if ( boundarylen < 1 ) {
 		httpd_send_err(hc, 400, httpd_err400title, "", err500form, "boundary=" );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	if ( nsigs < 0 )
@@ -325,21 +329,23 @@ void udc_create( httpd_conn* hc ) {
 
 	if ( nsigs == 0 ) {
 		httpd_send_err(hc, 501, err501title, "", err501form, "nsigs == 0" );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	if (hc->contentlength < 12) {
 		httpd_send_err(hc, 411, err411title, "", "Content-Length is absent or too short (%.80s)", "12");
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	cp=boundary;
 	boundary=malloc(boundarylen+5);
 	sigs=malloc(nsigs*sizeof(gpgme_data_t));
+	sigtexts=malloc(nsigs*sizeof(char *));
+	siglens=malloc(nsigs*sizeof(size_t));
 	buff=malloc(hc->contentlength+1);
-	if ( (!buff) || (!sigs) || (!boundary) ) {
+	if ( (!buff) || (!sigs) || (!sigtexts) || (!siglens) || (!boundary) ) {
 		httpd_send_err(hc, 500, err500title, "", err500form, "m" );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	strcpy(boundary,"--");
@@ -356,14 +362,14 @@ void udc_create( httpd_conn* hc ) {
 			nanosleep(&tim, NULL);
 			if (i++>50) { /* 50*300ms = 15 seconds */
 				httpd_send_err(hc, 408, httpd_err408title, "", httpd_err408form, "" );
-				exit(EXIT_FAILURE);
+				hpool_exit(EXIT_FAILURE);
 			}
 			continue;
 		} else
 			i=0;
 		if ( r <= 0 ) {
 			httpd_send_err(hc, 500, err500title, "", err500form, "read error" );
-			exit(EXIT_FAILURE);
+			hpool_exit(EXIT_FAILURE);
 		}
 		c += r;
 	}
@@ -399,39 +405,58 @@ void udc_create( httpd_conn* hc ) {
 		}
 		if ( csize < 1 ) {
 			httpd_send_err(hc, 411, err411title, "", "Content-Length is absent or too short (%.80s)", "1");
-			exit(EXIT_FAILURE);
+			hpool_exit(EXIT_FAILURE);
 		}
 		if (issig) {
 			if (i>=nsigs) {
 				httpd_send_err(hc, 400, httpd_err400title, "", err500form, "sigs>nsigs" );
-				exit(EXIT_FAILURE);
+				hpool_exit(EXIT_FAILURE);
 			}
 			if ( ( gpgerr=gpgme_data_new_from_mem(&sigs[i],cp,csize,0) ) != GPG_ERR_NO_ERROR ) {
 				httpd_send_err(hc, 500, err500title, "", err500form, gpgme_strerror(gpgerr) );
-				exit(EXIT_FAILURE);
+				hpool_exit(EXIT_FAILURE);
 			}
+			sigtexts[i]=cp;
+			siglens[i]=csize;
 			i++;
 		} else if ( ( gpgerr=gpgme_data_new_from_mem(&sheet,cp,csize,0) ) != GPG_ERR_NO_ERROR ) {
 				httpd_send_err(hc, 500, err500title, "", err500form, gpgme_strerror(gpgerr) );
-				exit(EXIT_FAILURE);
+				hpool_exit(EXIT_FAILURE);
+		} else {
+			sheettext=cp;
+			sheetlen=csize;
 		}
 		cp+=csize;
 	}
 	if (i!=nsigs) {
 		httpd_send_err(hc, 400, httpd_err400title, "", err500form, "sigs!=nsigs" );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
+	}
+	if (!sheettext) {
+		httpd_send_err(hc, 400, httpd_err400title, "", err500form, "no sheet" );
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	/* create context */
 	gpgerr=gpgme_new(&gpglctx);
 	if ( gpgerr  != GPG_ERR_NO_ERROR ) {
 		httpd_send_err(hc, 500, err500title, "", err500form, gpgme_strerror(gpgerr) );
-		exit(EXIT_FAILURE);
+		hpool_exit(EXIT_FAILURE);
 	}
 
 	for (i=0;i<nsigs;i++) {
-		  gpgerr = gpgme_op_verify (gpglctx, sigs[i], sheet, NULL);
-		  result = gpgme_op_verify_result (gpglctx);
+		/* Verify natively if the signer's key is loaded, else through gpg
+		 * (the sheet isn't processed yet: whatever the result, the answer stays the 501 below) */
+		if ( natsig_verify(sigtexts[i], siglens[i], sheettext, sheetlen, &natres) < NATSIG_NOKEY ) {
+			if ( natres.validity != NATSIG_GOOD )
+				syslog( LOG_INFO, "udc/create: invalid signature (%.80s)", natres.fpr );
+			continue;
+		}
+		gpgme_data_seek(sheet, 0, SEEK_SET);
+		gpgerr = gpgme_op_verify (gpglctx, sigs[i], sheet, NULL);
+		result = gpgme_op_verify_result (gpglctx);
+		if ( gpgerr != GPG_ERR_NO_ERROR || !result || !result->signatures || result->signatures->status != GPG_ERR_NO_ERROR )
+			syslog( LOG_INFO, "udc/create: invalid signature (%.80s)", result && result->signatures && result->signatures->fpr ? result->signatures->fpr : "" );
 	}
 	// Example of signature usage could be found in gpgme git repository
 	//     // in the gpgme/tests/run-verify.c
@@ -447,7 +472,7 @@ void udc_create( httpd_conn* hc ) {
 */
 	httpd_send_err(hc, 501, err501title, "", err501form, "udc/create" );
 	gpgme_release (gpglctx);
-	exit(EXIT_SUCCESS);
+	hpool_exit(EXIT_SUCCESS);
 
 }
 
@@ -456,6 +481,6 @@ void udc_validate( httpd_conn* hc ) {
 
 	httpd_send_err( hc, 501, err501title, "", err501form, "udc/validate" );
 	//gpgme_release (gpglctx);
-	exit(EXIT_SUCCESS);
+	hpool_exit(EXIT_SUCCESS);
 }
 #endif /* OPENUDC */